@@ -3,9 +3,12 @@
 #ifdef ESP_PLATFORM
 #include <esp_err.h>
 #include <esp_log.h>
+
+#include "sdkconfig.h"
 #else
 
 #include <stdio.h>
+#include <stdlib.h>
 
 /**
  * Minimal dummy header to run code using some ESP-IDF features on Linux.
@@ -26,12 +29,15 @@ typedef enum {
 #define ESP_LOGI(tag, format, ...)
 #define ESP_LOGD(tag, format, ...)
 #define ESP_LOGV(tag, format, ...)
+#define ESP_LOG_LEVEL(level, tag, format, ...)
 #else
 #define ESP_LOGE(tag, format, ...) printf("E[%s]\t" format "\n", tag, ##__VA_ARGS__)
 #define ESP_LOGW(tag, format, ...) printf("W[%s]\t" format "\n", tag, ##__VA_ARGS__)
 #define ESP_LOGI(tag, format, ...) printf("I[%s]\t" format "\n", tag, ##__VA_ARGS__)
 #define ESP_LOGD(tag, format, ...) printf("D[%s]\t" format "\n", tag, ##__VA_ARGS__)
 #define ESP_LOGV(tag, format, ...) printf("V[%s]\t" format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOG_LEVEL(level, tag, format, ...) \
+    printf("%c[%s]\t" format "\n", "NEWIDV"[level], tag, ##__VA_ARGS__)
 #endif
 
 #define CONFIG_LOG_MAXIMUM_LEVEL ESP_LOG_INFO
@@ -56,4 +62,156 @@ typedef int esp_err_t;
 #define ESP_ERR_NOT_FINISHED 0x10C     /*!< Operation has not fully completed */
 #define ESP_ERR_NOT_ALLOWED 0x10D      /*!< Operation is not allowed */
 
+// Abort on errors, also with NDEBUG, unlike assert().
+#define ESP_ERROR_CHECK(x)                                                                 \
+    do {                                                                                   \
+        const esp_err_t esp_err_check_rc_ = (x);                                           \
+        if (esp_err_check_rc_ != ESP_OK) {                                                 \
+            fprintf(stderr, "ESP_ERROR_CHECK failed: esp_err_t 0x%x at %s:%d\n",           \
+                    esp_err_check_rc_, __FILE__, __LINE__);                                \
+            abort();                                                                       \
+        }                                                                                  \
+    } while (0)
+
+#endif
+
+/**
+ * Tracepoints: the cost of named regions of code, as min/avg/max over all runs, in static storage.
+ * Enabled by defining FAKESP_TRACEPOINTS (make TRACEPOINTS=1), or by CONFIG_RTP_TRACEPOINTS on the
+ * device, they compile to nothing otherwise. Counted in CPU cycles on the device, TSC ticks on
+ * x86 and nanoseconds elsewhere. Thread-safe, with relaxed atomics.
+ *
+ *     FAKESP_TRACE_BEGIN(decode);
+ *     ...
+ *     FAKESP_TRACE_END(decode);
+ *
+ * FAKESP_TRACE_SCOPE(region) is a region up to the end of the enclosing block, for functions with
+ * several returns. fakesp_tracepoints_print() prints all regions run so far.
+ */
+#if defined(CONFIG_RTP_TRACEPOINTS) && !defined(FAKESP_TRACEPOINTS)
+#define FAKESP_TRACEPOINTS
+#endif
+
+#ifdef FAKESP_TRACEPOINTS
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef ESP_PLATFORM
+#include <esp_cpu.h>
+typedef uint32_t fakesp_cycles_t;  // Wraps around, which differences survive.
+#define FAKESP_CYCLES_UNIT "cycles"
+static inline fakesp_cycles_t fakesp_cycles() { return esp_cpu_get_cycle_count(); }
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+typedef uint64_t fakesp_cycles_t;
+#define FAKESP_CYCLES_UNIT "tsc"
+static inline fakesp_cycles_t fakesp_cycles() { return __rdtsc(); }
+#else
+#include <time.h>
+typedef uint64_t fakesp_cycles_t;
+#define FAKESP_CYCLES_UNIT "ns"
+static inline fakesp_cycles_t fakesp_cycles() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+typedef struct fakesp_tracepoint_t {
+    const char *name;
+    struct fakesp_tracepoint_t *next;  // In fakesp_tracepoints, once run.
+    atomic_bool listed;
+    atomic_uint_least32_t n;
+    atomic_uint_least64_t sum;
+    atomic_uint_least64_t min;
+    atomic_uint_least64_t max;
+} fakesp_tracepoint_t;
+
+// All regions run so far, across translation units, newest first.
+__attribute__((weak)) _Atomic(fakesp_tracepoint_t *) fakesp_tracepoints = NULL;
+
+static inline void fakesp_tracepoint_add(fakesp_tracepoint_t *tp, const fakesp_cycles_t cycles) {
+    if (!atomic_load_explicit(&tp->listed, memory_order_relaxed) &&
+        !atomic_exchange(&tp->listed, true)) {
+        tp->next = atomic_load(&fakesp_tracepoints);
+        while (!atomic_compare_exchange_weak(&fakesp_tracepoints, &tp->next, tp)) {
+        }
+    }
+    atomic_fetch_add_explicit(&tp->n, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&tp->sum, cycles, memory_order_relaxed);
+    uint64_t v = atomic_load_explicit(&tp->min, memory_order_relaxed);
+    while (cycles < v && !atomic_compare_exchange_weak_explicit(&tp->min, &v, cycles,
+                                                                memory_order_relaxed,
+                                                                memory_order_relaxed)) {
+    }
+    v = atomic_load_explicit(&tp->max, memory_order_relaxed);
+    while (cycles > v && !atomic_compare_exchange_weak_explicit(&tp->max, &v, cycles,
+                                                                memory_order_relaxed,
+                                                                memory_order_relaxed)) {
+    }
+}
+
+// A region up to the end of a block, see FAKESP_TRACE_SCOPE().
+typedef struct fakesp_tracepoint_scope_t {
+    fakesp_tracepoint_t *tp;
+    fakesp_cycles_t start;
+} fakesp_tracepoint_scope_t;
+
+static inline void fakesp_tracepoint_scope_end(const fakesp_tracepoint_scope_t *s) {
+    fakesp_tracepoint_add(s->tp, fakesp_cycles() - s->start);
+}
+
+static inline void fakesp_tracepoints_print() {
+    for (const fakesp_tracepoint_t *tp = atomic_load(&fakesp_tracepoints); tp != NULL;
+         tp = tp->next) {
+        const uint32_t n = atomic_load(&tp->n);
+        printf("Tracepoint %-24s n=%-9" PRIu32 " min=%-8" PRIu64 " avg=%-8" PRIu64
+               " max=%-8" PRIu64 " " FAKESP_CYCLES_UNIT "\n",
+               tp->name, n, atomic_load(&tp->min), n > 0 ? atomic_load(&tp->sum) / n : 0,
+               atomic_load(&tp->max));
+    }
+}
+
+#define FAKESP_TRACEPOINT_DEFINE(region) \
+    static fakesp_tracepoint_t fakesp_tp_##region = {.name = #region, .min = UINT64_MAX}
+#define FAKESP_TRACE_BEGIN(region)    \
+    FAKESP_TRACEPOINT_DEFINE(region); \
+    const fakesp_cycles_t fakesp_tp_start_##region = fakesp_cycles()
+#define FAKESP_TRACE_END(region) \
+    fakesp_tracepoint_add(&fakesp_tp_##region, fakesp_cycles() - fakesp_tp_start_##region)
+#define FAKESP_TRACE_SCOPE(region)                                                         \
+    FAKESP_TRACEPOINT_DEFINE(region);                                                      \
+    __attribute__((cleanup(fakesp_tracepoint_scope_end))) const fakesp_tracepoint_scope_t \
+        fakesp_tp_scope_##region = {&fakesp_tp_##region, fakesp_cycles()}
+
+#else
+
+#define FAKESP_TRACE_BEGIN(region)
+#define FAKESP_TRACE_END(region)
+#define FAKESP_TRACE_SCOPE(region)
+#define fakesp_tracepoints_print()
+
+#endif
+
+/**
+ * Poisoning: buffers whose stale contents are never read, such as frame data beyond its size or
+ * freed slab blocks, are not cleared on reuse. To catch code which reads them anyway, defining
+ * FAKESP_POISON (make POISON=1, and the sanitizer builds), or CONFIG_RTP_POISON on the device,
+ * fills them with FAKESP_POISON_BYTE instead. Compiles to nothing otherwise.
+ */
+#if defined(CONFIG_RTP_POISON) && !defined(FAKESP_POISON)
+#define FAKESP_POISON
+#endif
+
+#define FAKESP_POISON_BYTE 0xA5
+
+#ifdef FAKESP_POISON
+#include <string.h>
+#define FAKESP_POISON_FILL(buf, sz) memset((buf), FAKESP_POISON_BYTE, (sz))
+#else
+#define FAKESP_POISON_FILL(buf, sz)
 #endif
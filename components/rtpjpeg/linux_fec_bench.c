@@ -0,0 +1,259 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fakesp.h"
+#include "rtp.h"
+#include "rtp_fec.h"
+#include "rtp_jpeg.h"
+
+/**
+ * Benchmark of FEC protection levels, on a simulated lossy link without retransmissions.
+ *
+ * Sends synthetic RTP/JPEG frames through a link with random loss and a fixed delay into the
+ * jitterbuffer, once without FEC and once per FEC group size, and prints for each loss rate the
+ * FEC overhead and how many frames got through.
+ * Runs on a virtual clock, so results are reproducible and independent of the host.
+ *
+ * Usage: linux_fec_bench [n_frames]
+ */
+
+#define MAX_FRAMES 65536
+#define DEFAULT_N_FRAMES 3000
+#define FRAME_INTERVAL_US 33333
+#define FRAME_INTERVAL_TS (RTP_PT_CLOCKRATE_JPEG / 30)
+#define PACKET_INTERVAL_US 500
+#define LINK_DELAY_US 20000
+#define TICK_US 250
+#define MTU 1400
+#define SSRC 0x4E534642
+#define FEC_PAYLOAD_TYPE 127
+
+#define N_SCANS 16
+#define MIN_SCAN_SZ 8000
+#define MAX_SCAN_SZ 20000
+
+// Packets in flight on the link, more than the link delay can hold.
+#define LINK_CAP 1024
+
+typedef struct packet_t {
+    int64_t arrival_us;
+    ptrdiff_t sz;
+    uint8_t buf[MTU + RTP_FEC_MAX_OVERHEAD];
+} packet_t;
+
+typedef struct bench_t {
+    // Synthetic entropy coded scans, frame i carries scan i % N_SCANS.
+    uint8_t scans[N_SCANS][MAX_SCAN_SZ];
+    ptrdiff_t scan_szs[N_SCANS];
+
+    // Link, a FIFO as the delay is fixed.
+    packet_t link[LINK_CAP];
+    int link_head;
+    int link_n;
+
+    // Packets of the frame being sent, the FEC packets for them in between.
+    packet_t frame[64];
+    int frame_n;
+
+    uint8_t slab_mem[RTP_JITBUF_MAX_BLOCKS * RTP_JITBUF_BLOCK_SIZE_BYTES];
+    rtp_slab_t slab;
+    rtp_jitbuf_t jitbuf;
+    rtp_jpeg_session_t sess;
+    int64_t now_us;
+    int64_t frame_sent_us[MAX_FRAMES];
+
+    int frames_ok;
+    int frames_corrupt;
+    int64_t latency_us_sum;
+    uint32_t media_bytes;
+    uint32_t fec_bytes;
+} bench_t;
+
+static void frame_cb(const rtp_jpeg_frame_t *frame, void *userdata) {
+    bench_t *b = userdata;
+    const int i = frame->timestamp / FRAME_INTERVAL_TS;
+    const uint8_t *scan = b->scans[i % N_SCANS];
+    const ptrdiff_t scan_sz = b->scan_szs[i % N_SCANS];
+    if (frame->jpeg_data_sz - frame->jfif_header_sz != scan_sz ||
+        memcmp(&frame->jpeg_data[frame->jfif_header_sz], scan, scan_sz) != 0) {
+        b->frames_corrupt++;
+        return;
+    }
+    b->frames_ok++;
+    b->latency_us_sum += b->now_us - b->frame_sent_us[i % MAX_FRAMES];
+}
+
+// Write the RTP and RTP/JPEG headers of one fragment, returns the header size.
+static ptrdiff_t write_headers(uint8_t *buf, const uint16_t seq, const uint32_t ts,
+                               const uint32_t offset) {
+    ptrdiff_t p = 0;
+    buf[p++] = 2 << 6;
+    buf[p++] = RTP_PT_JPEG;
+    buf[p++] = seq >> 8;
+    buf[p++] = seq & 0xFF;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        buf[p++] = (ts >> shift) & 0xFF;
+    }
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        buf[p++] = (SSRC >> shift) & 0xFF;
+    }
+
+    // Type 1 (4:2:0), Q=255 with in-band tables, 240x240.
+    buf[p++] = 0;
+    buf[p++] = (offset >> 16) & 0xFF;
+    buf[p++] = (offset >> 8) & 0xFF;
+    buf[p++] = offset & 0xFF;
+    buf[p++] = 1;
+    buf[p++] = 255;
+    buf[p++] = 30;
+    buf[p++] = 30;
+    if (offset == 0) {
+        buf[p++] = 0;
+        buf[p++] = 0;
+        buf[p++] = 0;
+        buf[p++] = 128;
+        for (int i = 0; i < 128; i++) {
+            buf[p++] = 1 + i % 50;
+        }
+    }
+    return p;
+}
+
+// Packetize frame i into b->frame, adding a FEC packet after every fec_group packets.
+static void packetize(bench_t *b, const int i, uint16_t *seq, uint16_t *fec_seq,
+                      const int fec_group) {
+    const uint8_t *scan = b->scans[i % N_SCANS];
+    const ptrdiff_t scan_sz = b->scan_szs[i % N_SCANS];
+    const uint32_t ts = i * FRAME_INTERVAL_TS;
+
+    b->frame_n = 0;
+    int group_first = 0;
+    for (ptrdiff_t offset = 0; offset < scan_sz;) {
+        packet_t *pkt = &b->frame[b->frame_n++];
+        const ptrdiff_t header_sz = write_headers(pkt->buf, (*seq)++, ts, offset);
+        ptrdiff_t chunk_sz = MTU - header_sz;
+        if (chunk_sz > scan_sz - offset) {
+            chunk_sz = scan_sz - offset;
+        }
+        memcpy(&pkt->buf[header_sz], &scan[offset], chunk_sz);
+        offset += chunk_sz;
+        pkt->sz = header_sz + chunk_sz;
+        if (offset >= scan_sz) {
+            pkt->buf[1] |= 0x80;
+        }
+        b->media_bytes += pkt->sz;
+
+        const int group_n = b->frame_n - group_first;
+        if (fec_group > 0 && (group_n == fec_group || offset >= scan_sz)) {
+            const uint8_t *pkts[RTP_FEC_MAX_PROTECTED];
+            ptrdiff_t szs[RTP_FEC_MAX_PROTECTED];
+            for (int k = 0; k < group_n; k++) {
+                pkts[k] = b->frame[group_first + k].buf;
+                szs[k] = b->frame[group_first + k].sz;
+            }
+            packet_t *fec = &b->frame[b->frame_n++];
+            fec->sz = rtp_fec_make(pkts, szs, group_n, (*fec_seq)++, FEC_PAYLOAD_TYPE, SSRC,
+                                   fec->buf, sizeof(fec->buf));
+            assert(fec->sz > 0);
+            b->fec_bytes += fec->sz;
+            group_first = b->frame_n;
+        }
+    }
+}
+
+static void drain(bench_t *b) {
+    rtp_packet_view_t v;
+    while (rtp_jitbuf_peek_next(&b->jitbuf, b->now_us, &v) > 0) {
+        rtp_jpeg_session_feed(&b->sess, &v);
+        rtp_jitbuf_release(&b->jitbuf);
+    }
+}
+
+static void run(bench_t *b, const int n_frames, const int loss_permille, const int fec_group) {
+    // Holds as many blocks as a jitterbuffer can take, so it never runs out.
+    init_rtp_slab(b->slab_mem, sizeof(b->slab_mem), RTP_JITBUF_BLOCK_SIZE_BYTES, &b->slab);
+    init_rtp_jitbuf(SSRC, &b->slab, &b->jitbuf);
+    rtp_jitbuf_set_fec(&b->jitbuf, fec_group > 0 ? FEC_PAYLOAD_TYPE : 0, SSRC);
+    init_rtp_jpeg_session(SSRC, frame_cb, b, &b->sess);
+    b->link_head = 0;
+    b->link_n = 0;
+    b->frame_n = 0;
+    b->frames_ok = 0;
+    b->frames_corrupt = 0;
+    b->latency_us_sum = 0;
+    b->media_bytes = 0;
+    b->fec_bytes = 0;
+    srand(1);
+
+    uint16_t seq = 65000;  // Wrap around early on.
+    uint16_t fec_seq = 0;
+    int frame = 0;
+    int next_pkt = 0;
+    int64_t next_send_us = 0;
+    for (b->now_us = 0; frame < n_frames || next_pkt < b->frame_n || b->link_n > 0;
+         b->now_us += TICK_US) {
+        if (next_pkt >= b->frame_n && frame < n_frames &&
+            b->now_us >= (int64_t)frame * FRAME_INTERVAL_US) {
+            packetize(b, frame, &seq, &fec_seq, fec_group);
+            b->frame_sent_us[frame % MAX_FRAMES] = b->now_us;
+            next_pkt = 0;
+            frame++;
+        }
+        if (next_pkt < b->frame_n && b->now_us >= next_send_us) {
+            const packet_t *pkt = &b->frame[next_pkt++];
+            if (rand() % 1000 >= loss_permille) {
+                assert(b->link_n < LINK_CAP);
+                packet_t *in_flight = &b->link[(b->link_head + b->link_n++) % LINK_CAP];
+                *in_flight = *pkt;
+                in_flight->arrival_us = b->now_us + LINK_DELAY_US;
+            }
+            next_send_us = b->now_us + PACKET_INTERVAL_US;
+        }
+        while (b->link_n > 0 && b->link[b->link_head].arrival_us <= b->now_us) {
+            const packet_t *pkt = &b->link[b->link_head];
+            rtp_jitbuf_feed(&b->jitbuf, pkt->buf, pkt->sz, pkt->arrival_us);
+            drain(b);
+            b->link_head = (b->link_head + 1) % LINK_CAP;
+            b->link_n--;
+        }
+        drain(b);
+    }
+}
+
+int main(int argc, char **argv) {
+    const int n_frames = argc > 1 ? atoi(argv[1]) : DEFAULT_N_FRAMES;
+    if (n_frames <= 0 || n_frames > MAX_FRAMES) {
+        fprintf(stderr, "Usage: %s [n_frames], at most %d\n", argv[0], MAX_FRAMES);
+        return 1;
+    }
+
+    static bench_t b;
+    srand(2);
+    for (int i = 0; i < N_SCANS; i++) {
+        b.scan_szs[i] = MIN_SCAN_SZ + rand() % (MAX_SCAN_SZ - MIN_SCAN_SZ);
+        for (ptrdiff_t k = 0; k < b.scan_szs[i]; k++) {
+            b.scans[i][k] = rand() % 0xFF;  // Without 0xFF, i.e. without markers.
+        }
+    }
+
+    static const int loss_permilles[] = {5, 10, 20, 50, 100};
+    static const int fec_groups[] = {0, 16, 8, 4, 2};
+    printf("%-6s %-9s", "loss", "fec_group");
+    printf(" %-9s %-10s %-9s %-8s %-10s\n", "overhead", "frames_ok", "corrupt", "latency",
+           "recovered");
+    for (size_t l = 0; l < sizeof(loss_permilles) / sizeof(loss_permilles[0]); l++) {
+        for (size_t g = 0; g < sizeof(fec_groups) / sizeof(fec_groups[0]); g++) {
+            run(&b, n_frames, loss_permilles[l], fec_groups[g]);
+            rtp_jitbuf_reception_t rx;
+            rtp_jitbuf_get_reception(&b.jitbuf, &rx);
+            printf("%4.1f%%  %-9d %7.1f%%  %8.1f%%  %-9d %6.1fms %-10u\n",
+                   loss_permilles[l] / 10.0, fec_groups[g], 100.0 * b.fec_bytes / b.media_bytes,
+                   100.0 * b.frames_ok / n_frames, b.frames_corrupt,
+                   b.frames_ok > 0 ? b.latency_us_sum / 1000.0 / b.frames_ok : 0.0,
+                   rx.fec_recovered);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include "linux_frame_queue.h"
+
+#include <assert.h>
+#include <string.h>
+
+// Indices count up and wrap around, slots are taken modulo the number of slots.
+#define SLOT_MASK (LINUX_FRAME_QUEUE_N_SLOTS - 1)
+
+_Static_assert((LINUX_FRAME_QUEUE_N_SLOTS & SLOT_MASK) == 0, "Slots must be a power of two");
+
+void init_linux_frame_queue(linux_frame_queue_t *out) {
+    assert(out != NULL);
+    atomic_init(&out->head, 0);
+    out->tail_cached = 0;
+    atomic_init(&out->dropped, 0);
+    atomic_init(&out->tail, 0);
+    out->head_cached = 0;
+}
+
+bool linux_frame_queue_push(linux_frame_queue_t *q, const rtp_jpeg_frame_t *frame) {
+    assert(q != NULL);
+    assert(frame != NULL);
+    assert(frame->jpeg_data_sz <= CONFIG_RTP_JPEG_MAX_DATA_SIZE_BYTES);
+    const unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    if (head - q->tail_cached == LINUX_FRAME_QUEUE_N_SLOTS) {
+        // Looks full, see how far the consumer got.
+        q->tail_cached = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if (head - q->tail_cached == LINUX_FRAME_QUEUE_N_SLOTS) {
+            atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+            return false;
+        }
+    }
+
+    linux_frame_queue_slot_t *slot = &q->slots[head & SLOT_MASK];
+    slot->frame = *frame;
+    memcpy(slot->data, frame->jpeg_data, frame->jpeg_data_sz);
+    slot->frame.jpeg_data = slot->data;
+    // Publish the slot contents along with the index.
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return true;
+}
+
+const rtp_jpeg_frame_t *linux_frame_queue_peek(linux_frame_queue_t *q) {
+    assert(q != NULL);
+    const unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if (tail == q->head_cached) {
+        q->head_cached = atomic_load_explicit(&q->head, memory_order_acquire);
+        if (tail == q->head_cached) {
+            return NULL;
+        }
+    }
+    return &q->slots[tail & SLOT_MASK].frame;
+}
+
+void linux_frame_queue_pop(linux_frame_queue_t *q) {
+    assert(q != NULL);
+    const unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    assert(tail != q->head_cached);
+    // Hand the slot back to the producer only after we are done reading it.
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "rtp_jpeg.h"
+
+/**
+ * Lock-free queue of JPEG frames from one producer thread to one consumer thread, for the Linux
+ * tools. Frames are copied into slots owned by the queue, so the producer can hand them off from
+ * within the frame callback and never waits: if the queue is full, the frame is dropped.
+ */
+
+// A power of two.
+#define LINUX_FRAME_QUEUE_N_SLOTS 64
+
+#define LINUX_CACHE_LINE_SIZE_BYTES 64
+
+typedef struct linux_frame_queue_slot_t {
+    rtp_jpeg_frame_t frame;  // With jpeg_data pointing to data.
+    uint8_t data[CONFIG_RTP_JPEG_MAX_DATA_SIZE_BYTES];
+} linux_frame_queue_slot_t;
+
+/**
+ * The producer and consumer indices are on separate cache lines, and each side keeps a copy of the
+ * other's index, so the cache lines only move between cores when the copy runs out.
+ * Use init_linux_frame_queue() to initialize an instance before usage.
+ */
+typedef struct linux_frame_queue_t {
+    // Producer side.
+    alignas(LINUX_CACHE_LINE_SIZE_BYTES) atomic_uint head;  // Slots pushed.
+    unsigned tail_cached;
+    atomic_uint dropped;  // Frames dropped because the queue was full.
+
+    // Consumer side.
+    alignas(LINUX_CACHE_LINE_SIZE_BYTES) atomic_uint tail;  // Slots popped.
+    unsigned head_cached;
+
+    linux_frame_queue_slot_t slots[LINUX_FRAME_QUEUE_N_SLOTS];
+} linux_frame_queue_t;
+
+void init_linux_frame_queue(linux_frame_queue_t *out);
+
+// Copy a frame into the queue, producer only. Returns false if the queue was full.
+bool linux_frame_queue_push(linux_frame_queue_t *q, const rtp_jpeg_frame_t *frame);
+
+/**
+ * Returns the oldest frame in the queue, or NULL if it is empty, consumer only.
+ * The frame remains valid until linux_frame_queue_pop().
+ */
+const rtp_jpeg_frame_t *linux_frame_queue_peek(linux_frame_queue_t *q);
+
+// Remove the frame returned by linux_frame_queue_peek(), consumer only.
+void linux_frame_queue_pop(linux_frame_queue_t *q);
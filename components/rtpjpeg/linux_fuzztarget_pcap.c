@@ -85,6 +85,10 @@ int main(int argc, char **argv) {
     }
 
     rtp_jpeg_session_t sess = {0};
+    static uint8_t slab_mem[RTP_JITBUF_MAX_BLOCKS * RTP_JITBUF_BLOCK_SIZE_BYTES];
+    rtp_slab_t slab;
+    ESP_ERROR_CHECK(
+        init_rtp_slab(slab_mem, sizeof(slab_mem), RTP_JITBUF_BLOCK_SIZE_BYTES, &slab));
     rtp_jitbuf_t jitbuf = {0};
 
     // Loop through packets and process.
@@ -106,28 +110,25 @@ int main(int argc, char **argv) {
         if (sess.ssrc == 0) {
             // Try to initialize session.
             ESP_LOGI(TAG, "Starting session with ssrc=%u", ssrc);
-            init_rtp_jitbuf(ssrc, &jitbuf);
+            init_rtp_jitbuf(ssrc, &slab, &jitbuf);
             init_rtp_jpeg_session(ssrc, jpeg_frame_cb, NULL, &sess);
         }
 
-        if (rtp_jitbuf_feed(&jitbuf, udp.payload, udp.payload_length) != ESP_OK) {
+        // Use the capture timestamps as clock.
+        const int64_t arrival_us =
+            (int64_t)pcapheader.ts.tv_sec * 1000000 + (int64_t)pcapheader.ts.tv_usec;
+        if (rtp_jitbuf_feed(&jitbuf, udp.payload, udp.payload_length, arrival_us) != ESP_OK) {
             ESP_LOGI(TAG, "Failed to feed RTP packet to jitbuf");
         }
 
         // Feed from jitbuf to jpeg session.
-        uint8_t retr_buf[MAX_BUFFER];
-        ptrdiff_t retr_sz = 0;
-        while ((retr_sz = rtp_jitbuf_retrieve(&jitbuf, retr_buf, sizeof(retr_buf))) > 0) {
-            rtp_packet_t packet;
-            if (parse_rtp_packet(retr_buf, retr_sz, &packet) != ESP_OK) {
-                ESP_LOGI(TAG, "Failed to parse RTP header");
-                continue;
-            }
-
+        rtp_packet_view_t packet;
+        while (rtp_jitbuf_peek_next(&jitbuf, arrival_us, &packet) > 0) {
             ESP_LOGI(TAG, "Feed to JPEG session");
             if (rtp_jpeg_session_feed(&sess, &packet) != ESP_OK) {
                 ESP_LOGI(TAG, "Failed to feed RTP packet to jpeg_session");
             }
+            rtp_jitbuf_release(&jitbuf);
         }
     }
 
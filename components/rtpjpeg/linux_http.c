@@ -0,0 +1,443 @@
+#define _GNU_SOURCE  // For accept4().
+
+#include "linux_http.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+__attribute__((unused)) static const char *TAG = "linux_http";
+
+#define BOUNDARY "frame"
+#define MAX_EVENTS 64
+#define LISTEN_BACKLOG 64
+
+static const char PART_TRAILER[] = "\r\n";
+
+// The epoll data of the listening socket and the event fd, clients have their entry.
+static int listen_tag;
+static int event_tag;
+
+static void frame_unref(linux_http_frame_t *f) {
+    if (f != NULL && --f->refs == 0) {
+        free(f);
+    }
+}
+
+esp_err_t init_linux_http(const uint16_t port, linux_http_t *out) {
+    assert(out != NULL);
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < LINUX_HTTP_MAX_CLIENTS; i++) {
+        out->clients[i].fd = -1;
+    }
+    pthread_mutex_init(&out->lock, NULL);
+
+    out->listen_fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (out->listen_fd < 0) {
+        perror("cannot create socket");
+        return ESP_FAIL;
+    }
+    const int enable = 1;
+    setsockopt(out->listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(out->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(out->listen_fd, LISTEN_BACKLOG) < 0) {
+        perror("bind failed");
+        close(out->listen_fd);
+        return ESP_FAIL;
+    }
+
+    out->epoll_fd = epoll_create1(0);
+    out->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (out->epoll_fd < 0 || out->event_fd < 0) {
+        perror("cannot create epoll");
+        return ESP_FAIL;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &listen_tag};
+    epoll_ctl(out->epoll_fd, EPOLL_CTL_ADD, out->listen_fd, &ev);
+    ev.data.ptr = &event_tag;
+    epoll_ctl(out->epoll_fd, EPOLL_CTL_ADD, out->event_fd, &ev);
+    ESP_LOGI(TAG, "Serving streams on http://0.0.0.0:%u/", port);
+    return ESP_OK;
+}
+
+static void linux_http_close(linux_http_t *s, linux_http_client_t *c) {
+    if (c->streaming) {
+        ESP_LOGI(TAG, "Client of ssrc=%08x left, frames sent=%u skipped=%u", c->ssrc,
+                 c->frames_sent, c->frames_skipped);
+    }
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->out);
+    frame_unref(c->frame);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+static void linux_http_want_out(linux_http_t *s, linux_http_client_t *c, const bool want_out) {
+    if (c->want_out == want_out) {
+        return;
+    }
+    struct epoll_event ev = {.events = EPOLLIN | (want_out ? EPOLLOUT : 0), .data.ptr = c};
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->want_out = want_out;
+}
+
+static linux_http_stream_t *linux_http_find(linux_http_t *s, const uint32_t ssrc) {
+    for (int i = 0; i < LINUX_HTTP_MAX_STREAMS; i++) {
+        if (s->streams[i].latest != NULL && s->streams[i].ssrc == ssrc) {
+            return &s->streams[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Send what the client has to send, until the socket buffer is full. Streaming clients then go on
+ * with the newest frame of their stream, if they did not send it yet.
+ */
+static void linux_http_flush(linux_http_t *s, linux_http_client_t *c) {
+    while (1) {
+        if (c->frame == NULL && c->out_sent == c->out_sz && c->streaming) {
+            const linux_http_stream_t *st = linux_http_find(s, c->ssrc);
+            if (st != NULL && (!c->sent_any || st->latest->n != c->last_n)) {
+                if (c->sent_any) {
+                    c->frames_skipped += st->latest->n - c->last_n - 1;
+                }
+                c->frame = st->latest;
+                c->frame->refs++;
+                c->frame_sent = 0;
+            }
+        }
+
+        struct iovec iov[4];
+        int n_iov = 0;
+        if (c->out_sent < c->out_sz) {
+            iov[n_iov++] = (struct iovec){c->out + c->out_sent, c->out_sz - c->out_sent};
+        }
+        if (c->frame != NULL) {
+            // The parts of the frame, from where we left off.
+            const linux_http_frame_t *f = c->frame;
+            struct iovec parts[3] = {
+                {(void *)f->part_header, f->part_header_sz},
+                {(void *)f->data, f->sz},
+                {(void *)PART_TRAILER, sizeof(PART_TRAILER) - 1},
+            };
+            ptrdiff_t skip = c->frame_sent;
+            for (int i = 0; i < 3; i++) {
+                if (skip >= (ptrdiff_t)parts[i].iov_len) {
+                    skip -= parts[i].iov_len;
+                    continue;
+                }
+                iov[n_iov++] = (struct iovec){(uint8_t *)parts[i].iov_base + skip,
+                                              parts[i].iov_len - skip};
+                skip = 0;
+            }
+        }
+        if (n_iov == 0) {
+            if (c->close_when_sent) {
+                linux_http_close(s, c);
+            } else {
+                linux_http_want_out(s, c, false);
+            }
+            return;
+        }
+
+        // Like writev(), without SIGPIPE if the client went away.
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = n_iov};
+        ptrdiff_t sent = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                linux_http_want_out(s, c, true);
+            } else {
+                linux_http_close(s, c);
+            }
+            return;
+        }
+
+        const ptrdiff_t out_left = c->out_sz - c->out_sent;
+        const ptrdiff_t from_out = sent < out_left ? sent : out_left;
+        c->out_sent += from_out;
+        sent -= from_out;
+        if (c->frame != NULL) {
+            c->frame_sent += sent;
+            const linux_http_frame_t *f = c->frame;
+            if (c->frame_sent == f->part_header_sz + f->sz + (ptrdiff_t)sizeof(PART_TRAILER) - 1) {
+                c->sent_any = true;
+                c->last_n = f->n;
+                c->frames_sent++;
+                frame_unref(c->frame);
+                c->frame = NULL;
+            }
+        }
+    }
+}
+
+// Set the bytes to send before any frame, taking ownership of buf.
+static void linux_http_respond(linux_http_client_t *c, char *buf, const int sz,
+                               const bool close_when_sent) {
+    free(c->out);
+    c->out = buf;
+    c->out_sz = sz;
+    c->out_sent = 0;
+    c->close_when_sent = close_when_sent;
+}
+
+static void linux_http_respond_str(linux_http_client_t *c, const char *str,
+                                   const bool close_when_sent) {
+    linux_http_respond(c, strdup(str), strlen(str), close_when_sent);
+}
+
+// Returns a page listing the streams, to be freed.
+static int linux_http_index(const linux_http_t *s, char **out) {
+    const char *header = "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n<html><body>\n";
+    const int line_max = 160;
+    char *buf = malloc(strlen(header) + LINUX_HTTP_MAX_STREAMS * line_max + 32);
+    assert(buf != NULL);
+    int sz = sprintf(buf, "%s", header);
+    for (int i = 0; i < LINUX_HTTP_MAX_STREAMS; i++) {
+        const linux_http_stream_t *st = &s->streams[i];
+        if (st->latest != NULL) {
+            sz += snprintf(buf + sz, line_max,
+                           "<p><a href=\"/%08x\"><img src=\"/%08x\"></a><br>%08x %dx%d</p>\n",
+                           st->ssrc, st->ssrc, st->ssrc, st->latest->width, st->latest->height);
+        }
+    }
+    sz += sprintf(buf + sz, "</body></html>\n");
+    *out = buf;
+    return sz;
+}
+
+// Handle a complete request, which needs no more than its first line.
+static void linux_http_request(linux_http_t *s, linux_http_client_t *c) {
+    char path[64];
+    if (sscanf(c->request, "GET %63s HTTP/", path) != 1) {
+        linux_http_respond_str(c, "HTTP/1.0 400 Bad Request\r\n\r\n", true);
+        return;
+    }
+    if (strcmp(path, "/") == 0) {
+        char *page;
+        const int sz = linux_http_index(s, &page);
+        linux_http_respond(c, page, sz, true);
+        return;
+    }
+    char *end;
+    const uint32_t ssrc = strtoul(path + 1, &end, 16);
+    if (*end != '\0' || linux_http_find(s, ssrc) == NULL) {
+        linux_http_respond_str(c, "HTTP/1.0 404 Not Found\r\n\r\n", true);
+        return;
+    }
+    const char *header = "HTTP/1.0 200 OK\r\n"
+                         "Content-Type: multipart/x-mixed-replace; boundary=" BOUNDARY "\r\n"
+                         "Cache-Control: no-cache\r\n"
+                         "Connection: close\r\n\r\n";
+    linux_http_respond_str(c, header, false);
+    c->streaming = true;
+    c->ssrc = ssrc;
+    ESP_LOGI(TAG, "Client of ssrc=%08x joined", ssrc);
+}
+
+static void linux_http_accept(linux_http_t *s) {
+    while (1) {
+        const int fd = accept4(s->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) {
+            return;
+        }
+        linux_http_client_t *c = NULL;
+        for (int i = 0; i < LINUX_HTTP_MAX_CLIENTS && c == NULL; i++) {
+            if (s->clients[i].fd < 0) {
+                c = &s->clients[i];
+            }
+        }
+        if (c == NULL) {
+            ESP_LOGW(TAG, "Too many clients");
+            close(fd);
+            continue;
+        }
+        // The kernel doubles this for its bookkeeping.
+        const int sndbuf = LINUX_HTTP_CLIENT_SNDBUF_BYTES / 2;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        c->fd = fd;
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+static void linux_http_read(linux_http_t *s, linux_http_client_t *c) {
+    char buf[LINUX_HTTP_REQUEST_SIZE_BYTES];
+    const ptrdiff_t sz = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (sz == 0 || (sz < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        linux_http_close(s, c);
+        return;
+    }
+    if (sz < 0 || c->streaming || c->out != NULL) {
+        // Anything after the request is ignored.
+        return;
+    }
+    const ptrdiff_t n = sz < (ptrdiff_t)sizeof(c->request) - 1 - c->request_sz
+                            ? sz
+                            : (ptrdiff_t)sizeof(c->request) - 1 - c->request_sz;
+    memcpy(c->request + c->request_sz, buf, n);
+    c->request_sz += n;
+    c->request[c->request_sz] = '\0';
+    if (strstr(c->request, "\r\n\r\n") != NULL) {
+        linux_http_request(s, c);
+        linux_http_flush(s, c);
+    } else if (c->request_sz == (int)sizeof(c->request) - 1) {
+        linux_http_close(s, c);
+    }
+}
+
+// Make a frame the latest of its stream, and send it to the clients waiting for one.
+static void linux_http_update(linux_http_t *s, linux_http_frame_t *f) {
+    linux_http_stream_t *st = linux_http_find(s, f->ssrc);
+    for (int i = 0; i < LINUX_HTTP_MAX_STREAMS && st == NULL; i++) {
+        if (s->streams[i].latest == NULL) {
+            st = &s->streams[i];
+            st->ssrc = f->ssrc;
+            st->n_frames = 0;
+        }
+    }
+    if (st == NULL) {
+        free(f);
+        return;
+    }
+    f->refs = 1;
+    f->n = st->n_frames++;
+    frame_unref(st->latest);
+    st->latest = f;
+
+    for (int i = 0; i < LINUX_HTTP_MAX_CLIENTS; i++) {
+        linux_http_client_t *c = &s->clients[i];
+        if (c->fd >= 0 && c->streaming && c->ssrc == f->ssrc && c->frame == NULL &&
+            c->out_sent == c->out_sz) {
+            linux_http_flush(s, c);
+        }
+    }
+}
+
+void linux_http_publish(linux_http_t *s, const rtp_jpeg_frame_t *frame) {
+    assert(s != NULL);
+    assert(frame != NULL);
+    linux_http_frame_t *f = malloc(sizeof(*f) + frame->jpeg_data_sz);
+    if (f == NULL) {
+        return;
+    }
+    f->ssrc = frame->ssrc;
+    f->width = frame->width;
+    f->height = frame->height;
+    f->sz = frame->jpeg_data_sz;
+    f->part_header_sz = snprintf(f->part_header, sizeof(f->part_header),
+                                 "--" BOUNDARY "\r\nContent-Type: image/jpeg\r\n"
+                                 "Content-Length: %td\r\n\r\n",
+                                 frame->jpeg_data_sz);
+    memcpy(f->data, frame->jpeg_data, frame->jpeg_data_sz);
+
+    // Replace a frame of the same stream the server did not get to yet.
+    pthread_mutex_lock(&s->lock);
+    int i = 0;
+    while (i < s->n_pending && s->pending[i]->ssrc != f->ssrc) {
+        i++;
+    }
+    linux_http_frame_t *replaced = NULL;
+    if (i < s->n_pending) {
+        replaced = s->pending[i];
+        s->pending[i] = f;
+    } else if (s->n_pending < LINUX_HTTP_MAX_STREAMS) {
+        s->pending[s->n_pending++] = f;
+    } else {
+        replaced = f;
+    }
+    pthread_mutex_unlock(&s->lock);
+    free(replaced);
+
+    const uint64_t one = 1;
+    if (write(s->event_fd, &one, sizeof(one)) < 0) {
+        ESP_LOGD(TAG, "Failed to signal server");
+    }
+}
+
+void linux_http_stop(linux_http_t *s) {
+    assert(s != NULL);
+    atomic_store(&s->stopping, true);
+    const uint64_t one = 1;
+    if (write(s->event_fd, &one, sizeof(one)) < 0) {
+        ESP_LOGD(TAG, "Failed to signal server");
+    }
+}
+
+void linux_http_run(linux_http_t *s) {
+    assert(s != NULL);
+    while (!atomic_load(&s->stopping)) {
+        struct epoll_event events[MAX_EVENTS];
+        const int n = epoll_wait(s->epoll_fd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &listen_tag) {
+                linux_http_accept(s);
+            } else if (events[i].data.ptr == &event_tag) {
+                uint64_t count;
+                if (read(s->event_fd, &count, sizeof(count)) < 0) {
+                    ESP_LOGD(TAG, "Failed to read event fd");
+                }
+                linux_http_frame_t *pending[LINUX_HTTP_MAX_STREAMS];
+                pthread_mutex_lock(&s->lock);
+                const int n_pending = s->n_pending;
+                memcpy(pending, s->pending, n_pending * sizeof(pending[0]));
+                s->n_pending = 0;
+                pthread_mutex_unlock(&s->lock);
+                for (int k = 0; k < n_pending; k++) {
+                    linux_http_update(s, pending[k]);
+                }
+            } else {
+                linux_http_client_t *c = events[i].data.ptr;
+                // Closed by an earlier event of this round.
+                if (c->fd < 0) {
+                    continue;
+                }
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    linux_http_close(s, c);
+                    continue;
+                }
+                if (events[i].events & EPOLLIN) {
+                    linux_http_read(s, c);
+                }
+                if (c->fd >= 0 && (events[i].events & EPOLLOUT)) {
+                    linux_http_flush(s, c);
+                }
+            }
+        }
+    }
+}
+
+void linux_http_destroy(linux_http_t *s) {
+    assert(s != NULL);
+    for (int i = 0; i < LINUX_HTTP_MAX_CLIENTS; i++) {
+        if (s->clients[i].fd >= 0) {
+            linux_http_close(s, &s->clients[i]);
+        }
+    }
+    for (int i = 0; i < LINUX_HTTP_MAX_STREAMS; i++) {
+        frame_unref(s->streams[i].latest);
+        s->streams[i].latest = NULL;
+    }
+    for (int i = 0; i < s->n_pending; i++) {
+        free(s->pending[i]);
+    }
+    s->n_pending = 0;
+    close(s->epoll_fd);
+    close(s->event_fd);
+    close(s->listen_fd);
+    pthread_mutex_destroy(&s->lock);
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fakesp.h"
+#include "rtp_jpeg.h"
+
+/**
+ * HTTP server showing the streams to browsers as MJPEG (multipart/x-mixed-replace), for the
+ * Linux tools.
+ *
+ * GET / lists the streams, GET /<ssrc in hex> streams the frames of one. The server runs an epoll
+ * loop on its own thread. Frames are handed to it from any thread with linux_http_publish(), which
+ * copies each frame once into a reference counted buffer. All clients of a stream are sent from
+ * that buffer, with one gathered sendmsg() for the part header and the JPEG, and no copies per
+ * client. A client still sending a frame when newer ones arrive continues with the newest one once
+ * done, skipping those in between, so slow clients neither queue frames nor hold up others.
+ */
+
+#define LINUX_HTTP_MAX_CLIENTS 256
+#define LINUX_HTTP_MAX_STREAMS 256
+#define LINUX_HTTP_REQUEST_SIZE_BYTES 1024
+#define LINUX_HTTP_PART_HEADER_SIZE_BYTES 96
+// Bytes queued in the kernel per client, about two frames. Left to the kernel, a slow client
+// would have seconds of frames queued before it skips any.
+#define LINUX_HTTP_CLIENT_SNDBUF_BYTES (2 * CONFIG_RTP_JPEG_MAX_DATA_SIZE_BYTES)
+
+// A frame shared by the clients sending it.
+typedef struct linux_http_frame_t {
+    int refs;  // Only touched on the server thread.
+    uint32_t ssrc;
+    int width, height;
+    uint32_t n;  // Frames of the stream before this one.
+    char part_header[LINUX_HTTP_PART_HEADER_SIZE_BYTES];
+    int part_header_sz;
+    ptrdiff_t sz;
+    uint8_t data[];
+} linux_http_frame_t;
+
+typedef struct linux_http_stream_t {
+    uint32_t ssrc;
+    uint32_t n_frames;
+    linux_http_frame_t *latest;  // NULL if the entry is unused.
+} linux_http_stream_t;
+
+typedef struct linux_http_client_t {
+    int fd;  // -1 if the entry is unused.
+    bool streaming;
+    bool close_when_sent;
+    bool want_out;  // Registered for EPOLLOUT.
+    uint32_t ssrc;
+    char request[LINUX_HTTP_REQUEST_SIZE_BYTES];
+    int request_sz;
+
+    // Bytes owned by the client, sent before the frame: response headers or a page.
+    char *out;
+    ptrdiff_t out_sz;
+    ptrdiff_t out_sent;
+
+    // The frame being sent, NULL if none.
+    linux_http_frame_t *frame;
+    ptrdiff_t frame_sent;
+    bool sent_any;
+    uint32_t last_n;  // Of the last frame sent.
+
+    uint32_t frames_sent;
+    uint32_t frames_skipped;
+} linux_http_client_t;
+
+/**
+ * Use init_linux_http() to initialize an instance before usage.
+ */
+typedef struct linux_http_t {
+    int listen_fd;
+    int epoll_fd;
+    int event_fd;  // Signalled when frames are pending or the server should stop.
+    atomic_bool stopping;
+
+    // Frames handed over by linux_http_publish(), at most one per stream.
+    pthread_mutex_t lock;
+    linux_http_frame_t *pending[LINUX_HTTP_MAX_STREAMS];
+    int n_pending;
+
+    // Only touched on the server thread.
+    linux_http_stream_t streams[LINUX_HTTP_MAX_STREAMS];
+    linux_http_client_t clients[LINUX_HTTP_MAX_CLIENTS];
+} linux_http_t;
+
+// Listen on port on all interfaces.
+esp_err_t init_linux_http(const uint16_t port, linux_http_t *out);
+
+// Serve clients until linux_http_stop(), on the calling thread.
+void linux_http_run(linux_http_t *s);
+
+// Have linux_http_run() return, from any thread.
+void linux_http_stop(linux_http_t *s);
+
+// Close all connections and free the frames, after linux_http_run() returned.
+void linux_http_destroy(linux_http_t *s);
+
+// Show a frame to the clients of its stream, from any thread. The frame is copied.
+void linux_http_publish(linux_http_t *s, const rtp_jpeg_frame_t *frame);
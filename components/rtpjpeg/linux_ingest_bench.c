@@ -0,0 +1,300 @@
+#define _GNU_SOURCE  // For recvmmsg(), sendmmsg().
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fakesp.h"
+#include "linux_rx.h"
+#include "rtp.h"
+#include "rtp_jpeg.h"
+#include "rtp_session_table.h"
+#include "rtp_slab.h"
+
+/**
+ * Benchmark of the Linux ingest path.
+ *
+ * Sends synthetic RTP/JPEG frames of n_streams streams over loopback UDP in rounds, and in between
+ * feeds each round into a session table: once with one recvmsg() and rtp_session_table_feed() per
+ * packet, and once batched with recvmmsg() and rtp_session_table_feed_batch(). Sending and
+ * receiving take turns rather than run in parallel, so the receiver always finds a full socket
+ * buffer like on an ingest box under load, and so results do not depend on the number of cores.
+ * Prints the receiver CPU time per packet, the packet rate one core sustains at that cost, and
+ * how many packets the kernel dropped (SO_RXQ_OVFL), which should be none.
+ *
+ * Usage: linux_ingest_bench [n_packets] [n_streams]
+ */
+
+#define DEFAULT_N_PACKETS 1000000
+#define DEFAULT_N_STREAMS 64
+#define MAX_STREAMS 1024
+#define PACKETS_PER_FRAME 8
+#define PAYLOAD_SZ 1200
+#define SSRC_BASE 0x4E530000
+// Packets per round, must fit the socket buffer.
+#define ROUND_N 1024
+#define SEND_BATCH_N 64
+// A round is done early if nothing arrived for this long, i.e. packets were dropped.
+#define RECV_TIMEOUT_US 100000
+#define SOCKET_BUFFER_SIZE_BYTES (8 * 1024 * 1024)
+#define SLAB_N_BLOCKS 8192
+
+#define RTP_HEADER_SZ 12
+#define JPEG_HEADER_SZ 8
+#define QT_HEADER_SZ 4
+#define QT_SZ 128
+
+typedef struct packet_t {
+    uint8_t buf[RTP_HEADER_SZ + JPEG_HEADER_SZ + QT_HEADER_SZ + QT_SZ + PAYLOAD_SZ];
+    ptrdiff_t sz;
+} packet_t;
+
+// Sends frames of all streams in turn, each as a burst of packets.
+typedef struct sender_t {
+    int fd;
+    int n_streams;
+    uint32_t frame;
+    int stream;
+    int packet;
+    packet_t pkts[SEND_BATCH_N];
+} sender_t;
+
+typedef struct result_t {
+    uint32_t received;
+    uint32_t kernel_drops;
+    uint32_t batches;
+    int64_t cpu_ns;
+} result_t;
+
+static long frames = 0;
+
+static void frame_cb(const rtp_jpeg_frame_t *frame __attribute__((unused)),
+                     void *userdata __attribute__((unused))) {
+    frames++;
+}
+
+static int64_t thread_cpu_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Write packet k of frame f of a stream, as a RTP/JPEG type 1 frame of 16x16 px with Q 255.
+static void make_packet(const uint32_t ssrc, const uint32_t f, const int k, packet_t *out) {
+    uint8_t *b = out->buf;
+    const uint16_t seq = f * PACKETS_PER_FRAME + k;
+    const uint32_t ts = f * (RTP_PT_CLOCKRATE_JPEG / 30);
+    const uint32_t offset = k * PAYLOAD_SZ;
+    const uint8_t header[RTP_HEADER_SZ + JPEG_HEADER_SZ] = {
+        0x80, RTP_PT_JPEG | (k == PACKETS_PER_FRAME - 1 ? 0x80 : 0), seq >> 8, seq,
+        ts >> 24, ts >> 16, ts >> 8, ts, ssrc >> 24, ssrc >> 16, ssrc >> 8, ssrc,
+        0, offset >> 16, offset >> 8, offset, 1, 255, 2, 2,
+    };
+    memcpy(b, header, sizeof(header));
+    ptrdiff_t sz = sizeof(header);
+    if (k == 0) {
+        const uint8_t qt_header[QT_HEADER_SZ] = {0, 0, 0, QT_SZ};
+        memcpy(&b[sz], qt_header, sizeof(qt_header));
+        sz += sizeof(qt_header);
+        memset(&b[sz], 1, QT_SZ);
+        sz += QT_SZ;
+    }
+    memset(&b[sz], 0, PAYLOAD_SZ);
+    out->sz = sz + PAYLOAD_SZ;
+}
+
+// Send the next n packets.
+static void sender_send(sender_t *s, const int n) {
+    struct mmsghdr msgs[SEND_BATCH_N];
+    struct iovec iovs[SEND_BATCH_N];
+    for (int sent = 0; sent < n;) {
+        const int batch_n = n - sent < SEND_BATCH_N ? n - sent : SEND_BATCH_N;
+        for (int i = 0; i < batch_n; i++) {
+            make_packet(SSRC_BASE + s->stream, s->frame, s->packet, &s->pkts[i]);
+            iovs[i].iov_base = s->pkts[i].buf;
+            iovs[i].iov_len = s->pkts[i].sz;
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            if (++s->packet == PACKETS_PER_FRAME) {
+                s->packet = 0;
+                if (++s->stream == s->n_streams) {
+                    s->stream = 0;
+                    s->frame++;
+                }
+            }
+        }
+        for (int i = 0; i < batch_n;) {
+            const int r = sendmmsg(s->fd, &msgs[i], batch_n - i, 0);
+            if (r < 0) {
+                perror("sendmmsg failed");
+                exit(1);
+            }
+            i += r;
+        }
+        sent += batch_n;
+    }
+}
+
+// Returns a socket connected to port on loopback.
+static int connect_sender(const int port) {
+    const int fd = socket(PF_INET, SOCK_DGRAM, 0);
+    assert(fd >= 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect failed");
+        exit(1);
+    }
+    return fd;
+}
+
+// Bind a receive socket on loopback, returns its port via port_out.
+static int bind_receiver(int *port_out) {
+    const int fd = socket(PF_INET, SOCK_DGRAM, 0);
+    assert(fd >= 0);
+    const int buf_sz = SOCKET_BUFFER_SIZE_BYTES;
+    // Capped by net.core.rmem_max unless privileged, try both.
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &buf_sz, sizeof(buf_sz)) < 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf_sz, sizeof(buf_sz));
+    }
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+        perror("bind failed");
+        exit(1);
+    }
+    *port_out = ntohs(addr.sin_port);
+    return fd;
+}
+
+// Receive up to n packets of a round with one syscall per packet, returns how many.
+static int receive_single(linux_rx_t *rx, rtp_session_table_t *table, const int n) {
+    int got = 0;
+    while (got < n) {
+        uint8_t buf[RTP_JITBUF_BLOCK_SIZE_BYTES];
+        uint8_t cmsg_buf[LINUX_RX_CMSG_SIZE_BYTES];
+        struct iovec iov = {.iov_base = buf, .iov_len = sizeof(buf)};
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cmsg_buf;
+        msg.msg_controllen = sizeof(cmsg_buf);
+        const ptrdiff_t sz = recvmsg(rx->sockfd, &msg, 0);
+        if (sz < 0) {
+            break;
+        }
+        got++;
+        rx->received++;
+        rx->batches++;
+        int64_t arrival_us = 0;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+                arrival_us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+            } else if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+                memcpy(&rx->kernel_drops, CMSG_DATA(c), sizeof(rx->kernel_drops));
+            }
+        }
+        rtp_session_table_entry_t *e;
+        rtp_session_table_feed(table, buf, sz, arrival_us, &e);
+        if (e != NULL) {
+            rtp_session_table_drain(table, e, arrival_us);
+        }
+    }
+    return got;
+}
+
+// The same, batched.
+static int receive_batched(linux_rx_t *rx, rtp_session_table_t *table, const int n) {
+    int got = 0;
+    while (got < n) {
+        const int batch_n = linux_rx_receive(rx);
+        if (batch_n < 0) {
+            break;
+        }
+        got += batch_n;
+        rtp_session_table_entry_t *es[LINUX_RX_BATCH_N];
+        rtp_session_table_feed_batch(table, rx->pkts, batch_n, es);
+        for (int i = 0; i < batch_n; i++) {
+            // Drain each stream once per run of its packets.
+            if (es[i] != NULL && (i + 1 == batch_n || es[i + 1] != es[i])) {
+                rtp_session_table_drain(table, es[i], rx->pkts[batch_n - 1].arrival_us);
+            }
+        }
+    }
+    return got;
+}
+
+static void run(const bool batched, const int n_packets, const int n_streams, result_t *out) {
+    static uint8_t slab_mem[SLAB_N_BLOCKS * RTP_JITBUF_BLOCK_SIZE_BYTES];
+    static rtp_session_table_entry_t entries[MAX_STREAMS];
+    rtp_slab_t slab;
+    init_rtp_slab(slab_mem, sizeof(slab_mem), RTP_JITBUF_BLOCK_SIZE_BYTES, &slab);
+    rtp_session_table_t table;
+    init_rtp_session_table(entries, MAX_STREAMS, 60 * 1000000, &slab, frame_cb, NULL, &table);
+
+    int port;
+    const int fd = bind_receiver(&port);
+    static linux_rx_t rx;
+    if (init_linux_rx(fd, RECV_TIMEOUT_US, &rx) != ESP_OK) {
+        exit(1);
+    }
+    static sender_t s;
+    memset(&s, 0, sizeof(s));
+    s.fd = connect_sender(port);
+    s.n_streams = n_streams;
+
+    frames = 0;
+    out->cpu_ns = 0;
+    for (int sent = 0; sent < n_packets; sent += ROUND_N) {
+        const int n = n_packets - sent < ROUND_N ? n_packets - sent : ROUND_N;
+        sender_send(&s, n);
+        const int64_t start_ns = thread_cpu_ns();
+        batched ? receive_batched(&rx, &table, n) : receive_single(&rx, &table, n);
+        out->cpu_ns += thread_cpu_ns() - start_ns;
+    }
+    out->received = rx.received;
+    out->kernel_drops = rx.kernel_drops;
+    out->batches = rx.batches;
+
+    close(s.fd);
+    close(fd);
+    rtp_session_table_destroy(&table);
+}
+
+int main(int argc, char **argv) {
+    const int n_packets = argc > 1 ? atoi(argv[1]) : DEFAULT_N_PACKETS;
+    const int n_streams = argc > 2 ? atoi(argv[2]) : DEFAULT_N_STREAMS;
+    if (n_packets <= 0 || n_streams <= 0 || n_streams > MAX_STREAMS) {
+        fprintf(stderr, "Usage: %s [n_packets] [n_streams], at most %d streams\n", argv[0],
+                MAX_STREAMS);
+        return 1;
+    }
+
+    printf("%-8s %-9s %-9s %-8s %-7s %-9s %-10s\n", "mode", "received", "dropped", "frames",
+           "batch", "cpu/pkt", "pkts/s/core");
+    for (int batched = 0; batched <= 1; batched++) {
+        result_t r;
+        run(batched, n_packets, n_streams, &r);
+        const double ns_per_pkt = r.received > 0 ? (double)r.cpu_ns / r.received : 0;
+        const double batch_avg = r.batches > 0 ? (double)r.received / r.batches : 0;
+        printf("%-8s %-9u %-9u %-8ld %-7.1f %6.0fns  %-10.0f\n", batched ? "recvmmsg" : "recvmsg",
+               r.received, r.kernel_drops, frames, batch_avg, ns_per_pkt,
+               ns_per_pkt > 0 ? 1e9 / ns_per_pkt : 0);
+    }
+    return 0;
+}
@@ -1,28 +1,135 @@
+#define _GNU_SOURCE  // For recvmmsg().
+
 #include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/filter.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "fakesp.h"
+#include "linux_frame_queue.h"
+#include "linux_http.h"
+#include "linux_rx.h"
+#include "linux_segment_writer.h"
+#include "linux_shm_ring.h"
+#include "rtcp.h"
 #include "rtp.h"
+#include "rtp_impair.h"
 #include "rtp_jpeg.h"
+#include "rtp_log.h"
+#include "rtp_session_table.h"
+#include "rtp_slab.h"
+#include "rtp_trace.h"
 
 static const char *TAG = "main";
 
-#define PORT 1234
-#define MAX_BUFFER 65536
+#define DEFAULT_PORT 1234
 
-void jpeg_frame_cb(const rtp_jpeg_frame_t *frame, void *userdata __attribute__((unused))) {
-    assert(frame != NULL);
-    ESP_LOGI(TAG, "========== FRAME %dx%d %u ==========", frame->width, frame->height,
-             frame->timestamp);
+// Concurrent streams per worker, told apart by their SSRC.
+#define MAX_STREAMS 256
+// Streams are removed after this long without packets.
+#define IDLE_TIMEOUT_US (5 * 1000000)
+// Packets in flight of all streams of a worker, about 6 MB.
+#define SLAB_N_BLOCKS 4096
+#define MAX_THREADS 64
+// Sink threads check their queues this often when there is nothing to write.
+#define SINK_IDLE_US 1000
+#define FRAMES_DIR "frames"
+#define DEFAULT_SEGMENT_MB 256
+#define DEFAULT_SEGMENT_S 600
+// Frames kept in shared memory for other processes, about 1.4 MB.
+#define SHM_RING_N_SLOTS 64
+// Packets on the way through the simulated network of a worker, about 6 MB.
+#define IMPAIR_N_PACKETS 4096
+// With a simulated network, wake up this often to take out the packets which became due.
+#define IMPAIR_POLL_US 1000
+// Events traced of the last frames, about 1.5 MB or 1500 frames.
+#define TRACE_N_EVENTS (1 << 16)
+
+// Offset of the SSRC a stream is steered to a worker by, see steer_by_ssrc().
+#define RTP_SSRC_OFFSET 8
+#define RTCP_SSRC_OFFSET 4  // Of the sender, in the first packet of a compound RTCP packet.
+
+// Per stream state, parallel to the session table entries.
+typedef struct stream_t {
+    uint32_t ssrc;   // Of the session table entry this state was set up for.
+    uint32_t batch;  // Last batch of packets with packets of this stream.
+    rtcp_session_t rtcp;
+    struct sockaddr_in source_addr;
+    uint32_t nacks_sent;  // NACK packets sent, logged with the reports.
+} stream_t;
+
+/**
+ * Receives the streams steered to it on its own sockets, into its own packet storage and streams,
+ * so workers share nothing on the packet path, and never wait for file I/O.
+ */
+typedef struct worker_t {
+    int index;
+    int sockfd;
+    int rtcp_sockfd;
+    linux_rx_t rx;
+    rtp_slab_t slab;
+    rtp_session_table_t table;
+    stream_t *streams;
+    linux_frame_queue_t *queue;  // Completed frames go to a sink thread through this queue.
+    pthread_t thread;
+
+    // Packets go through this simulated network before the streams, if not NULL.
+    rtp_impair_t *impair;
+    rtp_jitbuf_packet_t impaired[LINUX_RX_BATCH_N];
+    struct sockaddr_in impaired_addrs[LINUX_RX_BATCH_N];
+    const struct sockaddr_in *impaired_srcs[LINUX_RX_BATCH_N];
+} worker_t;
+
+// Writes the frames of the workers w with w % n_sinks == index.
+typedef struct sink_t {
+    int index;
+    int n_sinks;
+    worker_t *workers;
+    int n_workers;
+    bool jpeg_files;  // Write a JPEG file per frame rather than segments.
+    linux_segment_writer_t segments;
+    linux_shm_ring_t *ring;  // Frames are also published here if not NULL, under ring_lock.
+    linux_http_t *http;      // And here.
+    atomic_bool workers_done;
+    pthread_t thread;
+} sink_t;
+
+// The ring has one writer, the sinks take turns.
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    static int fcount = 0;
+// Set on SIGINT or SIGTERM, to finish the segments before exiting.
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int sig __attribute__((unused))) {
+    stopping = 1;
+}
+
+// Stages of the frames of all workers and sinks are traced here, if not NULL.
+static rtp_trace_t *trace = NULL;
+
+// Trace a frame reaching a stage now.
+static void trace_frame_stage(const rtp_jpeg_frame_t *frame, const rtp_trace_stage_t stage) {
+    if (trace != NULL) {
+        rtp_trace_record(trace, frame->ssrc, frame->timestamp, stage, 0, linux_rx_now_us());
+    }
+}
+
+static void write_jpeg_file(const rtp_jpeg_frame_t *frame) {
+    static atomic_int fcount = 0;
     char fname[128] = {0};
-    snprintf(fname, sizeof(fname), "frames/frame_%010d.jpeg", fcount++);
+    snprintf(fname, sizeof(fname), FRAMES_DIR "/%08x_%010d.jpeg", frame->ssrc,
+             atomic_fetch_add(&fcount, 1));
 
     FILE *f = fopen(fname, "w");
     assert(f != NULL);
@@ -31,77 +138,671 @@ void jpeg_frame_cb(const rtp_jpeg_frame_t *frame, void *userdata __attribute__((
     fclose(f);
 }
 
-int main() {
-    int sockfd;
-    struct sockaddr_in server_addr, client_addr;
-    char buf[MAX_BUFFER];
-    socklen_t addr_size;
+void jpeg_frame_cb(const rtp_jpeg_frame_t *frame, void *userdata) {
+    assert(frame != NULL);
+    worker_t *w = userdata;
+    assert(w != NULL);
+    ESP_LOGI(TAG, "========== FRAME %08x %dx%d %u ==========", frame->ssrc, frame->width,
+             frame->height, frame->timestamp);
+    if (trace != NULL) {
+        rtp_trace_frame(trace, frame, linux_rx_now_us());
+    }
+    if (!linux_frame_queue_push(w->queue, frame)) {
+        ESP_LOGW(TAG, "Dropped frame ssrc=%08x, sink is behind", frame->ssrc);
+        return;
+    }
+    trace_frame_stage(frame, RTP_TRACE_QUEUED);
+}
 
-    // Create socket.
-    if ((sockfd = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+/**
+ * Create a UDP socket bound to port on all interfaces, returns -1 on failure.
+ * With reuseport, other sockets with reuseport can bind the same port, and the kernel spreads the
+ * packets over them.
+ */
+static int bind_udp(const uint16_t port, const bool reuseport) {
+    const int fd = socket(PF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
         perror("cannot create socket");
-        return 0;
+        return -1;
     }
-
-    // Bind to port.
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    const int enable = 1;
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+        perror("setsockopt(SO_REUSEPORT) failed");
+        close(fd);
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         perror("bind failed");
-        return 0;
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    rtp_jpeg_session_t sess = {0};
-    rtp_jitbuf_t jitbuf = {0};
+/**
+ * Have the kernel deliver packets to the sockets bound to the port of fd with SO_REUSEPORT by the
+ * SSRC at offset into the UDP payload: to the socket bound as (ssrc % n)th. Without this, the
+ * kernel picks a socket by a hash of the addresses and ports, which keeps each source on one
+ * socket, but may put a stream on different sockets for RTP and RTCP.
+ */
+static esp_err_t steer_by_ssrc(const int fd, const int offset, const int n) {
+    // The program sees the packet from the UDP payload on. Loads beyond the end of short packets
+    // end it with 0, steering them to the first socket.
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offset),  // A = SSRC, in network byte order.
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n),      // A = A % n
+        BPF_STMT(BPF_RET | BPF_A, 0),                // Return the socket index A.
+    };
+    const struct sock_fprog prog = {.len = sizeof(code) / sizeof(code[0]), .filter = code};
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF) failed");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
 
-    while (1) {
-        // Receive packet.
-        addr_size = sizeof client_addr;
-        memset(buf, 0, sizeof(buf));
-        const ptrdiff_t sz =
-            recvfrom(sockfd, buf, MAX_BUFFER, 0, (struct sockaddr *)&client_addr, &addr_size);
-        ESP_LOGI(TAG, "Received %ld bytes on port %d from %s", sz, client_addr.sin_port,
-                 inet_ntoa(client_addr.sin_addr));
-
-        // Parse RTP header.
-        uint16_t sequence_number = 0;
-        uint32_t ssrc = 0;
-        if (partial_parse_rtp_packet((uint8_t *)buf, sz, &sequence_number, &ssrc) != ESP_OK) {
-            ESP_LOGI(TAG, "Failed to parse RTP header");
+// Returns the state of a stream, set up anew if the session table entry was reused.
+static stream_t *get_stream(worker_t *w, const rtp_session_table_entry_t *e) {
+    stream_t *st = &w->streams[rtp_session_table_index(&w->table, e)];
+    if (st->ssrc != e->ssrc) {
+        ESP_LOGI(TAG, "Stream ssrc=%08x on worker %d", e->ssrc, w->index);
+        st->ssrc = e->ssrc;
+        st->nacks_sent = 0;
+        init_rtcp_session((uint32_t)linux_rx_now_us() ^ e->ssrc, "linux_main", &st->rtcp);
+    }
+    return st;
+}
+
+// Handle SRs from the sources, routed to their stream by the SSRC of the first packet.
+static void rtcp_receive(worker_t *w) {
+    const int64_t now = linux_rx_now_us();
+    uint8_t buf[1500];
+    ptrdiff_t sz;
+    while ((sz = recv(w->rtcp_sockfd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        rtcp_header_t h;
+        ptrdiff_t parsed_sz;
+        if (parse_rtcp_header(buf, sz, &h, &parsed_sz) != ESP_OK || h.payload_sz < 4) {
+            ESP_LOGI(TAG, "Failed to parse RTCP packet");
             continue;
         }
+        const uint32_t ssrc = (uint32_t)h.payload[0] << 24 | (uint32_t)h.payload[1] << 16 |
+                              (uint32_t)h.payload[2] << 8 | h.payload[3];
+        const rtp_session_table_entry_t *e = rtp_session_table_find(&w->table, ssrc);
+        if (e == NULL) {
+            ESP_LOGI(TAG, "RTCP packet for unknown ssrc=%u", ssrc);
+            continue;
+        }
+        if (rtcp_session_feed(&get_stream(w, e)->rtcp, buf, sz, now) != ESP_OK) {
+            ESP_LOGI(TAG, "Failed to parse RTCP packet");
+        }
+    }
+}
 
-        if (sess.ssrc == 0) {
-            // Try to initialize session.
-            ESP_LOGI(TAG, "Starting session with ssrc=%u", ssrc);
-            init_rtp_jitbuf(ssrc, &jitbuf);
-            init_rtp_jpeg_session(ssrc, jpeg_frame_cb, NULL, &sess);
+/**
+ * Send NACKs for missing packets of a stream and a RR + APP feedback when due.
+ * By convention, the source receives RTCP on its RTP port + 1.
+ */
+static void rtcp_service(int rtcp_sockfd, stream_t *st, rtp_jitbuf_t *jitbuf,
+                         const rtp_jpeg_session_t *sess) {
+    rtcp_session_t *rtcp = &st->rtcp;
+    const int64_t now = linux_rx_now_us();
+    uint8_t buf[1500];
+    ptrdiff_t sz;
+
+    struct sockaddr_in dest_addr = st->source_addr;
+    dest_addr.sin_port = htons(ntohs(st->source_addr.sin_port) + 1);
+
+    uint16_t nacks[CONFIG_RTP_JITBUF_CAP_N_PACKETS];
+    const int n_nacks = rtp_jitbuf_get_nacks(jitbuf, now, nacks, CONFIG_RTP_JITBUF_CAP_N_PACKETS);
+    if (n_nacks > 0) {
+        sz = rtcp_session_make_nack(rtcp, jitbuf->ssrc, nacks, n_nacks, buf, sizeof(buf));
+        assert(sz > 0);
+        if (sendto(rtcp_sockfd, buf, sz, 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) < 0) {
+            perror("sendto failed");
         }
+        st->nacks_sent++;
+        RTP_LOGD(TAG, "Sent NACK for %d packets from seq=%u", n_nacks, nacks[0]);
+    }
+
+    if (!rtcp_session_report_due(rtcp, now)) {
+        return;
+    }
+    rtp_jitbuf_reception_t rx;
+    rtp_jitbuf_get_reception(jitbuf, &rx);
+    rtp_jpeg_session_stats_t stats;
+    rtp_jpeg_session_stats(sess, &stats);
+    const rtcp_app_feedback_t app = {
+        .frames_completed = stats.frames_completed,
+        .frames_dropped = stats.frames_dropped,
+        .frames_oversize = stats.frames_oversize,
+        .frames_rescued = stats.frames_rescued,
+        .decode_us_avg = 0,  // We only write files, there is no decoder.
+    };
+    sz = rtcp_session_make_report(rtcp, &rx, &app, now, buf, sizeof(buf));
+    assert(sz > 0);
+    if (sendto(rtcp_sockfd, buf, sz, 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) < 0) {
+        perror("sendto failed");
+        return;
+    }
+    ESP_LOGI(TAG,
+             "Sent RTCP report: received=%u ext_highest_seq=%u jitter=%u dropped=%u nacked=%u "
+             "in %u NACKs rescued=%u/%u frames rtt=%dus fec_recovered=%u/%u damaged=%u "
+             "slab_exhausted=%u",
+             rx.received, rx.ext_highest_seq, rx.jitter, stats.frames_dropped, rx.nacked,
+             st->nacks_sent, rx.rescued, stats.frames_rescued, rx.rtt_us, rx.fec_recovered,
+             rx.fec_received, stats.frames_damaged, rx.slab_exhausted);
+    rtp_jitbuf_stats_t js;
+    rtp_jitbuf_stats(jitbuf, &js);
+    ESP_LOGI(TAG,
+             "Jitbuf ssrc=%08x fed=%u duplicates=%u late=%u evicted=%u gap_releases=%u "
+             "max_reorder=%d copied=%" PRIu64,
+             jitbuf->ssrc, js.fed, js.duplicates, js.late, js.evicted, js.gap_releases,
+             js.max_reorder_depth, js.bytes_copied);
+    ESP_LOGI(TAG,
+             "Session ssrc=%08x completed=%u dropped=%u (missing=%u header=%u unsupported=%u) "
+             "oversize=%u copied=%" PRIu64,
+             jitbuf->ssrc, stats.frames_completed, stats.frames_dropped, stats.dropped_missing,
+             stats.dropped_header, stats.dropped_unsupported, stats.frames_oversize,
+             stats.bytes_copied);
+}
+
+// Service RTCP of all streams, hand out packets which waited too long and remove idle streams.
+static void poll_streams(worker_t *w, const int64_t now) {
+    rtcp_receive(w);
+    for (rtp_session_table_entry_t *e = rtp_session_table_next(&w->table, NULL); e != NULL;
+         e = rtp_session_table_next(&w->table, e)) {
+        stream_t *st = get_stream(w, e);
+        rtcp_service(w->rtcp_sockfd, st, &e->jitbuf, &e->jpeg);
+    }
+    rtp_session_table_poll(&w->table, now);
+}
+
+// Set up the simulated network of a worker, with its own packet storage.
+static esp_err_t init_worker_impair(const rtp_impair_config_t *config, worker_t *w) {
+    uint8_t *slab_mem = malloc((size_t)IMPAIR_N_PACKETS * RTP_JITBUF_BLOCK_SIZE_BYTES);
+    rtp_slab_t *slab = malloc(sizeof(*slab));
+    rtp_impair_packet_t *ring = calloc(IMPAIR_N_PACKETS, sizeof(*ring));
+    w->impair = malloc(sizeof(*w->impair));
+    if (slab_mem == NULL || slab == NULL || ring == NULL || w->impair == NULL) {
+        perror("malloc failed");
+        return ESP_ERR_NO_MEM;
+    }
+    rtp_impair_config_t c = *config;
+    c.seed += w->index;  // Workers see different, but still reproducible, networks.
+    if (init_rtp_slab(slab_mem, (ptrdiff_t)IMPAIR_N_PACKETS * RTP_JITBUF_BLOCK_SIZE_BYTES,
+                      RTP_JITBUF_BLOCK_SIZE_BYTES, slab) != ESP_OK ||
+        init_rtp_impair(&c, ring, IMPAIR_N_PACKETS, slab, w->impair) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to initialize simulated network");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
 
-        if (rtp_jitbuf_feed(&jitbuf, (uint8_t *)buf, sz) != ESP_OK) {
-            ESP_LOGI(TAG, "Failed to feed RTP packet to jitbuf");
+/**
+ * Set up a worker on its sockets, returns ESP_OK on success.
+ * If impair is not NULL, packets go through a simulated network with this config.
+ */
+static esp_err_t init_worker(const int index, const int sockfd, const int rtcp_sockfd,
+                             linux_frame_queue_t *queue, const rtp_impair_config_t *impair,
+                             worker_t *out) {
+    out->index = index;
+    out->sockfd = sockfd;
+    out->rtcp_sockfd = rtcp_sockfd;
+    out->queue = queue;
+    if (impair != NULL && init_worker_impair(impair, out) != ESP_OK) {
+        return ESP_FAIL;
+    }
+
+    // Wake up periodically, so packets get handed out after waiting for max_wait_us even if
+    // nothing else arrives, and delayed packets come out of the simulated network in time.
+    const int64_t timeout_us = impair != NULL ? IMPAIR_POLL_US : CONFIG_RTP_JITBUF_MAX_WAIT_US;
+    if (init_linux_rx(sockfd, timeout_us, &out->rx) != ESP_OK) {
+        return ESP_FAIL;
+    }
+
+    // Packet storage shared by all streams of the worker, and the streams.
+    uint8_t *slab_mem = malloc((size_t)SLAB_N_BLOCKS * RTP_JITBUF_BLOCK_SIZE_BYTES);
+    rtp_session_table_entry_t *entries = calloc(MAX_STREAMS, sizeof(*entries));
+    out->streams = calloc(MAX_STREAMS, sizeof(*out->streams));
+    if (slab_mem == NULL || entries == NULL || out->streams == NULL) {
+        perror("malloc failed");
+        return ESP_ERR_NO_MEM;
+    }
+    if (init_rtp_slab(slab_mem, (ptrdiff_t)SLAB_N_BLOCKS * RTP_JITBUF_BLOCK_SIZE_BYTES,
+                      RTP_JITBUF_BLOCK_SIZE_BYTES, &out->slab) != ESP_OK ||
+        init_rtp_session_table(entries, MAX_STREAMS, IDLE_TIMEOUT_US, &out->slab, jpeg_frame_cb,
+                               out, &out->table) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to initialize session table");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Put the n packets received, if any, on the simulated network of a worker, and take out those
+ * due into w->impaired and w->impaired_srcs.
+ * Returns their number, or -1 as linux_rx_receive() did if there are none.
+ */
+static int worker_impair(worker_t *w, const int n) {
+    const linux_rx_t *rx = &w->rx;
+    for (int i = 0; i < n; i++) {
+        // The source goes along as tag, as the address and port in network byte order.
+        const uint64_t tag = (uint64_t)rx->srcs[i]->sin_addr.s_addr << 16 | rx->srcs[i]->sin_port;
+        rtp_impair_feed(w->impair, rx->pkts[i].buf, rx->pkts[i].sz, rx->pkts[i].arrival_us, tag);
+    }
+    uint64_t tags[LINUX_RX_BATCH_N];
+    const int k =
+        rtp_impair_poll(w->impair, linux_rx_now_us(), w->impaired, tags, LINUX_RX_BATCH_N);
+    for (int i = 0; i < k; i++) {
+        struct sockaddr_in *a = &w->impaired_addrs[i];
+        memset(a, 0, sizeof(*a));
+        a->sin_family = AF_INET;
+        a->sin_addr.s_addr = tags[i] >> 16;
+        a->sin_port = tags[i] & 0xFFFF;
+        w->impaired_srcs[i] = a;
+    }
+    return k == 0 && n < 0 ? n : k;
+}
+
+// Receive and assemble the streams of a worker, until stopping.
+static void *worker_run(void *arg) {
+    worker_t *w = arg;
+    linux_rx_t *rx = &w->rx;
+    int64_t polled_us = 0;
+    int64_t stats_logged_us = 0;
+    uint32_t batch = 0;
+
+    while (!stopping) {
+        // Receive as many packets as are queued, with one syscall.
+        int n = linux_rx_receive(rx);
+        const rtp_jitbuf_packet_t *pkts = rx->pkts;
+        const struct sockaddr_in *const *srcs = rx->srcs;
+        if (w->impair != NULL) {
+            n = worker_impair(w, n);
+            pkts = w->impaired;
+            srcs = w->impaired_srcs;
+        }
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("recvmmsg failed");
+                continue;
+            }
+            // Timed out, repeat NACKs and hand out packets which waited too long.
+            polled_us = linux_rx_now_us();
+            poll_streams(w, polled_us);
+            continue;
         }
+        if (n == 0) {
+            continue;
+        }
+        const int64_t arrival_us = pkts[n - 1].arrival_us;
+        ESP_LOGD(TAG, "Received %d packets on worker %d", n, w->index);
+
+        rtp_session_table_entry_t *es[LINUX_RX_BATCH_N];
+        rtp_session_table_feed_batch(&w->table, pkts, n, es);
 
-        // Feed from jitbuf to jpeg session.
-        uint8_t retr_buf[MAX_BUFFER];
-        ptrdiff_t retr_sz = 0;
-        while ((retr_sz = rtp_jitbuf_retrieve(&jitbuf, retr_buf, sizeof(retr_buf))) > 0) {
-            rtp_packet_t packet;
-            if (parse_rtp_packet(retr_buf, retr_sz, &packet) != ESP_OK) {
+        // The streams with packets in this batch.
+        rtp_session_table_entry_t *touched[LINUX_RX_BATCH_N];
+        int n_touched = 0;
+        batch++;
+        for (int i = 0; i < n; i++) {
+            if (es[i] == NULL) {
                 ESP_LOGI(TAG, "Failed to parse RTP header");
                 continue;
             }
+            stream_t *st = get_stream(w, es[i]);
+            st->source_addr = *srcs[i];
+            if (st->batch != batch) {
+                st->batch = batch;
+                touched[n_touched++] = es[i];
+            }
+        }
 
-            ESP_LOGI(TAG, "Feed to JPEG session");
-            if (rtp_jpeg_session_feed(&sess, &packet) != ESP_OK) {
-                ESP_LOGI(TAG, "Failed to feed RTP packet to jpeg_session");
+        // Log the estimates once per second, for graphing.
+        if (arrival_us - stats_logged_us >= 1000000 && n_touched > 0) {
+            const rtp_session_table_entry_t *e = touched[0];
+            rtp_jitbuf_playout_t playout;
+            rtp_jitbuf_get_playout(&e->jitbuf, &playout);
+            ESP_LOGI(TAG,
+                     "Playout ssrc=%08x jitter=%uts/%dus reorder=%d wait=%dus window=%d",
+                     e->ssrc, playout.jitter, playout.jitter_us, playout.reorder_depth,
+                     playout.wait_us, playout.window);
+            rtp_session_table_stats_t ts;
+            rtp_session_table_stats(&w->table, &ts);
+            rtp_slab_stats_t ss;
+            rtp_slab_stats(&w->slab, &ss);
+            ESP_LOGI(TAG,
+                     "Streams %d/%d created=%u evicted_idle=%u evicted_lru=%u slab free=%d/%d "
+                     "min_free=%d worker=%d",
+                     ts.n_streams, ts.max_streams, ts.created, ts.evicted_idle, ts.evicted_lru,
+                     ss.n_free, ss.n_blocks, ss.min_free, w->index);
+            ESP_LOGI(TAG,
+                     "Socket received=%u batches=%u kernel_drops=%u truncated=%u "
+                     "queue_dropped=%u worker=%d",
+                     rx->received, rx->batches, rx->kernel_drops, rx->truncated,
+                     atomic_load(&w->queue->dropped), w->index);
+            if (w->impair != NULL) {
+                rtp_impair_stats_t is;
+                rtp_impair_stats(w->impair, &is);
+                ESP_LOGI(TAG,
+                         "Impaired fed=%u delivered=%u lost=%u reordered=%u duplicated=%u "
+                         "overflow=%u worker=%d",
+                         is.fed, is.delivered, is.lost, is.reordered, is.duplicated, is.overflow,
+                         w->index);
             }
+            stats_logged_us = arrival_us;
+        }
+
+        // Request missing packets before giving up on them below.
+        rtcp_receive(w);
+        for (int i = 0; i < n_touched; i++) {
+            rtp_session_table_entry_t *e = touched[i];
+            stream_t *st = get_stream(w, e);
+            rtcp_service(w->rtcp_sockfd, st, &e->jitbuf, &e->jpeg);
+
+            // Feed from jitbuf to jpeg session.
+            rtp_session_table_drain(&w->table, e, arrival_us);
+        }
+
+        // With packets arriving all the time, the other streams still need servicing.
+        if (arrival_us - polled_us >= CONFIG_RTP_JITBUF_MAX_WAIT_US) {
+            polled_us = arrival_us;
+            poll_streams(w, polled_us);
         }
     }
+    return NULL;
+}
 
+// Write the frames queued by the workers of a sink, until the workers are done.
+static void *sink_run(void *arg) {
+    sink_t *s = arg;
+    while (1) {
+        // Read before draining, so frames queued by workers before they stopped are written.
+        const bool workers_done = atomic_load(&s->workers_done);
+        bool idle = true;
+        for (int i = s->index; i < s->n_workers; i += s->n_sinks) {
+            linux_frame_queue_t *q = s->workers[i].queue;
+            const rtp_jpeg_frame_t *frame;
+            while ((frame = linux_frame_queue_peek(q)) != NULL) {
+                trace_frame_stage(frame, RTP_TRACE_DECODE_START);
+                if (s->jpeg_files) {
+                    write_jpeg_file(frame);
+                } else if (linux_segment_writer_write(&s->segments, frame, linux_rx_now_us()) !=
+                           ESP_OK) {
+                    ESP_LOGW(TAG, "Failed to record frame ssrc=%08x", frame->ssrc);
+                }
+                if (s->ring != NULL) {
+                    pthread_mutex_lock(&ring_lock);
+                    linux_shm_ring_publish(s->ring, frame);
+                    pthread_mutex_unlock(&ring_lock);
+                }
+                if (s->http != NULL) {
+                    linux_http_publish(s->http, frame);
+                }
+                trace_frame_stage(frame, RTP_TRACE_DECODE_END);
+                linux_frame_queue_pop(q);
+                idle = false;
+            }
+        }
+        if (idle) {
+            if (workers_done) {
+                break;
+            }
+            linux_segment_writer_flush(&s->segments);
+            if (s->index == 0) {
+                rtp_log_flush();  // The deferred debug logs of all workers, if any.
+            }
+            usleep(SINK_IDLE_US);
+        }
+    }
+    linux_segment_writer_close(&s->segments);
+    return NULL;
+}
+
+static void write_trace(const char *buf, ptrdiff_t sz, void *userdata) {
+    fwrite(buf, 1, sz, userdata);
+}
+
+// Log the latency of the stages of the frames traced, and export the trace to path.
+static void finish_trace(const char *path) {
+    int32_t *scratch = malloc(TRACE_N_EVENTS * sizeof(*scratch));
+    if (scratch == NULL) {
+        perror("malloc failed");
+        return;
+    }
+    rtp_trace_summary_t summary;
+    rtp_trace_summarize(trace, scratch, TRACE_N_EVENTS, &summary);
+    free(scratch);
+    for (int i = RTP_TRACE_FIRST_PACKET + 1; i < RTP_TRACE_N_STAGES; i++) {
+        const rtp_trace_latency_t *l = &summary.stages[i];
+        if (l->n == 0) {
+            continue;  // Stages of the device only.
+        }
+        ESP_LOGI(TAG, "Trace %-13s n=%d p50=%dus p99=%dus max=%dus", rtp_trace_stage_name(i), l->n,
+                 l->p50_us, l->p99_us, l->max_us);
+    }
+    ESP_LOGI(TAG, "Trace %-13s n=%d p50=%dus p99=%dus max=%dus", "total", summary.total.n,
+             summary.total.p50_us, summary.total.p99_us, summary.total.max_us);
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror("cannot write trace");
+        return;
+    }
+    rtp_trace_export_chrome_json(trace, write_trace, f);
+    fclose(f);
+    ESP_LOGI(TAG, "Wrote trace to %s", path);
+}
+
+static void *http_run(void *arg) {
+    linux_http_run(arg);
+    return NULL;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-P port] [-t threads] [-s sink_threads] [-m segment_mb] [-d segment_s]\n"
+            "       [-j] [-p shm_name] [-H http_port] [-I impairments] [-T trace_json]\n"
+            "       [-L log_records]\n"
+            "  -P  Receive RTP on this port and RTCP on the next one (default %d).\n"
+            "  -t  Receive on this many worker threads, each owning the streams with\n"
+            "      ssrc %% threads == its index (default 1).\n"
+            "  -s  Write frames on this many threads, fed by the workers through lock-free\n"
+            "      queues (default 1).\n"
+            "  -m  Start a new segment before one grows beyond this many MiB (default %d).\n"
+            "  -d  Start a new segment after this many seconds (default %d).\n"
+            "  -j  Write a JPEG file per frame instead of segments.\n"
+            "  -p  Also publish frames to /dev/shm/<shm_name>, see linux_shm_cat.\n"
+            "  -H  Serve the streams as MJPEG on http://<host>:<http_port>/.\n"
+            "  -I  Pass the packets through a simulated network first, e.g.\n"
+            "      loss=0.01,ge=0.01:0.3,reorder=0.05:4,dup=0.01,delay=20000,jitter=10000,seed=1,\n"
+            "      see rtp_impair_parse_config().\n"
+            "  -T  Trace the stages of the last frames, log their latency and write the\n"
+            "      trace for https://ui.perfetto.dev to trace_json on exit.\n"
+            "  -L  Defer the debug logs of the packet path to a ring of this many records,\n"
+            "      a power of two, formatted by the first sink thread while idle.\n",
+            name, DEFAULT_PORT, DEFAULT_SEGMENT_MB, DEFAULT_SEGMENT_S);
+}
+
+int main(int argc, char **argv) {
+    int port = DEFAULT_PORT;
+    int n_workers = 1;
+    int n_sinks = 1;
+    int64_t segment_sz = (int64_t)DEFAULT_SEGMENT_MB * 1024 * 1024;
+    int64_t segment_us = (int64_t)DEFAULT_SEGMENT_S * 1000000;
+    bool jpeg_files = false;
+    const char *shm_name = NULL;
+    int http_port = 0;
+    const char *impair = NULL;
+    rtp_impair_config_t impair_config;
+    const char *trace_path = NULL;
+    int n_log_records = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "P:t:s:m:d:jp:H:I:T:L:")) != -1) {
+        switch (opt) {
+            case 'P':
+                port = atoi(optarg);
+                break;
+            case 't':
+                n_workers = atoi(optarg);
+                break;
+            case 's':
+                n_sinks = atoi(optarg);
+                break;
+            case 'm':
+                segment_sz = (int64_t)atoi(optarg) * 1024 * 1024;
+                break;
+            case 'd':
+                segment_us = (int64_t)atoi(optarg) * 1000000;
+                break;
+            case 'j':
+                jpeg_files = true;
+                break;
+            case 'p':
+                shm_name = optarg;
+                break;
+            case 'H':
+                http_port = atoi(optarg);
+                break;
+            case 'I':
+                impair = optarg;
+                break;
+            case 'T':
+                trace_path = optarg;
+                break;
+            case 'L':
+                n_log_records = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (n_workers < 1 || n_workers > MAX_THREADS || n_sinks < 1 || n_sinks > n_workers ||
+        port <= 0 || port >= UINT16_MAX || http_port < 0 || http_port > UINT16_MAX ||
+        (impair != NULL && rtp_impair_parse_config(impair, &impair_config) != ESP_OK) ||
+        optind < argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    worker_t *workers = calloc(n_workers, sizeof(*workers));
+    linux_frame_queue_t *queues = calloc(n_workers, sizeof(*queues));
+    sink_t *sinks = calloc(n_sinks, sizeof(*sinks));
+    if (workers == NULL || queues == NULL || sinks == NULL) {
+        perror("malloc failed");
+        return 0;
+    }
+    static rtp_trace_t trace_storage;
+    if (trace_path != NULL) {
+        rtp_trace_event_t *events = calloc(TRACE_N_EVENTS, sizeof(*events));
+        if (events == NULL) {
+            perror("malloc failed");
+            return 0;
+        }
+        init_rtp_trace(events, TRACE_N_EVENTS, &trace_storage);
+        trace = &trace_storage;
+    }
+    if (n_log_records != 0) {
+        rtp_log_record_t *log_records = calloc(n_log_records, sizeof(*log_records));
+        if (log_records == NULL) {
+            perror("malloc failed");
+            return 0;
+        }
+        if (init_rtp_log(log_records, n_log_records) != ESP_OK) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    static linux_shm_ring_t ring;
+    if (shm_name != NULL && init_linux_shm_ring(shm_name, SHM_RING_N_SLOTS, &ring) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create shared memory ring %s", shm_name);
+        return 0;
+    }
+    static linux_http_t http;
+    pthread_t http_thread;
+    if (http_port != 0) {
+        if (init_linux_http(http_port, &http) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to start HTTP server");
+            return 0;
+        }
+        if (pthread_create(&http_thread, NULL, http_run, &http) != 0) {
+            perror("pthread_create failed");
+            return 0;
+        }
+    }
+    for (int i = 0; i < n_sinks; i++) {
+        sinks[i] = (sink_t){.index = i, .n_sinks = n_sinks, .workers = workers,
+                            .n_workers = n_workers, .jpeg_files = jpeg_files,
+                            .ring = shm_name != NULL ? &ring : NULL,
+                            .http = http_port != 0 ? &http : NULL};
+        if (init_linux_segment_writer(FRAMES_DIR, i, segment_sz, segment_us,
+                                      &sinks[i].segments) != ESP_OK) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Create sockets, all of them before steering as that goes by the order they were bound in.
+    for (int i = 0; i < n_workers; i++) {
+        const int sockfd = bind_udp(port, n_workers > 1);
+        const int rtcp_sockfd = bind_udp(port + 1, n_workers > 1);
+        if (sockfd < 0 || rtcp_sockfd < 0) {
+            return 0;
+        }
+        init_linux_frame_queue(&queues[i]);
+        if (init_worker(i, sockfd, rtcp_sockfd, &queues[i], impair != NULL ? &impair_config : NULL,
+                        &workers[i]) != ESP_OK) {
+            return 0;
+        }
+    }
+    if (n_workers > 1) {
+        const bool steered =
+            steer_by_ssrc(workers[0].sockfd, RTP_SSRC_OFFSET, n_workers) == ESP_OK &&
+            steer_by_ssrc(workers[0].rtcp_sockfd, RTCP_SSRC_OFFSET, n_workers) == ESP_OK;
+        if (!steered) {
+            ESP_LOGW(TAG, "Streams are spread over workers by source address instead of SSRC");
+        }
+    }
+
+    ESP_LOGI(TAG, "Receiving on %d workers, writing frames on %d sinks", n_workers, n_sinks);
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    for (int i = 0; i < n_sinks; i++) {
+        if (pthread_create(&sinks[i].thread, NULL, sink_run, &sinks[i]) != 0) {
+            perror("pthread_create failed");
+            return 0;
+        }
+    }
+    for (int i = 0; i < n_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+            perror("pthread_create failed");
+            return 0;
+        }
+    }
+    for (int i = 0; i < n_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    for (int i = 0; i < n_sinks; i++) {
+        atomic_store(&sinks[i].workers_done, true);
+        pthread_join(sinks[i].thread, NULL);
+    }
+    rtp_log_flush();
+    if (trace != NULL) {
+        finish_trace(trace_path);
+    }
+    fakesp_tracepoints_print();
+    linux_shm_ring_destroy(&ring);
+    if (http_port != 0) {
+        linux_http_stop(&http);
+        pthread_join(http_thread, NULL);
+        linux_http_destroy(&http);
+    }
     return 0;
 }
 
@@ -109,6 +810,9 @@ int main() {
 void stack_usage() {
     uint8_t buf[1400];
     rtp_jpeg_session_t sess = {0};
+    uint8_t slab_mem[RTP_JITBUF_MAX_BLOCKS * RTP_JITBUF_BLOCK_SIZE_BYTES];
+    rtp_slab_t slab;
+    init_rtp_slab(slab_mem, sizeof(slab_mem), RTP_JITBUF_BLOCK_SIZE_BYTES, &slab);
     rtp_jitbuf_t jitbuf = {0};
 
     memset(buf, 0, sizeof(buf));
@@ -120,12 +824,12 @@ void stack_usage() {
 
     // Try to initialize session.
     ESP_LOGI(TAG, "Starting session with ssrc=%u", ssrc);
-    init_rtp_jitbuf(ssrc, &jitbuf);
+    init_rtp_jitbuf(ssrc, &slab, &jitbuf);
     init_rtp_jpeg_session(ssrc, jpeg_frame_cb, NULL, &sess);
 
-    rtp_jitbuf_feed(&jitbuf, (uint8_t *)buf, sizeof(buf));
-    rtp_jitbuf_retrieve(&jitbuf, buf, sizeof(buf));
-    rtp_packet_t packet;
-    parse_rtp_packet(buf, sizeof(buf), &packet);
+    rtp_jitbuf_feed(&jitbuf, (uint8_t *)buf, sizeof(buf), 0);
+    rtp_packet_view_t packet;
+    rtp_jitbuf_peek_next(&jitbuf, 0, &packet);
     rtp_jpeg_session_feed(&sess, &packet);
+    rtp_jitbuf_release(&jitbuf);
 }
@@ -0,0 +1,272 @@
+#define _GNU_SOURCE  // For sendmmsg().
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fakesp.h"
+#include "linux_tx.h"
+#include "rtp.h"
+#include "rtp_jpeg_packetizer.h"
+
+/**
+ * Sends JPEG files, or synthetic frames, as RTP/JPEG streams, to test receivers without GStreamer.
+ *
+ * Frames are packetized with rtp_jpeg_packetizer_t and sent with linux_tx_t, i.e. with
+ * sendmmsg() and UDP GSO. Without pacing, each frame goes out at once, in as few messages as GSO
+ * allows. With -p, the packets are spread evenly at that rate, in bursts of -b packets.
+ * With -c, the same frames are sent as that many streams, with consecutive SSRCs, to load test
+ * receivers with many streams.
+ *
+ * Usage: linux_pay [options] <dest_ip> <dest_port> [file.jpeg...]
+ */
+
+static const char *TAG = "pay";
+
+#define DEFAULT_FPS 10
+#define DEFAULT_PACKET_SIZE_BYTES 1400
+#define DEFAULT_WIDTH 320
+#define DEFAULT_HEIGHT 240
+#define DEFAULT_FRAME_SIZE_BYTES 15000
+#define DEFAULT_BURST_N_PACKETS 8
+#define FIRST_SSRC 0x5A000000
+#define MAX_STREAMS 1024
+#define MAX_FRAME_SIZE_BYTES (1024 * 1024)
+#define STATS_INTERVAL_NS 1000000000LL
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int sig __attribute__((unused))) {
+    stopping = 1;
+}
+
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until_ns(const int64_t t) {
+    const struct timespec ts = {.tv_sec = t / 1000000000, .tv_nsec = t % 1000000000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !stopping) {
+    }
+}
+
+// Read a whole file into a new buffer, returns its size or -1.
+static ptrdiff_t read_file(const char *name, uint8_t **out) {
+    FILE *f = fopen(name, "r");
+    if (f == NULL) {
+        perror(name);
+        return -1;
+    }
+    *out = malloc(MAX_FRAME_SIZE_BYTES);
+    const ptrdiff_t sz = *out != NULL ? (ptrdiff_t)fread(*out, 1, MAX_FRAME_SIZE_BYTES, f) : -1;
+    fclose(f);
+    return sz;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-f fps] [-n frames] [-c streams] [-m packet_size] [-W width] [-H height]\n"
+            "       [-z frame_size] [-i dri] [-p pps] [-b burst] [-G] <dest_ip> <dest_port>\n"
+            "       [file.jpeg...]\n"
+            "  -f  Frames per second (default %d).\n"
+            "  -n  Stop after this many frames (default: until Ctrl-C).\n"
+            "  -c  Send this many streams (default 1).\n"
+            "  -m  Max size of the packets, the UDP payload (default %d).\n"
+            "  -W, -H, -z, -i  Size, about the size in bytes and the restart interval in MCUs\n"
+            "      of the synthetic frames sent without files (default %dx%d, %d, 0).\n"
+            "  -p  Pace the packets of all streams to this many per second.\n"
+            "  -b  Packets per burst when pacing (default %d).\n"
+            "  -G  Send one message per packet, without UDP GSO.\n",
+            name, DEFAULT_FPS, DEFAULT_PACKET_SIZE_BYTES, DEFAULT_WIDTH, DEFAULT_HEIGHT,
+            DEFAULT_FRAME_SIZE_BYTES, DEFAULT_BURST_N_PACKETS);
+}
+
+int main(int argc, char **argv) {
+    int fps = DEFAULT_FPS;
+    long max_frames = -1;
+    int n_streams = 1;
+    int packet_sz = DEFAULT_PACKET_SIZE_BYTES;
+    int width = DEFAULT_WIDTH;
+    int height = DEFAULT_HEIGHT;
+    int frame_sz = DEFAULT_FRAME_SIZE_BYTES;
+    int dri = 0;
+    int pps = 0;
+    int burst = DEFAULT_BURST_N_PACKETS;
+    bool gso = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:n:c:m:W:H:z:i:p:b:G")) != -1) {
+        switch (opt) {
+            case 'f':
+                fps = atoi(optarg);
+                break;
+            case 'n':
+                max_frames = atol(optarg);
+                break;
+            case 'c':
+                n_streams = atoi(optarg);
+                break;
+            case 'm':
+                packet_sz = atoi(optarg);
+                break;
+            case 'W':
+                width = atoi(optarg);
+                break;
+            case 'H':
+                height = atoi(optarg);
+                break;
+            case 'z':
+                frame_sz = atoi(optarg);
+                break;
+            case 'i':
+                dri = atoi(optarg);
+                break;
+            case 'p':
+                pps = atoi(optarg);
+                break;
+            case 'b':
+                burst = atoi(optarg);
+                break;
+            case 'G':
+                gso = false;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    struct sockaddr_in dest;
+    memset(&dest, 0, sizeof(dest));
+    dest.sin_family = AF_INET;
+    if (argc - optind < 2 || inet_pton(AF_INET, argv[optind], &dest.sin_addr) != 1 ||
+        atoi(argv[optind + 1]) <= 0 || atoi(argv[optind + 1]) > UINT16_MAX || fps <= 0 ||
+        n_streams < 1 || n_streams > MAX_STREAMS || packet_sz > LINUX_TX_PACKET_SIZE_BYTES ||
+        width <= 0 || width > 2032 || width % 16 != 0 || height <= 0 || height > 2032 ||
+        height % 16 != 0 || dri < 0 || dri > UINT16_MAX || pps < 0 || burst < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    dest.sin_port = htons(atoi(argv[optind + 1]));
+
+    // The frames: the files, or a synthetic frame made anew for every frame sent.
+    const int n_files = argc - optind - 2;
+    uint8_t **files = calloc(n_files > 0 ? n_files : 1, sizeof(*files));
+    ptrdiff_t *file_szs = calloc(n_files > 0 ? n_files : 1, sizeof(*file_szs));
+    rtp_jpeg_packetizer_t *streams = calloc(n_streams, sizeof(*streams));
+    if (files == NULL || file_szs == NULL || streams == NULL) {
+        perror("malloc failed");
+        return 1;
+    }
+    for (int i = 0; i < n_files; i++) {
+        file_szs[i] = read_file(argv[optind + 2 + i], &files[i]);
+        if (file_szs[i] < 0) {
+            return 1;
+        }
+    }
+    static uint8_t synth[MAX_FRAME_SIZE_BYTES];
+
+    srandom(now_ns());
+    for (int i = 0; i < n_streams; i++) {
+        const uint16_t first_seq = random();
+        if (init_rtp_jpeg_packetizer(FIRST_SSRC + i, first_seq, packet_sz, &streams[i]) != ESP_OK) {
+            fprintf(stderr, "Packets must be at least %d bytes\n",
+                    RTP_JPEG_PACKETIZER_MIN_PACKET_SIZE_BYTES);
+            return 1;
+        }
+    }
+    const int sockfd = socket(PF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        perror("cannot create socket");
+        return 1;
+    }
+    static linux_tx_t tx;
+    if (init_linux_tx(sockfd, &dest, 1, gso, &tx) != ESP_OK) {
+        return 1;
+    }
+
+    ESP_LOGI(TAG, "Sending %d streams at %d fps to %s:%d", n_streams, fps, argv[optind],
+             ntohs(dest.sin_port));
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    const uint32_t first_timestamp = random();
+    const int64_t start_ns = now_ns();
+    int64_t frame_ns = start_ns;
+    int64_t burst_ns = start_ns;
+    int64_t stats_ns = start_ns;
+    uint32_t late = 0;
+    uint32_t stats_sent = 0;  // tx.sent at stats_ns.
+    for (long frame = 0; !stopping && frame != max_frames; frame++) {
+        const uint8_t *jpeg = synth;
+        ptrdiff_t sz;
+        if (n_files > 0) {
+            jpeg = files[frame % n_files];
+            sz = file_szs[frame % n_files];
+        } else {
+            sz = rtp_jpeg_synth_frame(width, height, dri, frame, frame_sz, synth, sizeof(synth));
+            assert(sz > 0);
+        }
+        const uint32_t timestamp = first_timestamp + frame * RTP_PT_CLOCKRATE_JPEG / fps;
+        for (int i = 0; i < n_streams; i++) {
+            const esp_err_t err = rtp_jpeg_packetizer_start(&streams[i], jpeg, sz, timestamp);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Cannot send frame %ld: error %d", frame, err);
+                return 1;
+            }
+        }
+
+        // The frame of each stream is queued as one run, which linux_tx sends in GSO messages of
+        // that stream only, see linux_tx.h. The streams follow each other within the frame.
+        uint8_t buf[LINUX_TX_PACKET_SIZE_BYTES];
+        int queued = 0;
+        for (int i = 0; i < n_streams && !stopping; i++) {
+            ptrdiff_t n;
+            while (!stopping && (n = rtp_jpeg_packetizer_next(&streams[i], buf, sizeof(buf))) > 0) {
+                linux_tx_queue(&tx, 0, buf, n);
+                if (pps > 0 && ++queued == burst) {
+                    linux_tx_flush(&tx);
+                    queued = 0;
+                    burst_ns += (int64_t)burst * 1000000000 / pps;
+                    sleep_until_ns(burst_ns);
+                }
+            }
+        }
+        linux_tx_flush(&tx);
+        if (pps > 0) {
+            // The last, partial burst delays the next one.
+            burst_ns += (int64_t)queued * 1000000000 / pps;
+        }
+
+        const int64_t now = now_ns();
+        if (now - stats_ns >= STATS_INTERVAL_NS) {
+            ESP_LOGI(TAG,
+                     "Frame %ld: %u packets/s, sent %u packets in %u messages with %u calls, "
+                     "failed=%u late=%u",
+                     frame, (uint32_t)((tx.sent - stats_sent) * 1000000000LL / (now - stats_ns)),
+                     tx.sent, tx.messages, tx.calls, tx.failed, late);
+            stats_ns = now;
+            stats_sent = tx.sent;
+        }
+        frame_ns += 1000000000 / fps;
+        if (frame_ns < now) {
+            // Behind, e.g. pacing does not leave time for the frame rate. Carry on from now.
+            late++;
+            frame_ns = now;
+        }
+        if (burst_ns < frame_ns) {
+            burst_ns = frame_ns;
+        }
+        sleep_until_ns(frame_ns);
+    }
+    ESP_LOGI(TAG, "Sent %u packets in %u messages with %u calls, failed=%u late=%u", tx.sent,
+             tx.messages, tx.calls, tx.failed, late);
+    return 0;
+}
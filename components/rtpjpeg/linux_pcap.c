@@ -0,0 +1,320 @@
+#include "linux_pcap.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+__attribute__((unused)) static const char *TAG = "linux_pcap";
+
+#define PCAP_HEADER_SZ 24
+#define PCAP_RECORD_HEADER_SZ 16
+#define PCAP_MAGIC_US 0xA1B2C3D4
+#define PCAP_MAGIC_NS 0xA1B23C4D
+// Same when read in either byte order.
+#define PCAPNG_SECTION_HEADER_BLOCK 0x0A0D0D0A
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_INTERFACE_DESCRIPTION_BLOCK 1
+#define PCAPNG_ENHANCED_PACKET_BLOCK 6
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_IF_TSRESOL 9
+// Microseconds, the default of pcapng.
+#define TSRESOL_US 6
+#define TSRESOL_NS 9
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_IPV6 0x86DD
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88A8
+
+static uint16_t rd16(const uint8_t *b, const bool big_endian) {
+    return big_endian ? b[0] << 8 | b[1] : b[1] << 8 | b[0];
+}
+
+static uint32_t rd32(const uint8_t *b, const bool big_endian) {
+    return big_endian ? (uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3]
+                      : (uint32_t)b[3] << 24 | b[2] << 16 | b[1] << 8 | b[0];
+}
+
+// Convert a timestamp in units of tsresol, as the if_tsresol option of pcapng, to nanoseconds.
+static int64_t to_ns(const uint64_t ts, const uint8_t tsresol) {
+    if (tsresol & 0x80) {
+        // Negative power of 2.
+        const int shift = tsresol & 0x7F;
+        if (shift >= 64) {
+            return 0;
+        }
+        const uint64_t frac = ts & ((1ULL << shift) - 1);
+        const int64_t frac_ns = (double)frac * 1e9 / (1ULL << shift);
+        return (int64_t)((ts >> shift) * 1000000000 + frac_ns);
+    }
+    // Unsigned, so that garbage wraps around.
+    uint64_t ns = ts;
+    for (int e = tsresol; e < TSRESOL_NS; e++) {
+        ns *= 10;
+    }
+    for (int e = TSRESOL_NS; e < tsresol; e++) {
+        ns /= 10;
+    }
+    return ns;
+}
+
+esp_err_t linux_pcap_open(const char *path, linux_pcap_t *out) {
+    assert(path != NULL);
+    assert(out != NULL);
+    memset(out, 0, sizeof(*out));
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return ESP_ERR_NOT_FOUND;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < PCAP_HEADER_SZ) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        close(fd);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap failed");
+        return ESP_ERR_NOT_FOUND;
+    }
+    // Read sequentially, once or a few times for benchmarks.
+    madvise(map, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+    out->map = map;
+    out->map_sz = st.st_size;
+
+    const uint32_t magic = rd32(out->map, false);
+    const uint32_t magic_be = rd32(out->map, true);
+    if (magic == PCAPNG_SECTION_HEADER_BLOCK) {
+        out->ng = true;
+    } else if (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS || magic_be == PCAP_MAGIC_US ||
+               magic_be == PCAP_MAGIC_NS) {
+        out->big_endian = magic_be == PCAP_MAGIC_US || magic_be == PCAP_MAGIC_NS;
+        out->n_ifaces = 1;
+        out->linktypes[0] = rd32(&out->map[20], out->big_endian);
+        const bool ns = (out->big_endian ? magic_be : magic) == PCAP_MAGIC_NS;
+        out->tsresols[0] = ns ? TSRESOL_NS : TSRESOL_US;
+    } else {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        linux_pcap_close(out);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    linux_pcap_rewind(out);
+    return ESP_OK;
+}
+
+void linux_pcap_close(linux_pcap_t *p) {
+    assert(p != NULL);
+    if (p->map != NULL) {
+        munmap((void *)p->map, p->map_sz);
+        p->map = NULL;
+    }
+}
+
+void linux_pcap_rewind(linux_pcap_t *p) {
+    assert(p != NULL);
+    // Blocks of pcapng are read from the section header on, which sets up the interfaces.
+    p->offset = p->ng ? 0 : PCAP_HEADER_SZ;
+}
+
+// Read the interface of an interface description block of size sz.
+static void linux_pcap_parse_interface(linux_pcap_t *p, const uint8_t *b, const ptrdiff_t sz) {
+    if (p->n_ifaces == LINUX_PCAP_MAX_INTERFACES || sz < 20) {
+        return;
+    }
+    const int i = p->n_ifaces++;
+    p->linktypes[i] = rd16(&b[8], p->big_endian);
+    p->tsresols[i] = TSRESOL_US;
+    // Options, each padded to 32 bits, up to the trailing length.
+    for (ptrdiff_t o = 16; o + 4 <= sz - 4;) {
+        const uint16_t code = rd16(&b[o], p->big_endian);
+        const uint16_t len = rd16(&b[o + 2], p->big_endian);
+        if (code == PCAPNG_OPT_END || o + 4 + len > sz - 4) {
+            break;
+        }
+        if (code == PCAPNG_OPT_IF_TSRESOL && len >= 1) {
+            p->tsresols[i] = b[o + 4];
+        }
+        o += 4 + ((len + 3) & ~3);
+    }
+}
+
+static esp_err_t linux_pcap_next_ng(linux_pcap_t *p, linux_pcap_packet_t *out) {
+    while (p->offset < (ptrdiff_t)p->map_sz) {
+        const uint8_t *b = &p->map[p->offset];
+        const ptrdiff_t left = p->map_sz - p->offset;
+        if (left < 12) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        const uint32_t type = rd32(b, p->big_endian);
+        if (type == PCAPNG_SECTION_HEADER_BLOCK) {
+            // A new section, possibly in the other byte order, with interfaces of its own.
+            if (rd32(&b[8], false) == PCAPNG_BYTE_ORDER_MAGIC) {
+                p->big_endian = false;
+            } else if (rd32(&b[8], true) == PCAPNG_BYTE_ORDER_MAGIC) {
+                p->big_endian = true;
+            } else {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            p->n_ifaces = 0;
+        }
+        const uint32_t sz = rd32(&b[4], p->big_endian);
+        if (sz < 12 || sz % 4 != 0 || sz > left) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        p->offset += sz;
+
+        if (type == PCAPNG_INTERFACE_DESCRIPTION_BLOCK) {
+            linux_pcap_parse_interface(p, b, sz);
+        } else if (type == PCAPNG_ENHANCED_PACKET_BLOCK && sz >= 32) {
+            const uint32_t iface = rd32(&b[8], p->big_endian);
+            const uint32_t caplen = rd32(&b[20], p->big_endian);
+            if (iface >= (uint32_t)p->n_ifaces || caplen > sz - 32) {
+                continue;
+            }
+            const uint64_t ts =
+                (uint64_t)rd32(&b[12], p->big_endian) << 32 | rd32(&b[16], p->big_endian);
+            out->ts_ns = to_ns(ts, p->tsresols[iface]);
+            out->linktype = p->linktypes[iface];
+            out->data = &b[28];
+            out->sz = caplen;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t linux_pcap_next(linux_pcap_t *p, linux_pcap_packet_t *out) {
+    assert(p != NULL);
+    assert(out != NULL);
+    if (p->ng) {
+        return linux_pcap_next_ng(p, out);
+    }
+    const ptrdiff_t left = p->map_sz - p->offset;
+    if (left == 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    const uint8_t *b = &p->map[p->offset];
+    if (left < PCAP_RECORD_HEADER_SZ) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const uint32_t caplen = rd32(&b[8], p->big_endian);
+    if (caplen > left - PCAP_RECORD_HEADER_SZ) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    p->offset += PCAP_RECORD_HEADER_SZ + caplen;
+    out->ts_ns = (int64_t)rd32(b, p->big_endian) * 1000000000 +
+                 to_ns(rd32(&b[4], p->big_endian), p->tsresols[0]);
+    out->linktype = p->linktypes[0];
+    out->data = &b[PCAP_RECORD_HEADER_SZ];
+    out->sz = caplen;
+    return ESP_OK;
+}
+
+esp_err_t linux_pcap_udp_payload(const linux_pcap_packet_t *pkt, const uint16_t port,
+                                 const uint8_t **payload_out, ptrdiff_t *payload_sz_out) {
+    assert(pkt != NULL);
+    assert(payload_out != NULL);
+    assert(payload_sz_out != NULL);
+    const uint8_t *b = pkt->data;
+    ptrdiff_t sz = pkt->sz;
+
+    // Link layer, leaves the ethertype, or 0 to go by the IP version.
+    ptrdiff_t l2_sz = 0;
+    uint16_t ethertype = 0;
+    switch (pkt->linktype) {
+        case LINUX_PCAP_LINKTYPE_ETHERNET:
+            l2_sz = 14;
+            if (sz < l2_sz) {
+                return ESP_ERR_NOT_FOUND;
+            }
+            ethertype = b[12] << 8 | b[13];
+            while ((ethertype == ETHERTYPE_VLAN || ethertype == ETHERTYPE_QINQ) &&
+                   sz >= l2_sz + 4) {
+                ethertype = b[l2_sz + 2] << 8 | b[l2_sz + 3];
+                l2_sz += 4;
+            }
+            break;
+        case LINUX_PCAP_LINKTYPE_LINUX_SLL:
+            l2_sz = 16;
+            if (sz < l2_sz) {
+                return ESP_ERR_NOT_FOUND;
+            }
+            ethertype = b[14] << 8 | b[15];
+            break;
+        case LINUX_PCAP_LINKTYPE_LINUX_SLL2:
+            l2_sz = 20;
+            if (sz < l2_sz) {
+                return ESP_ERR_NOT_FOUND;
+            }
+            ethertype = b[0] << 8 | b[1];
+            break;
+        case LINUX_PCAP_LINKTYPE_NULL:
+            // The address family is in the byte order of the capturing host, and differs for
+            // IPv6 between systems.
+            l2_sz = 4;
+            break;
+        case LINUX_PCAP_LINKTYPE_RAW:
+            break;
+        default:
+            return ESP_ERR_NOT_FOUND;
+    }
+    b += l2_sz;
+    sz -= l2_sz;
+    if (sz < 1) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (ethertype == 0) {
+        ethertype = b[0] >> 4 == 4 ? ETHERTYPE_IPV4 : b[0] >> 4 == 6 ? ETHERTYPE_IPV6 : 0;
+    }
+
+    // Network layer, without IPv6 extension headers.
+    if (ethertype == ETHERTYPE_IPV4) {
+        if (sz < 20 || b[0] >> 4 != 4) {
+            return ESP_ERR_NOT_FOUND;
+        }
+        const ptrdiff_t ihl = (b[0] & 0x0F) * 4;
+        const ptrdiff_t total_sz = b[2] << 8 | b[3];
+        // Fragments have the more fragments flag or an offset.
+        const bool fragment = ((b[6] << 8 | b[7]) & 0x3FFF) != 0;
+        if (b[9] != IPPROTO_UDP || ihl < 20 || fragment || total_sz < ihl) {
+            return ESP_ERR_NOT_FOUND;
+        }
+        // Ethernet pads short frames.
+        sz = total_sz < sz ? total_sz : sz;
+        b += ihl;
+        sz -= ihl;
+    } else if (ethertype == ETHERTYPE_IPV6) {
+        if (sz < 40 || b[0] >> 4 != 6 || b[6] != IPPROTO_UDP) {
+            return ESP_ERR_NOT_FOUND;
+        }
+        const ptrdiff_t total_sz = 40 + (b[4] << 8 | b[5]);
+        sz = total_sz < sz ? total_sz : sz;
+        b += 40;
+        sz -= 40;
+    } else {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    // Transport layer.
+    if (sz < 8) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    const uint16_t dport = b[2] << 8 | b[3];
+    const ptrdiff_t udp_sz = b[4] << 8 | b[5];
+    if ((port != 0 && dport != port) || udp_sz < 8) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (udp_sz > sz) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *payload_out = &b[8];
+    *payload_sz_out = udp_sz - 8;
+    return ESP_OK;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fakesp.h"
+
+/**
+ * Reader of packet captures in pcap or pcapng format, for the Linux tools, without libpcap.
+ * The file is mapped into memory and packets are handed out in place, so replaying a capture
+ * costs neither copies nor syscalls. Either byte order and timestamps in microseconds or
+ * nanoseconds (pcap), or any resolution of the interface (pcapng), are supported. Of pcapng,
+ * only enhanced packet blocks are read, which tcpdump and Wireshark write.
+ */
+
+// Link types, see https://www.tcpdump.org/linktypes.html.
+#define LINUX_PCAP_LINKTYPE_NULL 0
+#define LINUX_PCAP_LINKTYPE_ETHERNET 1
+#define LINUX_PCAP_LINKTYPE_RAW 101
+#define LINUX_PCAP_LINKTYPE_LINUX_SLL 113
+#define LINUX_PCAP_LINKTYPE_LINUX_SLL2 276
+
+// Interfaces of a pcapng section, packets of further ones are skipped.
+#define LINUX_PCAP_MAX_INTERFACES 16
+
+// A captured packet, see linux_pcap_next().
+typedef struct linux_pcap_packet_t {
+    int64_t ts_ns;  // Capture time since the epoch.
+    uint16_t linktype;
+    // The packet as captured, starting with the link layer header, in the mapped file.
+    const uint8_t *data;
+    ptrdiff_t sz;
+} linux_pcap_packet_t;
+
+/**
+ * Use linux_pcap_open() to initialize an instance before usage.
+ * All struct members are private to the implementation.
+ */
+typedef struct linux_pcap_t {
+    const uint8_t *map;
+    size_t map_sz;
+    ptrdiff_t offset;  // Of the next record or block.
+    bool ng;
+    bool big_endian;  // Byte order of the file, or of the pcapng section.
+
+    // Timestamps and link types of the pcap file, or of the interfaces of the pcapng section.
+    int n_ifaces;
+    uint16_t linktypes[LINUX_PCAP_MAX_INTERFACES];
+    uint8_t tsresols[LINUX_PCAP_MAX_INTERFACES];  // As the if_tsresol option of pcapng.
+} linux_pcap_t;
+
+/**
+ * Map a capture file read-only.
+ * Returns ESP_ERR_NOT_FOUND if it cannot be opened, or ESP_ERR_NOT_SUPPORTED if it is neither pcap
+ * nor pcapng.
+ */
+esp_err_t linux_pcap_open(const char *path, linux_pcap_t *out);
+
+void linux_pcap_close(linux_pcap_t *p);
+
+// Start over with the first packet.
+void linux_pcap_rewind(linux_pcap_t *p);
+
+/**
+ * Get the next packet, which remains valid until the file is closed.
+ * Returns ESP_ERR_NOT_FOUND at the end of the file, or ESP_ERR_INVALID_SIZE if the rest of the
+ * file is truncated or malformed.
+ */
+esp_err_t linux_pcap_next(linux_pcap_t *p, linux_pcap_packet_t *out);
+
+/**
+ * Get the payload of a packet if it is an unfragmented UDP datagram over IPv4 or IPv6 to the given
+ * port, or to any port if port is 0. Ethernet (with VLAN tags), Linux cooked captures, raw IP and
+ * BSD loopback are supported.
+ * The payload points into the packet.
+ * Returns ESP_ERR_NOT_FOUND otherwise, or ESP_ERR_INVALID_SIZE if the capture cut the datagram.
+ */
+esp_err_t linux_pcap_udp_payload(const linux_pcap_packet_t *pkt, const uint16_t port,
+                                 const uint8_t **payload_out, ptrdiff_t *payload_sz_out);
@@ -0,0 +1,276 @@
+#define _GNU_SOURCE  // For recvmmsg() and sendmmsg().
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "fakesp.h"
+#include "linux_rx.h"
+#include "linux_tx.h"
+#include "rtp.h"
+#include "rtp_slab.h"
+
+/**
+ * Relays one RTP stream to many receivers, e.g. displays.
+ *
+ * Receives the stream once, puts it in order and removes duplicates with a jitterbuffer, recovers
+ * lost packets from FEC, and sends the packets on to each destination as a stream of its own:
+ * with its own SSRC, and its own seq numbers, which are contiguous but for packets lost before the
+ * relay. A destination given as <ip>:<port>/<n> is sent one in n frames, for displays which cannot
+ * keep up with the full frame rate.
+ * Relays the first stream received, or the one with the given SSRC, and switches to another after
+ * IDLE_TIMEOUT_US without packets.
+ *
+ * Usage: linux_relay [-S ssrc] [-w max_wait_ms] [-G] <listen_port> <ip>:<port>[/n]...
+ */
+
+static const char *TAG = "relay";
+
+// The stream relayed is given up after this long without packets.
+#define IDLE_TIMEOUT_US (5 * 1000000)
+#define STATS_INTERVAL_US 1000000
+
+typedef struct dest_t {
+    uint32_t ssrc;
+    int every;             // Forward one in this many frames.
+    uint32_t frames;       // Frames of the source so far.
+    bool started;          // Whether timestamp is that of the current frame.
+    uint32_t timestamp;    // Of the current frame.
+    bool forwarding;       // Whether the packets of the current frame are forwarded.
+    uint16_t seq_skipped;  // Packets not forwarded, taken off the seq numbers.
+    uint32_t frames_forwarded;
+} dest_t;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int sig __attribute__((unused))) {
+    stopping = 1;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-S ssrc] [-w max_wait_ms] [-G] <listen_port> <ip>:<port>[/n]...\n"
+            "  -S  Relay the stream with this SSRC (hex), rather than the first one received.\n"
+            "  -w  Wait this long for missing packets (default %d).\n"
+            "  -G  Send one message per packet, without UDP GSO.\n"
+            "  /n  Send one in n frames to this destination.\n",
+            name, CONFIG_RTP_JITBUF_MAX_WAIT_US / 1000);
+}
+
+// Parse <ip>:<port>[/n], returns false if malformed.
+static bool parse_dest(const char *s, struct sockaddr_in *addr, int *every) {
+    char ip[INET_ADDRSTRLEN];
+    unsigned port;
+    int n = 1;
+    const int matched = sscanf(s, "%15[0-9.]:%u/%d", ip, &port, &n);
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    if (matched < 2 || port == 0 || port > UINT16_MAX || n < 1 ||
+        inet_pton(AF_INET, ip, &addr->sin_addr) != 1) {
+        return false;
+    }
+    addr->sin_port = htons(port);
+    *every = n;
+    return true;
+}
+
+// Start the destinations over as new streams, for a new source.
+static void reset_dests(dest_t *dests, const int n_dests) {
+    for (int i = 0; i < n_dests; i++) {
+        const int every = dests[i].every;
+        memset(&dests[i], 0, sizeof(dests[i]));
+        dests[i].every = every;
+        dests[i].ssrc = (uint32_t)random() << 1 ^ (uint32_t)random();
+    }
+}
+
+// Queue a packet of the source to each destination taking the frame it belongs to.
+static void forward(linux_tx_t *tx, dest_t *dests, const int n_dests, const rtp_packet_view_t *v) {
+    for (int i = 0; i < n_dests; i++) {
+        dest_t *d = &dests[i];
+        // Packets come in order, a new timestamp starts a new frame.
+        if (!d->started || v->timestamp != d->timestamp) {
+            d->started = true;
+            d->timestamp = v->timestamp;
+            d->forwarding = d->frames % d->every == 0;
+            d->frames++;
+            d->frames_forwarded += d->forwarding;
+        }
+        if (!d->forwarding) {
+            d->seq_skipped++;
+            continue;
+        }
+        uint8_t *buf = linux_tx_queue(tx, i, v->buf, v->sz);
+        if (buf == NULL) {
+            ESP_LOGW(TAG, "Dropping packet of %td bytes, too large", v->sz);
+            continue;
+        }
+        const uint16_t seq = v->sequence_number - d->seq_skipped;
+        buf[2] = seq >> 8;
+        buf[3] = seq;
+        buf[8] = d->ssrc >> 24;
+        buf[9] = d->ssrc >> 16;
+        buf[10] = d->ssrc >> 8;
+        buf[11] = d->ssrc;
+    }
+}
+
+// Hand out the packets which are due and queue them to the destinations.
+static void drain(rtp_jitbuf_t *jitbuf, linux_tx_t *tx, dest_t *dests, const int n_dests,
+                  const int64_t now) {
+    rtp_packet_view_t v;
+    while (rtp_jitbuf_peek_next(jitbuf, now, &v) > 0) {
+        forward(tx, dests, n_dests, &v);
+        rtp_jitbuf_release(jitbuf);
+    }
+}
+
+int main(int argc, char **argv) {
+    bool any_ssrc = true;
+    uint32_t want_ssrc = 0;
+    int32_t max_wait_us = CONFIG_RTP_JITBUF_MAX_WAIT_US;
+    bool gso = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "S:w:G")) != -1) {
+        switch (opt) {
+            case 'S':
+                any_ssrc = false;
+                want_ssrc = strtoul(optarg, NULL, 16);
+                break;
+            case 'w':
+                max_wait_us = atoi(optarg) * 1000;
+                break;
+            case 'G':
+                gso = false;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    const int n_dests = argc - optind - 1;
+    const int listen_port = optind < argc ? atoi(argv[optind]) : 0;
+    if (n_dests < 1 || n_dests > LINUX_TX_MAX_DESTS || listen_port <= 0 ||
+        listen_port > UINT16_MAX || max_wait_us <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    struct sockaddr_in addrs[LINUX_TX_MAX_DESTS];
+    dest_t dests[LINUX_TX_MAX_DESTS] = {0};
+    for (int i = 0; i < n_dests; i++) {
+        if (!parse_dest(argv[optind + 1 + i], &addrs[i], &dests[i].every)) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    const int sockfd = socket(PF_INET, SOCK_DGRAM, 0);
+    const int tx_sockfd = socket(PF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0 || tx_sockfd < 0) {
+        perror("cannot create socket");
+        return 1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(listen_port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind failed");
+        return 1;
+    }
+
+    // Wake up periodically, so packets get handed out after waiting for max_wait_us even if
+    // nothing else arrives.
+    static linux_rx_t rx;
+    static linux_tx_t tx;
+    if (init_linux_rx(sockfd, max_wait_us, &rx) != ESP_OK ||
+        init_linux_tx(tx_sockfd, addrs, n_dests, gso, &tx) != ESP_OK) {
+        return 1;
+    }
+    // One stream, a slab of this many blocks never runs out.
+    static uint8_t slab_mem[RTP_JITBUF_MAX_BLOCKS * RTP_JITBUF_BLOCK_SIZE_BYTES];
+    rtp_slab_t slab;
+    if (init_rtp_slab(slab_mem, sizeof(slab_mem), RTP_JITBUF_BLOCK_SIZE_BYTES, &slab) != ESP_OK) {
+        return 1;
+    }
+    static rtp_jitbuf_t jitbuf;
+    bool relaying = false;
+    int64_t source_us = 0;  // Arrival of the last packet of the source.
+    srandom(linux_rx_now_us() ^ getpid());
+
+    ESP_LOGI(TAG, "Relaying from port %d to %d destinations", listen_port, n_dests);
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    int64_t stats_logged_us = linux_rx_now_us();
+    while (!stopping) {
+        const int n = linux_rx_receive(&rx);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("recvmmsg failed");
+        }
+
+        // Pick the source, the jitterbuffer ignores the packets of other streams.
+        for (int i = 0; i < n; i++) {
+            uint16_t seq;
+            uint32_t ssrc;
+            if (partial_parse_rtp_packet(rx.pkts[i].buf, rx.pkts[i].sz, &seq, &ssrc) != ESP_OK) {
+                continue;
+            }
+            if (relaying && ssrc == jitbuf.ssrc) {
+                source_us = rx.pkts[i].arrival_us;
+                continue;
+            }
+            if ((any_ssrc || ssrc == want_ssrc) &&
+                (!relaying || rx.pkts[i].arrival_us - source_us > IDLE_TIMEOUT_US)) {
+                ESP_LOGI(TAG, "Relaying ssrc=%08x", ssrc);
+                if (relaying) {
+                    rtp_jitbuf_destroy(&jitbuf);
+                }
+                init_rtp_jitbuf(ssrc, &slab, &jitbuf);
+                rtp_jitbuf_set_max_wait_us(&jitbuf, max_wait_us);
+                reset_dests(dests, n_dests);
+                relaying = true;
+                source_us = rx.pkts[i].arrival_us;
+            }
+        }
+        if (!relaying) {
+            continue;
+        }
+
+        // Hand out packets between feeding, as a batch may span more than the window.
+        const int64_t now = linux_rx_now_us();
+        for (int i = 0; i < n;) {
+            i += rtp_jitbuf_feed_batch(&jitbuf, &rx.pkts[i], n - i);
+            drain(&jitbuf, &tx, dests, n_dests, now);
+        }
+        drain(&jitbuf, &tx, dests, n_dests, now);
+        linux_tx_flush(&tx);
+
+        if (now - stats_logged_us >= STATS_INTERVAL_US) {
+            rtp_jitbuf_reception_t r;
+            rtp_jitbuf_get_reception(&jitbuf, &r);
+            ESP_LOGI(TAG,
+                     "Received %u packets ext_highest_seq=%u fec_recovered=%u/%u "
+                     "kernel_drops=%u, sent %u packets in %u messages with %u calls, failed=%u",
+                     r.received, r.ext_highest_seq, r.fec_recovered, r.fec_received,
+                     rx.kernel_drops, tx.sent, tx.messages, tx.calls, tx.failed);
+            for (int i = 0; i < n_dests; i++) {
+                ESP_LOGI(TAG, "Destination %s:%d ssrc=%08x frames=%u/%u",
+                         inet_ntoa(addrs[i].sin_addr), ntohs(addrs[i].sin_port), dests[i].ssrc,
+                         dests[i].frames_forwarded, dests[i].frames);
+            }
+            stats_logged_us = now;
+        }
+    }
+    if (relaying) {
+        rtp_jitbuf_destroy(&jitbuf);
+    }
+    return 0;
+}
@@ -0,0 +1,717 @@
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fakesp.h"
+#include "linux_pcap.h"
+#include "rtp.h"
+#include "rtp_impair.h"
+#include "rtp_jpeg.h"
+#include "rtp_jpeg_packetizer.h"
+#include "rtp_slab.h"
+
+/**
+ * Benchmark of the depayload pipeline, rtp_jitbuf_feed(), rtp_jitbuf_peek_next() and
+ * rtp_jpeg_session_feed(), on captures or on synthetic workloads.
+ *
+ * Replays the RTP packets of pcap or pcapng captures, or of synthetic workloads, into a
+ * jitterbuffer and a RTP/JPEG session per SSRC, as linux_main does, on a single core without
+ * sockets. Each workload is replayed as fast as possible, on the clock of the capture, once through
+ * the jitterbuffers only and once through the whole pipeline, the sessions taking the difference.
+ * After a pass to warm up, these are repeated and the fastest one counts. A last pass times each
+ * packet, for percentiles of the time per packet and of the latency of frames, from the arrival
+ * of their first packet until they were handed out. With -s, that pass keeps the timing of the
+ * capture, sped up by the given factor, so the latency includes waiting for packets.
+ * Without captures, runs the synthetic workloads: in order, heavily reordered, with burst loss,
+ * and wrapping around the seq numbers. They are seeded, so results only depend on the build and
+ * the host.
+ * With -I, each workload first goes through a rtp_impair_t stage on the clock of the capture, to
+ * replay it as received over a bad network. With -w and -A, the jitterbuffers can be tuned, so
+ * the trade-off of latency and frames lost can be swept across seeds and impairments in seconds.
+ * Last, times setting up a stream, as for every new SSRC, which clears its state but not its
+ * frame data, against also clearing the frame data as a whole.
+ * Prints a table, or with -j JSON, to compare builds.
+ *
+ * Usage: linux_replay_bench [-j] [-n runs] [-s speed] [-p port] [-I impairments] [-w max_wait_us]
+ *                           [-A] [capture...]
+ */
+
+#define DEFAULT_N_RUNS 5
+#define DEFAULT_PORT 1234
+#define MAX_STREAMS 64
+// Frames per stream whose first arrival is remembered, for the latency.
+#define FRAME_HISTORY_N 16
+// Time the jitterbuffers get to hand out the last packets at the end of a replay.
+#define FLUSH_US (10 * 1000000)
+// Packets on the way through the impairment stage at once, further ones are dropped.
+#define IMPAIR_N_PACKETS 16384
+// Streams set up per pass of the stream setup benchmark.
+#define SETUP_N_STREAMS 10000
+
+#define SYNTH_N_FRAMES 2000
+#define SYNTH_WIDTH 320
+#define SYNTH_HEIGHT 240
+#define SYNTH_FRAME_SIZE_BYTES 12000
+#define SYNTH_PACKET_SIZE_BYTES 1400
+#define SYNTH_MAX_FRAME_PACKETS 32
+#define SYNTH_FRAME_INTERVAL_US 33333
+#define SYNTH_FRAME_INTERVAL_TS (RTP_PT_CLOCKRATE_JPEG / 30)
+#define SYNTH_PACKET_INTERVAL_US 100
+#define SYNTH_SSRC 0x5242454E
+
+// A synthetic workload.
+typedef struct synth_t {
+    const char *name;
+    uint16_t first_seq;
+    uint16_t dri;       // Restart interval, so frames with lost packets are concealed.
+    int reorder;        // Packets are shuffled within windows of this many, 0 for none.
+    int loss_permille;  // Chance of a burst of loss starting at a packet.
+    int loss_burst;     // Packets lost per burst.
+} synth_t;
+
+static const synth_t SYNTHS[] = {
+    {"in_order", 1000, 0, 0, 0, 0},
+    {"reorder", 1000, 0, 8, 0, 0},
+    {"burst_loss", 1000, 16, 0, 10, 8},
+    {"seq_wrap", UINT16_MAX - 100, 0, 0, 0, 0},
+};
+
+// The packets of a capture or synthetic workload, in order of arrival.
+typedef struct workload_t {
+    char name[64];
+    rtp_jitbuf_packet_t *pkts;
+    int n_pkts;
+    uint8_t *mem;       // Packets of a synthetic or impaired workload.
+    linux_pcap_t pcap;  // Capture the packets point into, if any.
+    rtp_impair_stats_t impair;
+} workload_t;
+
+// The receiving side of a stream.
+typedef struct stream_t {
+    rtp_jitbuf_t jitbuf;
+    rtp_jpeg_session_t sess;
+    // First arrival of the latest frames fed, frame i at i % FRAME_HISTORY_N by RTP timestamp.
+    uint32_t frame_ts[FRAME_HISTORY_N];
+    int64_t frame_arrival_us[FRAME_HISTORY_N];
+    uint32_t n_frames;  // Frames fed.
+} stream_t;
+
+typedef struct bench_t {
+    uint8_t slab_mem[MAX_STREAMS * RTP_JITBUF_MAX_BLOCKS * RTP_JITBUF_BLOCK_SIZE_BYTES];
+    rtp_slab_t slab;
+    stream_t streams[MAX_STREAMS];
+    int n_streams;
+    bool jpeg;       // Whether packets go on to the sessions.
+    int64_t now_us;  // Replay clock.
+    int32_t max_wait_us;
+    bool adaptive;
+
+    uint64_t bytes_copied;  // Into the jitterbuffers, and the frames assembled.
+    uint32_t frames;
+    // Latency of each frame, if not NULL.
+    int64_t *frame_latency_us;
+    int n_frame_latencies;
+} bench_t;
+
+// Percentiles of samples.
+typedef struct percentiles_t {
+    int64_t p50;
+    int64_t p90;
+    int64_t p99;
+    int64_t p999;
+    int64_t max;
+} percentiles_t;
+
+typedef struct result_t {
+    int n_streams;
+    uint32_t frames;
+    uint32_t frames_dropped;
+    uint32_t frames_damaged;
+    uint64_t bytes_copied;
+    // Counters of all streams, of the last pass.
+    rtp_jitbuf_stats_t jitbuf;
+    rtp_jpeg_session_stats_t session;
+    int64_t jitbuf_ns;  // Fastest pass through the jitterbuffers only.
+    int64_t total_ns;   // Fastest pass through the whole pipeline.
+    percentiles_t packet_ns;
+    percentiles_t frame_latency_us;
+} result_t;
+
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until_ns(const int64_t t) {
+    const struct timespec ts = {.tv_sec = t / 1000000000, .tv_nsec = t % 1000000000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static int compare_int64(const void *a, const void *b) {
+    const int64_t x = *(const int64_t *)a;
+    const int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Sorts the samples.
+static void get_percentiles(int64_t *samples, const int n, percentiles_t *out) {
+    memset(out, 0, sizeof(*out));
+    if (n == 0) {
+        return;
+    }
+    qsort(samples, n, sizeof(*samples), compare_int64);
+    out->p50 = samples[n * 50 / 100];
+    out->p90 = samples[n * 90 / 100];
+    out->p99 = samples[n * 99 / 100];
+    out->p999 = samples[(int64_t)n * 999 / 1000];
+    out->max = samples[n - 1];
+}
+
+static void frame_cb(const rtp_jpeg_frame_t *frame, void *userdata) {
+    bench_t *b = userdata;
+    b->frames++;
+    b->bytes_copied += frame->jpeg_data_sz;
+    if (b->frame_latency_us == NULL) {
+        return;
+    }
+    for (int i = 0; i < b->n_streams; i++) {
+        const stream_t *s = &b->streams[i];
+        if (s->sess.ssrc != frame->ssrc) {
+            continue;
+        }
+        for (uint32_t k = 0; k < FRAME_HISTORY_N && k < s->n_frames; k++) {
+            if (s->frame_ts[k] == frame->timestamp) {
+                b->frame_latency_us[b->n_frame_latencies++] = b->now_us - s->frame_arrival_us[k];
+                return;
+            }
+        }
+    }
+}
+
+// Start over without streams.
+static void bench_reset(bench_t *b, const bool jpeg, int64_t *frame_latency_us) {
+    init_rtp_slab(b->slab_mem, sizeof(b->slab_mem), RTP_JITBUF_BLOCK_SIZE_BYTES, &b->slab);
+    b->n_streams = 0;
+    b->jpeg = jpeg;
+    b->bytes_copied = 0;
+    b->frames = 0;
+    b->frame_latency_us = frame_latency_us;
+    b->n_frame_latencies = 0;
+}
+
+// Returns the stream of a packet, a new one for a new SSRC, or NULL if not RTP or too many.
+static stream_t *bench_stream(bench_t *b, const rtp_jitbuf_packet_t *p) {
+    uint16_t seq;
+    uint32_t ssrc;
+    if (partial_parse_rtp_packet(p->buf, p->sz, &seq, &ssrc) != ESP_OK) {
+        return NULL;
+    }
+    for (int i = 0; i < b->n_streams; i++) {
+        if (b->streams[i].jitbuf.ssrc == ssrc) {
+            return &b->streams[i];
+        }
+    }
+    if (b->n_streams == MAX_STREAMS) {
+        return NULL;
+    }
+    stream_t *s = &b->streams[b->n_streams++];
+    s->n_frames = 0;
+    init_rtp_jitbuf(ssrc, &b->slab, &s->jitbuf);
+    rtp_jitbuf_set_max_wait_us(&s->jitbuf, b->max_wait_us);
+    rtp_jitbuf_set_adaptive(&s->jitbuf, b->adaptive);
+    init_rtp_jpeg_session(ssrc, frame_cb, b, &s->sess);
+    return s;
+}
+
+static void bench_drain(bench_t *b, stream_t *s) {
+    rtp_packet_view_t v;
+    while (rtp_jitbuf_peek_next(&s->jitbuf, b->now_us, &v) > 0) {
+        b->bytes_copied += v.sz;
+        if (b->jpeg) {
+            rtp_jpeg_session_feed(&s->sess, &v);
+        }
+        rtp_jitbuf_release(&s->jitbuf);
+    }
+}
+
+static void bench_feed(bench_t *b, const rtp_jitbuf_packet_t *p) {
+    stream_t *s = bench_stream(b, p);
+    if (s == NULL) {
+        return;
+    }
+    if (b->frame_latency_us != NULL) {
+        const uint8_t *b4 = &p->buf[4];
+        const uint32_t ts = (uint32_t)b4[0] << 24 | b4[1] << 16 | b4[2] << 8 | b4[3];
+        const uint32_t n = s->n_frames;
+        if (n == 0 || s->frame_ts[(n - 1) % FRAME_HISTORY_N] != ts) {
+            s->frame_ts[n % FRAME_HISTORY_N] = ts;
+            s->frame_arrival_us[n % FRAME_HISTORY_N] = b->now_us;
+            s->n_frames++;
+        }
+    }
+    rtp_jitbuf_feed(&s->jitbuf, p->buf, p->sz, b->now_us);
+    bench_drain(b, s);
+}
+
+// Hand out what is left and tear down the streams.
+static void bench_finish(bench_t *b, result_t *out) {
+    b->now_us += FLUSH_US;
+    out->n_streams = b->n_streams;
+    out->frames_dropped = 0;
+    out->frames_damaged = 0;
+    memset(&out->jitbuf, 0, sizeof(out->jitbuf));
+    memset(&out->session, 0, sizeof(out->session));
+    for (int i = 0; i < b->n_streams; i++) {
+        bench_drain(b, &b->streams[i]);
+        rtp_jpeg_session_stats_t stats;
+        rtp_jpeg_session_stats(&b->streams[i].sess, &stats);
+        out->frames_dropped += stats.frames_dropped + stats.frames_oversize;
+        out->frames_damaged += stats.frames_damaged;
+        out->session.frames_oversize += stats.frames_oversize;
+        out->session.dropped_missing += stats.dropped_missing;
+        out->session.dropped_header += stats.dropped_header;
+        out->session.dropped_unsupported += stats.dropped_unsupported;
+        out->session.bytes_copied += stats.bytes_copied;
+
+        rtp_jitbuf_stats_t js;
+        rtp_jitbuf_stats(&b->streams[i].jitbuf, &js);
+        out->jitbuf.fed += js.fed;
+        out->jitbuf.duplicates += js.duplicates;
+        out->jitbuf.late += js.late;
+        out->jitbuf.evicted += js.evicted;
+        out->jitbuf.gap_releases += js.gap_releases;
+        out->jitbuf.bytes_copied += js.bytes_copied;
+        if (js.max_reorder_depth > out->jitbuf.max_reorder_depth) {
+            out->jitbuf.max_reorder_depth = js.max_reorder_depth;
+        }
+        rtp_jitbuf_destroy(&b->streams[i].jitbuf);
+    }
+    out->frames = b->frames;
+    out->bytes_copied = b->bytes_copied;
+}
+
+// Replay as fast as possible, returns the time taken.
+static int64_t replay_fast(bench_t *b, const workload_t *w, const bool jpeg, result_t *out) {
+    bench_reset(b, jpeg, NULL);
+    const int64_t start_ns = now_ns();
+    for (int i = 0; i < w->n_pkts; i++) {
+        b->now_us = w->pkts[i].arrival_us;
+        bench_feed(b, &w->pkts[i]);
+    }
+    const int64_t elapsed_ns = now_ns() - start_ns;
+    bench_finish(b, out);
+    return elapsed_ns;
+}
+
+// Replay timing each packet, at speed times the timing of the capture if speed > 0.
+static void replay_timed(bench_t *b, const workload_t *w, const double speed, int64_t *packet_ns,
+                         int64_t *frame_latency_us, result_t *out) {
+    bench_reset(b, true, frame_latency_us);
+    const int64_t first_us = w->n_pkts > 0 ? w->pkts[0].arrival_us : 0;
+    const int64_t start_ns = now_ns();
+    for (int i = 0; i < w->n_pkts; i++) {
+        const rtp_jitbuf_packet_t *p = &w->pkts[i];
+        if (speed > 0) {
+            sleep_until_ns(start_ns + (int64_t)((p->arrival_us - first_us) * 1000 / speed));
+        }
+        const int64_t t_ns = now_ns();
+        b->now_us = speed > 0 ? first_us + (int64_t)((t_ns - start_ns) * speed / 1000)
+                              : p->arrival_us;
+        bench_feed(b, p);
+        packet_ns[i] = now_ns() - t_ns;
+    }
+    bench_finish(b, out);
+    get_percentiles(packet_ns, w->n_pkts, &out->packet_ns);
+    get_percentiles(frame_latency_us, b->n_frame_latencies, &out->frame_latency_us);
+}
+
+static void run(const workload_t *w, const int n_runs, const double speed,
+                const int32_t max_wait_us, const bool adaptive, result_t *out) {
+    static bench_t b;
+    b.max_wait_us = max_wait_us;
+    b.adaptive = adaptive;
+    int64_t *packet_ns = malloc(w->n_pkts * sizeof(*packet_ns) + 1);
+    // A packet completes at most two frames, see rtp_jpeg_frame_cb.
+    int64_t *frame_latency_us = malloc(2 * w->n_pkts * sizeof(*frame_latency_us) + 1);
+    if (packet_ns == NULL || frame_latency_us == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+    // Warm up the caches and fault in the buffers first.
+    replay_fast(&b, w, true, out);
+    out->jitbuf_ns = INT64_MAX;
+    out->total_ns = INT64_MAX;
+    for (int r = 0; r < n_runs; r++) {
+        const int64_t jitbuf_ns = replay_fast(&b, w, false, out);
+        out->jitbuf_ns = jitbuf_ns < out->jitbuf_ns ? jitbuf_ns : out->jitbuf_ns;
+        const int64_t total_ns = replay_fast(&b, w, true, out);
+        out->total_ns = total_ns < out->total_ns ? total_ns : out->total_ns;
+    }
+    replay_timed(&b, w, speed, packet_ns, frame_latency_us, out);
+    free(packet_ns);
+    free(frame_latency_us);
+}
+
+// Time setting up a stream, clearing its frame data too if clear_all, returns the fastest pass in
+// ns per stream.
+static double run_stream_setup(const int n_runs, const bool clear_all) {
+    static bench_t b;
+    bench_reset(&b, true, NULL);
+    stream_t *s = &b.streams[0];
+    int64_t best_ns = INT64_MAX;
+    for (int r = 0; r <= n_runs; r++) {  // The first pass warms up.
+        const int64_t start_ns = now_ns();
+        for (int i = 0; i < SETUP_N_STREAMS; i++) {
+            if (clear_all) {
+                memset(&s->sess, 0, sizeof(s->sess));
+            }
+            init_rtp_jitbuf(SYNTH_SSRC + i, &b.slab, &s->jitbuf);
+            init_rtp_jpeg_session(SYNTH_SSRC + i, frame_cb, &b, &s->sess);
+            rtp_jitbuf_destroy(&s->jitbuf);
+        }
+        const int64_t elapsed_ns = now_ns() - start_ns;
+        if (r > 0 && elapsed_ns < best_ns) {
+            best_ns = elapsed_ns;
+        }
+    }
+    return (double)best_ns / SETUP_N_STREAMS;
+}
+
+static void print_stream_setup(const double ns, const double clear_all_ns, const bool json) {
+    const stream_t *s = NULL;
+    const int not_cleared = sizeof(s->sess.jpeg_data);
+    const int cleared = sizeof(s->jitbuf) + sizeof(s->sess) - not_cleared;
+    if (!json) {
+        printf("stream setup: %.1f ns clearing %d bytes, %.1f ns clearing the %d bytes of frame "
+               "data too\n",
+               ns, cleared, clear_all_ns, not_cleared);
+        return;
+    }
+    printf(" \"stream_setup\": {\"ns\": %.1f, \"bytes_cleared\": %d, \"clear_all_ns\": %.1f, "
+           "\"bytes_not_cleared\": %d}\n",
+           ns, cleared, clear_all_ns, not_cleared);
+}
+
+// Load the RTP packets of a capture to port, or to any port if 0.
+static esp_err_t load_capture(const char *path, const uint16_t port, workload_t *out) {
+    memset(out, 0, sizeof(*out));
+    const char *name = strrchr(path, '/');
+    snprintf(out->name, sizeof(out->name), "%s", name != NULL ? name + 1 : path);
+    esp_err_t err = linux_pcap_open(path, &out->pcap);
+    if (err != ESP_OK) {
+        return err;
+    }
+    // Count first, to take the packets in place.
+    linux_pcap_packet_t pkt;
+    const uint8_t *payload;
+    ptrdiff_t payload_sz;
+    int n = 0;
+    while ((err = linux_pcap_next(&out->pcap, &pkt)) == ESP_OK) {
+        n += linux_pcap_udp_payload(&pkt, port, &payload, &payload_sz) == ESP_OK;
+    }
+    if (err != ESP_ERR_NOT_FOUND) {
+        fprintf(stderr, "%s: truncated after %d packets\n", path, n);
+    }
+    out->pkts = calloc(n + 1, sizeof(*out->pkts));
+    if (out->pkts == NULL) {
+        perror("malloc failed");
+        return ESP_ERR_NO_MEM;
+    }
+    linux_pcap_rewind(&out->pcap);
+    while (out->n_pkts < n && linux_pcap_next(&out->pcap, &pkt) == ESP_OK) {
+        if (linux_pcap_udp_payload(&pkt, port, &payload, &payload_sz) == ESP_OK) {
+            rtp_jitbuf_packet_t *p = &out->pkts[out->n_pkts++];
+            p->buf = payload;
+            p->sz = payload_sz;
+            p->arrival_us = pkt.ts_ns / 1000;
+        }
+    }
+    return ESP_OK;
+}
+
+// Packetize synthetic frames into a workload, dropping and shuffling packets as given.
+static void make_synth(const synth_t *sy, workload_t *out) {
+    memset(out, 0, sizeof(*out));
+    snprintf(out->name, sizeof(out->name), "%s", sy->name);
+    const int cap = SYNTH_N_FRAMES * SYNTH_MAX_FRAME_PACKETS;
+    out->pkts = calloc(cap, sizeof(*out->pkts));
+    out->mem = malloc((size_t)cap * SYNTH_PACKET_SIZE_BYTES);
+    if (out->pkts == NULL || out->mem == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+    srand(1);
+    rtp_jpeg_packetizer_t p;
+    init_rtp_jpeg_packetizer(SYNTH_SSRC, sy->first_seq, SYNTH_PACKET_SIZE_BYTES, &p);
+    static uint8_t jpeg[CONFIG_RTP_JPEG_MAX_DATA_SIZE_BYTES];
+    int lost = 0;  // Left of the current burst.
+    for (int f = 0; f < SYNTH_N_FRAMES; f++) {
+        const int first = out->n_pkts;
+        const ptrdiff_t sz = rtp_jpeg_synth_frame(SYNTH_WIDTH, SYNTH_HEIGHT, sy->dri, f,
+                                                  SYNTH_FRAME_SIZE_BYTES, jpeg, sizeof(jpeg));
+        assert(sz > 0);
+        if (rtp_jpeg_packetizer_start(&p, jpeg, sz, f * SYNTH_FRAME_INTERVAL_TS) != ESP_OK) {
+            fprintf(stderr, "Cannot packetize synthetic frame %d\n", f);
+            exit(1);
+        }
+        for (int k = 0;; k++) {
+            assert(out->n_pkts < cap);
+            uint8_t *buf = &out->mem[(size_t)out->n_pkts * SYNTH_PACKET_SIZE_BYTES];
+            const ptrdiff_t n = rtp_jpeg_packetizer_next(&p, buf, SYNTH_PACKET_SIZE_BYTES);
+            if (n == 0) {
+                break;
+            }
+            if (lost > 0 || rand() % 1000 < sy->loss_permille) {
+                lost = (lost > 0 ? lost : sy->loss_burst) - 1;
+                continue;
+            }
+            rtp_jitbuf_packet_t *pkt = &out->pkts[out->n_pkts++];
+            pkt->buf = buf;
+            pkt->sz = n;
+            pkt->arrival_us = (int64_t)f * SYNTH_FRAME_INTERVAL_US + k * SYNTH_PACKET_INTERVAL_US;
+        }
+        // Shuffle the packets of the frame within windows, the times of arrival stay in order.
+        for (int w = first; sy->reorder > 1 && w < out->n_pkts; w += sy->reorder) {
+            const int n = out->n_pkts - w < sy->reorder ? out->n_pkts - w : sy->reorder;
+            for (int i = n - 1; i > 0; i--) {
+                const int j = rand() % (i + 1);
+                const rtp_jitbuf_packet_t tmp = out->pkts[w + i];
+                out->pkts[w + i].buf = out->pkts[w + j].buf;
+                out->pkts[w + i].sz = out->pkts[w + j].sz;
+                out->pkts[w + j].buf = tmp.buf;
+                out->pkts[w + j].sz = tmp.sz;
+            }
+        }
+    }
+}
+
+// Replace the packets of a workload by what comes out of an impairment stage they are fed to.
+static void impair_workload(const rtp_impair_config_t *config, workload_t *w) {
+    const int cap = 2 * w->n_pkts + 1;  // Every packet may be duplicated.
+    rtp_jitbuf_packet_t *pkts = calloc(cap, sizeof(*pkts));
+    uint8_t *mem = malloc((size_t)cap * RTP_JITBUF_BLOCK_SIZE_BYTES);
+    rtp_impair_packet_t *ring = calloc(IMPAIR_N_PACKETS, sizeof(*ring));
+    uint8_t *slab_mem = malloc((size_t)IMPAIR_N_PACKETS * RTP_JITBUF_BLOCK_SIZE_BYTES);
+    if (pkts == NULL || mem == NULL || ring == NULL || slab_mem == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+    rtp_slab_t slab;
+    rtp_impair_t m;
+    if (init_rtp_slab(slab_mem, (ptrdiff_t)IMPAIR_N_PACKETS * RTP_JITBUF_BLOCK_SIZE_BYTES,
+                      RTP_JITBUF_BLOCK_SIZE_BYTES, &slab) != ESP_OK ||
+        init_rtp_impair(config, ring, IMPAIR_N_PACKETS, &slab, &m) != ESP_OK) {
+        fprintf(stderr, "Failed to initialize simulated network\n");
+        exit(1);
+    }
+
+    const int64_t last_us = w->n_pkts > 0 ? w->pkts[w->n_pkts - 1].arrival_us : 0;
+    int n = 0;
+    for (int i = 0; i <= w->n_pkts; i++) {
+        // After the last packet, wait for all to come out.
+        const int64_t now_us = i < w->n_pkts ? w->pkts[i].arrival_us : last_us + FLUSH_US;
+        if (i < w->n_pkts) {
+            rtp_impair_feed(&m, w->pkts[i].buf, w->pkts[i].sz, now_us, 0);
+        }
+        rtp_jitbuf_packet_t out[64];
+        int k;
+        while ((k = rtp_impair_poll(&m, now_us, out, NULL, 64)) > 0) {
+            for (int j = 0; j < k && n < cap; j++, n++) {
+                uint8_t *buf = &mem[(size_t)n * RTP_JITBUF_BLOCK_SIZE_BYTES];
+                memcpy(buf, out[j].buf, out[j].sz);
+                pkts[n] = out[j];
+                pkts[n].buf = buf;
+            }
+        }
+    }
+    rtp_impair_stats(&m, &w->impair);
+    rtp_impair_destroy(&m);
+    free(ring);
+    free(slab_mem);
+
+    free(w->pkts);
+    free(w->mem);
+    w->pkts = pkts;
+    w->n_pkts = n;
+    w->mem = mem;
+}
+
+static void workload_destroy(workload_t *w) {
+    free(w->pkts);
+    free(w->mem);
+    linux_pcap_close(&w->pcap);
+}
+
+static void print_percentiles_json(const char *name, const percentiles_t *p) {
+    printf("\"%s\": {\"p50\": %" PRId64 ", \"p90\": %" PRId64 ", \"p99\": %" PRId64
+           ", \"p999\": %" PRId64 ", \"max\": %" PRId64 "}",
+           name, p->p50, p->p90, p->p99, p->p999, p->max);
+}
+
+static void print_result(const workload_t *w, const result_t *r, const bool json,
+                         const bool impaired, const bool first) {
+    const int n = w->n_pkts > 0 ? w->n_pkts : 1;
+    const double ns = (double)r->total_ns / n;
+    const double jitbuf_ns = (double)r->jitbuf_ns / n;
+    const double secs = r->total_ns / 1e9;
+    if (!json) {
+        printf("%-12.12s %-8d %-7d %-7u %-7u %-7.1f %-7.1f %-7.1f %-9.0f %-8.0f %-8.0f %-5" PRId64
+               " %-5" PRId64 " %-6" PRId64 " %-7.1f %.1f\n",
+               w->name, w->n_pkts, r->n_streams, r->frames, r->frames_dropped, ns, jitbuf_ns,
+               ns - jitbuf_ns, secs > 0 ? w->n_pkts / secs : 0, secs > 0 ? r->frames / secs : 0,
+               (double)r->bytes_copied / n, r->packet_ns.p50, r->packet_ns.p99,
+               r->packet_ns.p999, r->frame_latency_us.p50 / 1000.0,
+               r->frame_latency_us.p99 / 1000.0);
+        return;
+    }
+    printf("%s\n    {\"name\": \"%s\", \"packets\": %d, \"streams\": %d, \"frames\": %u, "
+           "\"frames_dropped\": %u, \"frames_damaged\": %u,\n",
+           first ? "" : ",", w->name, w->n_pkts, r->n_streams, r->frames, r->frames_dropped,
+           r->frames_damaged);
+    printf("     \"ns_per_packet\": %.1f, \"jitbuf_ns_per_packet\": %.1f, "
+           "\"jpeg_ns_per_packet\": %.1f,\n",
+           ns, jitbuf_ns, ns - jitbuf_ns);
+    printf("     \"packets_per_s\": %.0f, \"frames_per_s\": %.0f, \"bytes_copied\": %" PRIu64 ",\n",
+           secs > 0 ? w->n_pkts / secs : 0, secs > 0 ? r->frames / secs : 0, r->bytes_copied);
+    printf("     ");
+    print_percentiles_json("packet_ns", &r->packet_ns);
+    printf(",\n     ");
+    print_percentiles_json("frame_latency_us", &r->frame_latency_us);
+    const rtp_jitbuf_stats_t *js = &r->jitbuf;
+    printf(",\n     \"jitbuf\": {\"fed\": %u, \"duplicates\": %u, \"late\": %u, \"evicted\": %u, "
+           "\"gap_releases\": %u, \"max_reorder_depth\": %d, \"bytes_copied\": %" PRIu64 "}",
+           js->fed, js->duplicates, js->late, js->evicted, js->gap_releases,
+           js->max_reorder_depth, js->bytes_copied);
+    const rtp_jpeg_session_stats_t *ss = &r->session;
+    printf(",\n     \"session\": {\"dropped_missing\": %u, \"dropped_header\": %u, "
+           "\"dropped_unsupported\": %u, \"oversize\": %u, \"bytes_copied\": %" PRIu64 "}",
+           ss->dropped_missing, ss->dropped_header, ss->dropped_unsupported,
+           ss->frames_oversize, ss->bytes_copied);
+    if (impaired) {
+        const rtp_impair_stats_t *m = &w->impair;
+        printf(",\n     \"impair\": {\"fed\": %u, \"lost\": %u, \"reordered\": %u, "
+               "\"duplicated\": %u, \"overflow\": %u}",
+               m->fed, m->lost, m->reordered, m->duplicated, m->overflow);
+    }
+    printf("}");
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-j] [-n runs] [-s speed] [-p port] [-I impairments] [-w max_wait_us] [-A]\n"
+            "       [capture...]\n"
+            "  -j  Print JSON.\n"
+            "  -n  Throughput passes per workload, the fastest counts (default %d).\n"
+            "  -s  Replay the timed pass at this speed times the timing of the capture, rather\n"
+            "      than as fast as possible.\n"
+            "  -p  Replay the UDP packets to this port of the captures, 0 for any (default %d).\n"
+            "  -I  Impair the workloads first, e.g.\n"
+            "      loss=0.01,ge=0.01:0.3,reorder=0.05:4,dup=0.01,delay=20000,jitter=10000,seed=1,\n"
+            "      see rtp_impair_parse_config().\n"
+            "  -w  Max wait of the jitterbuffers for missing packets (default %d).\n"
+            "  -A  Always wait max_wait_us, rather than adapting to the jitter.\n"
+            "  Without captures, runs the synthetic workloads.\n",
+            name, DEFAULT_N_RUNS, DEFAULT_PORT, CONFIG_RTP_JITBUF_MAX_WAIT_US);
+}
+
+int main(int argc, char **argv) {
+    bool json = false;
+    int n_runs = DEFAULT_N_RUNS;
+    double speed = 0;
+    int port = DEFAULT_PORT;
+    const char *impair = NULL;
+    rtp_impair_config_t impair_config;
+    int max_wait_us = CONFIG_RTP_JITBUF_MAX_WAIT_US;
+    bool adaptive = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "jn:s:p:I:w:A")) != -1) {
+        switch (opt) {
+            case 'j':
+                json = true;
+                break;
+            case 'n':
+                n_runs = atoi(optarg);
+                break;
+            case 's':
+                speed = atof(optarg);
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'I':
+                impair = optarg;
+                break;
+            case 'w':
+                max_wait_us = atoi(optarg);
+                break;
+            case 'A':
+                adaptive = false;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (n_runs < 1 || speed < 0 || port < 0 || port > UINT16_MAX || max_wait_us < 0 ||
+        (impair != NULL && rtp_impair_parse_config(impair, &impair_config) != ESP_OK)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const int n_captures = argc - optind;
+    const int n_synths = sizeof(SYNTHS) / sizeof(SYNTHS[0]);
+    const int n_workloads = n_captures > 0 ? n_captures : n_synths;
+    if (json) {
+        printf("{\"bench\": \"linux_replay_bench\", \"runs\": %d, \"speed\": %g,\n", n_runs,
+               speed);
+        printf(" \"config\": {\"jitbuf_cap_n_packets\": %d, \"jitbuf_max_wait_us\": %d, "
+               "\"jitbuf_adaptive\": %s, \"jpeg_max_data_size_bytes\": %d},\n",
+               CONFIG_RTP_JITBUF_CAP_N_PACKETS, max_wait_us, adaptive ? "true" : "false",
+               CONFIG_RTP_JPEG_MAX_DATA_SIZE_BYTES);
+        if (impair != NULL) {
+            printf(" \"impair\": \"%s\",\n", impair);
+        }
+        printf(" \"workloads\": [");
+    } else {
+        printf("%-12s %-8s %-7s %-7s %-7s %-7s %-7s %-7s %-9s %-8s %-8s %-5s %-5s %-6s %-7s "
+               "%s\n",
+               "workload", "packets", "streams", "frames", "dropped", "ns/pkt", "jitbuf", "jpeg",
+               "pkts/s", "frames/s", "copy/pkt", "p50", "p99", "p99.9", "lat_p50", "lat_p99");
+    }
+    for (int i = 0; i < n_workloads; i++) {
+        workload_t w;
+        if (n_captures > 0) {
+            if (load_capture(argv[optind + i], port, &w) != ESP_OK) {
+                return 1;
+            }
+        } else {
+            make_synth(&SYNTHS[i], &w);
+        }
+        if (impair != NULL) {
+            impair_workload(&impair_config, &w);
+        }
+        result_t r;
+        run(&w, n_runs, speed, max_wait_us, adaptive, &r);
+        print_result(&w, &r, json, impair != NULL, i == 0);
+        workload_destroy(&w);
+    }
+    const double setup_ns = run_stream_setup(n_runs, false);
+    const double clear_all_ns = run_stream_setup(n_runs, true);
+    if (json) {
+        printf("\n],\n");
+        print_stream_setup(setup_ns, clear_all_ns, json);
+        printf("}\n");
+    } else {
+        print_stream_setup(setup_ns, clear_all_ns, json);
+        // Of all workloads, with make TRACEPOINTS=1.
+        fakesp_tracepoints_print();
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+#define _GNU_SOURCE  // For recvmmsg().
+
+#include "linux_rx.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+__attribute__((unused)) static const char *TAG = "linux_rx";
+
+static int64_t timespec_to_us(const struct timespec *ts) {
+    return (int64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+// Kernel receive timestamps (SO_TIMESTAMPNS) are CLOCK_REALTIME, so we use that clock throughout.
+int64_t linux_rx_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return timespec_to_us(&ts);
+}
+
+esp_err_t init_linux_rx(const int sockfd, const int64_t timeout_us, linux_rx_t *out) {
+    assert(out != NULL);
+    memset(out, 0, sizeof(*out));
+    out->sockfd = sockfd;
+
+    // Have the kernel timestamp packets on arrival, and count the ones it drops.
+    const int enable = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) < 0) {
+        perror("setsockopt(SO_TIMESTAMPNS) failed");
+        return ESP_FAIL;
+    }
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable)) < 0) {
+        perror("setsockopt(SO_RXQ_OVFL) failed");
+        return ESP_FAIL;
+    }
+    if (timeout_us > 0) {
+        struct timeval timeout = {0};
+        timeout.tv_sec = timeout_us / 1000000;
+        timeout.tv_usec = timeout_us % 1000000;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+            perror("setsockopt(SO_RCVTIMEO) failed");
+            return ESP_FAIL;
+        }
+    }
+
+    for (int i = 0; i < LINUX_RX_BATCH_N; i++) {
+        out->iovs[i].iov_base = out->bufs[i];
+        out->iovs[i].iov_len = sizeof(out->bufs[i]);
+    }
+    return ESP_OK;
+}
+
+int linux_rx_receive(linux_rx_t *r) {
+    assert(r != NULL);
+    // recvmmsg() overwrites the lengths, reset them. The buffers are not cleared, we only ever
+    // read the bytes received.
+    for (int i = 0; i < LINUX_RX_BATCH_N; i++) {
+        struct msghdr *msg = &r->msgs[i].msg_hdr;
+        msg->msg_name = &r->addrs[i];
+        msg->msg_namelen = sizeof(r->addrs[i]);
+        msg->msg_iov = &r->iovs[i];
+        msg->msg_iovlen = 1;
+        msg->msg_control = r->cmsgs[i];
+        msg->msg_controllen = sizeof(r->cmsgs[i]);
+        msg->msg_flags = 0;
+    }
+
+    // Block for the first packet only, then take what is queued.
+    const int n = recvmmsg(r->sockfd, r->msgs, LINUX_RX_BATCH_N, MSG_WAITFORONE, NULL);
+    if (n <= 0) {
+        return -1;
+    }
+    r->batches++;
+    r->received += n;
+
+    const int64_t now = linux_rx_now_us();
+    int out = 0;
+    for (int i = 0; i < n; i++) {
+        struct msghdr *msg = &r->msgs[i].msg_hdr;
+        int64_t arrival_us = now;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(msg); c != NULL; c = CMSG_NXTHDR(msg, c)) {
+            if (c->cmsg_level != SOL_SOCKET) {
+                continue;
+            }
+            if (c->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+                arrival_us = timespec_to_us(&ts);
+            } else if (c->cmsg_type == SO_RXQ_OVFL) {
+                memcpy(&r->kernel_drops, CMSG_DATA(c), sizeof(r->kernel_drops));
+            }
+        }
+        if (msg->msg_flags & MSG_TRUNC) {
+            ESP_LOGD(TAG, "Dropping truncated packet");
+            r->truncated++;
+            continue;
+        }
+        r->pkts[out].buf = r->bufs[i];
+        r->pkts[out].sz = r->msgs[i].msg_len;
+        r->pkts[out].arrival_us = arrival_us;
+        r->srcs[out] = &r->addrs[i];
+        out++;
+    }
+    return out;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "fakesp.h"
+#include "rtp.h"
+
+/**
+ * Batched UDP receive for the Linux tools: receives up to LINUX_RX_BATCH_N packets per syscall
+ * with recvmmsg(), into buffers owned by the receiver, along with their kernel
+ * receive timestamps (SO_TIMESTAMPNS, CLOCK_REALTIME) and the kernel drop counter (SO_RXQ_OVFL).
+ * Needs _GNU_SOURCE to be defined before the first include.
+ */
+
+#define LINUX_RX_BATCH_N 64
+
+// Room for the timestamp and drop counter control messages of one packet.
+#define LINUX_RX_CMSG_SIZE_BYTES \
+    (CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t)))
+
+/**
+ * A batched receiver on a bound UDP socket.
+ * Use init_linux_rx() to initialize an instance before usage.
+ */
+typedef struct linux_rx_t {
+    int sockfd;
+
+    // Packets of the last batch received and their sources, see linux_rx_receive().
+    rtp_jitbuf_packet_t pkts[LINUX_RX_BATCH_N];
+    const struct sockaddr_in *srcs[LINUX_RX_BATCH_N];
+
+    uint32_t kernel_drops;  // Packets the kernel dropped as the socket buffer was full.
+    uint32_t truncated;     // Packets dropped because they did not fit a buffer.
+    uint32_t received;      // Packets received, those dropped by us included.
+    uint32_t batches;       // Calls of recvmmsg() which returned packets.
+
+    // Private to the implementation.
+    struct mmsghdr msgs[LINUX_RX_BATCH_N];
+    struct iovec iovs[LINUX_RX_BATCH_N];
+    struct sockaddr_in addrs[LINUX_RX_BATCH_N];
+    uint8_t cmsgs[LINUX_RX_BATCH_N][LINUX_RX_CMSG_SIZE_BYTES];
+    // Large enough for media and FEC packets, larger ones are truncated.
+    uint8_t bufs[LINUX_RX_BATCH_N][RTP_JITBUF_BLOCK_SIZE_BYTES];
+} linux_rx_t;
+
+/**
+ * Initialize a receiver on a bound UDP socket, enabling timestamps and the drop counter.
+ * If timeout_us is positive, linux_rx_receive() returns after that long without packets.
+ */
+esp_err_t init_linux_rx(const int sockfd, const int64_t timeout_us, linux_rx_t *out);
+
+/**
+ * Wait for at least one packet and receive as many as are queued, up to LINUX_RX_BATCH_N.
+ * Sets pkts and srcs, which are valid until the next call.
+ * Returns the number of packets, which may be 0 if all were truncated, or -1 on timeout or error,
+ * with errno set.
+ */
+int linux_rx_receive(linux_rx_t *r);
+
+// Returns the current time on the clock of the receive timestamps.
+int64_t linux_rx_now_us();
@@ -0,0 +1,135 @@
+#define _GNU_SOURCE  // For fallocate().
+
+#include "linux_segment_writer.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+__attribute__((unused)) static const char *TAG = "linux_segment_writer";
+
+esp_err_t init_linux_segment_writer(const char *dir, const int id, const int64_t max_sz,
+                                    const int64_t max_us, linux_segment_writer_t *out) {
+    assert(dir != NULL);
+    assert(out != NULL);
+    if (max_sz <= (int64_t)sizeof(linux_segment_record_t) || max_sz > UINT32_MAX || max_us <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(out, 0, sizeof(*out));
+    out->dir = dir;
+    out->id = id;
+    out->max_sz = max_sz;
+    out->max_us = max_us;
+    out->fd = -1;
+    return ESP_OK;
+}
+
+static esp_err_t linux_segment_writer_open(linux_segment_writer_t *w, const int64_t now_us) {
+    char fname[256];
+    const int len = snprintf(fname, sizeof(fname), "%s/%010lld_%02d_%04u.jseg", w->dir,
+                             (long long)(now_us / 1000000), w->id, w->n);
+    if (len >= (int)sizeof(fname)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    w->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) {
+        perror("open segment failed");
+        return ESP_FAIL;
+    }
+    // Reserve the blocks up front, so the file system does not fragment the segment or find
+    // itself full in the middle of it. The file size still only grows with the records.
+    if (fallocate(w->fd, FALLOC_FL_KEEP_SIZE, 0, w->max_sz) < 0) {
+        ESP_LOGD(TAG, "Failed to preallocate segment");
+    }
+
+    ESP_LOGI(TAG, "Started segment %s", fname);
+
+    // Same name with the index extension.
+    memcpy(fname + len - 4, "jidx", 4);
+    w->index = fopen(fname, "w");
+    if (w->index == NULL) {
+        perror("open index failed");
+        close(w->fd);
+        w->fd = -1;
+        return ESP_FAIL;
+    }
+    w->sz = 0;
+    w->opened_us = now_us;
+    w->n++;
+    return ESP_OK;
+}
+
+void linux_segment_writer_close(linux_segment_writer_t *w) {
+    assert(w != NULL);
+    if (w->fd < 0) {
+        return;
+    }
+    // Hand back what was preallocated but not used.
+    if (ftruncate(w->fd, w->sz) < 0) {
+        perror("ftruncate segment failed");
+    }
+    close(w->fd);
+    fclose(w->index);
+    w->fd = -1;
+    w->index = NULL;
+    ESP_LOGI(TAG, "Finished segment %u of writer %d sz=%lld, frames=%u write_errors=%u in total",
+             w->n - 1, w->id, (long long)w->sz, w->frames, w->write_errors);
+}
+
+void linux_segment_writer_flush(linux_segment_writer_t *w) {
+    assert(w != NULL);
+    if (w->index != NULL) {
+        fflush(w->index);
+    }
+}
+
+esp_err_t linux_segment_writer_write(linux_segment_writer_t *w, const rtp_jpeg_frame_t *frame,
+                                     const int64_t now_us) {
+    assert(w != NULL);
+    assert(frame != NULL);
+    const int64_t record_sz = sizeof(linux_segment_record_t) + frame->jpeg_data_sz;
+    if (w->fd >= 0 && (w->sz + record_sz > w->max_sz || now_us - w->opened_us >= w->max_us)) {
+        linux_segment_writer_close(w);
+    }
+    if (w->fd < 0) {
+        esp_err_t err = linux_segment_writer_open(w, now_us);
+        if (err != ESP_OK) {
+            w->write_errors++;
+            return err;
+        }
+    }
+
+    const linux_segment_record_t record = {
+        .magic = htonl(LINUX_SEGMENT_RECORD_MAGIC),
+        .ssrc = htonl(frame->ssrc),
+        .timestamp = htonl(frame->timestamp),
+        .sz = htonl(frame->jpeg_data_sz),
+    };
+    const struct iovec iov[2] = {
+        {.iov_base = (void *)&record, .iov_len = sizeof(record)},
+        {.iov_base = (void *)frame->jpeg_data, .iov_len = frame->jpeg_data_sz},
+    };
+    const ptrdiff_t written = writev(w->fd, iov, 2);
+    if (written != record_sz) {
+        // Cut off the partial record, and start a new segment with the next frame.
+        perror("write segment failed");
+        linux_segment_writer_close(w);
+        w->write_errors++;
+        return ESP_FAIL;
+    }
+
+    const linux_segment_index_entry_t entry = {
+        .ssrc = htonl(frame->ssrc),
+        .timestamp = htonl(frame->timestamp),
+        .offset = htonl(w->sz),
+        .sz = htonl(frame->jpeg_data_sz),
+    };
+    // Buffered, so the index costs a syscall per few hundred frames.
+    fwrite(&entry, sizeof(entry), 1, w->index);
+    w->sz += record_sz;
+    w->frames++;
+    return ESP_OK;
+}
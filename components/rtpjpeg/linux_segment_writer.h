@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "fakesp.h"
+#include "rtp_jpeg.h"
+
+/**
+ * Records JPEG frames of any number of streams into segment files, for the Linux tools.
+ *
+ * A segment <dir>/<start unix seconds>_<writer id>_<n>.jseg is a sequence of records, each a
+ * linux_segment_record_t header followed by the JPEG data. Next to it, <...>.jidx holds one
+ * linux_segment_index_entry_t per record, to seek by stream and RTP timestamp without reading the
+ * segment. All fields are in network byte order.
+ * Segment files are preallocated as they are opened, and a new segment is started once the next
+ * frame would make the segment larger than max_sz, or it is older than max_us. After a crash, the
+ * segment holds whole records followed by at most one partial one, and the index may lack the
+ * records since the last linux_segment_writer_flush(), which can be restored by walking the
+ * segment.
+ */
+
+#define LINUX_SEGMENT_RECORD_MAGIC 0x524A4630  // "RJF0"
+
+typedef struct linux_segment_record_t {
+    uint32_t magic;      // LINUX_SEGMENT_RECORD_MAGIC
+    uint32_t ssrc;       // Of the stream.
+    uint32_t timestamp;  // RTP timestamp of the frame.
+    uint32_t sz;         // Of the JPEG data following.
+} linux_segment_record_t;
+
+typedef struct linux_segment_index_entry_t {
+    uint32_t ssrc;
+    uint32_t timestamp;
+    uint32_t offset;  // Of the record in the segment.
+    uint32_t sz;      // Of the JPEG data.
+} linux_segment_index_entry_t;
+
+/**
+ * Use init_linux_segment_writer() to initialize an instance before usage.
+ */
+typedef struct linux_segment_writer_t {
+    const char *dir;
+    int id;
+    int64_t max_sz;
+    int64_t max_us;
+
+    // Current segment, fd < 0 if none is open.
+    int fd;
+    FILE *index;
+    int64_t sz;
+    int64_t opened_us;
+    uint32_t n;  // Segments opened.
+
+    uint32_t frames;        // Frames recorded.
+    uint32_t write_errors;  // Frames lost because a write failed.
+} linux_segment_writer_t;
+
+/**
+ * Initialize a writer creating segments in dir, which must outlive it. id tells the segments of
+ * concurrent writers apart. max_sz is at most 4 GiB, as offsets in the index have 32 bits.
+ * No segment is opened before the first frame.
+ */
+esp_err_t init_linux_segment_writer(const char *dir, const int id, const int64_t max_sz,
+                                    const int64_t max_us, linux_segment_writer_t *out);
+
+// Append a frame to the current segment, starting a new one first if it is due.
+esp_err_t linux_segment_writer_write(linux_segment_writer_t *w, const rtp_jpeg_frame_t *frame,
+                                     const int64_t now_us);
+
+// Write out the buffered index entries, e.g. when there is nothing else to do.
+void linux_segment_writer_flush(linux_segment_writer_t *w);
+
+// Finish the current segment, if any, trimming the preallocated space and flushing the index.
+void linux_segment_writer_close(linux_segment_writer_t *w);
@@ -0,0 +1,328 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fakesp.h"
+#include "rtcp.h"
+#include "rtp.h"
+#include "rtp_fec.h"
+
+/**
+ * Stand-in RTP sender to test RTCP feedback on Linux.
+ *
+ * Forwards RTP packets arriving on a local port (e.g. from gst rtpjpegpay ! udpsink) to the
+ * receiver, sends RTCP sender reports on the source port + 1 and logs the receiver reports and
+ * APP feedback coming back.
+ * Keeps the last forwarded packets to answer NACKs with retransmissions. To test that, loss_pct
+ * percent of the packets can be dropped randomly instead of being forwarded.
+ * With fec_group > 0, also sends a ULPFEC packet (RFC 5109) after every fec_group packets and at
+ * the end of every frame, with payload type FEC_PAYLOAD_TYPE. FEC packets are dropped like the
+ * others.
+ *
+ * Usage: linux_sender <listen_port> <dest_ip> <dest_port> [src_port] [loss_pct] [fec_group]
+ */
+
+static const char *TAG = "sender";
+
+#define DEFAULT_SRC_PORT 5004
+#define SR_INTERVAL_US 1000000
+#define MAX_BUFFER 65536
+// Number of packets kept for retransmission, a power of two.
+#define RTX_CACHE_N_PACKETS 1024
+#define RTX_CACHE_PACKET_SIZE_BYTES 1500
+#define FEC_PAYLOAD_TYPE 127
+
+// Seconds from 1900 (NTP epoch) to 1970 (Unix epoch).
+static const uint64_t NTP_UNIX_OFFSET_S = 2208988800ULL;
+
+static int64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Convert wallclock microseconds to a 32.32 fixed point NTP timestamp.
+static uint64_t us_to_ntp(const int64_t us) {
+    const uint64_t s = us / 1000000 + NTP_UNIX_OFFSET_S;
+    const uint64_t frac = ((uint64_t)(us % 1000000) << 32) / 1000000;
+    return (s << 32) | frac;
+}
+
+typedef struct rtx_cache_slot_t {
+    bool valid;
+    uint16_t seq;
+    ptrdiff_t sz;
+    uint8_t buf[RTX_CACHE_PACKET_SIZE_BYTES];
+} rtx_cache_slot_t;
+
+// Retransmission cache, indexed by seq number & (RTX_CACHE_N_PACKETS - 1).
+typedef struct rtx_cache_t {
+    rtx_cache_slot_t slots[RTX_CACHE_N_PACKETS];
+    uint32_t retransmitted;
+    uint32_t missed;  // NACKed packets no longer (or never) in the cache.
+} rtx_cache_t;
+
+static void rtx_cache_put(rtx_cache_t *c, const rtp_packet_view_t *v) {
+    if (v->sz > RTX_CACHE_PACKET_SIZE_BYTES) {
+        return;
+    }
+    rtx_cache_slot_t *slot = &c->slots[v->sequence_number & (RTX_CACHE_N_PACKETS - 1)];
+    slot->valid = true;
+    slot->seq = v->sequence_number;
+    slot->sz = v->sz;
+    memcpy(slot->buf, v->buf, v->sz);
+}
+
+// Resend all packets requested by the NACKs in a compound RTCP packet.
+static void rtx_cache_handle_rtcp(rtx_cache_t *c, const uint8_t *buf, const ptrdiff_t sz,
+                                  const uint32_t ssrc, const int fd,
+                                  const struct sockaddr_in *dest_addr) {
+    ptrdiff_t offs = 0;
+    while (offs < sz) {
+        rtcp_header_t h;
+        ptrdiff_t parsed_sz = 0;
+        if (parse_rtcp_header(&buf[offs], sz - offs, &h, &parsed_sz) != ESP_OK) {
+            return;
+        }
+        offs += parsed_sz;
+
+        uint32_t media_ssrc = 0;
+        uint16_t seqs[256];
+        int n = sizeof(seqs) / sizeof(seqs[0]);
+        if (parse_rtcp_nack(&h, &media_ssrc, seqs, &n) != ESP_OK || media_ssrc != ssrc) {
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            rtx_cache_slot_t *slot = &c->slots[seqs[i] & (RTX_CACHE_N_PACKETS - 1)];
+            if (!slot->valid || slot->seq != seqs[i]) {
+                c->missed++;
+                continue;
+            }
+            if (sendto(fd, slot->buf, slot->sz, 0, (struct sockaddr *)dest_addr,
+                       sizeof(*dest_addr)) < 0) {
+                perror("sendto failed");
+            }
+            c->retransmitted++;
+        }
+        ESP_LOGI(TAG, "NACK for %d packets from seq=%u, retransmitted=%u missed=%u", n, seqs[0],
+                 c->retransmitted, c->missed);
+    }
+}
+
+// Packets of the current FEC protection group, which are kept in the retransmission cache.
+typedef struct fec_encoder_t {
+    int group_sz;  // Max packets per group, 0 to disable FEC.
+    uint16_t first_seq;
+    int n;
+    uint16_t seq;  // Seq number of the next FEC packet.
+    uint32_t sent;
+} fec_encoder_t;
+
+/**
+ * Add a forwarded packet to the current group. Once the group is full or the frame ends, writes
+ * the FEC packet for it to buf and returns its size, 0 otherwise.
+ */
+static ptrdiff_t fec_encoder_add(fec_encoder_t *e, const rtx_cache_t *c,
+                                 const rtp_packet_view_t *v, uint8_t *buf, const ptrdiff_t sz) {
+    if (e->group_sz <= 0) {
+        return 0;
+    }
+    if (e->n > 0 && (uint16_t)(v->sequence_number - e->first_seq) != e->n) {
+        // Out of order input, start a new group.
+        e->n = 0;
+    }
+    if (e->n == 0) {
+        e->first_seq = v->sequence_number;
+    }
+    e->n++;
+    if (e->n < e->group_sz && !v->marker) {
+        return 0;
+    }
+
+    const uint8_t *pkts[RTP_FEC_MAX_PROTECTED];
+    ptrdiff_t szs[RTP_FEC_MAX_PROTECTED];
+    int n = 0;
+    for (int i = 0; i < e->n; i++) {
+        const uint16_t seq = e->first_seq + i;
+        const rtx_cache_slot_t *slot = &c->slots[seq & (RTX_CACHE_N_PACKETS - 1)];
+        if (slot->valid && slot->seq == seq) {
+            pkts[n] = slot->buf;
+            szs[n] = slot->sz;
+            n++;
+        }
+    }
+    e->n = 0;
+    if (n == 0) {
+        return 0;
+    }
+    e->sent++;
+    return rtp_fec_make(pkts, szs, n, e->seq++, FEC_PAYLOAD_TYPE, v->ssrc, buf, sz);
+}
+
+static int bind_udp(const uint16_t port) {
+    const int fd = socket(PF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("cannot create socket");
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Log all report blocks and our APP feedback in a compound RTCP packet from the receiver.
+static void log_rtcp(const uint8_t *buf, const ptrdiff_t sz, const int64_t now) {
+    // Round trip time as per https://datatracker.ietf.org/doc/html/rfc3550#section-6.4.1.
+    const uint32_t now_mid = (us_to_ntp(now) >> 16) & 0xFFFFFFFF;
+
+    ptrdiff_t offs = 0;
+    while (offs < sz) {
+        rtcp_header_t h;
+        ptrdiff_t parsed_sz = 0;
+        if (parse_rtcp_header(&buf[offs], sz - offs, &h, &parsed_sz) != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to parse RTCP packet");
+            return;
+        }
+        offs += parsed_sz;
+
+        rtcp_report_block_t rb;
+        for (int i = 0; parse_rtcp_report_block(&h, i, &rb) == ESP_OK; i++) {
+            const uint32_t rtt = now_mid - rb.lsr - rb.dlsr;
+            const int64_t rtt_us = rb.lsr == 0 ? -1 : (int64_t)rtt * 1000000 / 65536;
+            ESP_LOGI(TAG,
+                     "RR ssrc=%u fraction_lost=%u/256 cumulative_lost=%d ext_highest_seq=%u "
+                     "jitter=%u rtt=%ldus",
+                     rb.ssrc, rb.fraction_lost, rb.cumulative_lost, rb.ext_highest_seq, rb.jitter,
+                     rtt_us);
+        }
+
+        rtcp_app_feedback_t app;
+        if (parse_rtcp_app_feedback(&h, &app) == ESP_OK) {
+            ESP_LOGI(TAG,
+                     "APP ssrc=%u frames completed=%u dropped=%u oversize=%u rescued=%u "
+                     "decode=%uus",
+                     app.ssrc, app.frames_completed, app.frames_dropped, app.frames_oversize,
+                     app.frames_rescued, app.decode_us_avg);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr,
+                "Usage: %s <listen_port> <dest_ip> <dest_port> [src_port] [loss_pct] "
+                "[fec_group]\n",
+                argv[0]);
+        return 1;
+    }
+    const uint16_t listen_port = atoi(argv[1]);
+    const uint16_t src_port = argc > 4 ? atoi(argv[4]) : DEFAULT_SRC_PORT;
+    const int loss_pct = argc > 5 ? atoi(argv[5]) : 0;
+    fec_encoder_t fec = {.group_sz = argc > 6 ? atoi(argv[6]) : 0};
+    if (fec.group_sz < 0 || fec.group_sz > RTP_FEC_MAX_PROTECTED) {
+        fprintf(stderr, "fec_group must be between 0 and %d\n", RTP_FEC_MAX_PROTECTED);
+        return 1;
+    }
+
+    struct sockaddr_in dest_addr = {0};
+    dest_addr.sin_family = AF_INET;
+    dest_addr.sin_port = htons(atoi(argv[3]));
+    if (inet_aton(argv[2], &dest_addr.sin_addr) == 0) {
+        fprintf(stderr, "Invalid dest_ip %s\n", argv[2]);
+        return 1;
+    }
+    struct sockaddr_in dest_rtcp_addr = dest_addr;
+    dest_rtcp_addr.sin_port = htons(ntohs(dest_addr.sin_port) + 1);
+
+    const int in_fd = bind_udp(listen_port);
+    const int rtp_fd = bind_udp(src_port);
+    const int rtcp_fd = bind_udp(src_port + 1);
+    if (in_fd < 0 || rtp_fd < 0 || rtcp_fd < 0) {
+        return 1;
+    }
+    ESP_LOGI(TAG, "Forwarding RTP from port %u to %s:%s via port %u", listen_port, argv[2], argv[3],
+             src_port);
+
+    uint8_t buf[MAX_BUFFER];
+    uint8_t fec_buf[RTX_CACHE_PACKET_SIZE_BYTES + RTP_FEC_MAX_OVERHEAD];
+    static rtx_cache_t rtx = {0};
+    rtcp_sr_t sr = {0};
+    int64_t last_rtp_us = 0;
+    int64_t next_sr_us = 0;
+
+    struct pollfd fds[2] = {
+        {.fd = in_fd, .events = POLLIN},
+        {.fd = rtcp_fd, .events = POLLIN},
+    };
+    while (1) {
+        if (poll(fds, 2, 100) < 0) {
+            perror("poll failed");
+            continue;
+        }
+        const int64_t now = now_us();
+
+        if (fds[0].revents & POLLIN) {
+            const ptrdiff_t sz = recv(in_fd, buf, sizeof(buf), 0);
+            rtp_packet_view_t v;
+            if (sz > 0 && parse_rtp_packet_view(buf, sz, &v) == ESP_OK) {
+                if (rand() % 100 >= loss_pct &&
+                    sendto(rtp_fd, buf, sz, 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) <
+                        0) {
+                    perror("sendto failed");
+                }
+                rtx_cache_put(&rtx, &v);
+                const ptrdiff_t fec_sz = fec_encoder_add(&fec, &rtx, &v, fec_buf, sizeof(fec_buf));
+                if (fec_sz > 0 && rand() % 100 >= loss_pct &&
+                    sendto(rtp_fd, fec_buf, fec_sz, 0, (struct sockaddr *)&dest_addr,
+                           sizeof(dest_addr)) < 0) {
+                    perror("sendto failed");
+                }
+                sr.ssrc = v.ssrc;
+                sr.rtp_timestamp = v.timestamp;
+                sr.packet_count++;
+                sr.octet_count += v.payload_sz;
+                last_rtp_us = now;
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            const ptrdiff_t sz = recv(rtcp_fd, buf, sizeof(buf), 0);
+            if (sz > 0) {
+                log_rtcp(buf, sz, now);
+                rtx_cache_handle_rtcp(&rtx, buf, sz, sr.ssrc, rtp_fd, &dest_addr);
+            }
+        }
+
+        if (sr.packet_count > 0 && now >= next_sr_us) {
+            // Extrapolate the RTP timestamp of the last packet to now.
+            rtcp_sr_t report = sr;
+            report.ntp_timestamp = us_to_ntp(now);
+            report.rtp_timestamp += (now - last_rtp_us) * RTP_PT_CLOCKRATE_JPEG / 1000000;
+            const ptrdiff_t sz = rtcp_make_sr(&report, "linux_sender", buf, sizeof(buf));
+            assert(sz > 0);
+            if (sendto(rtcp_fd, buf, sz, 0, (struct sockaddr *)&dest_rtcp_addr,
+                       sizeof(dest_rtcp_addr)) < 0) {
+                perror("sendto failed");
+            }
+            next_sr_us = now + SR_INTERVAL_US;
+        }
+    }
+
+    return 0;
+}
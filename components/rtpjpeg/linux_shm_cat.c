@@ -0,0 +1,140 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fakesp.h"
+#include "linux_shm_ring.h"
+
+/**
+ * Reads the frames linux_main publishes to shared memory (linux_main -p <name>).
+ *
+ * Prints a line per frame, and with -o, writes the frames to JPEG files in that directory.
+ * With -l, takes only the newest frame whenever there is a new one, like a preview would.
+ * Prints how many frames were read, skipped because they were overwritten before they were read,
+ * and torn, i.e. overwritten while being read, at exit and with -v every second.
+ *
+ * Usage: linux_shm_cat [-l] [-v] [-q] [-o dir] [-n frames] <name>
+ */
+
+// Poll interval when there are no new frames.
+#define IDLE_US 1000
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int sig __attribute__((unused))) {
+    stopping = 1;
+}
+
+static int64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-l] [-v] [-q] [-o dir] [-n frames] <name>\n", name);
+}
+
+int main(int argc, char **argv) {
+    bool latest = false;
+    bool verbose = false;
+    bool quiet = false;
+    const char *out_dir = NULL;
+    long max_frames = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "lvqo:n:")) != -1) {
+        switch (opt) {
+            case 'l':
+                latest = true;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            case 'o':
+                out_dir = optarg;
+                break;
+            case 'n':
+                max_frames = atol(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *name = argv[optind];
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    // Wait for the receiver to create the ring.
+    linux_shm_reader_t r;
+    esp_err_t err;
+    while ((err = linux_shm_reader_open(name, &r)) != ESP_OK) {
+        if (err != ESP_ERR_NOT_FOUND && err != ESP_ERR_INVALID_VERSION) {
+            fprintf(stderr, "Failed to open /dev/shm/%s\n", name);
+            return 1;
+        }
+        if (stopping) {
+            return 0;
+        }
+        usleep(100000);
+    }
+
+    static uint8_t copy[CONFIG_RTP_JPEG_MAX_DATA_SIZE_BYTES];
+    long frames = 0;
+    long torn = 0;
+    int64_t stats_us = now_us();
+    while (!stopping && frames != max_frames) {
+        linux_shm_frame_t f;
+        err = latest ? linux_shm_reader_latest(&r, &f) : linux_shm_reader_next(&r, &f);
+        if (err != ESP_OK) {
+            usleep(IDLE_US);
+            continue;
+        }
+
+        // Use the frame in place, here a look at its markers, or copy it out to write it.
+        const bool soi = f.jpeg_data_sz >= 2 && f.jpeg_data[0] == 0xFF && f.jpeg_data[1] == 0xD8;
+        if (out_dir != NULL) {
+            memcpy(copy, f.jpeg_data, f.jpeg_data_sz);
+        }
+        if (!linux_shm_reader_valid(&f)) {
+            torn++;
+            continue;
+        }
+        frames++;
+        if (!quiet) {
+            printf("%llu %08x %u %dx%d %td%s\n", (unsigned long long)f.generation, f.ssrc,
+                   f.timestamp, f.width, f.height, f.jpeg_data_sz, soi ? "" : " no SOI");
+        }
+        if (out_dir != NULL) {
+            char fname[256];
+            snprintf(fname, sizeof(fname), "%s/%08x_%010u.jpeg", out_dir, f.ssrc, f.timestamp);
+            FILE *file = fopen(fname, "w");
+            if (file == NULL || fwrite(copy, 1, f.jpeg_data_sz, file) != (size_t)f.jpeg_data_sz) {
+                perror("write failed");
+            }
+            if (file != NULL) {
+                fclose(file);
+            }
+        }
+
+        if (verbose && now_us() - stats_us >= 1000000) {
+            fprintf(stderr, "frames=%ld skipped=%llu torn=%ld\n", frames,
+                    (unsigned long long)r.skipped, torn);
+            stats_us = now_us();
+        }
+    }
+    fprintf(stderr, "frames=%ld skipped=%llu torn=%ld\n", frames, (unsigned long long)r.skipped,
+            torn);
+    linux_shm_reader_close(&r);
+    return 0;
+}
@@ -0,0 +1,210 @@
+#include "linux_shm_ring.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+__attribute__((unused)) static const char *TAG = "linux_shm_ring";
+
+#define ROUND_UP(x, n) (((x) + (n) - 1) / (n) * (n))
+
+static linux_shm_slot_t *slot_at(const linux_shm_ring_header_t *h, const uint64_t generation) {
+    uint8_t *slots = (uint8_t *)h + ROUND_UP(sizeof(*h), LINUX_CACHE_LINE_SIZE_BYTES);
+    return (linux_shm_slot_t *)(slots + (generation % h->n_slots) * h->slot_size_bytes);
+}
+
+esp_err_t init_linux_shm_ring(const char *name, const int n_slots, linux_shm_ring_t *out) {
+    assert(name != NULL);
+    assert(out != NULL);
+    memset(out, 0, sizeof(*out));
+    if (n_slots <= 0 || snprintf(out->name, sizeof(out->name), "/%s", name) >=
+                            (int)sizeof(out->name)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const size_t slot_sz = ROUND_UP(sizeof(linux_shm_slot_t) + CONFIG_RTP_JPEG_MAX_DATA_SIZE_BYTES,
+                                    LINUX_CACHE_LINE_SIZE_BYTES);
+    out->map_sz = ROUND_UP(sizeof(linux_shm_ring_header_t), LINUX_CACHE_LINE_SIZE_BYTES) +
+                  (size_t)n_slots * slot_sz;
+
+    // Replace rather than reuse an old ring, readers may still have it mapped.
+    shm_unlink(out->name);
+    const int fd = shm_open(out->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        perror("shm_open failed");
+        return ESP_FAIL;
+    }
+    if (ftruncate(fd, out->map_sz) < 0) {
+        perror("ftruncate failed");
+        close(fd);
+        shm_unlink(out->name);
+        return ESP_FAIL;
+    }
+    void *mem = mmap(NULL, out->map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("mmap failed");
+        shm_unlink(out->name);
+        return ESP_FAIL;
+    }
+
+    // The slots are zero, i.e. not written yet. Readers check the magic last.
+    linux_shm_ring_header_t *h = mem;
+    h->version = LINUX_SHM_RING_VERSION;
+    h->n_slots = n_slots;
+    h->slot_size_bytes = slot_sz;
+    h->data_cap_bytes = CONFIG_RTP_JPEG_MAX_DATA_SIZE_BYTES;
+    atomic_init(&h->head, 0);
+    atomic_thread_fence(memory_order_release);
+    h->magic = LINUX_SHM_RING_MAGIC;
+    out->header = h;
+    ESP_LOGI(TAG, "Publishing frames to /dev/shm%s, %d slots", out->name, n_slots);
+    return ESP_OK;
+}
+
+void linux_shm_ring_destroy(linux_shm_ring_t *w) {
+    assert(w != NULL);
+    if (w->header == NULL) {
+        return;
+    }
+    munmap(w->header, w->map_sz);
+    shm_unlink(w->name);
+    w->header = NULL;
+}
+
+void linux_shm_ring_publish(linux_shm_ring_t *w, const rtp_jpeg_frame_t *frame) {
+    assert(w != NULL);
+    assert(frame != NULL);
+    assert(frame->jpeg_data_sz <= CONFIG_RTP_JPEG_MAX_DATA_SIZE_BYTES);
+    linux_shm_slot_t *slot = slot_at(w->header, w->head);
+
+    // Mark the slot as being written before touching it.
+    const unsigned seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->ssrc = frame->ssrc;
+    slot->timestamp = frame->timestamp;
+    slot->width = frame->width;
+    slot->height = frame->height;
+    slot->sz = frame->jpeg_data_sz;
+    slot->generation = w->head;
+    memcpy(slot->data, frame->jpeg_data, frame->jpeg_data_sz);
+
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+    w->head++;
+    atomic_store_explicit(&w->header->head, w->head, memory_order_release);
+}
+
+esp_err_t linux_shm_reader_open(const char *name, linux_shm_reader_t *out) {
+    assert(name != NULL);
+    assert(out != NULL);
+    memset(out, 0, sizeof(*out));
+    char path[64];
+    if (snprintf(path, sizeof(path), "/%s", name) >= (int)sizeof(path)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const int fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        return errno == ENOENT ? ESP_ERR_NOT_FOUND : ESP_FAIL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(linux_shm_ring_header_t)) {
+        close(fd);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        return ESP_FAIL;
+    }
+    out->header = mem;
+    out->map_sz = st.st_size;
+
+    const linux_shm_ring_header_t *h = out->header;
+    const uint32_t magic = h->magic;
+    atomic_thread_fence(memory_order_acquire);
+    const size_t slots_sz = (size_t)h->n_slots * h->slot_size_bytes;
+    if (magic != LINUX_SHM_RING_MAGIC || h->version != LINUX_SHM_RING_VERSION ||
+        h->n_slots == 0 ||
+        h->slot_size_bytes < sizeof(linux_shm_slot_t) + h->data_cap_bytes ||
+        ROUND_UP(sizeof(*h), LINUX_CACHE_LINE_SIZE_BYTES) + slots_sz > out->map_sz) {
+        linux_shm_reader_close(out);
+        return ESP_ERR_INVALID_VERSION;
+    }
+    out->next = atomic_load_explicit(&h->head, memory_order_acquire);
+    return ESP_OK;
+}
+
+void linux_shm_reader_close(linux_shm_reader_t *r) {
+    assert(r != NULL);
+    if (r->header == NULL) {
+        return;
+    }
+    munmap((void *)r->header, r->map_sz);
+    r->header = NULL;
+}
+
+// Read the header of the slot of a generation, returns false if it has been overwritten.
+static bool linux_shm_reader_get(const linux_shm_reader_t *r, const uint64_t generation,
+                                 linux_shm_frame_t *out) {
+    const linux_shm_slot_t *slot = slot_at(r->header, generation);
+    const unsigned seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq & 1) {
+        return false;
+    }
+    out->generation = slot->generation;
+    out->ssrc = slot->ssrc;
+    out->timestamp = slot->timestamp;
+    out->width = slot->width;
+    out->height = slot->height;
+    out->jpeg_data = slot->data;
+    out->jpeg_data_sz = slot->sz;
+    out->slot = slot;
+    out->seq = seq;
+    // The size must not be trusted before checking nothing changed meanwhile.
+    return linux_shm_reader_valid(out) && out->generation == generation &&
+           out->jpeg_data_sz <= r->header->data_cap_bytes;
+}
+
+esp_err_t linux_shm_reader_next(linux_shm_reader_t *r, linux_shm_frame_t *out) {
+    assert(r != NULL);
+    assert(out != NULL);
+    const uint64_t head = atomic_load_explicit(&r->header->head, memory_order_acquire);
+    if (head - r->next > r->header->n_slots) {
+        // Lapped, the frames before the last n_slots are gone.
+        r->skipped += head - r->header->n_slots - r->next;
+        r->next = head - r->header->n_slots;
+    }
+    while (r->next < head) {
+        const uint64_t generation = r->next++;
+        if (linux_shm_reader_get(r, generation, out)) {
+            return ESP_OK;
+        }
+        r->skipped++;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t linux_shm_reader_latest(linux_shm_reader_t *r, linux_shm_frame_t *out) {
+    assert(r != NULL);
+    assert(out != NULL);
+    const uint64_t head = atomic_load_explicit(&r->header->head, memory_order_acquire);
+    if (head == r->next) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    r->skipped += head - 1 - r->next;
+    r->next = head - 1;
+    return linux_shm_reader_next(r, out);
+}
+
+bool linux_shm_reader_valid(const linux_shm_frame_t *f) {
+    assert(f != NULL);
+    // Order the reads of the frame before the check.
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&f->slot->seq, memory_order_relaxed) == f->seq;
+}
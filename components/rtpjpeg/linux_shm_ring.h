@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fakesp.h"
+#include "linux_frame_queue.h"
+#include "rtp_jpeg.h"
+
+/**
+ * Ring of the latest JPEG frames in shared memory (/dev/shm/<name>), for other processes on the
+ * box, for the Linux tools.
+ *
+ * One writer publishes frames into fixed size slots in turn. Any number of readers map the ring
+ * read-only and use the frames in place, with neither copies nor syscalls. Readers never hold up
+ * the writer: a slot is protected by a sequence counter (seqlock), which is odd while the slot is
+ * written, so readers can tell if a frame was overwritten while they were using it and discard
+ * their results. Frames are numbered by a generation counting up from 0, frame g going to slot
+ * g % n_slots.
+ */
+
+#define LINUX_SHM_RING_MAGIC 0x524A5352  // "RJSR"
+#define LINUX_SHM_RING_VERSION 1
+
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Atomics in shared memory must be lock-free");
+
+typedef struct linux_shm_ring_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_slots;
+    uint32_t slot_size_bytes;  // Including the slot header.
+    uint32_t data_cap_bytes;   // Max size of a frame.
+    alignas(LINUX_CACHE_LINE_SIZE_BYTES) atomic_ullong head;  // Frames published.
+} linux_shm_ring_header_t;
+
+typedef struct linux_shm_slot_t {
+    atomic_uint seq;  // Odd while the slot is written.
+    uint32_t ssrc;
+    uint32_t timestamp;
+    uint16_t width;
+    uint16_t height;
+    uint32_t sz;
+    uint64_t generation;
+    alignas(LINUX_CACHE_LINE_SIZE_BYTES) uint8_t data[];
+} linux_shm_slot_t;
+
+/**
+ * The writer side.
+ * Use init_linux_shm_ring() to initialize an instance before usage.
+ */
+typedef struct linux_shm_ring_t {
+    char name[64];
+    linux_shm_ring_header_t *header;
+    size_t map_sz;
+    uint64_t head;  // Frames published, the writer's copy.
+} linux_shm_ring_t;
+
+/**
+ * Create the ring /dev/shm/<name> with room for n_slots frames of up to
+ * CONFIG_RTP_JPEG_MAX_DATA_SIZE_BYTES. A ring of the same name is replaced, readers of that one
+ * see no more frames and have to open it again.
+ */
+esp_err_t init_linux_shm_ring(const char *name, const int n_slots, linux_shm_ring_t *out);
+
+// Unmap and remove the ring. Readers keep their mapping until they close it.
+void linux_shm_ring_destroy(linux_shm_ring_t *w);
+
+// Copy a frame into the next slot. Not thread safe, there is one writer.
+void linux_shm_ring_publish(linux_shm_ring_t *w, const rtp_jpeg_frame_t *frame);
+
+// A frame in the ring, see linux_shm_reader_next().
+typedef struct linux_shm_frame_t {
+    uint64_t generation;
+    uint32_t ssrc;
+    uint32_t timestamp;
+    int width, height;
+    const uint8_t *jpeg_data;  // In the ring.
+    ptrdiff_t jpeg_data_sz;
+
+    // Private to the implementation.
+    const linux_shm_slot_t *slot;
+    unsigned seq;
+} linux_shm_frame_t;
+
+/**
+ * The reader side.
+ * Use linux_shm_reader_open() to initialize an instance before usage.
+ */
+typedef struct linux_shm_reader_t {
+    const linux_shm_ring_header_t *header;
+    size_t map_sz;
+    uint64_t next;     // Generation of the next frame to read.
+    uint64_t skipped;  // Frames overwritten before they were read.
+} linux_shm_reader_t;
+
+/**
+ * Map the ring /dev/shm/<name> read-only. Reading starts with the frames published afterwards.
+ * Returns ESP_ERR_NOT_FOUND if there is no such ring, or ESP_ERR_INVALID_VERSION if it is not one
+ * of this version.
+ */
+esp_err_t linux_shm_reader_open(const char *name, linux_shm_reader_t *out);
+
+void linux_shm_reader_close(linux_shm_reader_t *r);
+
+/**
+ * Get the oldest frame not read yet, skipping those already overwritten.
+ * Returns ESP_ERR_NOT_FOUND if there is none.
+ * The frame data remains in the ring and may be overwritten any time, so check
+ * linux_shm_reader_valid() after using it.
+ */
+esp_err_t linux_shm_reader_next(linux_shm_reader_t *r, linux_shm_frame_t *out);
+
+// The same, for the newest frame, skipping all others not read yet.
+esp_err_t linux_shm_reader_latest(linux_shm_reader_t *r, linux_shm_frame_t *out);
+
+// Returns whether the frame was not overwritten so far, i.e. what was read of it is valid.
+bool linux_shm_reader_valid(const linux_shm_frame_t *f);
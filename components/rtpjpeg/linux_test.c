@@ -0,0 +1,159 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fakesp.h"
+#include "rtp.h"
+#include "rtp_jpeg.h"
+#include "rtp_jpeg_packetizer.h"
+
+/**
+ * Tests of RTP/JPEG depayloading in corner cases the benchmarks do not check the output of.
+ *
+ * Each test sends synthetic frames through rtp_jpeg_packetizer_t into a rtp_jpeg_session_t,
+ * dropping some packets, and checks the frames handed out and the session stats.
+ * Prints a line per test and exits with 1 if any failed.
+ *
+ * Usage: linux_test
+ */
+
+#define WIDTH 320
+#define HEIGHT 240
+#define DRI 20  // MCUs per restart interval, 15 intervals per frame.
+#define FRAME_SIZE_BYTES 12000
+#define PACKET_SIZE_BYTES 1400
+#define MAX_FRAME_PACKETS 32
+#define FRAME_INTERVAL_TS (RTP_PT_CLOCKRATE_JPEG / 30)
+#define SSRC 0x54455354
+
+#define CHECK(cond)                                                                  \
+    do {                                                                             \
+        if (!(cond)) {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return false;                                                            \
+        }                                                                            \
+    } while (0)
+
+typedef struct frames_t {
+    int n;
+    uint32_t timestamp;  // Of the last frame.
+    bool ends_with_eoi;  // Whether the last frame does.
+    int concealed_intervals;
+} frames_t;
+
+typedef struct packets_t {
+    int n;
+    ptrdiff_t szs[MAX_FRAME_PACKETS];
+    uint8_t bufs[MAX_FRAME_PACKETS][PACKET_SIZE_BYTES];
+} packets_t;
+
+static rtp_jpeg_session_t sess;
+
+static void frame_cb(const rtp_jpeg_frame_t *frame, void *userdata) {
+    frames_t *f = userdata;
+    f->n++;
+    f->timestamp = frame->timestamp;
+    f->ends_with_eoi = frame->jpeg_data_sz >= 2 &&
+                       frame->jpeg_data[frame->jpeg_data_sz - 2] == 0xFF &&
+                       frame->jpeg_data[frame->jpeg_data_sz - 1] == 0xD9;
+    f->concealed_intervals = frame->concealed_intervals;
+}
+
+// Packetize synthetic frame i with the given restart interval, at RTP timestamp ts.
+static bool make_frame(rtp_jpeg_packetizer_t *p, const uint16_t dri, const uint32_t i,
+                       const uint32_t ts, packets_t *out) {
+    static uint8_t jpeg[CONFIG_RTP_JPEG_MAX_DATA_SIZE_BYTES];
+    const ptrdiff_t sz =
+        rtp_jpeg_synth_frame(WIDTH, HEIGHT, dri, i, FRAME_SIZE_BYTES, jpeg, sizeof(jpeg));
+    CHECK(sz > 0);
+    CHECK(rtp_jpeg_packetizer_start(p, jpeg, sz, ts) == ESP_OK);
+    for (out->n = 0; out->n < MAX_FRAME_PACKETS; out->n++) {
+        out->szs[out->n] =
+            rtp_jpeg_packetizer_next(p, out->bufs[out->n], sizeof(out->bufs[out->n]));
+        if (out->szs[out->n] == 0) {
+            break;
+        }
+    }
+    CHECK(out->n > 2 && out->n < MAX_FRAME_PACKETS);
+    return true;
+}
+
+static bool feed(const packets_t *pkts, const int i) {
+    rtp_packet_view_t view;
+    CHECK(parse_rtp_packet_view(pkts->bufs[i], pkts->szs[i], &view) == ESP_OK);
+    rtp_jpeg_session_feed(&sess, &view);
+    return true;
+}
+
+// A frame with restart markers which lost its marker packet is concealed and ends in EOI.
+static bool test_lost_marker_packet() {
+    frames_t frames = {0};
+    init_rtp_jpeg_session(SSRC, frame_cb, &frames, &sess);
+    rtp_jpeg_packetizer_t p;
+    CHECK(init_rtp_jpeg_packetizer(SSRC, 0, PACKET_SIZE_BYTES, &p) == ESP_OK);
+    static packets_t pkts;
+
+    CHECK(make_frame(&p, DRI, 0, 0, &pkts));
+    for (int i = 0; i < pkts.n - 1; i++) {
+        CHECK(feed(&pkts, i));
+    }
+    CHECK(frames.n == 0);
+    // The next frame completes it.
+    CHECK(make_frame(&p, DRI, 1, FRAME_INTERVAL_TS, &pkts));
+    CHECK(feed(&pkts, 0));
+    CHECK(frames.n == 1);
+    CHECK(frames.timestamp == 0);
+    CHECK(frames.concealed_intervals > 0);
+    CHECK(frames.ends_with_eoi);
+
+    rtp_jpeg_session_stats_t stats;
+    rtp_jpeg_session_stats(&sess, &stats);
+    CHECK(stats.frames_completed == 1);
+    CHECK(stats.frames_damaged == 1);
+    CHECK(stats.frames_dropped == 0);
+    return true;
+}
+
+// A frame which lost its first packet is counted as dropped, also at RTP timestamp 0.
+static bool test_lost_first_packet() {
+    frames_t frames = {0};
+    init_rtp_jpeg_session(SSRC, frame_cb, &frames, &sess);
+    rtp_jpeg_packetizer_t p;
+    CHECK(init_rtp_jpeg_packetizer(SSRC, 0, PACKET_SIZE_BYTES, &p) == ESP_OK);
+    static packets_t pkts;
+
+    CHECK(make_frame(&p, 0, 0, 0, &pkts));
+    for (int i = 1; i < pkts.n; i++) {
+        CHECK(feed(&pkts, i));
+    }
+    CHECK(make_frame(&p, 0, 1, FRAME_INTERVAL_TS, &pkts));
+    for (int i = 0; i < pkts.n; i++) {
+        CHECK(feed(&pkts, i));
+    }
+    CHECK(frames.n == 1);
+    CHECK(frames.timestamp == FRAME_INTERVAL_TS);
+
+    rtp_jpeg_session_stats_t stats;
+    rtp_jpeg_session_stats(&sess, &stats);
+    CHECK(stats.frames_completed == 1);
+    CHECK(stats.frames_dropped == 1);
+    CHECK(stats.dropped_missing == 1);
+    return true;
+}
+
+int main() {
+    static const struct {
+        const char *name;
+        bool (*fn)();
+    } tests[] = {
+        {"lost_marker_packet", test_lost_marker_packet},
+        {"lost_first_packet", test_lost_first_packet},
+    };
+    int n_failed = 0;
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        const bool ok = tests[i].fn();
+        printf("%-24s %s\n", tests[i].name, ok ? "ok" : "FAILED");
+        n_failed += !ok;
+    }
+    return n_failed > 0;
+}
@@ -0,0 +1,149 @@
+#define _GNU_SOURCE  // For sendmmsg().
+
+#include "linux_tx.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <netinet/udp.h>
+#include <stdio.h>
+#include <string.h>
+
+__attribute__((unused)) static const char *TAG = "linux_tx";
+
+esp_err_t init_linux_tx(const int sockfd, const struct sockaddr_in *dests, const int n_dests,
+                        const bool gso, linux_tx_t *out) {
+    assert(dests != NULL);
+    assert(out != NULL);
+    memset(out, 0, sizeof(*out));
+    if (n_dests <= 0 || n_dests > LINUX_TX_MAX_DESTS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    out->sockfd = sockfd;
+    memcpy(out->dests, dests, n_dests * sizeof(*dests));
+    out->n_dests = n_dests;
+
+    // A segment size of 0 on the socket leaves GSO off unless a message asks for it, which is
+    // only accepted by kernels supporting it (4.18 on).
+    const int off = 0;
+    out->gso = gso && setsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off)) == 0;
+    if (gso && !out->gso) {
+        ESP_LOGW(TAG, "UDP GSO not supported, sending one message per packet");
+    }
+    return ESP_OK;
+}
+
+uint8_t *linux_tx_queue(linux_tx_t *t, const int dest, const uint8_t *buf, const ptrdiff_t sz) {
+    assert(t != NULL);
+    assert(buf != NULL);
+    assert(dest >= 0 && dest < t->n_dests);
+    if (sz > LINUX_TX_PACKET_SIZE_BYTES) {
+        return NULL;
+    }
+    if (t->n_pkts == LINUX_TX_MAX_PACKETS) {
+        linux_tx_flush(t);
+    }
+    const int i = t->n_pkts++;
+    t->pkts[i].dest = dest;
+    t->pkts[i].sz = sz;
+    uint16_t seq;
+    uint32_t ssrc;
+    t->pkts[i].flow = partial_parse_rtp_packet(buf, sz, &seq, &ssrc) == ESP_OK ? ssrc : 0;
+    memcpy(t->bufs[i], buf, sz);
+    return t->bufs[i];
+}
+
+// Set the segment size of a message of more than one packet, so the kernel splits it.
+static void set_gso_size(linux_tx_t *t, const int m) {
+    struct msghdr *msg = &t->msgs[m].msg_hdr;
+    if (msg->msg_iovlen < 2) {
+        return;
+    }
+    msg->msg_control = t->cmsgs[m];
+    msg->msg_controllen = sizeof(t->cmsgs[m]);
+    struct cmsghdr *c = CMSG_FIRSTHDR(msg);
+    c->cmsg_level = SOL_UDP;
+    c->cmsg_type = UDP_SEGMENT;
+    c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    const uint16_t gso_size = msg->msg_iov[0].iov_len;
+    memcpy(CMSG_DATA(c), &gso_size, sizeof(gso_size));
+}
+
+int linux_tx_flush(linux_tx_t *t) {
+    assert(t != NULL);
+    // Build the messages destination by destination, so the packets of a message are adjacent in
+    // iovs. A GSO message takes packets of the size of its first one, and one smaller packet last,
+    // all of the same flow.
+    int n_msgs = 0;
+    int n_iovs = 0;
+    for (int d = 0; d < t->n_dests; d++) {
+        struct msghdr *msg = NULL;
+        ptrdiff_t msg_sz = 0;
+        ptrdiff_t last_sz = 0;
+        uint32_t msg_flow = 0;
+        for (int i = 0; i < t->n_pkts; i++) {
+            const linux_tx_packet_t *p = &t->pkts[i];
+            if (p->dest != d) {
+                continue;
+            }
+            t->iovs[n_iovs].iov_base = t->bufs[i];
+            t->iovs[n_iovs].iov_len = p->sz;
+            const bool append = t->gso && msg != NULL && p->flow == msg_flow &&
+                                last_sz == (ptrdiff_t)msg->msg_iov[0].iov_len &&
+                                p->sz <= last_sz && msg->msg_iovlen < LINUX_TX_GSO_MAX_SEGMENTS &&
+                                msg_sz + p->sz <= LINUX_TX_GSO_MAX_BYTES;
+            if (append) {
+                msg->msg_iovlen++;
+                msg_sz += p->sz;
+            } else {
+                if (msg != NULL) {
+                    set_gso_size(t, n_msgs - 1);
+                }
+                msg = &t->msgs[n_msgs++].msg_hdr;
+                memset(msg, 0, sizeof(*msg));
+                msg->msg_name = &t->dests[d];
+                msg->msg_namelen = sizeof(t->dests[d]);
+                msg->msg_iov = &t->iovs[n_iovs];
+                msg->msg_iovlen = 1;
+                msg_sz = p->sz;
+                msg_flow = p->flow;
+            }
+            last_sz = p->sz;
+            n_iovs++;
+        }
+        if (msg != NULL) {
+            set_gso_size(t, n_msgs - 1);
+        }
+    }
+    assert(n_iovs == t->n_pkts);
+    t->n_pkts = 0;
+
+    int sent = 0;
+    int done = 0;
+    while (done < n_msgs) {
+        const int n = sendmmsg(t->sockfd, &t->msgs[done], n_msgs - done, 0);
+        t->calls++;
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // The first message failed, skip it. Devices which cannot checksum segments fail
+            // GSO messages with EIO, send single packets from then on.
+            struct msghdr *msg = &t->msgs[done].msg_hdr;
+            ESP_LOGW(TAG, "sendmmsg failed: %s", strerror(errno));
+            if (msg->msg_controllen > 0 && (errno == EIO || errno == EINVAL)) {
+                ESP_LOGW(TAG, "Disabling UDP GSO");
+                t->gso = false;
+            }
+            t->failed += msg->msg_iovlen;
+            done++;
+            continue;
+        }
+        for (int m = done; m < done + n; m++) {
+            sent += t->msgs[m].msg_hdr.msg_iovlen;
+        }
+        t->messages += n;
+        done += n;
+    }
+    t->sent += sent;
+    return sent;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "fakesp.h"
+#include "rtp.h"
+
+/**
+ * Batched UDP send to a list of destinations for the Linux tools: packets are queued per
+ * destination and sent with one sendmmsg() per flush. With UDP GSO (UDP_SEGMENT), a run of
+ * packets of the same size to a destination goes out as a single message, which the kernel splits
+ * into datagrams, so the stack is traversed once per run rather than once per packet.
+ * A message carries a single flow, i.e. the packets of a run have the same RTP SSRC: the kernel
+ * picks the receiving SO_REUSEPORT socket once per message on local delivery, which would put
+ * the packets of other streams on the wrong worker, see linux_main -t. Queue the packets of a
+ * stream in runs to benefit from GSO.
+ * Needs _GNU_SOURCE to be defined before the first include.
+ */
+
+#define LINUX_TX_MAX_PACKETS 256
+#define LINUX_TX_MAX_DESTS 32
+#define LINUX_TX_PACKET_SIZE_BYTES RTP_JITBUF_BLOCK_SIZE_BYTES
+// Limits of the kernel for a GSO message: UDP_MAX_SEGMENTS, and the size of an IPv4 datagram.
+#define LINUX_TX_GSO_MAX_SEGMENTS 64
+#define LINUX_TX_GSO_MAX_BYTES (UINT16_MAX - 8 - 20)
+
+// A queued packet, see linux_tx_queue().
+typedef struct linux_tx_packet_t {
+    int dest;
+    ptrdiff_t sz;
+    uint32_t flow;  // SSRC of a RTP packet, 0 for other packets.
+} linux_tx_packet_t;
+
+/**
+ * A batched sender on an unconnected UDP socket.
+ * Use init_linux_tx() to initialize an instance before usage.
+ */
+typedef struct linux_tx_t {
+    int sockfd;
+    bool gso;  // Whether runs of packets are sent with UDP_SEGMENT.
+    struct sockaddr_in dests[LINUX_TX_MAX_DESTS];
+    int n_dests;
+
+    uint32_t sent;      // Packets handed to the kernel.
+    uint32_t failed;    // Packets not sent because of errors.
+    uint32_t messages;  // Messages sent, a GSO message counting once.
+    uint32_t calls;     // Calls of sendmmsg().
+
+    // Private to the implementation.
+    int n_pkts;
+    linux_tx_packet_t pkts[LINUX_TX_MAX_PACKETS];
+    uint8_t bufs[LINUX_TX_MAX_PACKETS][LINUX_TX_PACKET_SIZE_BYTES];
+    struct mmsghdr msgs[LINUX_TX_MAX_PACKETS];
+    struct iovec iovs[LINUX_TX_MAX_PACKETS];
+    uint8_t cmsgs[LINUX_TX_MAX_PACKETS][CMSG_SPACE(sizeof(uint16_t))];
+} linux_tx_t;
+
+/**
+ * Initialize a sender on a UDP socket, sending to n_dests destinations, at most
+ * LINUX_TX_MAX_DESTS. GSO is used if gso is set and the kernel supports it.
+ */
+esp_err_t init_linux_tx(const int sockfd, const struct sockaddr_in *dests, const int n_dests,
+                        const bool gso, linux_tx_t *out);
+
+/**
+ * Queue a copy of a packet of up to LINUX_TX_PACKET_SIZE_BYTES to the destination with index
+ * dest, flushing first if the queue is full.
+ * Returns the copy, to be modified in place until the next flush, or NULL if the packet is too
+ * large.
+ */
+uint8_t *linux_tx_queue(linux_tx_t *t, const int dest, const uint8_t *buf, const ptrdiff_t sz);
+
+/**
+ * Send the queued packets, grouped by destination in the order they were queued.
+ * Returns the number of packets sent.
+ */
+int linux_tx_flush(linux_tx_t *t);
@@ -3,6 +3,8 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "fakesp.h"
+
 #define u_char uint8_t
 #define u_short uint16_t
 
@@ -227,5 +229,8 @@ void rfc2435_make_tables(int q, uint8_t *lqt, uint8_t *cqt) { MakeTables(q, lqt,
 
 int rfc2435_make_headers(uint8_t *p, int type, int w, int h, const uint8_t *lqt, const uint8_t *cqt,
                          uint16_t dri) {
-    return MakeHeaders(p, type, w, h, lqt, cqt, dri);
+    FAKESP_TRACE_BEGIN(rfc2435_make_headers);
+    const int sz = MakeHeaders(p, type, w, h, lqt, cqt, dri);
+    FAKESP_TRACE_END(rfc2435_make_headers);
+    return sz;
 }
@@ -0,0 +1,427 @@
+#include "rtcp.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <string.h>
+
+__attribute__((unused)) static const char *TAG = "rtcp";
+static const ptrdiff_t HEADER_SZ = 4;
+static const ptrdiff_t SENDER_INFO_SZ = 24;  // SSRC of sender + sender info.
+static const ptrdiff_t REPORT_BLOCK_SZ = 24;
+static const ptrdiff_t APP_FEEDBACK_SZ = 12 + 5 * 4;  // SSRC, name and 5 words of data.
+static const ptrdiff_t FB_HEADER_SZ = 12;             // Header, SSRC of sender and media source.
+static const uint8_t SDES_CNAME = 1;
+
+static uint32_t get_u32(const uint8_t *buf) {
+    return ((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+static void put_u16(uint8_t *buf, const uint16_t v) {
+    buf[0] = v >> 8;
+    buf[1] = v & 0xFF;
+}
+
+static void put_u32(uint8_t *buf, const uint32_t v) {
+    buf[0] = v >> 24;
+    buf[1] = (v >> 16) & 0xFF;
+    buf[2] = (v >> 8) & 0xFF;
+    buf[3] = v & 0xFF;
+}
+
+// Write a common header for a packet of sz bytes, sz must be a multiple of 4.
+static void put_header(uint8_t *buf, const uint8_t count, const uint8_t packet_type,
+                       const ptrdiff_t sz) {
+    assert(sz % 4 == 0 && sz >= HEADER_SZ);
+    assert(count < 32);
+    buf[0] = (2 << 6) | count;
+    buf[1] = packet_type;
+    put_u16(&buf[2], sz / 4 - 1);
+}
+
+esp_err_t parse_rtcp_header(const uint8_t *buf, ptrdiff_t sz, rtcp_header_t *out,
+                            ptrdiff_t *parsed_sz) {
+    if (buf == NULL || out == NULL || parsed_sz == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(out, 0, sizeof(*out));
+    *parsed_sz = 0;
+
+    if (sz < HEADER_SZ) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    out->version = (buf[0] >> 6) & 0x03;
+    if (out->version != 2) {
+        return ESP_ERR_INVALID_VERSION;
+    }
+    out->padding = (buf[0] >> 5) & 0x01;
+    out->count = buf[0] & 0x1F;
+    out->packet_type = buf[1];
+    out->length = (buf[2] << 8) | buf[3];
+
+    const ptrdiff_t packet_sz = ((ptrdiff_t)out->length + 1) * 4;
+    if (packet_sz > sz) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    out->payload = &buf[HEADER_SZ];
+    out->payload_sz = packet_sz - HEADER_SZ;
+    if (out->padding) {
+        // The last octet holds the padding count, including itself.
+        const uint8_t padding_sz = buf[packet_sz - 1];
+        if (padding_sz == 0 || padding_sz > out->payload_sz) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        out->payload_sz -= padding_sz;
+    }
+    *parsed_sz = packet_sz;
+    return ESP_OK;
+}
+
+esp_err_t parse_rtcp_sr(const rtcp_header_t *h, rtcp_sr_t *out) {
+    if (h == NULL || out == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (h->packet_type != RTCP_PT_SR) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (h->payload_sz < SENDER_INFO_SZ) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const uint8_t *p = h->payload;
+    out->ssrc = get_u32(&p[0]);
+    out->ntp_timestamp = ((uint64_t)get_u32(&p[4]) << 32) | get_u32(&p[8]);
+    out->rtp_timestamp = get_u32(&p[12]);
+    out->packet_count = get_u32(&p[16]);
+    out->octet_count = get_u32(&p[20]);
+    return ESP_OK;
+}
+
+esp_err_t parse_rtcp_report_block(const rtcp_header_t *h, int i, rtcp_report_block_t *out) {
+    if (h == NULL || out == NULL || i < 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    ptrdiff_t offs;
+    if (h->packet_type == RTCP_PT_SR) {
+        offs = SENDER_INFO_SZ;
+    } else if (h->packet_type == RTCP_PT_RR) {
+        offs = 4;  // SSRC of packet sender.
+    } else {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (i >= h->count) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    offs += i * REPORT_BLOCK_SZ;
+    if (offs + REPORT_BLOCK_SZ > h->payload_sz) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const uint8_t *p = &h->payload[offs];
+    out->ssrc = get_u32(&p[0]);
+    out->fraction_lost = p[4];
+    // Sign extend the 24 bit cumulative lost count.
+    out->cumulative_lost = (int32_t)(get_u32(&p[4]) << 8) >> 8;
+    out->ext_highest_seq = get_u32(&p[8]);
+    out->jitter = get_u32(&p[12]);
+    out->lsr = get_u32(&p[16]);
+    out->dlsr = get_u32(&p[20]);
+    return ESP_OK;
+}
+
+esp_err_t parse_rtcp_app_feedback(const rtcp_header_t *h, rtcp_app_feedback_t *out) {
+    if (h == NULL || out == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (h->packet_type != RTCP_PT_APP || h->count != 0 || h->payload_sz < 8 ||
+        memcmp(&h->payload[4], RTCP_APP_NAME, 4) != 0) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (h->payload_sz < APP_FEEDBACK_SZ - HEADER_SZ) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const uint8_t *p = h->payload;
+    out->ssrc = get_u32(&p[0]);
+    out->frames_completed = get_u32(&p[8]);
+    out->frames_dropped = get_u32(&p[12]);
+    out->frames_oversize = get_u32(&p[16]);
+    out->frames_rescued = get_u32(&p[20]);
+    out->decode_us_avg = get_u32(&p[24]);
+    return ESP_OK;
+}
+
+ptrdiff_t rtcp_make_nack(const uint32_t ssrc, const uint32_t media_ssrc, const uint16_t *seqs,
+                         const int n, uint8_t *buf, const ptrdiff_t sz) {
+    assert(seqs != NULL || n == 0);
+    assert(buf != NULL);
+    if (sz < FB_HEADER_SZ) {
+        return 0;
+    }
+    put_u32(&buf[4], ssrc);
+    put_u32(&buf[8], media_ssrc);
+
+    // Each FCI entry holds a packet id and a bitmask of the 16 packets following it.
+    ptrdiff_t offs = FB_HEADER_SZ;
+    uint16_t pid = 0;
+    uint16_t blp = 0;
+    for (int i = 0; i < n; i++) {
+        const uint16_t dist = seqs[i] - pid;
+        if (i > 0 && dist >= 1 && dist <= 16) {
+            blp |= 1 << (dist - 1);
+            continue;
+        }
+        if (i > 0) {
+            if (offs + 4 > sz) {
+                return 0;
+            }
+            put_u16(&buf[offs], pid);
+            put_u16(&buf[offs + 2], blp);
+            offs += 4;
+        }
+        pid = seqs[i];
+        blp = 0;
+    }
+    if (n > 0) {
+        if (offs + 4 > sz) {
+            return 0;
+        }
+        put_u16(&buf[offs], pid);
+        put_u16(&buf[offs + 2], blp);
+        offs += 4;
+    }
+
+    put_header(buf, RTCP_RTPFB_FMT_NACK, RTCP_PT_RTPFB, offs);
+    return offs;
+}
+
+esp_err_t parse_rtcp_nack(const rtcp_header_t *h, uint32_t *media_ssrc_out, uint16_t *seqs_out,
+                          int *n_inout) {
+    if (h == NULL || media_ssrc_out == NULL || seqs_out == NULL || n_inout == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const int cap = *n_inout;
+    *n_inout = 0;
+    if (h->packet_type != RTCP_PT_RTPFB || h->count != RTCP_RTPFB_FMT_NACK) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (h->payload_sz < FB_HEADER_SZ - HEADER_SZ) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *media_ssrc_out = get_u32(&h->payload[4]);
+
+    int n = 0;
+    for (ptrdiff_t offs = FB_HEADER_SZ - HEADER_SZ; offs + 4 <= h->payload_sz; offs += 4) {
+        const uint16_t pid = (h->payload[offs] << 8) | h->payload[offs + 1];
+        const uint16_t blp = (h->payload[offs + 2] << 8) | h->payload[offs + 3];
+        if (n < cap) {
+            seqs_out[n++] = pid;
+        }
+        for (int bit = 0; bit < 16; bit++) {
+            if ((blp >> bit) & 1 && n < cap) {
+                seqs_out[n++] = pid + bit + 1;
+            }
+        }
+    }
+    *n_inout = n;
+    return ESP_OK;
+}
+
+/**
+ * Write a SDES packet with a single CNAME item.
+ * Returns the number of bytes written, or 0 if buf is too small.
+ */
+static ptrdiff_t rtcp_write_sdes(const uint32_t ssrc, const char *cname, uint8_t *buf,
+                                 const ptrdiff_t sz) {
+    const ptrdiff_t cname_sz = strnlen(cname, RTCP_CNAME_MAX_LEN);
+    // Header, SSRC, CNAME item and at least one null octet ending the item list, padded to 32 bits.
+    const ptrdiff_t packet_sz = (HEADER_SZ + 4 + 2 + cname_sz + 1 + 3) & ~3;
+    if (packet_sz > sz) {
+        return 0;
+    }
+    memset(buf, 0, packet_sz);
+    put_header(buf, 1, RTCP_PT_SDES, packet_sz);
+    put_u32(&buf[4], ssrc);
+    buf[8] = SDES_CNAME;
+    buf[9] = cname_sz;
+    memcpy(&buf[10], cname, cname_sz);
+    return packet_sz;
+}
+
+ptrdiff_t rtcp_make_sr(const rtcp_sr_t *sr, const char *cname, uint8_t *buf, const ptrdiff_t sz) {
+    assert(sr != NULL);
+    assert(cname != NULL);
+    assert(buf != NULL);
+
+    const ptrdiff_t sr_sz = HEADER_SZ + SENDER_INFO_SZ;
+    if (sr_sz > sz) {
+        return 0;
+    }
+    put_header(buf, 0, RTCP_PT_SR, sr_sz);
+    put_u32(&buf[4], sr->ssrc);
+    put_u32(&buf[8], sr->ntp_timestamp >> 32);
+    put_u32(&buf[12], sr->ntp_timestamp & 0xFFFFFFFF);
+    put_u32(&buf[16], sr->rtp_timestamp);
+    put_u32(&buf[20], sr->packet_count);
+    put_u32(&buf[24], sr->octet_count);
+
+    const ptrdiff_t sdes_sz = rtcp_write_sdes(sr->ssrc, cname, &buf[sr_sz], sz - sr_sz);
+    if (sdes_sz == 0) {
+        return 0;
+    }
+    return sr_sz + sdes_sz;
+}
+
+// xorshift32, only used to randomize the report interval.
+static uint32_t rtcp_session_rand(rtcp_session_t *r) {
+    uint32_t x = r->rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    r->rand_state = x;
+    return x;
+}
+
+/**
+ * Schedule the next report in [0.5, 1.5] times the report interval from now, as RFC 3550
+ * Section 6.2 asks, so that receivers started at the same time do not stay synchronized.
+ */
+static void rtcp_session_schedule(rtcp_session_t *r, const int64_t now_us) {
+    const int64_t interval_us = (int64_t)CONFIG_RTP_RTCP_INTERVAL_MS * 1000;
+    r->next_report_us = now_us + interval_us / 2 + rtcp_session_rand(r) % (interval_us + 1);
+}
+
+void init_rtcp_session(const uint32_t ssrc, const char *cname, rtcp_session_t *r) {
+    assert(cname != NULL);
+    assert(r != NULL);
+    memset(r, 0, sizeof(*r));
+
+    r->ssrc = ssrc;
+    strncpy(r->cname, cname, RTCP_CNAME_MAX_LEN);
+    r->rand_state = ssrc != 0 ? ssrc : 1;
+    // Report soon after the first packets arrived.
+    r->next_report_us = INT64_MIN;
+}
+
+esp_err_t rtcp_session_feed(rtcp_session_t *r, const uint8_t *buf, const ptrdiff_t sz,
+                            const int64_t now_us) {
+    assert(r != NULL);
+    if (buf == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Walk the compound packet.
+    ptrdiff_t offs = 0;
+    while (offs < sz) {
+        rtcp_header_t h;
+        ptrdiff_t parsed_sz = 0;
+        const esp_err_t err = parse_rtcp_header(&buf[offs], sz - offs, &h, &parsed_sz);
+        if (err != ESP_OK) {
+            return err;
+        }
+        offs += parsed_sz;
+
+        rtcp_sr_t sr;
+        if (h.packet_type != RTCP_PT_SR || parse_rtcp_sr(&h, &sr) != ESP_OK) {
+            continue;
+        }
+        ESP_LOGD(TAG, "SR[ssrc=%" PRIu32 " ts=%" PRIu32 " packets=%" PRIu32 "]", sr.ssrc,
+                 sr.rtp_timestamp, sr.packet_count);
+        r->have_sr = true;
+        r->sr_ssrc = sr.ssrc;
+        r->lsr = (sr.ntp_timestamp >> 16) & 0xFFFFFFFF;
+        r->lsr_arrival_us = now_us;
+    }
+    return ESP_OK;
+}
+
+bool rtcp_session_report_due(const rtcp_session_t *r, const int64_t now_us) {
+    assert(r != NULL);
+    return now_us >= r->next_report_us;
+}
+
+// Write a report block for rx, see https://datatracker.ietf.org/doc/html/rfc3550#appendix-A.3.
+static void rtcp_session_write_report_block(rtcp_session_t *r, const rtp_jitbuf_reception_t *rx,
+                                            const int64_t now_us, uint8_t *buf) {
+    const uint32_t expected = rx->ext_highest_seq - rx->base_seq + 1;
+    int64_t lost = (int64_t)expected - rx->received;
+    if (lost > 0x7FFFFF) {
+        lost = 0x7FFFFF;
+    } else if (lost < -0x800000) {
+        lost = -0x800000;
+    }
+
+    const int64_t expected_interval = (int64_t)expected - r->expected_prior;
+    const int64_t received_interval = (int64_t)rx->received - r->received_prior;
+    const int64_t lost_interval = expected_interval - received_interval;
+    uint8_t fraction = 0;
+    if (expected_interval > 0 && lost_interval > 0) {
+        fraction = (lost_interval << 8) / expected_interval;
+    }
+    r->expected_prior = expected;
+    r->received_prior = rx->received;
+
+    uint32_t lsr = 0;
+    uint32_t dlsr = 0;
+    if (r->have_sr && r->sr_ssrc == rx->ssrc) {
+        lsr = r->lsr;
+        dlsr = (now_us - r->lsr_arrival_us) * 65536 / 1000000;
+    }
+
+    put_u32(&buf[0], rx->ssrc);
+    put_u32(&buf[4], (uint32_t)lost & 0xFFFFFF);
+    buf[4] = fraction;
+    put_u32(&buf[8], rx->ext_highest_seq);
+    put_u32(&buf[12], rx->jitter);
+    put_u32(&buf[16], lsr);
+    put_u32(&buf[20], dlsr);
+}
+
+ptrdiff_t rtcp_session_make_nack(const rtcp_session_t *r, const uint32_t media_ssrc,
+                                 const uint16_t *seqs, const int n, uint8_t *buf,
+                                 const ptrdiff_t sz) {
+    assert(r != NULL);
+    return rtcp_make_nack(r->ssrc, media_ssrc, seqs, n, buf, sz);
+}
+
+ptrdiff_t rtcp_session_make_report(rtcp_session_t *r, const rtp_jitbuf_reception_t *rx,
+                                   const rtcp_app_feedback_t *app, const int64_t now_us,
+                                   uint8_t *buf, const ptrdiff_t sz) {
+    assert(r != NULL);
+    assert(buf != NULL);
+
+    // RR, with a report block once something was received.
+    const int count = rx != NULL && rx->received > 0 ? 1 : 0;
+    const ptrdiff_t rr_sz = HEADER_SZ + 4 + count * REPORT_BLOCK_SZ;
+    if (rr_sz > sz) {
+        return 0;
+    }
+    put_header(buf, count, RTCP_PT_RR, rr_sz);
+    put_u32(&buf[4], r->ssrc);
+    if (count > 0) {
+        rtcp_session_write_report_block(r, rx, now_us, &buf[8]);
+    }
+    ptrdiff_t offs = rr_sz;
+
+    // SDES CNAME is mandatory in each compound packet.
+    const ptrdiff_t sdes_sz = rtcp_write_sdes(r->ssrc, r->cname, &buf[offs], sz - offs);
+    if (sdes_sz == 0) {
+        return 0;
+    }
+    offs += sdes_sz;
+
+    if (app != NULL) {
+        if (offs + APP_FEEDBACK_SZ > sz) {
+            return 0;
+        }
+        uint8_t *p = &buf[offs];
+        put_header(p, 0, RTCP_PT_APP, APP_FEEDBACK_SZ);
+        put_u32(&p[4], r->ssrc);
+        memcpy(&p[8], RTCP_APP_NAME, 4);
+        put_u32(&p[12], app->frames_completed);
+        put_u32(&p[16], app->frames_dropped);
+        put_u32(&p[20], app->frames_oversize);
+        put_u32(&p[24], app->frames_rescued);
+        put_u32(&p[28], app->decode_us_avg);
+        offs += APP_FEEDBACK_SZ;
+    }
+
+    rtcp_session_schedule(r, now_us);
+    return offs;
+}
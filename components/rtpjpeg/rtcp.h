@@ -0,0 +1,211 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fakesp.h"
+#include "rtp.h"
+
+// https://datatracker.ietf.org/doc/html/rfc3550#section-12.1
+typedef enum rtcp_pt {
+    RTCP_PT_SR = 200,
+    RTCP_PT_RR = 201,
+    RTCP_PT_SDES = 202,
+    RTCP_PT_BYE = 203,
+    RTCP_PT_APP = 204,
+    RTCP_PT_RTPFB = 205,  // https://datatracker.ietf.org/doc/html/rfc4585#section-6.1
+} rtcp_pt;
+
+// Feedback message type of a generic NACK, carried in the count field of RTPFB packets.
+#define RTCP_RTPFB_FMT_NACK 1
+
+/**
+ * A parsed RTCP common header as per
+ * https://datatracker.ietf.org/doc/html/rfc3550#section-6.4.1.
+ *
+ * 0                   1                   2                   3
+ * 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |V=2|P|    RC   |      PT       |             length            |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ */
+typedef struct rtcp_header_t {
+    uint8_t version;
+    uint8_t padding;
+    uint8_t count;  // Report count, source count or subtype, depending on packet_type.
+    uint8_t packet_type;
+    uint16_t length;  // In 32 bit words minus one, including the header.
+
+    // Pointer to the payload after the header, not owned by this struct.
+    const uint8_t *payload;
+    ptrdiff_t payload_sz;
+} rtcp_header_t;
+
+/**
+ * Parse one RTCP packet from a (compound) network buffer.
+ * The buf, out and parsed_sz params must not be NULL.
+ * The payload pointer will point into buf.
+ * *parsed_sz will be set to the size of the whole packet, i.e. the offset of the next one.
+ * Returns ESP_OK on success.
+ */
+esp_err_t parse_rtcp_header(const uint8_t *buf, ptrdiff_t sz, rtcp_header_t *out,
+                            ptrdiff_t *parsed_sz);
+
+/**
+ * A parsed sender info as per https://datatracker.ietf.org/doc/html/rfc3550#section-6.4.1,
+ * without the report blocks which may follow.
+ */
+typedef struct rtcp_sr_t {
+    uint32_t ssrc;
+    uint64_t ntp_timestamp;  // 32.32 fixed point seconds since 1900.
+    uint32_t rtp_timestamp;
+    uint32_t packet_count;
+    uint32_t octet_count;
+} rtcp_sr_t;
+
+// Parse the payload of a SR packet, as returned by parse_rtcp_header().
+esp_err_t parse_rtcp_sr(const rtcp_header_t *h, rtcp_sr_t *out);
+
+/**
+ * A parsed report block as per https://datatracker.ietf.org/doc/html/rfc3550#section-6.4.1.
+ *
+ * 0                   1                   2                   3
+ * 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ * +=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+ * |                 SSRC_1 (SSRC of first source)                 |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * | fraction lost |       cumulative number of packets lost       |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |           extended highest sequence number received           |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |                      interarrival jitter                      |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |                         last SR (LSR)                         |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |                   delay since last SR (DLSR)                  |
+ * +=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+ */
+typedef struct rtcp_report_block_t {
+    uint32_t ssrc;
+    uint8_t fraction_lost;  // Fixed point, fraction_lost/256.
+    int32_t cumulative_lost;
+    uint32_t ext_highest_seq;
+    uint32_t jitter;
+    uint32_t lsr;
+    uint32_t dlsr;  // In units of 1/65536 seconds.
+} rtcp_report_block_t;
+
+/**
+ * Parse the i-th report block of a SR or RR packet, as returned by parse_rtcp_header().
+ * Returns ESP_ERR_NOT_FOUND if there is no such block.
+ */
+esp_err_t parse_rtcp_report_block(const rtcp_header_t *h, int i, rtcp_report_block_t *out);
+
+// Name of our APP packets.
+#define RTCP_APP_NAME "NSFB"
+
+/**
+ * Receiver feedback carried in an APP packet with name RTCP_APP_NAME and subtype 0, see
+ * https://datatracker.ietf.org/doc/html/rfc3550#section-6.7.
+ * All fields are sent as 32 bit words in this order.
+ * Counters are cumulative, so senders can derive rates from consecutive reports.
+ */
+typedef struct rtcp_app_feedback_t {
+    uint32_t ssrc;  // Sender of the APP packet, set when parsing and ignored when writing.
+    uint32_t frames_completed;
+    uint32_t frames_dropped;
+    uint32_t frames_oversize;
+    uint32_t frames_rescued;
+    uint32_t decode_us_avg;  // Average decode time since the last report, 0 if unknown.
+} rtcp_app_feedback_t;
+
+// Parse an APP packet, as returned by parse_rtcp_header(), into feedback.
+esp_err_t parse_rtcp_app_feedback(const rtcp_header_t *h, rtcp_app_feedback_t *out);
+
+/**
+ * Write a generic NACK (https://datatracker.ietf.org/doc/html/rfc4585#section-6.2.1) from ssrc
+ * for the n packets in seqs, sent by media_ssrc. seqs must be in ascending order.
+ * Packets within 16 of each other are packed into one PID/BLP entry.
+ * Returns the number of bytes written, or 0 if buf is too small.
+ */
+ptrdiff_t rtcp_make_nack(const uint32_t ssrc, const uint32_t media_ssrc, const uint16_t *seqs,
+                         const int n, uint8_t *buf, const ptrdiff_t sz);
+
+/**
+ * Parse a generic NACK packet, as returned by parse_rtcp_header().
+ * Writes the requested seq numbers to seqs_out, which has room for *n_inout entries. On return,
+ * *n_inout is set to the number of seq numbers written, excess ones are ignored.
+ */
+esp_err_t parse_rtcp_nack(const rtcp_header_t *h, uint32_t *media_ssrc_out, uint16_t *seqs_out,
+                          int *n_inout);
+
+/**
+ * Write a SR packet without report blocks, followed by a SDES CNAME packet, to buf.
+ * Returns the number of bytes written, or 0 if buf is too small.
+ */
+ptrdiff_t rtcp_make_sr(const rtcp_sr_t *sr, const char *cname, uint8_t *buf, const ptrdiff_t sz);
+
+#ifndef ESP_PLATFORM
+#define CONFIG_RTP_RTCP_INTERVAL_MS (1000)
+#endif
+
+#define RTCP_CNAME_MAX_LEN 32
+
+/**
+ * Receiver side of a RTCP session with a single media source.
+ * Use init_rtcp_session() to initialize an instance before usage.
+ * All struct members are private to the implementation.
+ */
+typedef struct rtcp_session_t {
+    uint32_t ssrc;  // Our own SSRC, as sender of the reports.
+    char cname[RTCP_CNAME_MAX_LEN + 1];
+
+    // State at the previous report, for the fraction lost, see RFC 3550 Appendix A.3.
+    uint32_t expected_prior;
+    uint32_t received_prior;
+
+    // Last SR received.
+    bool have_sr;
+    uint32_t sr_ssrc;
+    uint32_t lsr;            // Middle 32 bits of its NTP timestamp.
+    int64_t lsr_arrival_us;  // Local arrival time.
+
+    int64_t next_report_us;
+    uint32_t rand_state;
+} rtcp_session_t;
+
+/**
+ * Initialize a session.
+ * ssrc is our own SSRC, which should be chosen randomly. cname is truncated to RTCP_CNAME_MAX_LEN.
+ */
+void init_rtcp_session(const uint32_t ssrc, const char *cname, rtcp_session_t *r);
+
+/**
+ * Feed a RTCP packet received from the media source.
+ * Sender reports are remembered for the LSR and DLSR fields, everything else is ignored.
+ */
+esp_err_t rtcp_session_feed(rtcp_session_t *r, const uint8_t *buf, const ptrdiff_t sz,
+                            const int64_t now_us);
+
+// Whether a report is due. Reports are spaced CONFIG_RTP_RTCP_INTERVAL_MS apart, randomized.
+bool rtcp_session_report_due(const rtcp_session_t *r, const int64_t now_us);
+
+/**
+ * Write a generic NACK for the n packets in seqs from media_ssrc, see rtcp_make_nack().
+ * It is sent on its own rather than as part of a compound packet, as per RFC 5506, so that
+ * retransmissions are requested without waiting for the next report.
+ */
+ptrdiff_t rtcp_session_make_nack(const rtcp_session_t *r, const uint32_t media_ssrc,
+                                 const uint16_t *seqs, const int n, uint8_t *buf,
+                                 const ptrdiff_t sz);
+
+/**
+ * Write a compound RR + SDES CNAME (+ APP if app is not NULL) packet to buf, and schedule the next
+ * report. rx describes the media source, now_us must come from the same clock as passed to
+ * rtcp_session_feed().
+ * Returns the number of bytes written, or 0 if buf is too small.
+ */
+ptrdiff_t rtcp_session_make_report(rtcp_session_t *r, const rtp_jitbuf_reception_t *rx,
+                                   const rtcp_app_feedback_t *app, const int64_t now_us,
+                                   uint8_t *buf, const ptrdiff_t sz);
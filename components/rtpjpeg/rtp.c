@@ -5,10 +5,13 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include "rtp_log.h"
+
 __attribute__((unused)) static const char *TAG = "rtp";
 static const ptrdiff_t HEADER_MIN_SZ = 12;
 
 esp_err_t parse_rtp_packet(const uint8_t *buf, const ptrdiff_t sz, rtp_packet_t *out) {
+    FAKESP_TRACE_SCOPE(parse_rtp_packet);
     if (out == NULL || buf == NULL) {
         return ESP_ERR_INVALID_ARG;
     }
@@ -70,21 +73,220 @@ esp_err_t partial_parse_rtp_packet(const uint8_t *buf, const ptrdiff_t sz,
 
 void rtp_packet_print(const rtp_packet_t *p __attribute__((unused))) {
     assert(p != NULL);
-    ESP_LOGD(TAG,
+    RTP_LOGD(TAG,
              "RTP[v=%" PRIu8 " ext=%" PRIu8 " csrc=%" PRIu8 " mark=%" PRIu8 " pt=%" PRIu8
              " seq=%" PRIu16 " ts=%" PRIu32 " ssrc=%" PRIu32 "]",
              p->version, p->extension, p->csrc_count, p->marker, p->payload_type,
              p->sequence_number, p->timestamp, p->ssrc);
 }
 
-void init_rtp_jitbuf(const uint32_t ssrc, rtp_jitbuf_t *j) {
+esp_err_t parse_rtp_packet_view(const uint8_t *buf, const ptrdiff_t sz, rtp_packet_view_t *out) {
+    if (out == NULL || buf == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (sz < HEADER_MIN_SZ) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const uint8_t version = (buf[0] >> 6) & 0x03;
+    if (version != 2) {
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    const uint8_t padding = (buf[0] >> 5) & 0x01;
+    const uint8_t extension = (buf[0] >> 4) & 0x01;
+    const uint8_t csrc_count = buf[0] & 0x0F;
+    out->marker = (buf[1] >> 7) & 0x01;
+    out->payload_type = buf[1] & 0x7F;
+    out->sequence_number = (buf[2] << 8) | buf[3];
+    out->timestamp = (buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7];
+    out->ssrc = (buf[8] << 24) | (buf[9] << 16) | (buf[10] << 8) | buf[11];
+
+    // Skip CSRC list and header extension.
+    ptrdiff_t parsed = HEADER_MIN_SZ + csrc_count * 4;
+    if (extension) {
+        if (sz < parsed + 4) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        const ptrdiff_t ext_words = (buf[parsed + 2] << 8) | buf[parsed + 3];
+        parsed += 4 + ext_words * 4;
+    }
+
+    // Strip padding, its size is in the last octet.
+    ptrdiff_t end = sz;
+    if (padding) {
+        if (buf[sz - 1] == 0) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        end -= buf[sz - 1];
+    }
+    if (parsed > end) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    out->buf = buf;
+    out->sz = sz;
+    out->payload = &buf[parsed];
+    out->payload_sz = end - parsed;
+
+    out->rescued = false;
+    out->arrival_us = 0;
+    out->jpeg_fragment_offset = 0;
+    if (out->payload_type == RTP_PT_JPEG && out->payload_sz >= 4) {
+        out->jpeg_fragment_offset =
+            (out->payload[1] << 16) | (out->payload[2] << 8) | out->payload[3];
+    }
+
+    return ESP_OK;
+}
+
+void rtp_packet_view_print(const rtp_packet_view_t *v __attribute__((unused))) {
+    assert(v != NULL);
+    RTP_LOGD(TAG,
+             "RTP[mark=%" PRIu8 " pt=%" PRIu8 " seq=%" PRIu16 " ts=%" PRIu32 " ssrc=%" PRIu32
+             " len=%d]",
+             v->marker, v->payload_type, v->sequence_number, v->timestamp, v->ssrc,
+             (int)v->payload_sz);
+}
+
+// Packets which are at most this much older than the last packet handed out are considered late,
+// anything older is treated as a sequence number discontinuity. See RFC 3550 Appendix A.1.
+static const int32_t JITBUF_MAX_MISORDER = 100;
+
+// In adaptive mode, the wait budget is this multiple of the jitter estimate.
+static const int32_t JITBUF_WAIT_JITTER_MULT = 4;
+// In adaptive mode, the window never shrinks below this many packets.
+static const int JITBUF_MIN_WINDOW = 4;
+// The reorder depth estimate decays by one after this many packets.
+static const int JITBUF_REORDER_DECAY_PACKETS = 256;
+// NACK round trip time to assume until measured.
+static const int32_t JITBUF_NACK_INITIAL_RTT_US = 20000;
+// Repeated NACKs for the same packet are spaced at least this far apart, even on a fast network.
+static const int32_t JITBUF_NACK_MIN_INTERVAL_US = 5000;
+// The FEC delay estimate is smoothed over about this many FEC packets.
+static const int32_t JITBUF_FEC_DELAY_SMOOTHING = 8;
+
+static void rtp_jitbuf_adapt(rtp_jitbuf_t *j);
+
+void init_rtp_jitbuf(const uint32_t ssrc, rtp_slab_t *slab, rtp_jitbuf_t *j) {
     assert(j != NULL);
+    assert(slab != NULL && slab->block_sz >= RTP_JITBUF_BLOCK_SIZE_BYTES);
     memset(j, 0, sizeof(*j));
 
     j->ssrc = ssrc;
+    j->slab = slab;
 
-    j->buf_top = -1;
     j->max_seq_out = -1;
+    j->lent_pos = -1;
+    j->max_wait_us = CONFIG_RTP_JITBUF_MAX_WAIT_US;
+    j->adaptive = true;
+    j->highest_seq = -1;
+    j->reorder_decay = JITBUF_REORDER_DECAY_PACKETS;
+    j->rtt_us = JITBUF_NACK_INITIAL_RTT_US;
+    j->fec_payload_type = CONFIG_RTP_JITBUF_FEC_PAYLOAD_TYPE;
+    j->fec_ssrc = ssrc;
+    rtp_jitbuf_adapt(j);
+}
+
+void rtp_jitbuf_set_max_wait_us(rtp_jitbuf_t *j, const int32_t max_wait_us) {
+    assert(j != NULL);
+    assert(max_wait_us >= 0);
+    j->max_wait_us = max_wait_us;
+    rtp_jitbuf_adapt(j);
+}
+
+void rtp_jitbuf_set_adaptive(rtp_jitbuf_t *j, const bool adaptive) {
+    assert(j != NULL);
+    j->adaptive = adaptive;
+    rtp_jitbuf_adapt(j);
+}
+
+static void rtp_jitbuf_fec_drop(rtp_jitbuf_t *j, rtp_jitbuf_fec_slot_t *f);
+
+void rtp_jitbuf_set_fec(rtp_jitbuf_t *j, const uint8_t payload_type, const uint32_t ssrc) {
+    assert(j != NULL);
+    j->fec_payload_type = payload_type;
+    j->fec_ssrc = ssrc;
+    for (int i = 0; i < CONFIG_RTP_JITBUF_FEC_CAP_N_PACKETS; i++) {
+        rtp_jitbuf_fec_drop(j, &j->fec[i]);
+    }
+    j->fec_span = 0;
+    j->fec_delay_us = 0;
+    rtp_jitbuf_adapt(j);
+}
+
+static int32_t rtp_jitbuf_jitter_us(const rtp_jitbuf_t *j) {
+    return (int64_t)(j->jitter_q4 >> 4) * 1000000 / RTP_PT_CLOCKRATE_JPEG;
+}
+
+void rtp_jitbuf_get_reception(const rtp_jitbuf_t *j, rtp_jitbuf_reception_t *out) {
+    assert(j != NULL);
+    assert(out != NULL);
+    out->ssrc = j->ssrc;
+    out->base_seq = j->base_seq;
+    out->ext_highest_seq = j->highest_seq < 0 ? j->base_seq : j->cycles + j->highest_seq;
+    out->received = j->received;
+    out->jitter = j->jitter_q4 >> 4;
+    out->nacked = j->nacked;
+    out->rescued = j->rescued;
+    out->rtt_us = j->rtt_us;
+    out->fec_received = j->fec_received;
+    out->fec_recovered = j->fec_recovered;
+    out->slab_exhausted = j->slab_exhausted;
+}
+
+void rtp_jitbuf_stats(const rtp_jitbuf_t *j, rtp_jitbuf_stats_t *out) {
+    assert(j != NULL);
+    assert(out != NULL);
+    *out = j->stats;
+}
+
+void rtp_jitbuf_get_playout(const rtp_jitbuf_t *j, rtp_jitbuf_playout_t *out) {
+    assert(j != NULL);
+    assert(out != NULL);
+    out->jitter = j->jitter_q4 >> 4;
+    out->jitter_us = rtp_jitbuf_jitter_us(j);
+    out->reorder_depth = j->reorder_depth;
+    out->wait_us = j->wait_us;
+    out->window = j->window;
+}
+
+/**
+ * Derive the effective wait budget and window from the current estimates.
+ * With FEC, both are stretched so that a protection group and its FEC packet fit in.
+ */
+static void rtp_jitbuf_adapt(rtp_jitbuf_t *j) {
+    if (!j->adaptive || j->max_wait_us == 0) {
+        j->wait_us = j->max_wait_us;
+    } else {
+        int64_t wait_us = (int64_t)JITBUF_WAIT_JITTER_MULT * rtp_jitbuf_jitter_us(j);
+        if (wait_us < CONFIG_RTP_JITBUF_MIN_WAIT_US) {
+            wait_us = CONFIG_RTP_JITBUF_MIN_WAIT_US;
+        }
+        if (j->fec_span > 0 && wait_us < j->fec_delay_us + j->fec_delay_us / 4) {
+            wait_us = j->fec_delay_us + j->fec_delay_us / 4;
+        }
+        if (wait_us > j->max_wait_us) {
+            wait_us = j->max_wait_us;
+        }
+        j->wait_us = wait_us;
+    }
+
+    if (!j->adaptive) {
+        j->window = CONFIG_RTP_JITBUF_CAP_N_PACKETS;
+    } else {
+        int window = 2 * (j->reorder_depth + 1);
+        if (window < JITBUF_MIN_WINDOW) {
+            window = JITBUF_MIN_WINDOW;
+        }
+        if (window < j->fec_span + 1) {
+            window = j->fec_span + 1;
+        }
+        if (window > CONFIG_RTP_JITBUF_CAP_N_PACKETS) {
+            window = CONFIG_RTP_JITBUF_CAP_N_PACKETS;
+        }
+        j->window = window;
+    }
 }
 
 /**
@@ -97,110 +299,615 @@ void init_rtp_jitbuf(const uint32_t ssrc, rtp_jitbuf_t *j) {
  */
 static int32_t seqnum_compare(uint16_t seq0, uint16_t seq1) { return (int16_t)(seq1 - seq0); }
 
-static int mod(int a, int b) { return (a % b + b) % b; }
+static int rtp_jitbuf_slot(const uint16_t sequence_number) {
+    return sequence_number & RTP_JITBUF_SLOT_MASK;
+}
 
-esp_err_t rtp_jitbuf_feed(rtp_jitbuf_t *j, const uint8_t *buf, const ptrdiff_t sz) {
-    uint16_t sequence_number = 0;
-    uint32_t ssrc = 0;
-    esp_err_t err = partial_parse_rtp_packet(buf, sz, &sequence_number, &ssrc);
-    if (err != ESP_OK) {
-        return err;
+// Sequence number of the packet in an occupied slot, derived from its distance to max_seq.
+static uint16_t rtp_jitbuf_slot_seq(const rtp_jitbuf_t *j, const int pos) {
+    return j->max_seq - ((j->max_seq - pos) & RTP_JITBUF_SLOT_MASK);
+}
+
+static bool rtp_jitbuf_slot_occupied(const rtp_jitbuf_t *j, const int pos) {
+    return (j->occupied[pos / 32] >> (pos % 32)) & 1;
+}
+
+static rtp_jitbuf_nack_t *rtp_jitbuf_nack(rtp_jitbuf_t *j, const uint16_t seq) {
+    return &j->nacks[seq & (RTP_JITBUF_NACK_HISTORY - 1)];
+}
+
+// Returns whether a NACK was sent for seq and its retransmission did not arrive yet.
+static bool rtp_jitbuf_nack_pending(const rtp_jitbuf_t *j, const uint16_t seq) {
+    const rtp_jitbuf_nack_t *n = &j->nacks[seq & (RTP_JITBUF_NACK_HISTORY - 1)];
+    return n->count > 0 && n->seq == seq;
+}
+
+// Take a slab block for slot pos, unless it has one. Returns false if the slab is exhausted.
+static bool rtp_jitbuf_get_block(rtp_jitbuf_t *j, const int pos) {
+    if (j->buf[pos] != NULL) {
+        return true;
     }
+    j->buf[pos] = rtp_slab_alloc(j->slab);
+    if (j->buf[pos] == NULL) {
+        return false;
+    }
+    j->held[pos / 32] |= (uint32_t)1 << (pos % 32);
+    return true;
+}
 
-    if (ssrc != j->ssrc) {
-        return ESP_OK;
+// Hand back the block of slot pos to the slab, along with the data in it.
+static void rtp_jitbuf_put_block(rtp_jitbuf_t *j, const int pos) {
+    assert(!rtp_jitbuf_slot_occupied(j, pos));
+    rtp_slab_free(j->slab, j->buf[pos]);
+    j->buf[pos] = NULL;
+    j->slots[pos].sz = 0;
+    j->held[pos / 32] &= ~((uint32_t)1 << (pos % 32));
+}
+
+// Whether to keep the data of packets after handing them out, for FEC to recover others from.
+static bool rtp_jitbuf_keeps_data(const rtp_jitbuf_t *j) {
+    return j->fec_payload_type != 0 && j->fec_received > 0;
+}
+
+static void rtp_jitbuf_place(rtp_jitbuf_t *j, const rtp_packet_view_t *v,
+                             const int64_t arrival_us, const bool rescued) {
+    const int pos = rtp_jitbuf_slot(v->sequence_number);
+    assert(!rtp_jitbuf_slot_occupied(j, pos));
+    assert(v->sz <= CONFIG_RTP_JITBUF_CAP_PACKET_SIZE_BYTES);
+    // The block was reserved by rtp_jitbuf_insert(), but may have been handed back since.
+    const bool have_block __attribute__((unused)) = rtp_jitbuf_get_block(j, pos);
+    assert(have_block);
+    memcpy(j->buf[pos], v->buf, v->sz);
+    j->stats.bytes_copied += v->sz;
+
+    rtp_jitbuf_slot_t *slot = &j->slots[pos];
+    slot->rescued = rescued;
+    slot->seq = v->sequence_number;
+    slot->sz = v->sz;
+    slot->payload_offset = v->payload - v->buf;
+    slot->payload_sz = v->payload_sz;
+    slot->arrival_us = arrival_us;
+    slot->timestamp = v->timestamp;
+    slot->jpeg_fragment_offset = v->jpeg_fragment_offset;
+    slot->marker = v->marker;
+    slot->payload_type = v->payload_type;
+
+    j->occupied[pos / 32] |= (uint32_t)1 << (pos % 32);
+    j->n_packets++;
+}
+
+/**
+ * Clear n consecutive slots starting at first, wrapping around, and hand back their blocks.
+ * Works on whole bitmap words, so the cost does not depend on n, only on the number of blocks.
+ * Returns the number of packets dropped.
+ */
+static int rtp_jitbuf_clear_slots(rtp_jitbuf_t *j, const int first, const int n) {
+    assert(n >= 0 && n <= CONFIG_RTP_JITBUF_CAP_N_PACKETS);
+    int dropped = 0;
+    int pos = first;
+    int left = n;
+    while (left > 0) {
+        const int bit = pos % 32;
+        int span = 32 - bit;
+        if (span > CONFIG_RTP_JITBUF_CAP_N_PACKETS - pos) {
+            span = CONFIG_RTP_JITBUF_CAP_N_PACKETS - pos;
+        }
+        if (span > left) {
+            span = left;
+        }
+        const uint32_t mask = (span == 32 ? UINT32_MAX : (((uint32_t)1 << span) - 1)) << bit;
+        dropped += __builtin_popcount(j->occupied[pos / 32] & mask);
+        j->occupied[pos / 32] &= ~mask;
+        for (uint32_t held = j->held[pos / 32] & mask; held != 0; held &= held - 1) {
+            rtp_jitbuf_put_block(j, (pos / 32) * 32 + __builtin_ctz(held));
+        }
+
+        left -= span;
+        pos = (pos + span) & RTP_JITBUF_SLOT_MASK;
     }
 
-    if (sz > CONFIG_RTP_JITBUF_CAP_PACKET_SIZE_BYTES) {
-        return ESP_ERR_INVALID_SIZE;
+    j->n_packets -= dropped;
+    assert(j->n_packets >= 0);
+    return dropped;
+}
+
+// Drop all packets and forget the sequence number history.
+static void rtp_jitbuf_reset(rtp_jitbuf_t *j) {
+    rtp_jitbuf_clear_slots(j, 0, CONFIG_RTP_JITBUF_CAP_N_PACKETS);
+    assert(j->n_packets == 0);
+    for (int i = 0; i < CONFIG_RTP_JITBUF_FEC_CAP_N_PACKETS; i++) {
+        rtp_jitbuf_fec_drop(j, &j->fec[i]);
+    }
+    j->max_seq = 0;
+    j->max_seq_out = -1;
+}
+
+void rtp_jitbuf_destroy(rtp_jitbuf_t *j) {
+    assert(j != NULL);
+    j->lent_pos = -1;
+    rtp_jitbuf_reset(j);
+}
+
+/**
+ * Update the jitter and reorder depth estimates with a received packet, then adapt.
+ * The jitter estimator is the one from RFC 3550 Appendix A.8, with the arrival time converted to
+ * RTP timestamp units.
+ * Retransmitted packets are only counted as received.
+ */
+static void rtp_jitbuf_estimate(rtp_jitbuf_t *j, const rtp_packet_view_t *v,
+                                const int64_t arrival_us, const bool retransmitted) {
+    j->received++;
+    if (retransmitted) {
+        // Arrives late on purpose, which says nothing about jitter or reordering on the path.
+        return;
     }
 
-    ESP_LOGD(TAG, "->jitbuf state max_seq=%hu buf_top=%d", j->max_seq, j->buf_top);
-    ESP_LOGD(TAG, "->jitbuf new packet seq=%hu", sequence_number);
+    // In two steps, as epoch times like those of the Linux receiver overflow the product.
+    const uint32_t arrival = (uint32_t)(arrival_us * (RTP_PT_CLOCKRATE_JPEG / 1000) / 1000);
+    const uint32_t transit = arrival - v->timestamp;
+    if (j->have_transit) {
+        int32_t d = (int32_t)(transit - j->last_transit);
+        if (d < 0) {
+            d = -d;
+        }
+        j->jitter_q4 += d - ((j->jitter_q4 + 8) >> 4);
+    }
+    j->last_transit = transit;
+    j->have_transit = true;
+
+    const int32_t behind =
+        j->highest_seq < 0 ? 0 : seqnum_compare(v->sequence_number, (uint16_t)j->highest_seq);
+    if (j->highest_seq < 0 || behind >= JITBUF_MAX_MISORDER) {
+        // First packet, or a sequence discontinuity, start over.
+        j->highest_seq = v->sequence_number;
+        j->base_seq = v->sequence_number;
+        j->cycles = 0;
+        j->received = 1;
+    } else {
+        if (behind < 0) {
+            if (v->sequence_number < j->highest_seq) {
+                // Wrapped around.
+                j->cycles += 1 << 16;
+            }
+            j->highest_seq = v->sequence_number;
+        } else if (behind > j->reorder_depth && behind < CONFIG_RTP_JITBUF_CAP_N_PACKETS) {
+            // Deeper reordering cannot be absorbed by the buffer anyway, e.g. late retransmissions.
+            j->reorder_depth = behind;
+            j->reorder_decay = JITBUF_REORDER_DECAY_PACKETS;
+        }
+        if (behind > j->stats.max_reorder_depth) {
+            j->stats.max_reorder_depth = behind;
+        }
+    }
+    if (--j->reorder_decay <= 0) {
+        if (j->reorder_depth > 0) {
+            j->reorder_depth--;
+        }
+        j->reorder_decay = JITBUF_REORDER_DECAY_PACKETS;
+    }
+
+    rtp_jitbuf_adapt(j);
+}
+
+// See rtp_jitbuf_insert(), the slot of the packet has a block.
+static bool rtp_jitbuf_insert_in_window(rtp_jitbuf_t *j, const rtp_packet_view_t *v,
+                                        const int64_t arrival_us, const bool rescued) {
+    const uint16_t sequence_number = v->sequence_number;
+
+    RTP_LOGD(TAG, "->jitbuf state max_seq=%hu n_packets=%d", j->max_seq, j->n_packets);
+    RTP_LOGD(TAG, "->jitbuf new packet seq=%hu", sequence_number);
+
+    if (j->max_seq_out >= 0) {
+        const int32_t since_out = seqnum_compare((uint16_t)j->max_seq_out, sequence_number);
+        if (since_out <= 0 && since_out > -JITBUF_MAX_MISORDER) {
+            RTP_LOGD(TAG,
+                     "->jitbuf dropping incoming packet which is too late seq=%" PRIu16
+                     " max_seq_out=%" PRId32,
+                     sequence_number, j->max_seq_out);
+            j->stats.late++;
+            return false;
+        }
+        if (since_out <= 0) {
+            RTP_LOGD(TAG, "->jitbuf seq jumped back by %" PRId32 ", reset", -since_out);
+            j->stats.evicted += j->n_packets;
+            rtp_jitbuf_reset(j);
+        }
+    }
 
     // Buffer is empty -> place at start.
-    if (j->buf_top < 0) {
-        ESP_LOGD(TAG, "->jitbuf empty, place at start");
-        assert(j->max_seq == 0);
+    if (j->n_packets == 0) {
+        RTP_LOGD(TAG, "->jitbuf empty, place at start");
         j->max_seq = sequence_number;
-        j->buf_top = 0;
-        assert(sz <= CONFIG_RTP_JITBUF_CAP_PACKET_SIZE_BYTES);
-        memcpy(j->buf[j->buf_top], buf, sz);
-        j->buf_szs[j->buf_top] = sz;
-        return ESP_OK;
+        rtp_jitbuf_place(j, v, arrival_us, rescued);
+        return true;
     }
 
     // Figure out where to place the new packet relative to the current newest one.
     const int32_t advance = seqnum_compare(j->max_seq, sequence_number);
-    ESP_LOGD(TAG, "->jitbuf advance %" PRId32, advance);
+    RTP_LOGD(TAG, "->jitbuf advance %" PRId32, advance);
 
     if (advance == 0) {
         // Duplicate, drop.
-        return ESP_OK;
+        j->stats.duplicates++;
+        return false;
     }
 
-    if (advance > 0) {
-        for (int32_t i = 0; i < advance; i++) {
-            j->buf_top = (j->buf_top + 1) % CONFIG_RTP_JITBUF_CAP_N_PACKETS;
-            if (j->buf_szs[j->buf_top] > 0) {
-                ESP_LOGD(TAG, "->jitbuf dropping packet from end of buffer at %d", j->buf_top);
-                memset(j->buf[j->buf_top], 0, j->buf_szs[j->buf_top]);
-                j->buf_szs[j->buf_top] = 0;
-            }
+    if (advance >= CONFIG_RTP_JITBUF_CAP_N_PACKETS) {
+        // All packets in the buffer fall out of the window, drop them all at once.
+        RTP_LOGD(TAG, "->jitbuf jump by %" PRId32 ", dropping %d packets", advance, j->n_packets);
+        j->stats.evicted += rtp_jitbuf_clear_slots(j, 0, CONFIG_RTP_JITBUF_CAP_N_PACKETS);
+        j->max_seq = sequence_number;
+        rtp_jitbuf_place(j, v, arrival_us, rescued);
+        return true;
+    }
 
-            // No need to circle around more than that.
-            if (i > CONFIG_RTP_JITBUF_CAP_N_PACKETS) {
-                continue;
-            }
-        }
+    if (advance > 0) {
+        // Drop the packets which fall out of the window at its end.
+        const int dropped = rtp_jitbuf_clear_slots(j, rtp_jitbuf_slot(j->max_seq + 1), advance);
+        RTP_LOGD(TAG, "->jitbuf dropped %d packets from end of buffer", dropped);
+        j->stats.evicted += dropped;
 
-        ESP_LOGD(TAG, "->jitbuf place packet at %d", j->buf_top);
+        RTP_LOGD(TAG, "->jitbuf place packet at %d", rtp_jitbuf_slot(sequence_number));
         j->max_seq = sequence_number;
-        assert(sz <= CONFIG_RTP_JITBUF_CAP_PACKET_SIZE_BYTES);
-        memcpy(j->buf[j->buf_top], buf, sz);
-        assert(j->buf_szs[j->buf_top] == 0);
-        j->buf_szs[j->buf_top] = sz;
-
-        return ESP_OK;
+        rtp_jitbuf_place(j, v, arrival_us, rescued);
+        return true;
     }
 
     if (advance <= -CONFIG_RTP_JITBUF_CAP_N_PACKETS) {
         // Too old, drop.
-        ESP_LOGD(TAG,
+        RTP_LOGD(TAG,
                  "->jitbuf dropping incoming packet which is too late seq=%" PRIu16
                  " diff=%" PRId32,
                  sequence_number, advance);
-        return ESP_OK;
+        j->stats.late++;
+        return false;
     }
 
     // Place the packet somewhere in the middle.
-    const int pos = mod(j->buf_top + advance, CONFIG_RTP_JITBUF_CAP_N_PACKETS);
-    ESP_LOGD(TAG, "->jitbuf older packet seq=%" PRIu16 " diff=%" PRId32 " placing at %d",
+    const int pos = rtp_jitbuf_slot(sequence_number);
+    RTP_LOGD(TAG, "->jitbuf older packet seq=%" PRIu16 " diff=%" PRId32 " placing at %d",
              sequence_number, advance, pos);
-    if (j->buf_szs[pos] != 0) {
-        ESP_LOGD(TAG, "->jitbuf dropping older duplicate packet seq=%" PRIu16 " diff=%" PRId32,
+    if (rtp_jitbuf_slot_occupied(j, pos)) {
+        RTP_LOGD(TAG, "->jitbuf dropping older duplicate packet seq=%" PRIu16 " diff=%" PRId32,
                  sequence_number, advance);
+        j->stats.duplicates++;
+        return false;
+    }
+    rtp_jitbuf_place(j, v, arrival_us, rescued);
+    return true;
+}
+
+/**
+ * Place a packet in the buffer, unless it is too late or a duplicate, or the slab is exhausted.
+ * Returns whether it was placed.
+ */
+static bool rtp_jitbuf_insert(rtp_jitbuf_t *j, const rtp_packet_view_t *v,
+                              const int64_t arrival_us, const bool rescued) {
+    // Reserve a block before changing any state, so that placing the packet cannot fail.
+    const int pos = rtp_jitbuf_slot(v->sequence_number);
+    if (!rtp_jitbuf_get_block(j, pos)) {
+        RTP_LOGD(TAG, "->jitbuf slab exhausted, dropping seq=%" PRIu16, v->sequence_number);
+        j->slab_exhausted++;
+        return false;
+    }
+    const bool placed = rtp_jitbuf_insert_in_window(j, v, arrival_us, rescued);
+    if (!placed && j->buf[pos] != NULL && j->slots[pos].sz == 0) {
+        // Not needed after all.
+        rtp_jitbuf_put_block(j, pos);
+    }
+    return placed;
+}
+
+/**
+ * Returns the slot with the data of packet seq, or NULL if we do not have it.
+ * Packets which were already handed out still count, until their slot is reused.
+ */
+static const rtp_jitbuf_slot_t *rtp_jitbuf_find_data(const rtp_jitbuf_t *j, const uint16_t seq) {
+    const int32_t behind = seqnum_compare(seq, j->max_seq);
+    if (behind < 0 || behind >= CONFIG_RTP_JITBUF_CAP_N_PACKETS) {
+        return NULL;
+    }
+    const rtp_jitbuf_slot_t *slot = &j->slots[rtp_jitbuf_slot(seq)];
+    return slot->sz > 0 && slot->seq == seq ? slot : NULL;
+}
+
+/**
+ * Recover the packet protected by a stored FEC packet, if it is the only one missing.
+ * The recovered packet is assembled in f->buf, which consumes the FEC packet.
+ * Returns whether f should be kept, i.e. it may still help once more packets arrive.
+ */
+static bool rtp_jitbuf_fec_apply(rtp_jitbuf_t *j, rtp_jitbuf_fec_slot_t *f, const int64_t now_us) {
+    const uint8_t *pkts[RTP_FEC_MAX_PROTECTED];
+    ptrdiff_t szs[RTP_FEC_MAX_PROTECTED];
+    int n = 0;
+    int n_missing = 0;
+    uint16_t missing = 0;
+    for (uint64_t m = f->fec.mask; m != 0; m &= m - 1) {
+        const uint16_t seq = f->fec.sn_base + __builtin_ctzll(m);
+        if (seqnum_compare(seq, j->max_seq) >= CONFIG_RTP_JITBUF_CAP_N_PACKETS) {
+            // Out of the window, the data is gone or will be soon.
+            return false;
+        }
+        const rtp_jitbuf_slot_t *slot = rtp_jitbuf_find_data(j, seq);
+        if (slot != NULL) {
+            pkts[n] = j->buf[slot - j->slots];
+            szs[n] = slot->sz;
+            n++;
+        } else if (++n_missing > 1) {
+            return true;
+        } else {
+            missing = seq;
+        }
+    }
+    if (n_missing == 0 ||
+        (j->max_seq_out >= 0 && seqnum_compare((uint16_t)j->max_seq_out, missing) <= 0)) {
+        // Nothing to recover, or too late.
+        return false;
+    }
+
+    const ptrdiff_t sz = rtp_fec_recover(&f->fec, pkts, szs, n, missing, j->ssrc, f->buf,
+                                         RTP_JITBUF_BLOCK_SIZE_BYTES);
+    rtp_packet_view_t v;
+    if (sz == 0 || sz > CONFIG_RTP_JITBUF_CAP_PACKET_SIZE_BYTES ||
+        parse_rtp_packet_view(f->buf, sz, &v) != ESP_OK) {
+        RTP_LOGD(TAG, "->jitbuf failed to recover seq=%" PRIu16 " from FEC", missing);
+        return false;
+    }
+    if (rtp_jitbuf_insert(j, &v, now_us, true)) {
+        RTP_LOGD(TAG, "->jitbuf recovered seq=%" PRIu16 " from FEC", missing);
+        j->fec_recovered++;
+        // No need to wait for a retransmission anymore.
+        rtp_jitbuf_nack_t *nack = rtp_jitbuf_nack(j, missing);
+        if (nack->seq == missing) {
+            nack->count = 0;
+        }
+    }
+    return false;
+}
+
+// Forget a stored FEC packet and hand back its block.
+static void rtp_jitbuf_fec_drop(rtp_jitbuf_t *j, rtp_jitbuf_fec_slot_t *f) {
+    f->valid = false;
+    if (f->buf != NULL) {
+        rtp_slab_free(j->slab, f->buf);
+        f->buf = NULL;
+    }
+}
+
+// Try all stored FEC packets, after a packet was placed.
+static void rtp_jitbuf_fec_apply_all(rtp_jitbuf_t *j, const int64_t now_us) {
+    for (int i = 0; i < CONFIG_RTP_JITBUF_FEC_CAP_N_PACKETS; i++) {
+        if (j->fec[i].valid && !rtp_jitbuf_fec_apply(j, &j->fec[i], now_us)) {
+            rtp_jitbuf_fec_drop(j, &j->fec[i]);
+        }
+    }
+}
+
+/**
+ * Store a FEC packet, replacing the oldest one if full, and apply it.
+ * Also measures the protection group, for adapting the window and wait budget.
+ */
+static esp_err_t rtp_jitbuf_feed_fec(rtp_jitbuf_t *j, const rtp_packet_view_t *v,
+                                     const int64_t arrival_us) {
+    rtp_jitbuf_fec_slot_t *f = &j->fec[0];
+    for (int i = 0; i < CONFIG_RTP_JITBUF_FEC_CAP_N_PACKETS && f->valid; i++) {
+        if (!j->fec[i].valid || j->fec[i].arrival_us < f->arrival_us) {
+            f = &j->fec[i];
+        }
+    }
+    if (v->sz > RTP_JITBUF_BLOCK_SIZE_BYTES) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (f->buf == NULL && (f->buf = rtp_slab_alloc(j->slab)) == NULL) {
+        j->slab_exhausted++;
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(f->buf, v->buf, v->sz);
+    j->stats.bytes_copied += v->sz;
+    const esp_err_t err = parse_rtp_fec(&f->buf[v->payload - v->buf], v->payload_sz, &f->fec);
+    if (err != ESP_OK || f->fec.mask == 0) {
+        rtp_jitbuf_fec_drop(j, f);
+        return err;
+    }
+    f->valid = true;
+    f->arrival_us = arrival_us;
+    j->fec_received++;
+
+    int64_t first_arrival_us = INT64_MAX;
+    for (uint64_t m = f->fec.mask; m != 0; m &= m - 1) {
+        const rtp_jitbuf_slot_t *slot =
+            rtp_jitbuf_find_data(j, f->fec.sn_base + __builtin_ctzll(m));
+        if (slot != NULL && slot->arrival_us < first_arrival_us) {
+            first_arrival_us = slot->arrival_us;
+        }
+    }
+    if (first_arrival_us != INT64_MAX) {
+        j->fec_delay_us +=
+            (arrival_us - first_arrival_us - j->fec_delay_us) / JITBUF_FEC_DELAY_SMOOTHING;
+    }
+    j->fec_span = 64 - __builtin_clzll(f->fec.mask);
+    rtp_jitbuf_adapt(j);
+
+    if (!rtp_jitbuf_fec_apply(j, f, arrival_us)) {
+        rtp_jitbuf_fec_drop(j, f);
+    }
+    return ESP_OK;
+}
+
+// See rtp_jitbuf_feed(), *placed is set if a media packet was placed and FEC is to be applied.
+static esp_err_t rtp_jitbuf_feed_one(rtp_jitbuf_t *j, const uint8_t *buf, const ptrdiff_t sz,
+                                     const int64_t arrival_us, bool *placed) {
+    assert(j->lent_pos < 0);
+
+    rtp_packet_view_t v;
+    esp_err_t err = parse_rtp_packet_view(buf, sz, &v);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    if (j->fec_payload_type != 0 && v.payload_type == j->fec_payload_type &&
+        v.ssrc == j->fec_ssrc) {
+        return rtp_jitbuf_feed_fec(j, &v, arrival_us);
+    }
+    if (v.ssrc != j->ssrc) {
         return ESP_OK;
     }
-    assert(sz <= CONFIG_RTP_JITBUF_CAP_PACKET_SIZE_BYTES);
-    memcpy(j->buf[pos], buf, sz);
-    j->buf_szs[pos] = sz;
+    const uint16_t sequence_number = v.sequence_number;
 
+    j->stats.fed++;
+    if (sz > CONFIG_RTP_JITBUF_CAP_PACKET_SIZE_BYTES) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    const bool retransmitted = rtp_jitbuf_nack_pending(j, sequence_number);
+    rtp_jitbuf_estimate(j, &v, arrival_us, retransmitted);
+    if (retransmitted) {
+        // Sample the round trip even if the retransmission is too late, so a long one gets
+        // learned. Only if the NACK was not repeated, as we cannot tell which one the
+        // retransmission answers (Karn's algorithm).
+        rtp_jitbuf_nack_t *nack = rtp_jitbuf_nack(j, sequence_number);
+        if (nack->count == 1) {
+            j->rtt_us += (arrival_us - nack->first_us - j->rtt_us) / 8;
+        }
+        nack->count = 0;
+    }
+
+    const uint32_t slab_exhausted = j->slab_exhausted;
+    if (!rtp_jitbuf_insert(j, &v, arrival_us, retransmitted)) {
+        return j->slab_exhausted != slab_exhausted ? ESP_ERR_NO_MEM : ESP_OK;
+    }
+    if (retransmitted) {
+        j->rescued++;
+    }
+    *placed = true;
     return ESP_OK;
 }
 
-static int rtp_jitbuf_find_oldest_packet(rtp_jitbuf_t *j) {
-    if (j->buf_top < 0) {
-        return -1;
+esp_err_t rtp_jitbuf_feed(rtp_jitbuf_t *j, const uint8_t *buf, const ptrdiff_t sz,
+                          const int64_t arrival_us) {
+    FAKESP_TRACE_BEGIN(rtp_jitbuf_feed);
+    bool placed = false;
+    const esp_err_t err = rtp_jitbuf_feed_one(j, buf, sz, arrival_us, &placed);
+    if (placed) {
+        rtp_jitbuf_fec_apply_all(j, arrival_us);
     }
+    FAKESP_TRACE_END(rtp_jitbuf_feed);
+    return err;
+}
+
+static int rtp_jitbuf_find_oldest_packet(const rtp_jitbuf_t *j);
+
+// Whether placing a packet would push buffered packets out of the window, before they could be
+// handed out.
+static bool rtp_jitbuf_pushes_out(const rtp_jitbuf_t *j, const uint8_t *buf, const ptrdiff_t sz) {
+    uint16_t sequence_number;
+    uint32_t ssrc;
+    if (j->n_packets == 0 || partial_parse_rtp_packet(buf, sz, &sequence_number, &ssrc) != ESP_OK ||
+        ssrc != j->ssrc || (j->fec_payload_type != 0 && (buf[1] & 0x7F) == j->fec_payload_type)) {
+        return false;
+    }
+    const uint16_t oldest = rtp_jitbuf_slot_seq(j, rtp_jitbuf_find_oldest_packet(j));
+    return seqnum_compare(oldest, sequence_number) >= CONFIG_RTP_JITBUF_CAP_N_PACKETS;
+}
+
+int rtp_jitbuf_feed_batch(rtp_jitbuf_t *j, const rtp_jitbuf_packet_t *pkts, const int n) {
+    FAKESP_TRACE_SCOPE(rtp_jitbuf_feed_batch);
+    assert(j != NULL);
+    assert(pkts != NULL || n == 0);
+    bool placed = false;
+    int i = 0;
+    for (; i < n; i++) {
+        if (i > 0 && rtp_jitbuf_pushes_out(j, pkts[i].buf, pkts[i].sz)) {
+            break;
+        }
+        if (i + 1 < n) {
+            // The header of the next packet is likely not in cache yet.
+            __builtin_prefetch(pkts[i + 1].buf);
+        }
+        if (rtp_jitbuf_feed_one(j, pkts[i].buf, pkts[i].sz, pkts[i].arrival_us, &placed) !=
+            ESP_OK) {
+            RTP_LOGD(TAG, "->jitbuf dropping packet %d of batch", i);
+        }
+    }
+    if (placed) {
+        rtp_jitbuf_fec_apply_all(j, pkts[i - 1].arrival_us);
+    }
+    return i;
+}
 
-    // We start searching one after buf_top.
-    for (int i = 1; i <= CONFIG_RTP_JITBUF_CAP_N_PACKETS; i++) {
-        const int pos = (j->buf_top + i) % CONFIG_RTP_JITBUF_CAP_N_PACKETS;
-        if (j->buf_szs[pos] <= 0) {
+int rtp_jitbuf_get_nacks(rtp_jitbuf_t *j, const int64_t now_us, uint16_t *out, const int n) {
+    assert(j != NULL);
+    assert(out != NULL);
+    if (CONFIG_RTP_JITBUF_NACK_MAX_RETRIES <= 0 || j->n_packets == 0 || j->max_seq_out < 0) {
+        return 0;
+    }
+
+    // Missing packets which could still be handed out in order: after max_seq_out and within the
+    // window, excluding the newest reorder_depth ones which may just be reordered.
+    const uint16_t window_start = j->max_seq - CONFIG_RTP_JITBUF_CAP_N_PACKETS + 1;
+    uint16_t first = (uint16_t)(j->max_seq_out + 1);
+    if (seqnum_compare(first, window_start) > 0) {
+        first = window_start;
+    }
+    const int32_t count = seqnum_compare(first, j->max_seq) - j->reorder_depth;
+
+    const int32_t retry_us =
+        j->rtt_us > JITBUF_NACK_MIN_INTERVAL_US ? j->rtt_us : JITBUF_NACK_MIN_INTERVAL_US;
+    int written = 0;
+    for (int32_t i = 0; i < count && written < n; i++) {
+        const uint16_t seq = first + i;
+        const int pos = rtp_jitbuf_slot(seq);
+        if (rtp_jitbuf_slot_occupied(j, pos)) {
             continue;
         }
-        return pos;
+        rtp_jitbuf_nack_t *nack = rtp_jitbuf_nack(j, seq);
+        if (nack->seq != seq) {
+            // State left over from an older packet.
+            nack->seq = seq;
+            nack->count = 0;
+        }
+        if (nack->count >= CONFIG_RTP_JITBUF_NACK_MAX_RETRIES ||
+            (nack->count > 0 && now_us - nack->last_us < retry_us)) {
+            continue;
+        }
+        if (nack->count == 0) {
+            nack->first_us = now_us;
+        }
+        nack->last_us = now_us;
+        nack->count++;
+        j->nacked++;
+        out[written++] = seq;
+    }
+    if (written > 0) {
+        RTP_LOGD(TAG, "jitbuf-> NACK %d packets from seq=%" PRIu16, written, out[0]);
+    }
+    return written;
+}
+
+/**
+ * Find the slot holding the packet with the lowest sequence number.
+ * Slots are ordered by sequence number starting one after max_seq, wrapping around, so this is a
+ * find-first-set on the rotated occupancy bitmap.
+ * Returns -1 if the buffer is empty.
+ */
+static int rtp_jitbuf_find_oldest_packet(const rtp_jitbuf_t *j) {
+    if (j->n_packets <= 0) {
+        return -1;
+    }
+
+    const int start = rtp_jitbuf_slot(j->max_seq + 1);
+    const int w0 = start / 32;
+    const uint32_t above = j->occupied[w0] & (UINT32_MAX << (start % 32));
+    if (above != 0) {
+        return w0 * 32 + __builtin_ctz(above);
+    }
+
+    // The last iteration revisits w0, for the bits below start.
+    for (int i = 1; i <= RTP_JITBUF_BITMAP_WORDS; i++) {
+        const int w = (w0 + i) % RTP_JITBUF_BITMAP_WORDS;
+        if (j->occupied[w] != 0) {
+            return w * 32 + __builtin_ctz(j->occupied[w]);
+        }
     }
 
     // This should never happen, because we should have returned above already.
@@ -208,76 +915,148 @@ static int rtp_jitbuf_find_oldest_packet(rtp_jitbuf_t *j) {
     return -1;
 }
 
-static ptrdiff_t rtp_jitbuf_hand_out_buffer(rtp_jitbuf_t *j, const int pos,
-                                            const uint16_t sequence_number, uint8_t *buf,
-                                            const ptrdiff_t sz) {
-    ESP_LOGV(TAG, "jitbuf-> hand out buffer %d len=%ld", pos, (long)j->buf_szs[pos]);
-    j->max_seq_out = sequence_number;
+/**
+ * If a NACK for the missing packet seq is outstanding, returns until when to wait for its
+ * retransmission before handing out the packet in slot pos after it: one round trip after the
+ * latest NACK, but no more than one round trip after the packet would be handed out otherwise.
+ * Returns INT64_MIN if there is nothing to wait for.
+ */
+static int64_t rtp_jitbuf_nack_hold_until(const rtp_jitbuf_t *j, const uint16_t seq,
+                                          const int pos) {
+    const int32_t behind = seqnum_compare(seq, j->max_seq);
+    if (behind <= 0 || behind >= CONFIG_RTP_JITBUF_CAP_N_PACKETS ||
+        !rtp_jitbuf_nack_pending(j, seq)) {
+        return INT64_MIN;
+    }
+    const int64_t hold_until_us = j->nacks[seq & (RTP_JITBUF_NACK_HISTORY - 1)].last_us +
+                                  j->rtt_us + j->rtt_us / 4;
+    const int64_t max_hold_until_us = j->slots[pos].arrival_us + j->wait_us + j->rtt_us;
+    return hold_until_us < max_hold_until_us ? hold_until_us : max_hold_until_us;
+}
 
-    // Copy out.
-    if (sz < CONFIG_RTP_JITBUF_CAP_PACKET_SIZE_BYTES) {
-        return 0;
+// Returns the slot of the packet to hand out next, or -1 if we should wait for more packets.
+static int rtp_jitbuf_next_slot(const rtp_jitbuf_t *j, const int64_t now_us) {
+    RTP_LOGD(TAG, "jitbuf-> state max_seq=%" PRIu16 " n_packets=%d max_seq_out=%" PRId32,
+             j->max_seq, j->n_packets, j->max_seq_out);
+
+    const int pos = rtp_jitbuf_find_oldest_packet(j);
+    if (pos < 0) {
+        RTP_LOGV(TAG, "jitbuf-> is empty");
+        return -1;
     }
-    assert(pos >= 0 && pos < CONFIG_RTP_JITBUF_CAP_N_PACKETS);
-    const ptrdiff_t ret = j->buf_szs[pos];
-    memcpy(buf, j->buf[pos], j->buf_szs[pos]);
 
-    // Delete buf slot.
-    assert(j->buf_szs[pos] <= CONFIG_RTP_JITBUF_CAP_PACKET_SIZE_BYTES);
-    memset(j->buf[pos], 0, j->buf_szs[pos]);
-    j->buf_szs[pos] = 0;
+    const uint16_t sequence_number = rtp_jitbuf_slot_seq(j, pos);
+    RTP_LOGV(TAG, "jitbuf-> consider packet at %d seq=%hu", pos, sequence_number);
 
-    if (sequence_number == j->max_seq) {
-        // We just handed out the last buffer.
+    const uint16_t next_seq = (uint16_t)(j->max_seq_out + 1);
+    if (j->max_seq_out < 0 || sequence_number == next_seq) {
+        RTP_LOGD(TAG, "jitbuf-> hand out packet next in seq");
+        return pos;
+    }
 
-        ESP_LOGD(TAG, "jitbuf-> is now empty, cleanup");
+    // A retransmission of the next packet is on its way, only the hard limits apply.
+    const bool holding = now_us < rtp_jitbuf_nack_hold_until(j, next_seq, pos);
 
-        j->max_seq = 0;
-        j->buf_top = -1;
+    // Window is full, hand out the oldest packet.
+    const int32_t span = seqnum_compare(sequence_number, j->max_seq) + 1;
+    if (span >= j->window && !holding) {
+        RTP_LOGD(TAG, "jitbuf-> hand out packet because window is full pos=%d span=%" PRId32, pos,
+                 span);
+        return pos;
+    }
 
-        for (int i = 0; i < CONFIG_RTP_JITBUF_CAP_N_PACKETS; i++) {
-            assert(j->buf_szs[i] == 0);
-        }
+    // The next packet in sequence would be dropped as too old, no point in waiting for it.
+    const uint16_t window_start = j->max_seq - CONFIG_RTP_JITBUF_CAP_N_PACKETS + 1;
+    if (seqnum_compare(next_seq, window_start) > 0) {
+        RTP_LOGD(TAG, "jitbuf-> hand out packet because seq=%" PRIu16 " is out of window",
+                 next_seq);
+        return pos;
     }
 
-    return ret;
+    // Waited long enough for the missing packets, give up on them.
+    const int64_t waited_us = now_us - j->slots[pos].arrival_us;
+    if (j->wait_us > 0 && waited_us >= j->wait_us && !holding) {
+        RTP_LOGD(TAG, "jitbuf-> hand out packet because it waited %" PRId32 "us",
+                 (int32_t)waited_us);
+        return pos;
+    }
+
+    RTP_LOGV(TAG, "jitbuf-> nothing to hand out pos=%d seq=%hu", pos, sequence_number);
+    return -1;
 }
 
-ptrdiff_t rtp_jitbuf_retrieve(rtp_jitbuf_t *j, uint8_t *buf, const ptrdiff_t sz) {
-    ESP_LOGD(TAG, "jitbuf-> state max_seq=%" PRIu16 " buf_top=%d max_seq_out=%" PRId32, j->max_seq,
-             j->buf_top, j->max_seq_out);
+ptrdiff_t rtp_jitbuf_peek_next(rtp_jitbuf_t *j, const int64_t now_us, rtp_packet_view_t *out) {
+    assert(j != NULL);
+    assert(out != NULL);
 
-    const int pos = rtp_jitbuf_find_oldest_packet(j);
+    if (j->lent_pos < 0) {
+        j->lent_pos = rtp_jitbuf_next_slot(j, now_us);
+    }
+    const int pos = j->lent_pos;
     if (pos < 0) {
-        ESP_LOGV(TAG, "jitbuf-> is empty");
         return 0;
     }
 
-    // Parse the candidate.
-    uint16_t sequence_number = 0;
-    uint32_t ssrc = 0;
-    const esp_err_t err =
-        partial_parse_rtp_packet(j->buf[pos], j->buf_szs[pos], &sequence_number, &ssrc);
-    if (err != ESP_OK) {
-        // This should never happen, we parse before placing them in buf.
-        assert(false);
-        return 0;
+    const rtp_jitbuf_slot_t *slot = &j->slots[pos];
+    RTP_LOGV(TAG, "jitbuf-> lend out buffer %d len=%d", pos, (int)slot->sz);
+    assert(rtp_jitbuf_slot_occupied(j, pos));
+    out->marker = slot->marker;
+    out->payload_type = slot->payload_type;
+    out->sequence_number = rtp_jitbuf_slot_seq(j, pos);
+    out->timestamp = slot->timestamp;
+    out->ssrc = j->ssrc;
+    out->jpeg_fragment_offset = slot->jpeg_fragment_offset;
+    out->rescued = slot->rescued;
+    out->arrival_us = slot->arrival_us;
+    out->buf = j->buf[pos];
+    out->sz = slot->sz;
+    out->payload = &j->buf[pos][slot->payload_offset];
+    out->payload_sz = slot->payload_sz;
+    return slot->sz;
+}
+
+void rtp_jitbuf_release(rtp_jitbuf_t *j) {
+    assert(j != NULL);
+    const int pos = j->lent_pos;
+    if (pos < 0) {
+        return;
     }
 
-    ESP_LOGV(TAG, "jitbuf-> consider packet at %d seq=%hu", pos, sequence_number);
+    assert(pos < CONFIG_RTP_JITBUF_CAP_N_PACKETS);
+    assert(rtp_jitbuf_slot_occupied(j, pos));
+    const uint16_t seq = rtp_jitbuf_slot_seq(j, pos);
+    if (j->max_seq_out >= 0 && seq != (uint16_t)(j->max_seq_out + 1)) {
+        j->stats.gap_releases++;
+    }
+    j->max_seq_out = seq;
+    j->lent_pos = -1;
+    j->occupied[pos / 32] &= ~((uint32_t)1 << (pos % 32));
+    j->n_packets--;
+    if (!rtp_jitbuf_keeps_data(j)) {
+        rtp_jitbuf_put_block(j, pos);
+    }
 
-    if (j->max_seq_out < 0 || sequence_number == j->max_seq_out + 1) {
-        ESP_LOGD(TAG, "jitbuf-> hand out packet next in seq");
-        return rtp_jitbuf_hand_out_buffer(j, pos, sequence_number, buf, sz);
+    if (j->n_packets == 0) {
+        RTP_LOGD(TAG, "jitbuf-> is now empty");
     }
+}
 
-    // Buffer is full, hand out the last packet.
-    if (mod(pos - 1, CONFIG_RTP_JITBUF_CAP_N_PACKETS) == j->buf_top) {
-        ESP_LOGD(TAG, "jitbuf-> hand out packet because buffer is full pos=%d top=%d", pos,
-                 j->buf_top);
-        return rtp_jitbuf_hand_out_buffer(j, pos, sequence_number, buf, sz);
+ptrdiff_t rtp_jitbuf_retrieve(rtp_jitbuf_t *j, const int64_t now_us, uint8_t *buf,
+                              const ptrdiff_t sz) {
+    FAKESP_TRACE_SCOPE(rtp_jitbuf_retrieve);
+    rtp_packet_view_t lent;
+    const ptrdiff_t lent_sz = rtp_jitbuf_peek_next(j, now_us, &lent);
+    if (lent_sz <= 0) {
+        return 0;
+    }
+    if (sz < lent_sz) {
+        // Leave the packet in the buffer.
+        j->lent_pos = -1;
+        return 0;
     }
 
-    ESP_LOGV(TAG, "jitbuf-> nothing to hand out pos=%d top=%d +1=", pos, j->buf_top);
-    return 0;
+    memcpy(buf, lent.buf, lent_sz);
+    j->stats.bytes_copied += lent_sz;
+    rtp_jitbuf_release(j);
+    return lent_sz;
 }
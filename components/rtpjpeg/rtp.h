@@ -1,9 +1,12 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #include "fakesp.h"
+#include "rtp_fec.h"
+#include "rtp_slab.h"
 
 /**
  * A parsed RTP packet as per
@@ -68,49 +71,333 @@ typedef enum rtp_pt_clockrate {
     RTP_PT_CLOCKRATE_JPEG = 90000,
 } rtp_pt_clockrate;
 
+/**
+ * A lightweight view of a parsed RTP packet, without the CSRC list.
+ * Unlike rtp_packet_t, the payload excludes header extensions and padding.
+ */
+typedef struct rtp_packet_view_t {
+    uint8_t marker;
+    uint8_t payload_type;
+    uint16_t sequence_number;
+    uint32_t timestamp;
+    uint32_t ssrc;
+
+    // Fragment offset of the RTP/JPEG header, see rtp_jpeg_packet_t.
+    // Only set if payload_type is RTP_PT_JPEG, 0 otherwise.
+    uint32_t jpeg_fragment_offset;
+
+    // Set by rtp_jitbuf_peek_next() if the packet was retransmitted after a NACK or recovered
+    // from FEC, false otherwise.
+    bool rescued;
+
+    // Local arrival time as passed to rtp_jitbuf_feed(), set by rtp_jitbuf_peek_next(), 0
+    // otherwise.
+    int64_t arrival_us;
+
+    // Pointers to the whole packet and to the payload, not owned by this struct.
+    const uint8_t *buf;
+    ptrdiff_t sz;
+    const uint8_t *payload;
+    ptrdiff_t payload_sz;
+} rtp_packet_view_t;
+
+/**
+ * Parse a packet from a network buffer into a view.
+ * The buf and out params must not be NULL.
+ * The pointers in out will point into buf.
+ * Returns ESP_OK on success.
+ */
+esp_err_t parse_rtp_packet_view(const uint8_t *buf, const ptrdiff_t sz, rtp_packet_view_t *out);
+
+// Print a packet view via ESP_LOG().
+void rtp_packet_view_print(const rtp_packet_view_t *v);
+
 #ifndef ESP_PLATFORM
-#define CONFIG_RTP_JITBUF_CAP_N_PACKETS (15)
+#define CONFIG_RTP_JITBUF_CAP_N_PACKETS (16)
 #define CONFIG_RTP_JITBUF_CAP_PACKET_SIZE_BYTES (1400)
+#define CONFIG_RTP_JITBUF_MAX_WAIT_US (50000)
+#define CONFIG_RTP_JITBUF_MIN_WAIT_US (5000)
+#define CONFIG_RTP_JITBUF_NACK_MAX_RETRIES (3)
+#define CONFIG_RTP_JITBUF_FEC_CAP_N_PACKETS (4)
+#define CONFIG_RTP_JITBUF_FEC_PAYLOAD_TYPE (127)
 #endif
 
+_Static_assert(CONFIG_RTP_JITBUF_CAP_N_PACKETS > 0 &&
+                   (CONFIG_RTP_JITBUF_CAP_N_PACKETS & (CONFIG_RTP_JITBUF_CAP_N_PACKETS - 1)) == 0,
+               "CONFIG_RTP_JITBUF_CAP_N_PACKETS must be a power of two");
+_Static_assert(CONFIG_RTP_JITBUF_FEC_CAP_N_PACKETS > 0,
+               "CONFIG_RTP_JITBUF_FEC_CAP_N_PACKETS must be positive");
+
+// Slot index of a sequence number.
+#define RTP_JITBUF_SLOT_MASK (CONFIG_RTP_JITBUF_CAP_N_PACKETS - 1)
+// Number of 32 bit words in the slot occupancy bitmap.
+#define RTP_JITBUF_BITMAP_WORDS ((CONFIG_RTP_JITBUF_CAP_N_PACKETS + 31) / 32)
+
+// Size of the slab blocks a jitterbuffer stores packets in, FEC packets included.
+#define RTP_JITBUF_BLOCK_SIZE_BYTES \
+    ((CONFIG_RTP_JITBUF_CAP_PACKET_SIZE_BYTES + RTP_FEC_MAX_OVERHEAD + 7) & ~7)
+// Max number of blocks a jitterbuffer holds at once. A slab of this many blocks per jitterbuffer
+// never runs out.
+#define RTP_JITBUF_MAX_BLOCKS \
+    (CONFIG_RTP_JITBUF_CAP_N_PACKETS + CONFIG_RTP_JITBUF_FEC_CAP_N_PACKETS)
+
+// Header metadata of a buffered packet, parsed once in rtp_jitbuf_feed().
+// If FEC is received, the packet data and metadata stay valid after the packet was handed out,
+// until the slot is reused, so that FEC can still be applied.
+typedef struct rtp_jitbuf_slot_t {
+    uint16_t seq;
+    ptrdiff_t sz;              // Size of the whole packet.
+    ptrdiff_t payload_offset;  // Offset of the payload in the packet.
+    ptrdiff_t payload_sz;
+    int64_t arrival_us;        // Local arrival time as passed to rtp_jitbuf_feed().
+    uint32_t timestamp;
+    uint32_t jpeg_fragment_offset;
+    uint8_t marker;
+    uint8_t payload_type;
+    bool rescued;  // Arrived after a NACK for it, or was recovered from FEC.
+} rtp_jitbuf_slot_t;
+
+// NACK state of a missing packet, see rtp_jitbuf_get_nacks().
+typedef struct rtp_jitbuf_nack_t {
+    uint16_t seq;
+    uint8_t count;     // NACKs sent so far, 0 if none or once the retransmission arrived.
+    int64_t first_us;  // Time of the first NACK.
+    int64_t last_us;   // Time of the latest NACK.
+} rtp_jitbuf_nack_t;
+
+// Number of seq numbers to remember NACKs for. Longer than the window, so that retransmissions
+// which arrive too late are still recognized as such.
+#define RTP_JITBUF_NACK_HISTORY (4 * CONFIG_RTP_JITBUF_CAP_N_PACKETS)
+
+// A FEC packet kept until the packets it protects arrived or fell out of the window.
+typedef struct rtp_jitbuf_fec_slot_t {
+    bool valid;
+    int64_t arrival_us;
+    rtp_fec_t fec;  // Parsed from buf.
+    // Slab block with the whole FEC packet, also used to assemble the recovered packet in place.
+    uint8_t *buf;
+} rtp_jitbuf_fec_slot_t;
+
+// Counters of a jitterbuffer, see rtp_jitbuf_stats().
+typedef struct rtp_jitbuf_stats_t {
+    uint32_t fed;           // Media packets of the stream fed, including dropped ones.
+    uint32_t duplicates;    // Dropped because the packet was already buffered.
+    uint32_t late;          // Dropped because packets after it were already handed out.
+    uint32_t evicted;       // Buffered packets pushed out of the window before being handed out.
+    uint32_t gap_releases;  // Packets handed out giving up on missing packets before them.
+    uint64_t bytes_copied;  // Into slab blocks, and out by rtp_jitbuf_retrieve().
+    int max_reorder_depth;  // Max of how far packets arrived behind the highest seq number.
+} rtp_jitbuf_stats_t;
+
 /**
  * A jitterbuffer reorders RTP packets and drops duplicates.
- * Will wait for missing packets until the buffer is full.
+ * Will wait for missing packets until the buffer is full, or until the oldest packet in the buffer
+ * has waited for max_wait_us, whichever comes first.
+ * In adaptive mode (the default), the wait budget and the number of packets considered full are
+ * derived at runtime from the measured interarrival jitter and reordering, bounded by max_wait_us
+ * and CONFIG_RTP_JITBUF_CAP_N_PACKETS.
+ * Missing packets can be requested via rtp_jitbuf_get_nacks(). While a NACK is outstanding, the
+ * jitterbuffer waits up to one more round trip for the retransmission.
+ * Single lost packets can also be recovered from a companion ULPFEC stream (RFC 5109), see
+ * rtp_jitbuf_set_fec(). In adaptive mode, the jitterbuffer then waits long enough for the FEC
+ * packet of a protection group to arrive.
  * Packets arriving too late are dropped.
- * Use init_rtp_jitbuf() to initialize an instance before usage.
+ * Packets are stored in blocks drawn from a slab, which may be shared by many jitterbuffers, so
+ * that memory is only taken by packets in flight. Blocks go back to the slab once their packet
+ * was handed out, or if FEC is received, once the packet falls out of the window.
+ * Use init_rtp_jitbuf() to initialize an instance before usage, and rtp_jitbuf_destroy() to hand
+ * back its blocks.
  * All struct members are private to the implementation.
  */
 typedef struct rtp_jitbuf_t {
     uint32_t ssrc;
 
-    uint16_t max_seq;  // Max seq number we currently have in the buffer.
-    int buf_top;       // Wrap-around buf index pointing to the packet with the highest seq number.
-                       // Negative if the buffer is empty.
+    uint16_t max_seq;  // Max seq number we currently have in the buffer, valid if n_packets > 0.
+    int n_packets;     // Number of occupied slots.
+
+    // Packet buffers, indexed by sequence number & RTP_JITBUF_SLOT_MASK.
+    // Holds at most the packets in the window (max_seq - CONFIG_RTP_JITBUF_CAP_N_PACKETS, max_seq].
+    rtp_slab_t *slab;
+    uint8_t *buf[CONFIG_RTP_JITBUF_CAP_N_PACKETS];  // Slab blocks, NULL if none.
+    // Metadata of the packets in buf, see rtp_jitbuf_slot_t.
+    rtp_jitbuf_slot_t slots[CONFIG_RTP_JITBUF_CAP_N_PACKETS];
+    // Occupancy bitmap, bit (i % 32) of word (i / 32) is set if slot i holds a packet.
+    uint32_t occupied[RTP_JITBUF_BITMAP_WORDS];
+    // Same for slots which hold a slab block, occupied or kept for FEC.
+    uint32_t held[RTP_JITBUF_BITMAP_WORDS];
+    uint32_t slab_exhausted;  // Packets dropped because the slab had no free block.
+
+    int32_t max_seq_out;  // Last seq number handed out, or -1 if none yet.
+    int lent_pos;         // Slot currently lent out via rtp_jitbuf_peek_next(), or -1.
+
+    int32_t max_wait_us;  // Wait budget for missing packets, 0 to wait until the buffer is full.
+    bool adaptive;        // Adapt wait_us and window to the measured jitter and reordering.
+    int32_t wait_us;      // Effective wait budget, at most max_wait_us.
+    int window;           // Effective window in packets, at most CONFIG_RTP_JITBUF_CAP_N_PACKETS.
 
-    // Packet buffer. Spaced by sequence number, i.e. neighbors have a seq difference of 1.
-    uint8_t buf[CONFIG_RTP_JITBUF_CAP_N_PACKETS][CONFIG_RTP_JITBUF_CAP_PACKET_SIZE_BYTES];
-    // Keeps track of occupied slots in the buffer, and their sizes. Uses same indexing as buf.
-    ptrdiff_t buf_szs[CONFIG_RTP_JITBUF_CAP_N_PACKETS];
+    // Interarrival jitter estimation as per RFC 3550 Appendix A.8.
+    bool have_transit;
+    uint32_t last_transit;  // Relative transit time of the previous packet, in RTP timestamp units.
+    uint32_t jitter_q4;     // Jitter estimate in RTP timestamp units, times 16.
 
-    int32_t max_seq_out;
+    // Reception statistics as per RFC 3550 Appendix A.1 and A.3.
+    int32_t highest_seq;  // Highest seq number seen, or -1.
+    uint16_t base_seq;    // First seq number seen.
+    uint32_t cycles;      // Count of seq number wraparounds, shifted left by 16.
+    uint32_t received;    // Packets received, including duplicates and late ones.
+
+    int reorder_depth;    // Decaying max of how far packets arrived behind highest_seq.
+    int reorder_decay;    // Packets left until reorder_depth decays.
+
+    // NACK state, indexed by sequence number & (RTP_JITBUF_NACK_HISTORY - 1).
+    rtp_jitbuf_nack_t nacks[RTP_JITBUF_NACK_HISTORY];
+    // NACK round trip time estimate, from NACK to the arrival of the retransmission.
+    int32_t rtt_us;
+    uint32_t nacked;   // Seq numbers requested via NACK, counting repeats.
+    uint32_t rescued;  // Retransmitted packets which arrived in time.
+
+    // FEC packets are recognized by payload type and ssrc, which may be the media ssrc.
+    // A payload type of 0 disables FEC.
+    uint8_t fec_payload_type;
+    uint32_t fec_ssrc;
+    rtp_jitbuf_fec_slot_t fec[CONFIG_RTP_JITBUF_FEC_CAP_N_PACKETS];
+    int fec_span;          // Seq numbers spanned by the latest protection group, or 0.
+    int32_t fec_delay_us;  // Smoothed delay from the first protected packet to the FEC packet.
+    uint32_t fec_received;
+    uint32_t fec_recovered;  // Lost packets recovered in time.
+
+    rtp_jitbuf_stats_t stats;
 } rtp_jitbuf_t;
 
-// Initialize a rtp_jitbuf_t instance.
-void init_rtp_jitbuf(const uint32_t ssrc, rtp_jitbuf_t *j);
+// Reception statistics, as needed for RTCP receiver reports, see rtp_jitbuf_get_reception().
+typedef struct rtp_jitbuf_reception_t {
+    uint32_t ssrc;
+    uint16_t base_seq;         // First seq number received.
+    uint32_t ext_highest_seq;  // Highest seq number received, extended with the wraparound count.
+    uint32_t received;         // Packets received, including duplicates and late ones.
+    uint32_t jitter;           // RFC 3550 interarrival jitter in RTP timestamp units.
+    uint32_t nacked;           // Seq numbers requested via NACK, counting repeats.
+    uint32_t rescued;          // Retransmitted packets which arrived in time.
+    int32_t rtt_us;            // NACK round trip time estimate.
+    uint32_t fec_received;     // FEC packets received.
+    uint32_t fec_recovered;    // Lost packets recovered from FEC in time.
+    uint32_t slab_exhausted;   // Packets dropped because the slab had no free block.
+} rtp_jitbuf_reception_t;
+
+// Playout parameters and the estimates they were derived from, see rtp_jitbuf_get_playout().
+typedef struct rtp_jitbuf_playout_t {
+    uint32_t jitter;    // RFC 3550 interarrival jitter in RTP timestamp units.
+    int32_t jitter_us;  // Same, in microseconds.
+    int reorder_depth;
+    int32_t wait_us;  // Effective wait budget.
+    int window;       // Effective window in packets.
+} rtp_jitbuf_playout_t;
+
+/**
+ * Initialize a rtp_jitbuf_t instance, with max_wait_us set to CONFIG_RTP_JITBUF_MAX_WAIT_US.
+ * Packets are stored in blocks from slab, which must have a block size of at least
+ * RTP_JITBUF_BLOCK_SIZE_BYTES and outlive the jitterbuffer.
+ */
+void init_rtp_jitbuf(const uint32_t ssrc, rtp_slab_t *slab, rtp_jitbuf_t *j);
+
+// Drop all packets and hand back their blocks to the slab.
+void rtp_jitbuf_destroy(rtp_jitbuf_t *j);
+
+/**
+ * Set how long packets wait for missing packets before them, in microseconds.
+ * 0 disables the deadline, packets then wait until the buffer is full.
+ */
+void rtp_jitbuf_set_max_wait_us(rtp_jitbuf_t *j, const int32_t max_wait_us);
+
+/**
+ * Enable or disable adaptive mode.
+ * If disabled, the wait budget is always max_wait_us and packets are waited for until the whole
+ * buffer is full.
+ */
+void rtp_jitbuf_set_adaptive(rtp_jitbuf_t *j, const bool adaptive);
+
+/**
+ * Set the payload type and ssrc of the FEC stream protecting the media.
+ * FEC packets have their own seq numbers and are never handed out, only the packets recovered
+ * from them. A payload_type of 0 disables FEC.
+ * By default, FEC is expected with the media ssrc and CONFIG_RTP_JITBUF_FEC_PAYLOAD_TYPE.
+ */
+void rtp_jitbuf_set_fec(rtp_jitbuf_t *j, const uint8_t payload_type, const uint32_t ssrc);
+
+// Get the reception statistics of the source.
+void rtp_jitbuf_get_reception(const rtp_jitbuf_t *j, rtp_jitbuf_reception_t *out);
+
+// Get the counters of a jitterbuffer.
+void rtp_jitbuf_stats(const rtp_jitbuf_t *j, rtp_jitbuf_stats_t *out);
+
+// Get the current playout parameters, e.g. for graphing them.
+void rtp_jitbuf_get_playout(const rtp_jitbuf_t *j, rtp_jitbuf_playout_t *out);
 
 /**
  * Feed a packet to the jitter buffer.
  * Call this once per packet received from the network.
- * Packets with a different SSRC will be silently ignored.
+ * arrival_us is the local receive time of the packet in microseconds, from any monotonic clock.
+ * Packets with a different SSRC will be silently ignored, unless they are FEC packets.
+ * Returns ESP_ERR_NO_MEM if the packet was dropped because the slab had no free block.
+ */
+esp_err_t rtp_jitbuf_feed(rtp_jitbuf_t *j, const uint8_t *buf, const ptrdiff_t sz,
+                          const int64_t arrival_us);
+
+// A packet received from the network, see rtp_jitbuf_feed_batch().
+typedef struct rtp_jitbuf_packet_t {
+    const uint8_t *buf;
+    ptrdiff_t sz;
+    int64_t arrival_us;
+} rtp_jitbuf_packet_t;
+
+/**
+ * Feed up to n packets to the jitter buffer, like rtp_jitbuf_feed() for each of them, but
+ * recovering lost packets from FEC once per batch rather than once per packet.
+ * Stops before a packet which would push buffered packets out of the window, which
+ * rtp_jitbuf_feed() only does if they were not handed out in time. Hand out packets and feed the
+ * rest then. Errors of single packets are not reported, see rtp_jitbuf_get_reception() for drops.
+ * Returns the number of packets fed, at least one if n > 0.
+ */
+int rtp_jitbuf_feed_batch(rtp_jitbuf_t *j, const rtp_jitbuf_packet_t *pkts, const int n);
+
+/**
+ * Collect missing packets to request via NACK, and mark them as requested.
+ * A packet counts as missing once packets more than the reorder depth after it arrived, and it is
+ * requested again every round trip, at most CONFIG_RTP_JITBUF_NACK_MAX_RETRIES times, for as long
+ * as it could still be handed out in order.
+ * now_us is the current time, from the same clock as the arrival_us passed to rtp_jitbuf_feed().
+ * Writes up to n seq numbers in ascending order to out.
+ * Returns the number of seq numbers written, 0 if there is nothing to request.
+ * Should be called after rtp_jitbuf_feed().
  */
-esp_err_t rtp_jitbuf_feed(rtp_jitbuf_t *j, const uint8_t *buf, const ptrdiff_t sz);
+int rtp_jitbuf_get_nacks(rtp_jitbuf_t *j, const int64_t now_us, uint16_t *out, const int n);
+
+/**
+ * Borrow the next packet from the buffer without copying it.
+ * now_us is the current time, from the same clock as the arrival_us passed to rtp_jitbuf_feed().
+ * On success, *out is set to a view pointing into the buffer and the size of the packet is
+ * returned. The header fields are taken from what rtp_jitbuf_feed() parsed, no parsing is done.
+ * The packet remains owned by the jitterbuffer and must be handed back via rtp_jitbuf_release()
+ * before calling rtp_jitbuf_feed() again. Calling this again before releasing returns the same
+ * packet.
+ * Returns 0 if no packet was available.
+ * After each call to rtp_jitbuf_feed(), this should be called repeatedly (each followed by
+ * rtp_jitbuf_release()) until no more packets are available. To honor max_wait_us when no packets
+ * arrive, it should also be called periodically.
+ */
+ptrdiff_t rtp_jitbuf_peek_next(rtp_jitbuf_t *j, const int64_t now_us, rtp_packet_view_t *out);
+
+// Hand back the packet borrowed via rtp_jitbuf_peek_next() and remove it from the buffer.
+void rtp_jitbuf_release(rtp_jitbuf_t *j);
 
 /**
- * Receive the next packet from the buffer.
+ * Receive the next packet from the buffer, copying it.
+ * Same as rtp_jitbuf_peek_next() followed by rtp_jitbuf_release(), but copies the packet.
  * Will write the data to buf (which has extent sz).
  * Fails if buf is too small to hold the output data.
  * Returns the number of bytes written to buf, or 0 if no packet was available.
  * After each call to rtp_jitbuf_feed(), this should be called repeatedly until no more packets are
  * available.
  */
-ptrdiff_t rtp_jitbuf_retrieve(rtp_jitbuf_t *j, uint8_t *buf, const ptrdiff_t sz);
+ptrdiff_t rtp_jitbuf_retrieve(rtp_jitbuf_t *j, const int64_t now_us, uint8_t *buf,
+                              const ptrdiff_t sz);
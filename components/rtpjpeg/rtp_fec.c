@@ -0,0 +1,175 @@
+#include "rtp_fec.h"
+
+#include <assert.h>
+#include <string.h>
+
+__attribute__((unused)) static const char *TAG = "rtp_fec";
+static const ptrdiff_t RTP_HEADER_SZ = 12;
+static const ptrdiff_t FEC_HEADER_SZ = 10;
+static const ptrdiff_t LEVEL_HEADER_SZ = 4;  // Short mask, 4 more bytes for the long one.
+
+static uint16_t get_u16(const uint8_t *buf) { return (buf[0] << 8) | buf[1]; }
+
+static uint32_t get_u32(const uint8_t *buf) {
+    return ((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+static void put_u16(uint8_t *buf, const uint16_t v) {
+    buf[0] = v >> 8;
+    buf[1] = v & 0xFF;
+}
+
+static void put_u32(uint8_t *buf, const uint32_t v) {
+    buf[0] = v >> 24;
+    buf[1] = (v >> 16) & 0xFF;
+    buf[2] = (v >> 8) & 0xFF;
+    buf[3] = v & 0xFF;
+}
+
+static void xor_bytes(uint8_t *dst, const uint8_t *src, const ptrdiff_t sz) {
+    for (ptrdiff_t i = 0; i < sz; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+esp_err_t parse_rtp_fec(const uint8_t *buf, const ptrdiff_t sz, rtp_fec_t *out) {
+    if (buf == NULL || out == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (sz < FEC_HEADER_SZ + LEVEL_HEADER_SZ) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const bool extension = buf[0] >> 7;
+    const bool long_mask = (buf[0] >> 6) & 0x01;
+    if (extension) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    out->recovery_b0 = buf[0] & 0x3F;
+    out->recovery_b1 = buf[1];
+    out->sn_base = get_u16(&buf[2]);
+    out->ts_recovery = get_u32(&buf[4]);
+    out->length_recovery = get_u16(&buf[8]);
+
+    const ptrdiff_t level_sz = LEVEL_HEADER_SZ + (long_mask ? 4 : 0);
+    if (sz < FEC_HEADER_SZ + level_sz) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const uint8_t *level = &buf[FEC_HEADER_SZ];
+    const ptrdiff_t protection_sz = get_u16(&level[0]);
+    // The mask is MSB first, with the MSB standing for sn_base.
+    uint64_t mask_msb = (uint64_t)get_u16(&level[2]) << 32;
+    int mask_bits = 16;
+    if (long_mask) {
+        mask_msb |= get_u32(&level[4]);
+        mask_bits = 48;
+    }
+    out->mask = 0;
+    for (int i = 0; i < mask_bits; i++) {
+        out->mask |= ((mask_msb >> (47 - i)) & 1) << i;
+    }
+
+    if (FEC_HEADER_SZ + level_sz + protection_sz != sz) {
+        // Either truncated, or followed by further protection levels.
+        return sz < FEC_HEADER_SZ + level_sz + protection_sz ? ESP_ERR_INVALID_SIZE
+                                                             : ESP_ERR_NOT_SUPPORTED;
+    }
+    out->payload = &buf[FEC_HEADER_SZ + level_sz];
+    out->payload_sz = protection_sz;
+    return ESP_OK;
+}
+
+ptrdiff_t rtp_fec_recover(const rtp_fec_t *fec, const uint8_t *const *pkts,
+                          const ptrdiff_t *szs, const int n, const uint16_t seq,
+                          const uint32_t ssrc, uint8_t *out, const ptrdiff_t out_sz) {
+    assert(fec != NULL);
+    assert(out != NULL);
+
+    // Recover the header fields and the length first, out may overlap with the FEC payload.
+    uint8_t b0 = fec->recovery_b0;
+    uint8_t b1 = fec->recovery_b1;
+    uint32_t ts = fec->ts_recovery;
+    uint16_t len = fec->length_recovery;
+    for (int i = 0; i < n; i++) {
+        assert(szs[i] >= RTP_HEADER_SZ);
+        b0 ^= pkts[i][0];
+        b1 ^= pkts[i][1];
+        ts ^= get_u32(&pkts[i][4]);
+        len ^= szs[i] - RTP_HEADER_SZ;
+    }
+    if (len > fec->payload_sz || RTP_HEADER_SZ + len > out_sz) {
+        // Only partially protected, or corrupt.
+        return 0;
+    }
+
+    // Copying forward is safe, as out + RTP_HEADER_SZ is not after fec->payload.
+    assert(fec->payload < out || fec->payload >= out + RTP_HEADER_SZ);
+    memmove(&out[RTP_HEADER_SZ], fec->payload, len);
+    for (int i = 0; i < n; i++) {
+        const ptrdiff_t pkt_len = szs[i] - RTP_HEADER_SZ;
+        xor_bytes(&out[RTP_HEADER_SZ], &pkts[i][RTP_HEADER_SZ], pkt_len < len ? pkt_len : len);
+    }
+
+    out[0] = (2 << 6) | (b0 & 0x3F);
+    out[1] = b1;
+    put_u16(&out[2], seq);
+    put_u32(&out[4], ts);
+    put_u32(&out[8], ssrc);
+    return RTP_HEADER_SZ + len;
+}
+
+ptrdiff_t rtp_fec_make(const uint8_t *const *pkts, const ptrdiff_t *szs, const int n,
+                       const uint16_t seq, const uint8_t payload_type, const uint32_t ssrc,
+                       uint8_t *buf, const ptrdiff_t sz) {
+    assert(pkts != NULL && szs != NULL);
+    assert(n > 0);
+    assert(buf != NULL);
+
+    const uint16_t sn_base = get_u16(&pkts[0][2]);
+    uint64_t mask_msb = 0;
+    ptrdiff_t protection_sz = 0;
+    for (int i = 0; i < n; i++) {
+        assert(szs[i] >= RTP_HEADER_SZ);
+        const uint16_t offs = get_u16(&pkts[i][2]) - sn_base;
+        assert(offs < RTP_FEC_MAX_PROTECTED);
+        mask_msb |= (uint64_t)1 << (47 - offs);
+        if (szs[i] - RTP_HEADER_SZ > protection_sz) {
+            protection_sz = szs[i] - RTP_HEADER_SZ;
+        }
+    }
+    const bool long_mask = (mask_msb & 0xFFFFFFFF) != 0;
+    const ptrdiff_t payload_offs =
+        RTP_HEADER_SZ + FEC_HEADER_SZ + LEVEL_HEADER_SZ + (long_mask ? 4 : 0);
+    if (payload_offs + protection_sz > sz) {
+        return 0;
+    }
+
+    uint8_t *fec = &buf[RTP_HEADER_SZ];
+    uint8_t *payload = &buf[payload_offs];
+    memset(fec, 0, payload_offs - RTP_HEADER_SZ + protection_sz);
+    uint32_t ts = 0;
+    uint16_t len = 0;
+    for (int i = 0; i < n; i++) {
+        fec[0] ^= pkts[i][0] & 0x3F;
+        fec[1] ^= pkts[i][1];
+        ts ^= get_u32(&pkts[i][4]);
+        len ^= szs[i] - RTP_HEADER_SZ;
+        xor_bytes(payload, &pkts[i][RTP_HEADER_SZ], szs[i] - RTP_HEADER_SZ);
+    }
+    fec[0] |= long_mask << 6;
+    put_u16(&fec[2], sn_base);
+    put_u32(&fec[4], ts);
+    put_u16(&fec[8], len);
+    put_u16(&fec[10], protection_sz);
+    put_u16(&fec[12], mask_msb >> 32);
+    if (long_mask) {
+        put_u32(&fec[14], mask_msb & 0xFFFFFFFF);
+    }
+
+    // RTP header of the FEC packet itself.
+    buf[0] = 2 << 6;
+    buf[1] = payload_type & 0x7F;
+    put_u16(&buf[2], seq);
+    put_u32(&buf[4], get_u32(&pkts[n - 1][4]));
+    put_u32(&buf[8], ssrc);
+    return payload_offs + protection_sz;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fakesp.h"
+
+// Max number of packets a FEC packet can protect, with the long mask (L=1).
+#define RTP_FEC_MAX_PROTECTED 48
+
+// FEC header (10 bytes) and level 0 header with the long mask (8 bytes).
+// A FEC packet is at most this much larger than the packets it protects.
+#define RTP_FEC_MAX_OVERHEAD 18
+
+/**
+ * A parsed ULPFEC packet as per https://datatracker.ietf.org/doc/html/rfc5109#section-7,
+ * with a single protection level (level 0).
+ *
+ * 0                   1                   2                   3
+ * 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |E|L|P|X|  CC   |M| PT recovery |            SN base            |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |                          TS recovery                          |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |        length recovery        |       Protection Length       |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |             mask              | mask cont. (present only if L = 1)
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ */
+typedef struct rtp_fec_t {
+    uint16_t sn_base;
+    uint64_t mask;  // Bit i is set if packet sn_base + i is protected.
+
+    // XOR of the respective fields of the protected packets.
+    uint8_t recovery_b0;  // P, X and CC bits.
+    uint8_t recovery_b1;  // M and PT.
+    uint32_t ts_recovery;
+    uint16_t length_recovery;  // Of everything after the fixed 12 byte RTP header.
+
+    // XOR of the protected packets after their fixed 12 byte RTP header, zero padded.
+    // Pointer into the buffer parsed from, not owned by this struct.
+    const uint8_t *payload;
+    ptrdiff_t payload_sz;  // Protection length.
+} rtp_fec_t;
+
+/**
+ * Parse the payload of a FEC packet, i.e. what follows its RTP header.
+ * The payload pointer of out will point into buf.
+ * Returns ESP_ERR_NOT_SUPPORTED for FEC with more than one protection level.
+ */
+esp_err_t parse_rtp_fec(const uint8_t *buf, const ptrdiff_t sz, rtp_fec_t *out);
+
+/**
+ * Recover the one missing protected packet with seq number seq from fec and the n other
+ * protected packets in pkts/szs (all as received, starting with their RTP header).
+ * Writes the packet with the given ssrc to out, which has extent out_sz. out may overlap with
+ * the buffer fec was parsed from, as long as it starts at least 12 bytes before fec->payload.
+ * Returns the size of the recovered packet, or 0 if it could not be recovered.
+ */
+ptrdiff_t rtp_fec_recover(const rtp_fec_t *fec, const uint8_t *const *pkts,
+                          const ptrdiff_t *szs, const int n, const uint16_t seq,
+                          const uint32_t ssrc, uint8_t *out, const ptrdiff_t out_sz);
+
+/**
+ * Write a FEC packet protecting the n packets in pkts/szs to buf, which has extent sz.
+ * The packets must be in ascending seq number order and span at most RTP_FEC_MAX_PROTECTED seq
+ * numbers. The FEC packet gets its own seq number, payload type and ssrc, and the timestamp of
+ * the last protected packet.
+ * Returns the size of the FEC packet, or 0 if buf is too small.
+ */
+ptrdiff_t rtp_fec_make(const uint8_t *const *pkts, const ptrdiff_t *szs, const int n,
+                       const uint16_t seq, const uint8_t payload_type, const uint32_t ssrc,
+                       uint8_t *buf, const ptrdiff_t sz);
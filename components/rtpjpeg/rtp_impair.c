@@ -0,0 +1,261 @@
+#include "rtp_impair.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+__attribute__((unused)) static const char *TAG = "rtp_impair";
+
+// xorshift32, seeded by the config so runs are reproducible.
+static uint32_t rtp_impair_rand(rtp_impair_t *m) {
+    uint32_t x = m->rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    m->rand_state = x;
+    return x;
+}
+
+// Returns true with probability p, without drawing a number if p is 0.
+static bool rtp_impair_chance(rtp_impair_t *m, const float p) {
+    return p > 0 && (rtp_impair_rand(m) >> 8) * (1.0f / (1 << 24)) < p;
+}
+
+static bool rtp_impair_lose(rtp_impair_t *m) {
+    const rtp_impair_config_t *c = &m->config;
+    if (c->ge_p <= 0) {
+        return rtp_impair_chance(m, c->loss);
+    }
+    if (m->bad ? rtp_impair_chance(m, c->ge_r) : rtp_impair_chance(m, c->ge_p)) {
+        m->bad = !m->bad;
+    }
+    return rtp_impair_chance(m, m->bad ? c->ge_bad_loss : c->loss);
+}
+
+static bool valid_probability(const float p) { return p >= 0 && p <= 1; }
+
+esp_err_t init_rtp_impair(const rtp_impair_config_t *config, rtp_impair_packet_t *ring,
+                          const int n_ring, rtp_slab_t *slab, rtp_impair_t *out) {
+    if (config == NULL || ring == NULL || n_ring < 1 || slab == NULL || out == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!valid_probability(config->loss) || !valid_probability(config->ge_p) ||
+        !valid_probability(config->ge_r) || !valid_probability(config->ge_bad_loss) ||
+        !valid_probability(config->reorder) || !valid_probability(config->duplicate) ||
+        config->reorder_depth < 0 || config->delay_us < 0 || config->jitter_us < 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(out, 0, sizeof(*out));
+    out->config = *config;
+    out->rand_state = config->seed != 0 ? config->seed : 1;  // xorshift is stuck at 0.
+    out->slab = slab;
+    out->ring = ring;
+    out->n_ring = n_ring;
+    out->last_due_us = INT64_MIN;
+    return ESP_OK;
+}
+
+void rtp_impair_destroy(rtp_impair_t *m) {
+    assert(m != NULL);
+    for (int i = 0; i < m->n; i++) {
+        rtp_slab_free(m->slab, m->ring[(m->head + i) % m->n_ring].block);
+    }
+    for (int i = 0; i < m->n_held; i++) {
+        rtp_slab_free(m->slab, m->held[i].block);
+    }
+    m->n = 0;
+    m->n_lent = 0;
+    m->n_held = 0;
+}
+
+// Queue a packet to go out at due_us, or after the last one queued. Takes the block.
+static void rtp_impair_queue(rtp_impair_t *m, const rtp_impair_packet_t *p, const int64_t due_us) {
+    if (m->n == m->n_ring) {
+        m->stats.overflow++;
+        rtp_slab_free(m->slab, p->block);
+        return;
+    }
+    rtp_impair_packet_t *q = &m->ring[(m->head + m->n) % m->n_ring];
+    *q = *p;
+    q->due_us = due_us > m->last_due_us ? due_us : m->last_due_us;
+    q->hold = 0;
+    m->last_due_us = q->due_us;
+    m->n++;
+}
+
+// Copy a packet into a block, returns false if the slab is exhausted or it does not fit.
+static bool rtp_impair_copy(rtp_impair_t *m, const uint8_t *buf, const ptrdiff_t sz,
+                            const uint64_t tag, rtp_impair_packet_t *out) {
+    if (sz > m->slab->block_sz || (out->block = rtp_slab_alloc(m->slab)) == NULL) {
+        m->stats.overflow++;
+        return false;
+    }
+    memcpy(out->block, buf, sz);
+    out->sz = sz;
+    out->tag = tag;
+    return true;
+}
+
+// Queue the held packet i after the packets queued so far.
+static void rtp_impair_release_held(rtp_impair_t *m, const int i, const int64_t due_us) {
+    rtp_impair_queue(m, &m->held[i], due_us);
+    memmove(&m->held[i], &m->held[i + 1], (m->n_held - i - 1) * sizeof(m->held[0]));
+    m->n_held--;
+}
+
+void rtp_impair_feed(rtp_impair_t *m, const uint8_t *buf, const ptrdiff_t sz, const int64_t now_us,
+                     const uint64_t tag) {
+    assert(m != NULL);
+    assert(buf != NULL);
+    const rtp_impair_config_t *c = &m->config;
+    m->stats.fed++;
+    if (rtp_impair_lose(m)) {
+        m->stats.lost++;
+        return;
+    }
+
+    rtp_impair_packet_t p;
+    if (!rtp_impair_copy(m, buf, sz, tag, &p)) {
+        return;
+    }
+    if (c->reorder_depth > 0 && m->n_held < RTP_IMPAIR_MAX_HELD &&
+        rtp_impair_chance(m, c->reorder)) {
+        // Held back until reorder_depth later packets went out, due_us is when it was fed.
+        p.due_us = now_us;
+        p.hold = c->reorder_depth;
+        m->held[m->n_held++] = p;
+        m->stats.reordered++;
+        return;
+    }
+
+    int64_t due_us = now_us + c->delay_us;
+    if (c->jitter_us > 0) {
+        due_us += rtp_impair_rand(m) % ((uint32_t)c->jitter_us + 1);
+    }
+    const bool duplicate = rtp_impair_chance(m, c->duplicate);
+    rtp_impair_packet_t dup;
+    if (duplicate && rtp_impair_copy(m, buf, sz, tag, &dup)) {
+        m->stats.duplicated++;
+        rtp_impair_queue(m, &p, due_us);
+        rtp_impair_queue(m, &dup, due_us);
+    } else {
+        rtp_impair_queue(m, &p, due_us);
+    }
+
+    // Held packets go out right after the packet which makes up their depth.
+    for (int i = 0; i < m->n_held;) {
+        if (--m->held[i].hold == 0) {
+            rtp_impair_release_held(m, i, due_us);
+        } else {
+            i++;
+        }
+    }
+}
+
+int rtp_impair_poll(rtp_impair_t *m, const int64_t now_us, rtp_jitbuf_packet_t *out,
+                    uint64_t *tags_out, const int n) {
+    assert(m != NULL);
+    assert(out != NULL);
+    // The packets handed out last time are done with.
+    for (; m->n_lent > 0; m->n_lent--) {
+        rtp_slab_free(m->slab, m->ring[m->head].block);
+        m->head = (m->head + 1) % m->n_ring;
+        m->n--;
+    }
+    // Held packets no later packets came for.
+    for (int i = 0; i < m->n_held;) {
+        if (now_us - m->held[i].due_us >= RTP_IMPAIR_MAX_HOLD_US) {
+            rtp_impair_release_held(m, i, m->held[i].due_us + RTP_IMPAIR_MAX_HOLD_US);
+        } else {
+            i++;
+        }
+    }
+
+    int k = 0;
+    for (; k < n && k < m->n; k++) {
+        const rtp_impair_packet_t *p = &m->ring[(m->head + k) % m->n_ring];
+        if (p->due_us > now_us) {
+            break;
+        }
+        out[k].buf = p->block;
+        out[k].sz = p->sz;
+        out[k].arrival_us = p->due_us;
+        if (tags_out != NULL) {
+            tags_out[k] = p->tag;
+        }
+    }
+    m->n_lent = k;
+    m->stats.delivered += k;
+    return k;
+}
+
+esp_err_t rtp_impair_parse_config(const char *s, rtp_impair_config_t *out) {
+    assert(s != NULL);
+    assert(out != NULL);
+    memset(out, 0, sizeof(*out));
+    while (*s != '\0') {
+        char key[16];
+        int key_sz = 0;
+        if (sscanf(s, "%15[a-z]=%n", key, &key_sz) != 1 || key_sz == 0) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        s += key_sz;
+
+        // Up to three numbers separated by colons.
+        double v[3];
+        int n_v = 0;
+        while (1) {
+            char *end;
+            v[n_v++] = strtod(s, &end);
+            if (end == s) {
+                return ESP_ERR_INVALID_ARG;
+            }
+            s = end;
+            if (*s != ':' || n_v == 3) {
+                break;
+            }
+            s++;
+        }
+        if (*s == ',') {
+            s++;
+        } else if (*s != '\0') {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        // Integers, range checked before the conversion.
+        const bool v1_int = n_v >= 2 && v[1] >= 0 && v[1] <= INT32_MAX;
+        const bool v0_int = v[0] >= 0 && v[0] <= INT32_MAX;
+        // Probabilities, as init_rtp_impair() checks them.
+        const bool v0_p = valid_probability(v[0]);
+        const bool v12_p = n_v >= 2 && valid_probability(v[1]) &&
+                           (n_v < 3 || valid_probability(v[2]));
+        if (strcmp(key, "loss") == 0 && n_v == 1 && v0_p) {
+            out->loss = v[0];
+        } else if (strcmp(key, "ge") == 0 && v0_p && v12_p) {
+            out->ge_p = v[0];
+            out->ge_r = v[1];
+            out->ge_bad_loss = n_v == 3 ? v[2] : 1;
+        } else if (strcmp(key, "reorder") == 0 && n_v == 2 && v0_p && v1_int) {
+            out->reorder = v[0];
+            out->reorder_depth = v[1];
+        } else if (strcmp(key, "dup") == 0 && n_v == 1 && v0_p) {
+            out->duplicate = v[0];
+        } else if (strcmp(key, "delay") == 0 && n_v == 1 && v0_int) {
+            out->delay_us = v[0];
+        } else if (strcmp(key, "jitter") == 0 && n_v == 1 && v0_int) {
+            out->jitter_us = v[0];
+        } else if (strcmp(key, "seed") == 0 && n_v == 1 && v[0] >= 0 && v[0] <= UINT32_MAX) {
+            out->seed = v[0];
+        } else {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    return ESP_OK;
+}
+
+void rtp_impair_stats(const rtp_impair_t *m, rtp_impair_stats_t *out) {
+    assert(m != NULL);
+    assert(out != NULL);
+    *out = m->stats;
+}
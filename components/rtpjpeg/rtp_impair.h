@@ -0,0 +1,132 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fakesp.h"
+#include "rtp.h"
+#include "rtp_slab.h"
+
+// Packets held back for reordering at once, further ones are not reordered.
+#define RTP_IMPAIR_MAX_HELD 32
+// A held packet goes out after this long at the latest, even if no further packets come.
+#define RTP_IMPAIR_MAX_HOLD_US 1000000
+
+/**
+ * Impairments of a simulated network, see rtp_impair_t.
+ * All probabilities are per packet, from 0 to 1. A zeroed config passes packets unchanged.
+ */
+typedef struct rtp_impair_config_t {
+    uint32_t seed;  // Of the random numbers, the same seed and packets give the same output.
+
+    // Loss, uniform, or in the good state of the Gilbert-Elliott model if enabled.
+    float loss;
+    // Gilbert-Elliott model of burst loss, enabled if ge_p > 0: a packet moves the link from the
+    // good to the bad state with probability ge_p, and back with ge_r, so bursts are 1 / ge_r
+    // packets long on average. In the bad state, packets are lost with ge_bad_loss.
+    float ge_p;
+    float ge_r;
+    float ge_bad_loss;
+
+    // Reordering: a packet is held back with probability reorder, and goes out after the next
+    // reorder_depth packets.
+    float reorder;
+    int reorder_depth;
+
+    // Duplication: a packet goes out twice with probability duplicate.
+    float duplicate;
+
+    // Every packet is delayed by delay_us plus a uniformly random jitter of up to jitter_us.
+    // Jitter does not reorder packets, a packet waits for the one before it as on a real link.
+    int32_t delay_us;
+    int32_t jitter_us;
+} rtp_impair_config_t;
+
+// Counters of an impairment stage, see rtp_impair_stats().
+typedef struct rtp_impair_stats_t {
+    uint32_t fed;
+    uint32_t delivered;   // Duplicates included.
+    uint32_t lost;        // Dropped by the loss model.
+    uint32_t reordered;   // Held back behind later packets.
+    uint32_t duplicated;  // Delivered twice.
+    uint32_t overflow;    // Dropped as the stage was full, i.e. too much delay for its capacity.
+} rtp_impair_stats_t;
+
+// A packet on the simulated link. Private to the implementation.
+typedef struct rtp_impair_packet_t {
+    uint8_t *block;  // From the slab.
+    ptrdiff_t sz;
+    int64_t due_us;  // When it goes out.
+    uint64_t tag;
+    int hold;  // Packets still to go out before this one, if held back.
+} rtp_impair_packet_t;
+
+/**
+ * A seeded network impairment stage in front of rtp_jitbuf_feed(): packets fed are lost,
+ * reordered, duplicated and delayed as configured, and taken out with rtp_impair_poll() once due.
+ * Time is only what the caller passes, e.g. the timestamps of a capture, so a run is exactly
+ * reproducible and can go as fast as the packets are fed.
+ * Packets are copied into blocks from a slab, and queued in a ring of descriptors provided by the
+ * caller, in the order they go out.
+ * Not thread-safe.
+ * Use init_rtp_impair() to initialize an instance before usage.
+ * All struct members are private to the implementation.
+ */
+typedef struct rtp_impair_t {
+    rtp_impair_config_t config;
+    uint32_t rand_state;  // Of the xorshift generator.
+    bool bad;             // Gilbert-Elliott state.
+
+    rtp_slab_t *slab;
+    rtp_impair_packet_t *ring;
+    int n_ring;
+    int head;
+    int n;                // Queued in the ring.
+    int n_lent;           // At the head of the ring, handed out by the last rtp_impair_poll().
+    int64_t last_due_us;  // Of the last packet queued, later packets do not go out before it.
+
+    rtp_impair_packet_t held[RTP_IMPAIR_MAX_HELD];
+    int n_held;
+
+    rtp_impair_stats_t stats;
+} rtp_impair_t;
+
+/**
+ * Initialize an impairment stage with up to n_ring packets on the way, stored in ring, which must
+ * outlive the stage.
+ * Packets are copied into blocks from slab, which must be large enough for the packets fed.
+ * Returns ESP_ERR_INVALID_ARG if a probability is out of range.
+ */
+esp_err_t init_rtp_impair(const rtp_impair_config_t *config, rtp_impair_packet_t *ring,
+                          const int n_ring, rtp_slab_t *slab, rtp_impair_t *out);
+
+// Hand back the blocks of all packets on the way.
+void rtp_impair_destroy(rtp_impair_t *m);
+
+/**
+ * Put a packet on the simulated link at now_us, e.g. its time of arrival.
+ * tag is handed out with the packet, e.g. to tell its source.
+ */
+void rtp_impair_feed(rtp_impair_t *m, const uint8_t *buf, const ptrdiff_t sz, const int64_t now_us,
+                     const uint64_t tag);
+
+/**
+ * Take out up to n packets due by now_us, in order, into out and their tags into tags_out, which
+ * may be NULL. The arrival time of each is when it became due.
+ * The packets are valid until the next call of rtp_impair_poll() or rtp_impair_destroy().
+ * Returns the number of packets.
+ */
+int rtp_impair_poll(rtp_impair_t *m, const int64_t now_us, rtp_jitbuf_packet_t *out,
+                    uint64_t *tags_out, const int n);
+
+/**
+ * Parse a config from a list like "loss=0.02,ge=0.01:0.25,reorder=0.05:4,dup=0.01,delay=20000,
+ * jitter=10000,seed=7", for the command line of the Linux tools. Keys not given are 0.
+ * ge takes p:r[:bad_loss] with bad_loss 1 if not given, reorder takes probability:depth, delay
+ * and jitter are in microseconds.
+ * Returns ESP_ERR_INVALID_ARG on unknown keys or bad values, e.g. probabilities outside 0..1.
+ */
+esp_err_t rtp_impair_parse_config(const char *s, rtp_impair_config_t *out);
+
+void rtp_impair_stats(const rtp_impair_t *m, rtp_impair_stats_t *out);
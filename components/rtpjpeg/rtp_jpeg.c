@@ -2,10 +2,12 @@
 
 #include <assert.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <string.h>
 
 #include "fakesp.h"
 #include "rfc2435.h"
+#include "rtp_log.h"
 
 __attribute__((unused)) static const char *TAG = "mjpg";
 
@@ -15,7 +17,7 @@ esp_err_t parse_rtp_jpeg_packet(const uint8_t *buf, ptrdiff_t sz, rtp_jpeg_packe
     }
     memset(out, 0, sizeof(*out));
 
-    const ptrdiff_t header_sz = 8;
+    ptrdiff_t header_sz = 8;
     if (sz < header_sz) {
         return ESP_ERR_INVALID_SIZE;
     }
@@ -36,6 +38,17 @@ esp_err_t parse_rtp_jpeg_packet(const uint8_t *buf, ptrdiff_t sz, rtp_jpeg_packe
         return ESP_ERR_INVALID_ARG;
     }
 
+    if (out->type >= RTP_JPEG_TYPE_RESTART && out->type < 128) {
+        if (sz < header_sz + 4) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        out->restart_interval = (buf[8] << 8) | buf[9];
+        out->restart_first = buf[10] >> 7;
+        out->restart_last = (buf[10] >> 6) & 0x01;
+        out->restart_count = ((buf[10] & 0x3F) << 8) | buf[11];
+        header_sz += 4;
+    }
+
     out->payload = (uint8_t *)&buf[header_sz];
     out->payload_sz = sz - header_sz;
     return ESP_OK;
@@ -43,10 +56,11 @@ esp_err_t parse_rtp_jpeg_packet(const uint8_t *buf, ptrdiff_t sz, rtp_jpeg_packe
 
 void rtp_jpeg_packet_print(const rtp_jpeg_packet_t *p __attribute__((unused))) {
     assert(p != NULL);
-    ESP_LOGD(TAG,
+    RTP_LOGD(TAG,
              "RTP/JPEG[typs=%" PRIu8 " fof=%" PRIu32 " t=%" PRIu8 " q=%" PRIu8 " sz=%" PRIu16
-             "x%" PRIu16 "]",
-             p->type_specific, p->fragment_offset, p->type, p->q, p->width, p->height);
+             "x%" PRIu16 " dri=%" PRIu16 " f=%d l=%d rc=%" PRIu16 "]",
+             p->type_specific, p->fragment_offset, p->type, p->q, p->width, p->height,
+             p->restart_interval, p->restart_first, p->restart_last, p->restart_count);
 }
 
 esp_err_t parse_rtp_jpeg_qt(const uint8_t *buf, ptrdiff_t sz, rtp_jpeg_qt_t *out,
@@ -65,9 +79,6 @@ esp_err_t parse_rtp_jpeg_qt(const uint8_t *buf, ptrdiff_t sz, rtp_jpeg_qt_t *out
     out->mbz = buf[0];
     out->precision = buf[1];
     out->length = (buf[2] << 8) | buf[3];
-    if (out->length == 0) {
-        return ESP_ERR_INVALID_ARG;
-    }
 
     if (header_sz + out->length > sz) {
         return ESP_ERR_INVALID_SIZE;
@@ -82,36 +93,214 @@ esp_err_t parse_rtp_jpeg_qt(const uint8_t *buf, ptrdiff_t sz, rtp_jpeg_qt_t *out
 
 void rtp_jpeg_qt_print(const rtp_jpeg_qt_t *p __attribute__((unused))) {
     assert(p != NULL);
-    ESP_LOGD(TAG, "QT[mbz=%hhu prec=%hhu len=%u]", p->mbz, p->precision, p->length);
+    RTP_LOGD(TAG, "QT[mbz=%hhu prec=%hhu len=%u]", p->mbz, p->precision, p->length);
 }
 
 void init_rtp_jpeg_session(const uint32_t ssrc, rtp_jpeg_frame_cb frame_cb, void *userdata,
                            rtp_jpeg_session_t *s) {
     assert(frame_cb != NULL);
     assert(s != NULL);
-    memset(s, 0, sizeof(*s));
+    memset(s, 0, offsetof(rtp_jpeg_session_t, jpeg_data));
+    FAKESP_POISON_FILL(s->jpeg_data, sizeof(s->jpeg_data));
     s->ssrc = ssrc;
     s->frame_cb = frame_cb;
     s->userdata = userdata;
 }
 
-static esp_err_t rtp_jpeg_write_header(rtp_jpeg_session_t *s, const rtp_jpeg_qt_t *qt) {
-    assert(qt != NULL);
-    // We only support 8 bit precision Q tables for now.
-    if (qt->payload_sz != 128 || (qt->precision & 1) || (qt->precision & 2)) {
-        return ESP_ERR_NOT_SUPPORTED;
+/**
+ * Write the JFIF header of the current frame with the quantization tables qt to jpeg_data.
+ * The header is built only once for each set of parameters and then copied from the cache.
+ */
+static void rtp_jpeg_write_header(rtp_jpeg_session_t *s, const uint8_t *qt) {
+    const uint8_t type = s->header.type % RTP_JPEG_TYPE_RESTART;
+    rtp_jpeg_header_cache_entry_t *e = NULL;
+    bool hit = false;
+    for (int i = 0; i < CONFIG_RTP_JPEG_HEADER_CACHE_N_ENTRIES; i++) {
+        rtp_jpeg_header_cache_entry_t *c = &s->header_cache[i];
+        if (c->valid && c->type == type && c->q == s->header.q && c->width == s->header.width &&
+            c->height == s->header.height && c->dri == s->dri &&
+            // Tables computed from q are the same anyway.
+            (qt == NULL || memcmp(c->qt, qt, sizeof(c->qt)) == 0)) {
+            e = c;
+            hit = true;
+            break;
+        }
+        if (e == NULL || !c->valid || (e->valid && c->last_used < e->last_used)) {
+            // Least recently used so far.
+            e = c;
+        }
+    }
+
+    if (!hit) {
+        RTP_LOGD(TAG, "Building JFIF header type=%" PRIu8 " q=%" PRIu8, type, s->header.q);
+        e->valid = true;
+        e->type = type;
+        e->q = s->header.q;
+        e->width = s->header.width;
+        e->height = s->header.height;
+        e->dri = s->dri;
+        if (qt == NULL) {
+            rfc2435_make_tables(e->q, &e->qt[0], &e->qt[RTP_JPEG_QT_SIZE_BYTES / 2]);
+        } else {
+            memcpy(e->qt, qt, sizeof(e->qt));
+        }
+        e->header_sz = rfc2435_make_headers(e->header, type, e->width >> 3, e->height >> 3,
+                                            &e->qt[0], &e->qt[RTP_JPEG_QT_SIZE_BYTES / 2], e->dri);
+        assert(e->header_sz <= RFC2435_HEADER_MAX_SIZE_BYTES);
     }
-    const ptrdiff_t lqt_sz = (qt->precision & 1) ? 128 : 64;
+    e->last_used = ++s->header_clock;
 
     _Static_assert(sizeof(s->jpeg_data) >= RFC2435_HEADER_MAX_SIZE_BYTES, "Buffer too small");
-    const ptrdiff_t jfif_header_sz =
-        rfc2435_make_headers(&s->jpeg_data[0], s->header.type, s->header.width >> 3,
-                             s->header.height >> 3, &qt->payload[0], &qt->payload[lqt_sz], 0);
-    assert(jfif_header_sz <= RFC2435_HEADER_MAX_SIZE_BYTES);
+    memcpy(s->jpeg_data, e->header, e->header_sz);
+    s->jpeg_data_sz = e->header_sz;
+    s->jfif_header_sz = e->header_sz;
+}
 
-    s->jpeg_data_sz = jfif_header_sz;
-    s->jfif_header_sz = jfif_header_sz;
+/**
+ * Append a gray restart interval of n_mcus MCUs to jpeg_data: every block has a DC difference of
+ * 0, which is mid-gray after the restart, and no AC coefficients. Uses the Huffman codes of the
+ * tables from RFC 2435 Appendix B: "00" for DC category 0 (luma and chroma), "1010" for the luma
+ * AC EOB and "00" for the chroma one.
+ */
+static esp_err_t rtp_jpeg_write_gray_interval(rtp_jpeg_session_t *s, const int n_mcus) {
+    // Type 0 is 4:2:2 with two luma blocks per MCU, type 1 is 4:2:0 with four.
+    const int n_luma_blocks = s->header.type % RTP_JPEG_TYPE_RESTART == 0 ? 2 : 4;
+    uint32_t bits = 0;
+    int n_bits = 0;
+    for (int i = 0; i < n_mcus; i++) {
+        for (int b = 0; b < n_luma_blocks + 2; b++) {
+            if (b < n_luma_blocks) {
+                bits = (bits << 6) | 0x0A;
+                n_bits += 6;
+            } else {
+                bits <<= 4;
+                n_bits += 4;
+            }
+            while (n_bits >= 8) {
+                // Two bytes for a stuffed 0xFF.
+                if (s->jpeg_data_sz + 2 > (ptrdiff_t)sizeof(s->jpeg_data)) {
+                    return ESP_ERR_NO_MEM;
+                }
+                n_bits -= 8;
+                const uint8_t byte = bits >> n_bits;
+                s->jpeg_data[s->jpeg_data_sz++] = byte;
+                if (byte == 0xFF) {
+                    s->jpeg_data[s->jpeg_data_sz++] = 0x00;
+                }
+            }
+        }
+    }
+    if (n_bits > 0) {
+        // Pad with 1 bits.
+        if (s->jpeg_data_sz + 2 > (ptrdiff_t)sizeof(s->jpeg_data)) {
+            return ESP_ERR_NO_MEM;
+        }
+        const uint8_t byte = (bits << (8 - n_bits)) | (0xFF >> n_bits);
+        s->jpeg_data[s->jpeg_data_sz++] = byte;
+        if (byte == 0xFF) {
+            s->jpeg_data[s->jpeg_data_sz++] = 0x00;
+        }
+    }
+    return ESP_OK;
+}
 
+/**
+ * Replace the restart intervals from next_interval up to (excluding) end with gray ones, each
+ * followed by its RST marker except for the last interval of the frame.
+ * jpeg_data must end at the start of next_interval.
+ */
+static esp_err_t rtp_jpeg_conceal_intervals(rtp_jpeg_session_t *s, const int end) {
+    assert(s->dri > 0);
+    const int n_intervals = (s->n_mcus + s->dri - 1) / s->dri;
+    assert(end <= n_intervals);
+    while (s->next_interval < end) {
+        const int mcus_left = s->n_mcus - s->next_interval * s->dri;
+        const esp_err_t err =
+            rtp_jpeg_write_gray_interval(s, mcus_left < s->dri ? mcus_left : s->dri);
+        if (err != ESP_OK) {
+            return err;
+        }
+        if (s->next_interval < n_intervals - 1) {
+            if (s->jpeg_data_sz + 2 > (ptrdiff_t)sizeof(s->jpeg_data)) {
+                return ESP_ERR_NO_MEM;
+            }
+            s->jpeg_data[s->jpeg_data_sz++] = 0xFF;
+            s->jpeg_data[s->jpeg_data_sz++] = 0xD0 + (s->next_interval & 0x07);
+        }
+        s->next_interval++;
+        s->interval_start_sz = s->jpeg_data_sz;
+        s->concealed_intervals++;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Append scan data to jpeg_data, keeping track of the restart intervals in it.
+ * *eoi_out is set if the data contains an EOI marker.
+ */
+static esp_err_t rtp_jpeg_append(rtp_jpeg_session_t *s, const uint8_t *data, const ptrdiff_t sz,
+                                 bool *eoi_out) {
+    if (s->jpeg_data_sz + sz > (ptrdiff_t)sizeof(s->jpeg_data)) {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(&s->jpeg_data[s->jpeg_data_sz], data, sz);
+    s->stats.bytes_copied += sz;
+
+    // Markers may straddle packets, so start at the last byte appended before. Within the scan,
+    // 0xFF is always followed by 0x00 unless it is a marker.
+    ptrdiff_t i = s->jpeg_data_sz > s->jfif_header_sz ? s->jpeg_data_sz - 1 : s->jpeg_data_sz;
+    s->jpeg_data_sz += sz;
+    *eoi_out = false;
+    while (i + 1 < s->jpeg_data_sz) {
+        const uint8_t *ff = memchr(&s->jpeg_data[i], 0xFF, s->jpeg_data_sz - 1 - i);
+        if (ff == NULL) {
+            break;
+        }
+        i = ff - s->jpeg_data;
+        if (ff[1] >= 0xD0 && ff[1] <= 0xD7) {
+            s->next_interval++;
+            s->interval_start_sz = i + 2;
+        } else if (ff[1] == 0xD9) {
+            *eoi_out = true;
+        }
+        i++;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Continue a frame with restart markers after lost packets: drop the partial restart interval
+ * before the gap, conceal the lost ones and skip a leading RST marker of the packet, which the
+ * concealed intervals already end with.
+ * On success, *data_inout and *sz_inout are adjusted to the scan data to append.
+ * Returns ESP_ERR_NOT_FOUND if the packet does not start a restart interval, so that it has to be
+ * skipped as well.
+ */
+static esp_err_t rtp_jpeg_resync(rtp_jpeg_session_t *s, const rtp_jpeg_packet_t *jp,
+                                 const uint8_t **data_inout, ptrdiff_t *sz_inout) {
+    if (s->dri == 0 || jp->fragment_offset < s->next_fragment_offset) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!jp->restart_first || jp->restart_count == RTP_JPEG_RESTART_COUNT_NONE) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    const int n_intervals = (s->n_mcus + s->dri - 1) / s->dri;
+    if (jp->restart_count < s->next_interval || jp->restart_count >= n_intervals) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    RTP_LOGD(TAG, "Resync at restart interval %" PRIu16 " after %d", jp->restart_count,
+             s->next_interval);
+
+    s->jpeg_data_sz = s->interval_start_sz;
+    const esp_err_t err = rtp_jpeg_conceal_intervals(s, jp->restart_count);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (*sz_inout >= 2 && (*data_inout)[0] == 0xFF && (*data_inout)[1] >= 0xD0 &&
+        (*data_inout)[1] <= 0xD7) {
+        *data_inout += 2;
+        *sz_inout -= 2;
+    }
     return ESP_OK;
 }
 
@@ -122,12 +311,16 @@ static esp_err_t rtp_jpeg_handle_frame(const rtp_jpeg_session_t *s) {
 
     // Emit frame callback.
     rtp_jpeg_frame_t frame = {0};
+    frame.ssrc = s->ssrc;
     frame.width = s->header.width;
     frame.height = s->header.height;
     frame.timestamp = s->rtp_timestamp;
     frame.jpeg_data = s->jpeg_data;
     frame.jpeg_data_sz = s->jpeg_data_sz;
     frame.jfif_header_sz = s->jfif_header_sz;
+    frame.concealed_intervals = s->concealed_intervals;
+    frame.first_arrival_us = s->first_arrival_us;
+    frame.last_arrival_us = s->last_arrival_us;
 
     assert(s->frame_cb != NULL);
     s->frame_cb(&frame, s->userdata);
@@ -135,14 +328,130 @@ static esp_err_t rtp_jpeg_handle_frame(const rtp_jpeg_session_t *s) {
     return ESP_OK;
 }
 
-esp_err_t rtp_jpeg_session_feed(rtp_jpeg_session_t *s, const rtp_packet_t *p) {
+/**
+ * Hand out the current frame and reset.
+ * If truncated, i.e. its marker packet was lost, the frame is only handed out if it has restart
+ * markers, with the rest concealed from the last complete restart interval on and the EOI marker
+ * the lost packet would have ended with.
+ */
+static esp_err_t rtp_jpeg_close_frame(rtp_jpeg_session_t *s, const bool truncated) {
+    esp_err_t err = ESP_OK;
+    if (truncated) {
+        if (s->dri == 0) {
+            err = ESP_ERR_INVALID_STATE;
+        } else {
+            s->jpeg_data_sz = s->interval_start_sz;
+            err = rtp_jpeg_conceal_intervals(s, (s->n_mcus + s->dri - 1) / s->dri);
+            if (err == ESP_OK && s->jpeg_data_sz + 2 > (ptrdiff_t)sizeof(s->jpeg_data)) {
+                err = ESP_ERR_NO_MEM;
+            } else if (err == ESP_OK) {
+                s->jpeg_data[s->jpeg_data_sz++] = 0xFF;
+                s->jpeg_data[s->jpeg_data_sz++] = 0xD9;
+            }
+        }
+    }
+    if (err == ESP_OK) {
+        err = rtp_jpeg_handle_frame(s);
+    }
+    s->jpeg_data_sz = 0;
+
+    if (err == ESP_OK) {
+        s->stats.frames_completed++;
+        if (s->rescued) {
+            s->stats.frames_rescued++;
+        }
+        if (s->concealed_intervals > 0) {
+            s->stats.frames_damaged++;
+        }
+    } else if (err == ESP_ERR_NO_MEM) {
+        s->stats.frames_oversize++;
+    } else {
+        s->stats.frames_dropped++;
+        s->stats.dropped_missing++;
+    }
+    return err;
+}
+
+// Start a new frame from its first packet.
+static esp_err_t rtp_jpeg_start_frame(rtp_jpeg_session_t *s, const rtp_packet_view_t *p,
+                                      const rtp_jpeg_packet_t *jp, const uint8_t **data_out,
+                                      ptrdiff_t *sz_out) {
+    FAKESP_POISON_FILL(s->jpeg_data, s->jpeg_data_sz);
+    s->jpeg_data_sz = 0;
+    s->jfif_header_sz = 0;
+    s->rescued = false;
+    s->next_fragment_offset = 0;
+    s->first_arrival_us = p->arrival_us;
+
+    // Copy header.
+    s->header = *jp;
+    s->header.payload = NULL;
+    s->header.payload_sz = 0;
+    s->rtp_timestamp = p->timestamp;
+    s->has_timestamp = true;
+
+    // Restart interval state.
+    const int mcu_height = jp->type % RTP_JPEG_TYPE_RESTART == 0 ? 8 : 16;
+    s->dri = jp->restart_interval;
+    s->n_mcus = ((jp->width + 15) / 16) * ((jp->height + mcu_height - 1) / mcu_height);
+    s->next_interval = 0;
+    s->concealed_intervals = 0;
+
+    // Quantization tables: computed from Q 1-99, in-band for Q 128-255.
+    const uint8_t *tables = NULL;
+    ptrdiff_t qt_parsed_sz = 0;
+    if (jp->q >= 128) {
+        rtp_jpeg_qt_t qt = {0};
+        const esp_err_t err = parse_rtp_jpeg_qt(jp->payload, jp->payload_sz, &qt, &qt_parsed_sz);
+        if (err != ESP_OK) {
+            return err;
+        }
+        rtp_jpeg_qt_print(&qt);
+
+        if (qt.length == 0) {
+            // Sent with a previous frame, which is not allowed for Q 255.
+            if (jp->q == 255 || jp->q != s->qt_q) {
+                return ESP_ERR_INVALID_STATE;
+            }
+            tables = s->qt;
+        } else {
+            // We only support 8 bit precision Q tables for now.
+            if (qt.payload_sz != RTP_JPEG_QT_SIZE_BYTES || (qt.precision & 0x03)) {
+                return ESP_ERR_NOT_SUPPORTED;
+            }
+            tables = qt.payload;
+            if (jp->q < 255) {
+                memcpy(s->qt, tables, sizeof(s->qt));
+                s->qt_q = jp->q;
+            }
+        }
+    } else if (jp->q == 0 || jp->q >= 100) {
+        // Reserved.
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    // Write JFIF header to data buffer.
+    rtp_jpeg_write_header(s, tables);
+    s->interval_start_sz = s->jpeg_data_sz;
+    s->stats.bytes_copied += s->jpeg_data_sz;
+
+    *data_out = jp->payload + qt_parsed_sz;
+    *sz_out = jp->payload_sz - qt_parsed_sz;
+    assert(*sz_out >= 0);
+    RTP_LOGD(TAG, "Added QT jp.payload_sz=%d qt_parsed_sz=%d s->payload_sz=%d",
+             (int)jp->payload_sz, (int)qt_parsed_sz, (int)s->jpeg_data_sz);
+    return ESP_OK;
+}
+
+esp_err_t rtp_jpeg_session_feed(rtp_jpeg_session_t *s, const rtp_packet_view_t *p) {
+    FAKESP_TRACE_SCOPE(rtp_jpeg_session_feed);
     assert(s != NULL);
     if (p == NULL) {
         return ESP_ERR_INVALID_ARG;
     }
-    rtp_packet_print(p);
+    rtp_packet_view_print(p);
 
-    if (p->padding || p->extension || p->csrc_count || p->payload_type != RTP_PT_JPEG) {
+    if (p->payload_type != RTP_PT_JPEG) {
         // We cannot handle that.
         return ESP_ERR_NOT_SUPPORTED;
     }
@@ -150,6 +459,21 @@ esp_err_t rtp_jpeg_session_feed(rtp_jpeg_session_t *s, const rtp_packet_t *p) {
         // Not our session.
         return ESP_ERR_INVALID_ARG;
     }
+    if (s->jpeg_data_sz > 0 && p->timestamp != s->rtp_timestamp) {
+        // The marker packet of the current frame was lost.
+        rtp_jpeg_close_frame(s, true);
+    }
+    if (p->jpeg_fragment_offset != 0 && s->jpeg_data_sz == 0) {
+        // Continuation of a frame we did not see the start of, no need to parse it.
+        if (!s->has_timestamp || p->timestamp != s->rtp_timestamp) {
+            // Count each such frame once.
+            s->rtp_timestamp = p->timestamp;
+            s->has_timestamp = true;
+            s->stats.frames_dropped++;
+            s->stats.dropped_missing++;
+        }
+        return ESP_ERR_INVALID_STATE;
+    }
 
     // Parse RTP JPEG header.
     rtp_jpeg_packet_t jp = {0};
@@ -158,75 +482,92 @@ esp_err_t rtp_jpeg_session_feed(rtp_jpeg_session_t *s, const rtp_packet_t *p) {
         return err;
     }
 
-    // TODO: eventually support jp.q < 128.
-    if (!(jp.type == 1 && jp.type_specific == 0 && jp.q >= 128)) {
-        // We cannot handle that.
+    if (!(jp.type % RTP_JPEG_TYPE_RESTART <= 1 && jp.type < 128 && jp.type_specific == 0)) {
+        // We cannot handle that. Count the frame by its first packet, the rest is skipped above.
+        if (jp.fragment_offset == 0 && s->jpeg_data_sz == 0) {
+            s->rtp_timestamp = p->timestamp;
+            s->has_timestamp = true;
+            s->stats.frames_dropped++;
+            s->stats.dropped_unsupported++;
+        }
         return ESP_ERR_NOT_SUPPORTED;
     }
 
     rtp_jpeg_packet_print(&jp);
 
+    const uint8_t *data = NULL;
+    ptrdiff_t data_sz = 0;
     if (jp.fragment_offset == 0) {
-        // New frame, reset.
-        init_rtp_jpeg_session(s->ssrc, s->frame_cb, s->userdata, s);
-
-        // Copy header.
-        s->header = jp;
-        s->header.payload = NULL;
-        s->header.payload_sz = 0;
-        s->rtp_timestamp = p->timestamp;
+        if (s->jpeg_data_sz > 0) {
+            // A new frame with the same timestamp, the marker packet of the current one was lost.
+            rtp_jpeg_close_frame(s, true);
+        }
 
-        // Parse quantization table.
-        rtp_jpeg_qt_t qt = {0};
-        ptrdiff_t qt_parsed_sz = 0;
-        const esp_err_t err2 = parse_rtp_jpeg_qt(jp.payload, jp.payload_sz, &qt, &qt_parsed_sz);
+        const esp_err_t err2 = rtp_jpeg_start_frame(s, p, &jp, &data, &data_sz);
         if (err2 != ESP_OK) {
+            s->jpeg_data_sz = 0;
+            s->stats.frames_dropped++;
+            if (err2 == ESP_ERR_NOT_SUPPORTED) {
+                s->stats.dropped_unsupported++;
+            } else {
+                s->stats.dropped_header++;
+            }
             return err2;
         }
-        rtp_jpeg_qt_print(&qt);
-
-        // Write JFIF header to data buffer.
-        const esp_err_t err3 = rtp_jpeg_write_header(s, &qt);
-        if (err3 != ESP_OK) {
-            return err3;
-        }
-
-        // Copy fragment.
-        const ptrdiff_t payload_sz = jp.payload_sz - qt_parsed_sz;
-        assert(payload_sz >= 0);
-        memcpy(s->jpeg_data + s->jpeg_data_sz, jp.payload + qt_parsed_sz, payload_sz);
-        s->jpeg_data_sz += payload_sz;
-
-        ESP_LOGD(TAG, "Added QT jp.payload_sz=%ld qt_parsed_sz=%ld s->payload_sz=%ld",
-                 (long)jp.payload_sz, (long)qt_parsed_sz, (long)s->jpeg_data_sz);
+        s->last_arrival_us = p->arrival_us;
     } else {
         if (jp.type_specific != s->header.type_specific || jp.type != s->header.type ||
             // Does it match the first packet?
-            jp.q != s->header.q || jp.width != s->header.width || jp.height != s->header.height) {
+            jp.q != s->header.q || jp.width != s->header.width || jp.height != s->header.height ||
+            jp.restart_interval != s->header.restart_interval) {
             s->jpeg_data_sz = 0;
+            s->stats.frames_dropped++;
+            s->stats.dropped_header++;
             return ESP_ERR_INVALID_STATE;
         }
-
-        if ((int64_t)jp.fragment_offset + s->jfif_header_sz != s->jpeg_data_sz) {
-            s->jpeg_data_sz = 0;
-            return ESP_ERR_INVALID_STATE;
-        }
-
-        if (s->jpeg_data_sz + jp.payload_sz > (ptrdiff_t)sizeof(s->jpeg_data)) {
-            s->jpeg_data_sz = 0;
-            return ESP_ERR_NO_MEM;
+        s->last_arrival_us = p->arrival_us;
+
+        data = jp.payload;
+        data_sz = jp.payload_sz;
+        if (jp.fragment_offset != s->next_fragment_offset) {
+            // Packets were lost, continue after them if the frame has restart markers.
+            const esp_err_t err2 = rtp_jpeg_resync(s, &jp, &data, &data_sz);
+            if (err2 == ESP_ERR_NOT_FOUND) {
+                // Wait for the next restart interval.
+                return p->marker ? rtp_jpeg_close_frame(s, true) : ESP_OK;
+            }
+            if (err2 != ESP_OK) {
+                s->jpeg_data_sz = 0;
+                if (err2 == ESP_ERR_NO_MEM) {
+                    s->stats.frames_oversize++;
+                } else {
+                    s->stats.frames_dropped++;
+                    s->stats.dropped_missing++;
+                }
+                return err2;
+            }
         }
+    }
 
-        memcpy(&s->jpeg_data[s->jpeg_data_sz], jp.payload, jp.payload_sz);
-        s->jpeg_data_sz += jp.payload_sz;
+    bool eoi = false;
+    const esp_err_t err3 = rtp_jpeg_append(s, data, data_sz, &eoi);
+    if (err3 != ESP_OK) {
+        s->jpeg_data_sz = 0;
+        s->stats.frames_oversize++;
+        return err3;
     }
+    s->next_fragment_offset = jp.fragment_offset + jp.payload_sz -
+                              (jp.fragment_offset == 0 ? data - jp.payload : 0);
 
-    if (p->marker == 0) {
+    s->rescued |= p->rescued;
+    if (p->marker == 0 && !eoi) {
         return ESP_OK;
     }
+    return rtp_jpeg_close_frame(s, false);
+}
 
-    const esp_err_t success = rtp_jpeg_handle_frame(s);
-    s->jpeg_data_sz = 0;
-
-    return success;
+void rtp_jpeg_session_stats(const rtp_jpeg_session_t *s, rtp_jpeg_session_stats_t *out) {
+    assert(s != NULL);
+    assert(out != NULL);
+    *out = s->stats;
 }
@@ -17,6 +17,15 @@
  * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
  * |      Type     |       Q       |     Width     |     Height    |
  * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ * For types 64-127, followed by the restart marker header as per
+ * https://datatracker.ietf.org/doc/html/rfc2435#section-3.1.7.
+ *
+ * 0                   1                   2                   3
+ * 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |       Restart Interval        |F|L|       Restart Count       |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
  */
 typedef struct rtp_jpeg_packet_t {
     uint8_t type_specific;
@@ -26,6 +35,12 @@ typedef struct rtp_jpeg_packet_t {
     uint16_t width;
     uint16_t height;
 
+    // Restart marker header, all 0 for types without restart markers.
+    uint16_t restart_interval;  // In MCUs, as in the DRI marker.
+    bool restart_first;         // The payload starts with a restart interval.
+    bool restart_last;          // The payload ends with a restart interval.
+    uint16_t restart_count;     // Index of the first restart interval if restart_first.
+
     // Pointer to the payload, not owned by this struct.
     uint8_t *payload;
     ptrdiff_t payload_sz;
@@ -70,6 +85,7 @@ typedef struct rtp_jpeg_qt_t {
  * The buf and out params must not be NULL.
  * The payload pointer will point into buf.
  * *parsed_sz will be set to the number of bytes parsed.
+ * A length of 0 means that the tables for this Q value were sent with a previous frame.
  * Returns ESP_OK on success.
  */
 esp_err_t parse_rtp_jpeg_qt(const uint8_t *buf, ptrdiff_t sz, rtp_jpeg_qt_t *out,
@@ -80,10 +96,41 @@ void rtp_jpeg_qt_print(const rtp_jpeg_qt_t *p);
 
 #ifndef ESP_PLATFORM
 #define CONFIG_RTP_JPEG_MAX_DATA_SIZE_BYTES (22 * 1024)
+#define CONFIG_RTP_JPEG_HEADER_CACHE_N_ENTRIES (2)
 #endif
 
+_Static_assert(CONFIG_RTP_JPEG_HEADER_CACHE_N_ENTRIES > 0, "Header cache must not be empty");
+
+// Types offset by this carry the restart marker header.
+#define RTP_JPEG_TYPE_RESTART 64
+// Restart count of packets which do not start a restart interval.
+#define RTP_JPEG_RESTART_COUNT_NONE 0x3FFF
+
+// Size of the luma and chroma quantization tables with 8 bit precision.
+#define RTP_JPEG_QT_SIZE_BYTES 128
+
+/**
+ * A JFIF header built by rfc2435_make_headers(), for reuse by frames with the same parameters.
+ */
+typedef struct rtp_jpeg_header_cache_entry_t {
+    bool valid;
+    uint32_t last_used;  // Session header clock at the last use, to evict the oldest entry.
+
+    // Key.
+    uint8_t type;  // Without the restart marker offset.
+    uint8_t q;
+    uint16_t width;
+    uint16_t height;
+    uint16_t dri;
+    uint8_t qt[RTP_JPEG_QT_SIZE_BYTES];  // Luma and chroma tables, computed from q if q < 128.
+
+    uint8_t header[RFC2435_HEADER_MAX_SIZE_BYTES];
+    ptrdiff_t header_sz;
+} rtp_jpeg_header_cache_entry_t;
+
 // A fully assembled RTP/JPEG frame.
 typedef struct rtp_jpeg_frame_t {
+    uint32_t ssrc;       // SSRC of the session.
     int width, height;   // Image size.
     uint32_t timestamp;  // RTP timestamp of the frame.
 
@@ -92,17 +139,48 @@ typedef struct rtp_jpeg_frame_t {
     const uint8_t *jpeg_data;
     ptrdiff_t jpeg_data_sz;
     ptrdiff_t jfif_header_sz;  // Size of the JFIF header, contained in jpeg_data at the start.
+
+    // Restart intervals which were lost and replaced with gray ones, 0 if the frame is intact.
+    int concealed_intervals;
+
+    // Arrival times of the first and the last packet of the frame, which is the marker packet
+    // unless it was lost. From the packet views fed, see rtp_packet_view_t.
+    int64_t first_arrival_us;
+    int64_t last_arrival_us;
 } rtp_jpeg_frame_t;
 
 /**
  * Will be called from rtp_jpeg_session_feed() when a complete JPEG frame has been received and
- * assembled, at most once per invocation. The buffers remain owned by the session and are valid
- * only during the invocation of the callback.
+ * assembled, at most once per invocation. The exception is a frame closed because of a lost marker
+ * packet, which may be followed by a frame consisting of the packet fed.
+ * The buffers remain owned by the session and are valid only during the invocation of the
+ * callback.
  */
 typedef void (*rtp_jpeg_frame_cb)(const rtp_jpeg_frame_t *frame, void *userdata);
 
+// Counters of a RTP/JPEG session, see rtp_jpeg_session_stats().
+typedef struct rtp_jpeg_session_stats_t {
+    uint32_t frames_completed;
+    uint32_t frames_dropped;   // Frames lost, or abandoned because of missing or bad packets.
+    uint32_t frames_oversize;  // Frames abandoned because of CONFIG_RTP_JPEG_MAX_DATA_SIZE_BYTES.
+    uint32_t frames_rescued;   // Completed frames with a packet retransmitted or recovered by FEC.
+    uint32_t frames_damaged;   // Completed frames with concealed restart intervals.
+
+    // Frames dropped by reason, these add up to frames_dropped.
+    uint32_t dropped_missing;      // Packets lost which could not be concealed, i.e. a fragment
+                                   // offset mismatch, or the first or marker packet was lost.
+    uint32_t dropped_header;       // A RTP/JPEG header bad or not matching the first packet.
+    uint32_t dropped_unsupported;  // A type, Q or quantization table which is not supported.
+
+    uint64_t bytes_copied;  // JFIF headers and payload copied into frames.
+} rtp_jpeg_session_stats_t;
+
 /**
  * A RTP/JPEG session de-payloads and assembles JPEG frames from RTP packets.
+ * Frames are completed by the marker bit or an EOI marker. If packets of a frame with restart
+ * markers (types 64-127) are lost, the frame is still handed out, with the lost restart intervals
+ * replaced by gray ones. This includes frames whose marker packet was lost, which are closed once
+ * the next frame starts. Frames without restart markers are dropped in that case.
  * Use init_rtp_jpeg_session() to initialize an instance before usage.
  * All struct members are private to the implementation.
  */
@@ -113,19 +191,45 @@ typedef struct rtp_jpeg_session_t {
     // Its payload will be set to NULL, we only care about the metadata.
     rtp_jpeg_packet_t header;
     uint32_t rtp_timestamp;  // RTP timestamp of the frame.
+    bool has_timestamp;      // Whether rtp_timestamp is set, as any value is a valid timestamp.
 
-    // Will contain the fully assembled frame in JPEG File Interchange Format (JFIF).
-    uint8_t jpeg_data[CONFIG_RTP_JPEG_MAX_DATA_SIZE_BYTES];
+    // Size of the frame in jpeg_data below.
     ptrdiff_t jpeg_data_sz;
     ptrdiff_t jfif_header_sz;  // Size of the JFIF header, contained in jpeg_data at the start.
+    bool rescued;              // Whether a packet of the current frame was rescued, see above.
+    int64_t first_arrival_us;  // Of the first packet of the current frame.
+    int64_t last_arrival_us;   // Of the last packet appended to the current frame.
+
+    // Restart interval state of the current frame, see rtp_jpeg_packet_t.
+    uint32_t next_fragment_offset;  // Expected fragment offset of the next packet.
+    uint16_t dri;                   // Restart interval in MCUs, 0 if the frame has none.
+    int n_mcus;                     // MCUs in the frame.
+    int next_interval;              // Index of the restart interval being assembled.
+    ptrdiff_t interval_start_sz;    // Offset of that restart interval in jpeg_data.
+    int concealed_intervals;        // Restart intervals replaced with gray ones so far.
+
+    // In-band quantization tables of the last frame with Q 128-254, for later frames which
+    // refer to them with a table length of 0.
+    uint8_t qt_q;  // 0 if none.
+    uint8_t qt[RTP_JPEG_QT_SIZE_BYTES];
+
+    rtp_jpeg_header_cache_entry_t header_cache[CONFIG_RTP_JPEG_HEADER_CACHE_N_ENTRIES];
+    uint32_t header_clock;
 
     rtp_jpeg_frame_cb frame_cb;
     void *userdata;
+
+    rtp_jpeg_session_stats_t stats;
+
+    // Will contain the fully assembled frame in JPEG File Interchange Format (JFIF).
+    // Last, as only the jpeg_data_sz bytes of it are ever read, so it is not cleared.
+    uint8_t jpeg_data[CONFIG_RTP_JPEG_MAX_DATA_SIZE_BYTES];
 } rtp_jpeg_session_t;
 
 /**
  * Initialize a session with a given SSRC and callback.
  * Userdata will be passed to the callback as last argument and may be NULL.
+ * Clears all state but jpeg_data, which is poisoned in debug builds instead, see fakesp.h.
  */
 void init_rtp_jpeg_session(const uint32_t ssrc, rtp_jpeg_frame_cb frame_cb, void *userdata,
                            rtp_jpeg_session_t *s);
@@ -133,5 +237,9 @@ void init_rtp_jpeg_session(const uint32_t ssrc, rtp_jpeg_frame_cb frame_cb, void
 /**
  * Feed a RTP packet to an RTP/JPEG session.
  * Packets are expected to be ordered and deduplicated (use jitbuf for this).
+ * The view is typically obtained from rtp_jitbuf_peek_next() or parse_rtp_packet_view().
  */
-esp_err_t rtp_jpeg_session_feed(rtp_jpeg_session_t *s, const rtp_packet_t *p);
+esp_err_t rtp_jpeg_session_feed(rtp_jpeg_session_t *s, const rtp_packet_view_t *p);
+
+// Get the counters of a session.
+void rtp_jpeg_session_stats(const rtp_jpeg_session_t *s, rtp_jpeg_session_stats_t *out);
@@ -0,0 +1,386 @@
+#include "rtp_jpeg_packetizer.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fakesp.h"
+#include "rfc2435.h"
+
+__attribute__((unused)) static const char *TAG = "mjpg_pay";
+
+// Size of one 8 bit quantization table.
+#define QT_TABLE_SIZE_BYTES (RTP_JPEG_QT_SIZE_BYTES / 2)
+
+static uint16_t read_u16(const uint8_t *buf) {
+    return (buf[0] << 8) | buf[1];
+}
+
+static void write_u16(uint8_t *buf, const uint16_t v) {
+    buf[0] = v >> 8;
+    buf[1] = v;
+}
+
+static void write_u32(uint8_t *buf, const uint32_t v) {
+    buf[0] = v >> 24;
+    buf[1] = v >> 16;
+    buf[2] = v >> 8;
+    buf[3] = v;
+}
+
+esp_err_t init_rtp_jpeg_packetizer(const uint32_t ssrc, const uint16_t sequence_number,
+                                   const ptrdiff_t packet_sz, rtp_jpeg_packetizer_t *out) {
+    assert(out != NULL);
+    memset(out, 0, sizeof(*out));
+    if (packet_sz < RTP_JPEG_PACKETIZER_MIN_PACKET_SIZE_BYTES) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    out->ssrc = ssrc;
+    out->sequence_number = sequence_number;
+    out->packet_sz = packet_sz;
+    return ESP_OK;
+}
+
+/**
+ * Parse the frame header (SOF0) into the packetizer.
+ * Sets *lqt_out and *cqt_out to the ids of the luma and chroma quantization tables.
+ */
+static esp_err_t rtp_jpeg_packetizer_parse_sof(rtp_jpeg_packetizer_t *p, const uint8_t *seg,
+                                               const ptrdiff_t sz, int *lqt_out, int *cqt_out) {
+    if (sz < 6 + 3 * 3) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const uint16_t height = read_u16(&seg[1]);
+    const uint16_t width = read_u16(&seg[3]);
+    if (seg[0] != 8 || seg[5] != 3) {
+        // Only 8 bit YUV.
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (width == 0 || height == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (width > 2040 || height > 2040) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    // Components: id, sampling factors, quantization table id.
+    const uint8_t *y = &seg[6];
+    const uint8_t *cb = &seg[9];
+    const uint8_t *cr = &seg[12];
+    if (cb[1] != 0x11 || cr[1] != 0x11 || cb[2] != cr[2] || y[2] > 3 || cb[2] > 3) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (y[1] == 0x21) {
+        p->type = 0;
+    } else if (y[1] == 0x22) {
+        p->type = 1;
+    } else {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    // Sent in units of 8 pixels, as the receiver's decoder sees it the image gets padded.
+    p->width = (width + 7) & ~7;
+    p->height = (height + 7) & ~7;
+    *lqt_out = y[2];
+    *cqt_out = cb[2];
+    return ESP_OK;
+}
+
+esp_err_t rtp_jpeg_packetizer_start(rtp_jpeg_packetizer_t *p, const uint8_t *jpeg,
+                                    const ptrdiff_t sz, const uint32_t timestamp) {
+    assert(p != NULL);
+    assert(jpeg != NULL);
+    p->scan = NULL;
+    p->scan_sz = 0;
+    p->offset = 0;
+    if (sz < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Walk the markers up to the start of the scan, keeping the tables and parameters.
+    uint8_t tables[4][QT_TABLE_SIZE_BYTES];
+    int have_tables = 0;  // Bit mask of the table ids defined.
+    int lqt = -1;
+    int cqt = -1;
+    uint16_t dri = 0;
+    ptrdiff_t i = 2;
+    while (1) {
+        if (i + 4 > sz || jpeg[i] != 0xFF) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        const uint8_t marker = jpeg[i + 1];
+        if (marker == 0xFF) {
+            // Fill byte.
+            i++;
+            continue;
+        }
+        const ptrdiff_t len = read_u16(&jpeg[i + 2]);
+        if (len < 2 || i + 2 + len > sz) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        const uint8_t *seg = &jpeg[i + 4];
+        const ptrdiff_t seg_sz = len - 2;
+        i += 2 + len;
+
+        if (marker == 0xDB) {
+            // DQT, one or more tables.
+            for (ptrdiff_t j = 0; j < seg_sz;) {
+                const int precision = seg[j] >> 4;
+                const int id = seg[j] & 0x0F;
+                if (precision != 0) {
+                    // We only send 8 bit precision tables, as we receive.
+                    return ESP_ERR_NOT_SUPPORTED;
+                }
+                if (id > 3 || j + 1 + QT_TABLE_SIZE_BYTES > seg_sz) {
+                    return ESP_ERR_INVALID_ARG;
+                }
+                memcpy(tables[id], &seg[j + 1], QT_TABLE_SIZE_BYTES);
+                have_tables |= 1 << id;
+                j += 1 + QT_TABLE_SIZE_BYTES;
+            }
+        } else if (marker == 0xC0) {
+            // SOF0, baseline.
+            const esp_err_t err = rtp_jpeg_packetizer_parse_sof(p, seg, seg_sz, &lqt, &cqt);
+            if (err != ESP_OK) {
+                return err;
+            }
+        } else if (marker >= 0xC1 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 &&
+                   marker != 0xCC) {
+            // Progressive, lossless, arithmetic coded and so on.
+            return ESP_ERR_NOT_SUPPORTED;
+        } else if (marker == 0xDD) {
+            // DRI.
+            if (seg_sz < 2) {
+                return ESP_ERR_INVALID_ARG;
+            }
+            dri = read_u16(seg);
+        } else if (marker == 0xDA) {
+            // SOS, the scan data follows its header.
+            break;
+        }
+        // APPn, COM and DHT are rebuilt by the receiver or not needed.
+    }
+    if (lqt < 0 || !(have_tables & (1 << lqt)) || !(have_tables & (1 << cqt)) || i >= sz) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memcpy(&p->qt[0], tables[lqt], QT_TABLE_SIZE_BYTES);
+    memcpy(&p->qt[QT_TABLE_SIZE_BYTES], tables[cqt], QT_TABLE_SIZE_BYTES);
+    p->dri = dri;
+    p->timestamp = timestamp;
+    p->scan = &jpeg[i];
+    p->scan_sz = sz - i;
+    p->next_interval = 0;
+    p->at_interval_start = true;
+    ESP_LOGD(TAG, "Frame type=%" PRIu8 " %" PRIu16 "x%" PRIu16 " dri=%" PRIu16 " scan_sz=%td",
+             p->type, p->width, p->height, p->dri, p->scan_sz);
+    return ESP_OK;
+}
+
+ptrdiff_t rtp_jpeg_packetizer_next(rtp_jpeg_packetizer_t *p, uint8_t *buf, const ptrdiff_t sz) {
+    assert(p != NULL);
+    assert(buf != NULL);
+    if (p->offset >= p->scan_sz || sz < p->packet_sz) {
+        return 0;
+    }
+    const bool first = p->offset == 0;
+    const ptrdiff_t headers_sz = 12 + 8 + (p->dri > 0 ? 4 : 0) + (first ? 4 + sizeof(p->qt) : 0);
+    ptrdiff_t end = p->offset + p->packet_sz - headers_sz;
+    if (end > p->scan_sz) {
+        end = p->scan_sz;
+    }
+
+    // With restart markers, end the packet after the last RST marker which fits, so that the next
+    // one starts a restart interval. Within the scan, 0xFF is always followed by 0x00 unless it is
+    // a marker.
+    int n_rst = 0;
+    bool ends_interval = end == p->scan_sz;
+    if (p->dri > 0) {
+        ptrdiff_t last_rst_end = -1;
+        ptrdiff_t i = p->offset;
+        while (i + 1 < end) {
+            const uint8_t *ff = memchr(&p->scan[i], 0xFF, end - 1 - i);
+            if (ff == NULL) {
+                break;
+            }
+            i = ff - p->scan;
+            if (ff[1] >= 0xD0 && ff[1] <= 0xD7) {
+                n_rst++;
+                last_rst_end = i + 2;
+            }
+            i++;
+        }
+        if (!ends_interval && last_rst_end > p->offset) {
+            end = last_rst_end;
+            ends_interval = true;
+        } else if (!ends_interval && end - 1 > p->offset && p->scan[end - 1] == 0xFF) {
+            // Keep a marker in one packet, so it is counted above.
+            end--;
+        }
+    }
+
+    // RTP header.
+    buf[0] = 0x80;
+    buf[1] = RTP_PT_JPEG | (end == p->scan_sz ? 0x80 : 0);
+    write_u16(&buf[2], p->sequence_number);
+    write_u32(&buf[4], p->timestamp);
+    write_u32(&buf[8], p->ssrc);
+
+    // RTP/JPEG header.
+    uint8_t *h = &buf[12];
+    write_u32(&h[0], p->offset);
+    h[0] = 0;  // Type-specific.
+    h[4] = p->type + (p->dri > 0 ? RTP_JPEG_TYPE_RESTART : 0);
+    h[5] = 255;  // The tables are sent in-band with every frame.
+    h[6] = p->width / 8;
+    h[7] = p->height / 8;
+    h += 8;
+
+    if (p->dri > 0) {
+        // Restart counts beyond the 14 bits of the field cannot be told.
+        const bool counted =
+            p->at_interval_start && p->next_interval < RTP_JPEG_RESTART_COUNT_NONE;
+        const uint16_t count = counted ? p->next_interval : RTP_JPEG_RESTART_COUNT_NONE;
+        write_u16(&h[0], p->dri);
+        write_u16(&h[2], count);
+        h[2] |= (p->at_interval_start ? 0x80 : 0) | (ends_interval ? 0x40 : 0);
+        h += 4;
+    }
+    if (first) {
+        h[0] = 0;  // MBZ.
+        h[1] = 0;  // 8 bit precision for both tables.
+        write_u16(&h[2], sizeof(p->qt));
+        memcpy(&h[4], p->qt, sizeof(p->qt));
+        h += 4 + sizeof(p->qt);
+    }
+    assert(h - buf == headers_sz);
+    memcpy(h, &p->scan[p->offset], end - p->offset);
+
+    const ptrdiff_t packet_sz = headers_sz + end - p->offset;
+    p->sequence_number++;
+    p->next_interval += n_rst;
+    p->at_interval_start = ends_interval;
+    p->offset = end;
+    return packet_sz;
+}
+
+// Writes entropy coded data, stuffing 0xFF bytes.
+typedef struct bit_writer_t {
+    uint8_t *buf;
+    ptrdiff_t sz;
+    ptrdiff_t pos;
+    uint32_t bits;
+    int n_bits;
+    bool overflow;
+} bit_writer_t;
+
+static void put_byte(bit_writer_t *w, const uint8_t byte) {
+    if (w->pos >= w->sz) {
+        w->overflow = true;
+        return;
+    }
+    w->buf[w->pos++] = byte;
+}
+
+// Append the n (at most 16) low bits of code.
+static void put_bits(bit_writer_t *w, const uint32_t code, const int n) {
+    w->bits = (w->bits << n) | (code & ((1u << n) - 1));
+    w->n_bits += n;
+    while (w->n_bits >= 8) {
+        w->n_bits -= 8;
+        const uint8_t byte = w->bits >> w->n_bits;
+        put_byte(w, byte);
+        if (byte == 0xFF) {
+            put_byte(w, 0x00);
+        }
+    }
+}
+
+// Pad to a byte with 1 bits, before a marker.
+static void pad_bits(bit_writer_t *w) {
+    if (w->n_bits > 0) {
+        put_bits(w, 0xFF, 8 - w->n_bits);
+    }
+}
+
+// Codes of the luma DC categories 0-11, JPEG spec Table K.3.
+static const uint16_t luma_dc_codes[] = {0x0, 0x2, 0x3, 0x4, 0x5, 0x6,
+                                         0xE, 0x1E, 0x3E, 0x7E, 0xFE, 0x1FE};
+static const uint8_t luma_dc_code_lens[] = {2, 3, 3, 3, 3, 3, 4, 5, 6, 7, 8, 9};
+
+// Luma DC difference, then k AC coefficients of +-1 with signs from noise, and EOB.
+static void put_luma_block(bit_writer_t *w, const int diff, const int k, uint32_t *noise) {
+    int cat = 0;
+    while (abs(diff) >> cat) {
+        cat++;
+    }
+    put_bits(w, luma_dc_codes[cat], luma_dc_code_lens[cat]);
+    if (cat > 0) {
+        put_bits(w, diff >= 0 ? diff : diff + (1 << cat) - 1, cat);
+    }
+    for (int i = 0; i < k; i++) {
+        // Xorshift.
+        *noise ^= *noise << 13;
+        *noise ^= *noise >> 17;
+        *noise ^= *noise << 5;
+        put_bits(w, 0x0, 2);  // Run 0, size 1.
+        put_bits(w, *noise, 1);
+    }
+    if (k < 63) {
+        put_bits(w, 0xA, 4);  // EOB.
+    }
+}
+
+ptrdiff_t rtp_jpeg_synth_frame(const int width, const int height, const uint16_t dri,
+                               const uint32_t frame, const ptrdiff_t target_sz, uint8_t *buf,
+                               const ptrdiff_t sz) {
+    assert(width > 0 && width <= 2032 && width % 16 == 0);
+    assert(height > 0 && height <= 2032 && height % 16 == 0);
+    assert(buf != NULL);
+    if (sz < RFC2435_HEADER_MAX_SIZE_BYTES) {
+        return 0;
+    }
+    uint8_t lqt[QT_TABLE_SIZE_BYTES];
+    uint8_t cqt[QT_TABLE_SIZE_BYTES];
+    rfc2435_make_tables(50, lqt, cqt);
+    const ptrdiff_t header_sz = rfc2435_make_headers(buf, 1, width / 8, height / 8, lqt, cqt, dri);
+
+    // Spend the bits left over on noise: a block takes about 8 bits for DC, EOB and its share of
+    // the chroma blocks, and 3 bits per AC coefficient.
+    const int mcus_x = width / 16;
+    const int n_mcus = mcus_x * (height / 16);
+    const int64_t bits_per_block = (target_sz - header_sz) * 8 / (n_mcus * 4);
+    int k = (bits_per_block - 8) / 3;
+    k = k < 0 ? 0 : k > 63 ? 63 : k;
+
+    bit_writer_t w = {.buf = buf, .sz = sz, .pos = header_sz};
+    uint32_t noise = frame * 2654435761u + 1;
+    if (noise == 0) {
+        noise = 1;
+    }
+    const int cols = width / 8;
+    const int bar = cols / 8 > 0 ? cols / 8 : 1;
+    int pred = 0;
+    for (int m = 0; m < n_mcus; m++) {
+        if (dri > 0 && m > 0 && m % dri == 0) {
+            pad_bits(&w);
+            put_byte(&w, 0xFF);
+            put_byte(&w, 0xD0 + ((m / dri - 1) & 0x07));
+            pred = 0;
+        }
+        // Four luma blocks, left to right and top to bottom, then Cb and Cr.
+        for (int b = 0; b < 4; b++) {
+            const int col = (m % mcus_x) * 2 + (b & 1);
+            const bool bright = ((col - (int)(frame % cols) + cols) % cols) < bar;
+            const int dc = bright ? 48 : -24;
+            put_luma_block(&w, dc - pred, k, &noise);
+            pred = dc;
+        }
+        put_bits(&w, 0x0, 4);  // DC difference 0 and EOB.
+        put_bits(&w, 0x0, 4);
+    }
+    pad_bits(&w);
+    put_byte(&w, 0xFF);
+    put_byte(&w, 0xD9);  // EOI.
+    return w.overflow ? 0 : w.pos;
+}
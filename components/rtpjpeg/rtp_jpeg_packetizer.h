@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fakesp.h"
+#include "rtp_jpeg.h"
+
+// RTP header, RTP/JPEG header, restart marker header, quantization table header and tables.
+#define RTP_JPEG_PACKETIZER_HEADERS_SIZE_BYTES (12 + 8 + 4 + 4 + RTP_JPEG_QT_SIZE_BYTES)
+// Room for at least one byte of scan data in the first packet of a frame.
+#define RTP_JPEG_PACKETIZER_MIN_PACKET_SIZE_BYTES (RTP_JPEG_PACKETIZER_HEADERS_SIZE_BYTES + 1)
+
+/**
+ * A RTP/JPEG packetizer, the sending side of rtp_jpeg_session_t.
+ * Takes baseline JFIF frames as produced by common encoders, drops the headers which receivers
+ * rebuild with rfc2435_make_headers(), and splits the scan data into packets of the RTP/JPEG
+ * header, the quantization tables in-band (Q 255) in the first packet, and the data. Frames with a
+ * restart interval (DRI marker) are sent as types 64-127 with packets cut after RST markers where
+ * possible, so receivers can conceal lost packets.
+ * The Huffman tables of the frames are not sent, receivers use those of RFC 2435 Appendix B, i.e.
+ * the typical ones from the JPEG spec, which encoders use unless told to optimize them.
+ * Use init_rtp_jpeg_packetizer() to initialize an instance before usage.
+ * All struct members are private to the implementation.
+ */
+typedef struct rtp_jpeg_packetizer_t {
+    uint32_t ssrc;
+    uint16_t sequence_number;  // Of the next packet.
+    ptrdiff_t packet_sz;       // Max size of a packet, RTP header included.
+
+    // The frame being sent, see rtp_jpeg_packetizer_start().
+    uint32_t timestamp;
+    uint8_t type;  // Without the restart marker offset.
+    uint16_t width;
+    uint16_t height;
+    uint16_t dri;
+    uint8_t qt[RTP_JPEG_QT_SIZE_BYTES];
+    const uint8_t *scan;  // Scan data up to the end of the frame, not owned by this struct.
+    ptrdiff_t scan_sz;
+    ptrdiff_t offset;        // Of the next packet in scan, scan_sz once the frame is sent.
+    int next_interval;       // Index of the restart interval at offset.
+    bool at_interval_start;  // Whether offset is the start of that restart interval.
+} rtp_jpeg_packetizer_t;
+
+/**
+ * Initialize a packetizer for a stream with the given SSRC and first sequence number, sending
+ * packets of up to packet_sz bytes, at least RTP_JPEG_PACKETIZER_MIN_PACKET_SIZE_BYTES.
+ */
+esp_err_t init_rtp_jpeg_packetizer(const uint32_t ssrc, const uint16_t sequence_number,
+                                   const ptrdiff_t packet_sz, rtp_jpeg_packetizer_t *out);
+
+/**
+ * Start sending a frame in JFIF with the given RTP timestamp, abandoning the current one.
+ * The jpeg buffer must remain valid until the last packet of the frame was written.
+ * Returns ESP_ERR_NOT_SUPPORTED if RTP/JPEG cannot carry the frame: it is not baseline, not 8 bit
+ * YUV 4:2:2 or 4:2:0, or larger than 2040 pixels. Returns ESP_ERR_INVALID_ARG if it is malformed.
+ */
+esp_err_t rtp_jpeg_packetizer_start(rtp_jpeg_packetizer_t *p, const uint8_t *jpeg,
+                                    const ptrdiff_t sz, const uint32_t timestamp);
+
+/**
+ * Write the next packet of the frame to buf, which has extent sz of at least packet_sz.
+ * The last packet of a frame has the marker bit set.
+ * Returns the size of the packet, or 0 if the frame has been sent or buf is too small.
+ */
+ptrdiff_t rtp_jpeg_packetizer_next(rtp_jpeg_packetizer_t *p, uint8_t *buf, const ptrdiff_t sz);
+
+/**
+ * Write a synthetic 4:2:0 frame in JFIF to buf, which has extent sz, to test receivers without a
+ * camera or encoder: a bright bar moving one 8 pixel column per frame over a noisy background.
+ * The noise is varied to make the frame about target_sz bytes large, if width and height allow.
+ * width and height must be multiples of 16 up to 2032. With a dri > 0, the frame has a restart
+ * interval of dri MCUs.
+ * Returns the size of the frame, or 0 if buf is too small.
+ */
+ptrdiff_t rtp_jpeg_synth_frame(const int width, const int height, const uint16_t dri,
+                               const uint32_t frame, const ptrdiff_t target_sz, uint8_t *buf,
+                               const ptrdiff_t sz);
@@ -0,0 +1,123 @@
+#include "rtp_log.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <string.h>
+
+#ifdef ESP_PLATFORM
+#include <esp_timer.h>
+#else
+#include <time.h>
+#endif
+
+__attribute__((unused)) static const char *TAG = "rtp_log";
+
+// The ring of the deferred log, see init_rtp_log().
+static rtp_log_record_t *records = NULL;
+static int n_records = 0;
+static atomic_uint head = 0;  // Records written.
+static unsigned tail = 0;     // Records flushed.
+
+static int64_t rtp_log_now_us() {
+#ifdef ESP_PLATFORM
+    return esp_timer_get_time();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+// Format a record, the arguments beyond n_args are 0 and ignored by the format.
+static void rtp_log_format(const char *format, const uint32_t *args, const int n_args, char *out,
+                           const ptrdiff_t out_sz) {
+    uint32_t a[RTP_LOG_MAX_ARGS] = {0};
+    memcpy(a, args, n_args * sizeof(a[0]));
+    _Static_assert(RTP_LOG_MAX_ARGS == 10, "Pass all arguments below");
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+    snprintf(out, out_sz, format, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9]);
+#pragma GCC diagnostic pop
+}
+
+esp_err_t init_rtp_log(rtp_log_record_t *r, const int n) {
+    if (r == NULL || n < 1 || (n & (n - 1)) != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (int i = 0; i < n; i++) {
+        atomic_init(&r[i].seq, 0);
+    }
+    n_records = n;
+    tail = atomic_load(&head);
+    records = r;
+    return ESP_OK;
+}
+
+void rtp_log_write(const esp_log_level_t level, const char *tag, const char *format,
+                   const uint32_t *args, const int n_args) {
+    assert(n_args <= RTP_LOG_MAX_ARGS);
+    if (records == NULL) {
+        char line[256];
+        rtp_log_format(format, args, n_args, line, sizeof(line));
+        ESP_LOG_LEVEL(level, tag, "%s", line);
+        return;
+    }
+
+    // Claim a record, and mark it as being written until it is.
+    const unsigned i = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+    rtp_log_record_t *r = &records[i & (n_records - 1)];
+    atomic_store_explicit(&r->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    r->level = level;
+    r->n_args = n_args;
+    r->tag = tag;
+    r->format = format;
+    r->t_us = rtp_log_now_us();
+    memcpy(r->args, args, n_args * sizeof(args[0]));
+    atomic_store_explicit(&r->seq, i + 1, memory_order_release);
+}
+
+uint32_t rtp_log_flush() {
+    if (records == NULL) {
+        return 0;
+    }
+    uint32_t lost = 0;
+    const unsigned end = atomic_load(&head);
+    if (end - tail > (unsigned)n_records) {
+        // Overwritten before they were flushed.
+        lost += end - tail - n_records;
+        tail = end - n_records;
+    }
+    for (; tail != end; tail++) {
+        const rtp_log_record_t *r = &records[tail & (n_records - 1)];
+        const unsigned seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+        if (seq != tail + 1) {
+            if (seq == 0 || (int)(seq - (tail + 1)) < 0) {
+                break;  // Still being written, flushed next time.
+            }
+            lost++;  // Overwritten already.
+            continue;
+        }
+        rtp_log_record_t copy;
+        copy.level = r->level;
+        copy.n_args = r->n_args;
+        copy.tag = r->tag;
+        copy.format = r->format;
+        copy.t_us = r->t_us;
+        memcpy(copy.args, r->args, sizeof(copy.args));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&r->seq, memory_order_relaxed) != tail + 1) {
+            lost++;
+            continue;
+        }
+
+        char line[256];
+        rtp_log_format(copy.format, copy.args, copy.n_args, line, sizeof(line));
+        ESP_LOG_LEVEL((esp_log_level_t)copy.level, copy.tag, "@%" PRId64 "us %s", copy.t_us,
+                      line);
+    }
+    if (lost > 0) {
+        ESP_LOGW(TAG, "Lost %" PRIu32 " records, flush more often or enlarge the ring", lost);
+    }
+    return lost;
+}
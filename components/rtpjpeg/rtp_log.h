@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "fakesp.h"
+
+/**
+ * Deferred logging for the packet path: RTP_LOGD() and RTP_LOGV() take the place of ESP_LOGD()
+ * and ESP_LOGV(), but once init_rtp_log() set up a ring, they only store the format, the raw
+ * arguments and a timestamp. rtp_log_flush() formats the records later, off the packet path, so
+ * debug logging hardly changes the timing it is meant to diagnose.
+ * Without a ring, records are formatted and logged right away, as with ESP_LOGx().
+ *
+ * Levels above RTP_LOG_LEVEL are removed at compile time. Arguments are stored as 32 bits each,
+ * so formats must not take wider ones, i.e. no %ld, %lld, PRId64 or %s, which the compiler does not
+ * check. Up to RTP_LOG_MAX_ARGS arguments.
+ */
+
+#define RTP_LOG_MAX_ARGS 10
+
+#ifndef RTP_LOG_LEVEL
+#ifdef ESP_PLATFORM
+#define RTP_LOG_LEVEL CONFIG_LOG_MAXIMUM_LEVEL
+#elif defined(NDEBUG)
+#define RTP_LOG_LEVEL ESP_LOG_NONE
+#else
+#define RTP_LOG_LEVEL ESP_LOG_VERBOSE
+#endif
+#endif
+
+// A record in the ring, see rtp_log_write().
+typedef struct rtp_log_record_t {
+    atomic_uint seq;  // 1 + its index once written, 0 while written.
+    uint8_t level;
+    uint8_t n_args;
+    const char *tag;
+    const char *format;  // The string literal of the call, which tells the call.
+    int64_t t_us;
+    uint32_t args[RTP_LOG_MAX_ARGS];
+} rtp_log_record_t;
+
+/**
+ * Set up the ring of the deferred log, of the last n_records records, which must be a power of
+ * two. Records are written without locks by any number of threads, and overwrite the oldest ones
+ * not flushed yet, which are counted as lost.
+ * Returns ESP_ERR_INVALID_ARG unless n_records is a power of two.
+ */
+esp_err_t init_rtp_log(rtp_log_record_t *records, const int n_records);
+
+/**
+ * Format and log the records written since the last flush, with the time they were written.
+ * Only one thread may flush at a time. Returns the number of records lost since the last flush.
+ */
+uint32_t rtp_log_flush();
+
+// Use RTP_LOGD() or RTP_LOGV() instead.
+void rtp_log_write(const esp_log_level_t level, const char *tag, const char *format,
+                   const uint32_t *args, const int n_args);
+
+// The arguments are type checked against the format by the dead printf() call.
+#define RTP_LOG_AT(level, tag, format, ...)                                                     \
+    do {                                                                                        \
+        if ((level) <= RTP_LOG_LEVEL) {                                                         \
+            if (0) {                                                                            \
+                printf(format, ##__VA_ARGS__);                                                  \
+            }                                                                                   \
+            const uint32_t rtp_log_args_[] = {0, ##__VA_ARGS__};                                \
+            _Static_assert(sizeof(rtp_log_args_) <= sizeof(uint32_t) * (RTP_LOG_MAX_ARGS + 1),  \
+                           "Too many arguments to log");                                        \
+            rtp_log_write((level), (tag), (format), &rtp_log_args_[1],                          \
+                          sizeof(rtp_log_args_) / sizeof(rtp_log_args_[0]) - 1);                \
+        }                                                                                       \
+    } while (0)
+
+#define RTP_LOGD(tag, format, ...) RTP_LOG_AT(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#define RTP_LOGV(tag, format, ...) RTP_LOG_AT(ESP_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
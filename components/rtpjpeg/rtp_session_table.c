@@ -0,0 +1,268 @@
+#include "rtp_session_table.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <string.h>
+
+__attribute__((unused)) static const char *TAG = "rtp_session_table";
+
+// Fibonacci hashing, takes the top hash_bits of the SSRC times 2^32 / golden ratio.
+static int32_t rtp_session_table_bucket(const rtp_session_table_t *t, const uint32_t ssrc) {
+    const uint32_t h = ssrc * UINT32_C(2654435769);
+    return (int32_t)(((uint64_t)h << t->hash_bits) >> 32);
+}
+
+esp_err_t init_rtp_session_table(rtp_session_table_entry_t *entries, const int n_entries,
+                                 const int64_t idle_timeout_us, rtp_slab_t *slab,
+                                 rtp_jpeg_frame_cb frame_cb, void *userdata,
+                                 rtp_session_table_t *out) {
+    if (entries == NULL || slab == NULL || frame_cb == NULL || out == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(out, 0, sizeof(*out));
+    if (n_entries <= 0 || idle_timeout_us <= 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    out->entries = entries;
+    while (out->hash_bits < 30 && (1 << (out->hash_bits + 1)) <= n_entries) {
+        out->hash_bits++;
+    }
+    for (int i = 0; i < n_entries; i++) {
+        rtp_session_table_entry_t *e = &entries[i];
+        e->active = false;
+        e->bucket = -1;
+        e->hash_next = i + 1 < n_entries ? i + 1 : -1;
+        e->lru_prev = -1;
+        e->lru_next = -1;
+    }
+    out->free_head = 0;
+    out->lru_head = -1;
+    out->lru_tail = -1;
+    out->idle_timeout_us = idle_timeout_us;
+    out->slab = slab;
+    out->frame_cb = frame_cb;
+    out->userdata = userdata;
+    out->stats.max_streams = n_entries;
+    return ESP_OK;
+}
+
+rtp_session_table_entry_t *rtp_session_table_find(const rtp_session_table_t *t,
+                                                  const uint32_t ssrc) {
+    assert(t != NULL);
+    int32_t i = t->entries[rtp_session_table_bucket(t, ssrc)].bucket;
+    while (i >= 0 && t->entries[i].ssrc != ssrc) {
+        i = t->entries[i].hash_next;
+    }
+    return i >= 0 ? &t->entries[i] : NULL;
+}
+
+// Unlink entry i from the LRU list.
+static void rtp_session_table_lru_remove(rtp_session_table_t *t, const int32_t i) {
+    rtp_session_table_entry_t *e = &t->entries[i];
+    if (e->lru_prev >= 0) {
+        t->entries[e->lru_prev].lru_next = e->lru_next;
+    } else {
+        t->lru_head = e->lru_next;
+    }
+    if (e->lru_next >= 0) {
+        t->entries[e->lru_next].lru_prev = e->lru_prev;
+    } else {
+        t->lru_tail = e->lru_prev;
+    }
+    e->lru_prev = -1;
+    e->lru_next = -1;
+}
+
+// Link entry i as the most recently active one.
+static void rtp_session_table_lru_push(rtp_session_table_t *t, const int32_t i) {
+    rtp_session_table_entry_t *e = &t->entries[i];
+    e->lru_prev = -1;
+    e->lru_next = t->lru_head;
+    if (t->lru_head >= 0) {
+        t->entries[t->lru_head].lru_prev = i;
+    } else {
+        t->lru_tail = i;
+    }
+    t->lru_head = i;
+}
+
+// Remove stream i, handing back its blocks.
+static void rtp_session_table_evict(rtp_session_table_t *t, const int32_t i) {
+    rtp_session_table_entry_t *e = &t->entries[i];
+    assert(e->active);
+    ESP_LOGI(TAG, "Removing stream ssrc=%08" PRIx32 " after %" PRIu32 " frames", e->ssrc,
+             e->jpeg.stats.frames_completed);
+
+    int32_t *link = &t->entries[rtp_session_table_bucket(t, e->ssrc)].bucket;
+    while (*link != i) {
+        assert(*link >= 0);
+        link = &t->entries[*link].hash_next;
+    }
+    *link = e->hash_next;
+    rtp_session_table_lru_remove(t, i);
+
+    rtp_jitbuf_destroy(&e->jitbuf);
+    e->active = false;
+    e->hash_next = t->free_head;
+    t->free_head = i;
+    t->stats.n_streams--;
+}
+
+// Start a stream, making room for it if the table is full.
+static rtp_session_table_entry_t *rtp_session_table_create(rtp_session_table_t *t,
+                                                           const uint32_t ssrc) {
+    if (t->free_head < 0) {
+        assert(t->lru_tail >= 0);
+        rtp_session_table_evict(t, t->lru_tail);
+        t->stats.evicted_lru++;
+    }
+    const int32_t i = t->free_head;
+    rtp_session_table_entry_t *e = &t->entries[i];
+    t->free_head = e->hash_next;
+
+    ESP_LOGI(TAG, "Starting stream ssrc=%08" PRIx32, ssrc);
+    e->ssrc = ssrc;
+    e->active = true;
+    init_rtp_jitbuf(ssrc, t->slab, &e->jitbuf);
+    init_rtp_jpeg_session(ssrc, t->frame_cb, t->userdata, &e->jpeg);
+
+    int32_t *bucket = &t->entries[rtp_session_table_bucket(t, ssrc)].bucket;
+    e->hash_next = *bucket;
+    *bucket = i;
+    rtp_session_table_lru_push(t, i);
+    t->stats.n_streams++;
+    t->stats.created++;
+    return e;
+}
+
+// Returns the stream of ssrc, started if there is none, and marks it as the most recently active.
+static rtp_session_table_entry_t *rtp_session_table_get(rtp_session_table_t *t,
+                                                        const uint32_t ssrc,
+                                                        const int64_t arrival_us) {
+    rtp_session_table_entry_t *e = rtp_session_table_find(t, ssrc);
+    if (e == NULL) {
+        e = rtp_session_table_create(t, ssrc);
+    } else if (e != &t->entries[t->lru_head]) {
+        const int32_t i = e - t->entries;
+        rtp_session_table_lru_remove(t, i);
+        rtp_session_table_lru_push(t, i);
+    }
+    e->last_arrival_us = arrival_us;
+    return e;
+}
+
+void rtp_session_table_destroy(rtp_session_table_t *t) {
+    assert(t != NULL);
+    while (t->lru_head >= 0) {
+        rtp_session_table_evict(t, t->lru_head);
+    }
+}
+
+esp_err_t rtp_session_table_feed(rtp_session_table_t *t, const uint8_t *buf, const ptrdiff_t sz,
+                                 const int64_t arrival_us, rtp_session_table_entry_t **out) {
+    assert(t != NULL);
+    if (out != NULL) {
+        *out = NULL;
+    }
+
+    uint16_t sequence_number = 0;
+    uint32_t ssrc = 0;
+    const esp_err_t err = partial_parse_rtp_packet(buf, sz, &sequence_number, &ssrc);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    rtp_session_table_entry_t *e = rtp_session_table_get(t, ssrc, arrival_us);
+    if (out != NULL) {
+        *out = e;
+    }
+    return rtp_jitbuf_feed(&e->jitbuf, buf, sz, arrival_us);
+}
+
+// Parse the SSRC of a packet, returns false if it is not a RTP packet.
+static bool rtp_session_table_parse_ssrc(const rtp_jitbuf_packet_t *pkt, uint32_t *ssrc_out) {
+    uint16_t sequence_number = 0;
+    return partial_parse_rtp_packet(pkt->buf, pkt->sz, &sequence_number, ssrc_out) == ESP_OK;
+}
+
+int rtp_session_table_feed_batch(rtp_session_table_t *t, const rtp_jitbuf_packet_t *pkts,
+                                 const int n, rtp_session_table_entry_t **out) {
+    assert(t != NULL);
+    assert(n == 0 || (pkts != NULL && out != NULL));
+    int fed = 0;
+    int i = 0;
+    while (i < n) {
+        uint32_t ssrc = 0;
+        if (!rtp_session_table_parse_ssrc(&pkts[i], &ssrc)) {
+            out[i++] = NULL;
+            continue;
+        }
+        // Packets of a stream tend to arrive in bursts, look it up once per run.
+        int end = i + 1;
+        uint32_t next_ssrc = 0;
+        while (end < n && rtp_session_table_parse_ssrc(&pkts[end], &next_ssrc) &&
+               next_ssrc == ssrc) {
+            end++;
+        }
+        rtp_session_table_entry_t *e = rtp_session_table_get(t, ssrc, pkts[end - 1].arrival_us);
+        while (i < end) {
+            const int k = rtp_jitbuf_feed_batch(&e->jitbuf, &pkts[i], end - i);
+            for (int m = i; m < i + k; m++) {
+                out[m] = e;
+            }
+            i += k;
+            fed += k;
+            if (i < end) {
+                // Make room for the rest of the run.
+                rtp_session_table_drain(t, e, pkts[i - 1].arrival_us);
+            }
+        }
+    }
+    return fed;
+}
+
+void rtp_session_table_drain(rtp_session_table_t *t __attribute__((unused)),
+                             rtp_session_table_entry_t *e, const int64_t now_us) {
+    assert(t != NULL);
+    assert(e != NULL && e->active);
+    rtp_packet_view_t packet;
+    while (rtp_jitbuf_peek_next(&e->jitbuf, now_us, &packet) > 0) {
+        if (rtp_jpeg_session_feed(&e->jpeg, &packet) != ESP_OK) {
+            ESP_LOGD(TAG, "Failed to feed RTP packet to jpeg_session");
+        }
+        rtp_jitbuf_release(&e->jitbuf);
+    }
+}
+
+void rtp_session_table_poll(rtp_session_table_t *t, const int64_t now_us) {
+    assert(t != NULL);
+    for (int32_t i = t->lru_head; i >= 0; i = t->entries[i].lru_next) {
+        rtp_session_table_drain(t, &t->entries[i], now_us);
+    }
+    // The LRU list is ordered by arrival time too, so idle streams are at its tail.
+    while (t->lru_tail >= 0 &&
+           now_us - t->entries[t->lru_tail].last_arrival_us > t->idle_timeout_us) {
+        rtp_session_table_evict(t, t->lru_tail);
+        t->stats.evicted_idle++;
+    }
+}
+
+rtp_session_table_entry_t *rtp_session_table_next(const rtp_session_table_t *t,
+                                                  const rtp_session_table_entry_t *e) {
+    assert(t != NULL);
+    const int32_t i = e == NULL ? t->lru_head : e->lru_next;
+    return i >= 0 ? &t->entries[i] : NULL;
+}
+
+int rtp_session_table_index(const rtp_session_table_t *t, const rtp_session_table_entry_t *e) {
+    assert(t != NULL);
+    assert(e != NULL && e >= t->entries && e - t->entries < t->stats.max_streams);
+    return e - t->entries;
+}
+
+void rtp_session_table_stats(const rtp_session_table_t *t, rtp_session_table_stats_t *out) {
+    assert(t != NULL);
+    assert(out != NULL);
+    *out = t->stats;
+}
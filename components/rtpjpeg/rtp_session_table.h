@@ -0,0 +1,131 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fakesp.h"
+#include "rtp.h"
+#include "rtp_jpeg.h"
+#include "rtp_slab.h"
+
+/**
+ * A stream in a session table: the jitterbuffer and RTP/JPEG session of one SSRC.
+ * The jitterbuffer and session may be used directly, e.g. to get their statistics or NACKs, but
+ * must not be re-initialized.
+ * All other struct members are private to the implementation.
+ */
+typedef struct rtp_session_table_entry_t {
+    uint32_t ssrc;
+    bool active;
+    int64_t last_arrival_us;  // Arrival time of the last packet fed.
+
+    int32_t bucket;     // First entry of the hash bucket with the index of this entry, or -1.
+    int32_t hash_next;  // Next entry in the same hash bucket or in the free list, or -1.
+    int32_t lru_prev;   // Entry which received a packet more recently, or -1.
+    int32_t lru_next;   // Entry which received a packet less recently, or -1.
+
+    rtp_jitbuf_t jitbuf;
+    rtp_jpeg_session_t jpeg;
+} rtp_session_table_entry_t;
+
+// Counters of a session table, see rtp_session_table_stats().
+typedef struct rtp_session_table_stats_t {
+    int n_streams;          // Streams currently in the table.
+    int max_streams;        // Capacity of the table.
+    uint32_t created;       // Streams started by their first packet.
+    uint32_t evicted_idle;  // Streams removed after idle_timeout_us without packets.
+    uint32_t evicted_lru;   // Least recently active streams removed to make room for a new one.
+} rtp_session_table_stats_t;
+
+/**
+ * A session table demultiplexes packets of many concurrent RTP/JPEG streams arriving on one
+ * socket by their SSRC, and hands out the assembled frames of all streams to one callback.
+ * Streams are started by their first packet, and removed once idle for idle_timeout_us, or to
+ * make room for a new stream when the table is full, least recently active first.
+ * All jitterbuffers draw their packet blocks from one shared slab, so memory for packets is taken
+ * only by packets in flight, not by idle streams.
+ * Entries are provided by the caller, who can keep state per stream in an array parallel to them,
+ * see rtp_session_table_index().
+ * Not thread-safe.
+ * Use init_rtp_session_table() to initialize an instance before usage.
+ * All struct members are private to the implementation.
+ */
+typedef struct rtp_session_table_t {
+    rtp_session_table_entry_t *entries;
+    int hash_bits;      // There are 1 << hash_bits hash buckets, at most one per entry.
+    int32_t free_head;  // First entry not in use, or -1 if full.
+    int32_t lru_head;   // Most recently active stream, or -1 if empty.
+    int32_t lru_tail;   // Least recently active stream, or -1 if empty.
+    int64_t idle_timeout_us;
+
+    rtp_slab_t *slab;
+    rtp_jpeg_frame_cb frame_cb;
+    void *userdata;
+
+    rtp_session_table_stats_t stats;
+} rtp_session_table_t;
+
+/**
+ * Initialize a session table for up to n_entries concurrent streams, stored in entries, which
+ * must outlive the table.
+ * Packets are stored in blocks from slab, see init_rtp_jitbuf().
+ * frame_cb is called with the frames of all streams, see rtp_jpeg_frame_t.ssrc. Userdata will be
+ * passed to it as last argument and may be NULL.
+ */
+esp_err_t init_rtp_session_table(rtp_session_table_entry_t *entries, const int n_entries,
+                                 const int64_t idle_timeout_us, rtp_slab_t *slab,
+                                 rtp_jpeg_frame_cb frame_cb, void *userdata,
+                                 rtp_session_table_t *out);
+
+// Remove all streams and hand back their blocks to the slab.
+void rtp_session_table_destroy(rtp_session_table_t *t);
+
+/**
+ * Feed a RTP packet received from the network to the stream of its SSRC, starting the stream if
+ * there is none yet. See rtp_jitbuf_feed().
+ * If out is not NULL, it will be set to the stream, or NULL if the packet could not be parsed.
+ * Call rtp_session_table_drain() on the stream afterwards to assemble frames.
+ */
+esp_err_t rtp_session_table_feed(rtp_session_table_t *t, const uint8_t *buf, const ptrdiff_t sz,
+                                 const int64_t arrival_us, rtp_session_table_entry_t **out);
+
+/**
+ * Feed n RTP packets received from the network, e.g. by one recvmmsg(), see
+ * rtp_session_table_feed(). Runs of packets of the same stream are looked up once and fed with
+ * rtp_jitbuf_feed_batch().
+ * out must have room for n entries, each is set to the stream of the packet, or NULL if it could
+ * not be parsed. Call rtp_session_table_drain() on the streams afterwards to assemble frames.
+ * If the batch has more streams than the table has entries, a later packet may evict the stream
+ * of an earlier one, so its entry then belongs to another SSRC.
+ * Returns the number of packets fed to a stream.
+ */
+int rtp_session_table_feed_batch(rtp_session_table_t *t, const rtp_jitbuf_packet_t *pkts,
+                                 const int n, rtp_session_table_entry_t **out);
+
+// Hand out the packets of a stream which are due at now_us to its RTP/JPEG session.
+void rtp_session_table_drain(rtp_session_table_t *t, rtp_session_table_entry_t *e,
+                             const int64_t now_us);
+
+/**
+ * Drain all streams and remove the ones idle since idle_timeout_us.
+ * Call this periodically, e.g. when no packet arrived for CONFIG_RTP_JITBUF_MAX_WAIT_US.
+ */
+void rtp_session_table_poll(rtp_session_table_t *t, const int64_t now_us);
+
+// Returns the stream with the given SSRC, or NULL if there is none.
+rtp_session_table_entry_t *rtp_session_table_find(const rtp_session_table_t *t,
+                                                  const uint32_t ssrc);
+
+/**
+ * Iterate over the streams, most recently active first.
+ * Returns the stream after e, or the first one if e is NULL. Returns NULL after the last one.
+ */
+rtp_session_table_entry_t *rtp_session_table_next(const rtp_session_table_t *t,
+                                                  const rtp_session_table_entry_t *e);
+
+// Returns the index of a stream in the entries passed to init_rtp_session_table().
+int rtp_session_table_index(const rtp_session_table_t *t, const rtp_session_table_entry_t *e);
+
+// Get the counters of a session table.
+void rtp_session_table_stats(const rtp_session_table_t *t, rtp_session_table_stats_t *out);
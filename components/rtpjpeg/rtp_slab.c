@@ -0,0 +1,72 @@
+#include "rtp_slab.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "fakesp.h"
+
+__attribute__((unused)) static const char *TAG = "rtp_slab";
+
+// The free list link is stored at the start of each free block.
+static int32_t get_link(const uint8_t *block) {
+    int32_t next;
+    memcpy(&next, block, sizeof(next));
+    return next;
+}
+
+static void set_link(uint8_t *block, const int32_t next) { memcpy(block, &next, sizeof(next)); }
+
+esp_err_t init_rtp_slab(uint8_t *mem, const ptrdiff_t mem_sz, const ptrdiff_t block_sz,
+                        rtp_slab_t *out) {
+    if (mem == NULL || out == NULL || block_sz < (ptrdiff_t)sizeof(int32_t)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(out, 0, sizeof(*out));
+    if (mem_sz < block_sz || mem_sz / block_sz > INT32_MAX) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    out->mem = mem;
+    out->block_sz = block_sz;
+    out->n_blocks = mem_sz / block_sz;
+    for (int i = 0; i < out->n_blocks; i++) {
+        set_link(&mem[i * block_sz], i + 1 < out->n_blocks ? i + 1 : -1);
+    }
+    out->free_head = 0;
+    out->n_free = out->n_blocks;
+    out->min_free = out->n_blocks;
+    return ESP_OK;
+}
+
+uint8_t *rtp_slab_alloc(rtp_slab_t *s) {
+    assert(s != NULL);
+    if (s->free_head < 0) {
+        return NULL;
+    }
+    uint8_t *block = &s->mem[s->free_head * s->block_sz];
+    s->free_head = get_link(block);
+    s->n_free--;
+    if (s->n_free < s->min_free) {
+        s->min_free = s->n_free;
+    }
+    return block;
+}
+
+void rtp_slab_free(rtp_slab_t *s, uint8_t *block) {
+    assert(s != NULL);
+    assert(block >= s->mem && block < s->mem + s->n_blocks * s->block_sz);
+    assert((block - s->mem) % s->block_sz == 0);
+    FAKESP_POISON_FILL(block, s->block_sz);
+    set_link(block, s->free_head);
+    s->free_head = (block - s->mem) / s->block_sz;
+    s->n_free++;
+    assert(s->n_free <= s->n_blocks);
+}
+
+void rtp_slab_stats(const rtp_slab_t *s, rtp_slab_stats_t *out) {
+    assert(s != NULL);
+    assert(out != NULL);
+    out->n_blocks = s->n_blocks;
+    out->n_free = s->n_free;
+    out->min_free = s->min_free;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fakesp.h"
+
+/**
+ * A pool of fixed size blocks carved out of a caller provided buffer, to share packet storage
+ * between jitterbuffers.
+ * Free blocks are kept in a LIFO list linked through the blocks themselves, so alloc and free are
+ * O(1) and recently freed (cache hot) blocks are reused first.
+ * Not thread-safe, all users of a slab must run on the same thread.
+ * Use init_rtp_slab() to initialize an instance before usage.
+ * All struct members are private to the implementation.
+ */
+typedef struct rtp_slab_t {
+    uint8_t *mem;
+    ptrdiff_t block_sz;
+    int n_blocks;
+    int32_t free_head;  // Index of the first free block, or -1 if exhausted.
+    int n_free;
+    int min_free;  // Low water mark of n_free.
+} rtp_slab_t;
+
+// Usage of a slab, see rtp_slab_stats().
+typedef struct rtp_slab_stats_t {
+    int n_blocks;
+    int n_free;
+    int min_free;  // Least number of free blocks since init.
+} rtp_slab_stats_t;
+
+/**
+ * Initialize a slab with as many blocks of block_sz bytes as fit into mem, which has extent
+ * mem_sz and must outlive the slab.
+ * Returns ESP_ERR_INVALID_SIZE if not even one block fits.
+ */
+esp_err_t init_rtp_slab(uint8_t *mem, const ptrdiff_t mem_sz, const ptrdiff_t block_sz,
+                        rtp_slab_t *out);
+
+// Take a block of block_sz bytes, returns NULL if all blocks are in use.
+uint8_t *rtp_slab_alloc(rtp_slab_t *s);
+
+// Hand back a block taken via rtp_slab_alloc().
+void rtp_slab_free(rtp_slab_t *s, uint8_t *block);
+
+// Get the usage of a slab.
+void rtp_slab_stats(const rtp_slab_t *s, rtp_slab_stats_t *out);
@@ -0,0 +1,202 @@
+#include "rtp_trace.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+__attribute__((unused)) static const char *TAG = "rtp_trace";
+
+static const char *STAGE_NAMES[RTP_TRACE_N_STAGES] = {
+    [RTP_TRACE_FIRST_PACKET] = "first_packet",  [RTP_TRACE_LAST_PACKET] = "receive",
+    [RTP_TRACE_FRAME_CB] = "depayload",         [RTP_TRACE_QUEUED] = "handoff",
+    [RTP_TRACE_DECODE_START] = "queue",         [RTP_TRACE_DRAW_START] = "decode_stripe",
+    [RTP_TRACE_DRAW_END] = "draw_stripe",       [RTP_TRACE_DECODE_END] = "finish",
+};
+
+esp_err_t init_rtp_trace(rtp_trace_event_t *events, const int n_events, rtp_trace_t *out) {
+    if (events == NULL || n_events < 1 || (n_events & (n_events - 1)) != 0 || out == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(out, 0, sizeof(*out));
+    out->events = events;
+    out->n_events = n_events;
+    atomic_init(&out->n_recorded, 0);
+    return ESP_OK;
+}
+
+void rtp_trace_record(rtp_trace_t *t, const uint32_t ssrc, const uint32_t timestamp,
+                      const rtp_trace_stage_t stage, const int arg, const int64_t t_us) {
+    assert(t != NULL);
+    assert(stage < RTP_TRACE_N_STAGES);
+    const unsigned i = atomic_fetch_add_explicit(&t->n_recorded, 1, memory_order_relaxed);
+    rtp_trace_event_t *e = &t->events[i & (t->n_events - 1)];
+    e->t_us = t_us;
+    e->ssrc = ssrc;
+    e->timestamp = timestamp;
+    e->arg = arg;
+    e->stage = stage;
+}
+
+void rtp_trace_frame(rtp_trace_t *t, const rtp_jpeg_frame_t *frame, const int64_t now_us) {
+    assert(frame != NULL);
+    rtp_trace_record(t, frame->ssrc, frame->timestamp, RTP_TRACE_FIRST_PACKET, 0,
+                     frame->first_arrival_us);
+    rtp_trace_record(t, frame->ssrc, frame->timestamp, RTP_TRACE_LAST_PACKET, 0,
+                     frame->last_arrival_us);
+    rtp_trace_record(t, frame->ssrc, frame->timestamp, RTP_TRACE_FRAME_CB, 0, now_us);
+}
+
+const char *rtp_trace_stage_name(const rtp_trace_stage_t stage) {
+    assert(stage < RTP_TRACE_N_STAGES);
+    return STAGE_NAMES[stage];
+}
+
+// A frame being matched up by rtp_trace_walk_next().
+typedef struct rtp_trace_walk_frame_t {
+    uint32_t ssrc;
+    uint32_t timestamp;
+    int64_t first_us;
+    int64_t last_us;  // Of its last stage so far.
+} rtp_trace_walk_frame_t;
+
+// Goes over the events from the oldest on, matching them up into spans by their frame.
+typedef struct rtp_trace_walk_t {
+    const rtp_trace_t *t;
+    unsigned i;
+    unsigned end;
+    rtp_trace_walk_frame_t frames[RTP_TRACE_MAX_FRAMES];
+    int n_frames;
+    int next_frame;  // To be replaced when a frame starts, the oldest.
+} rtp_trace_walk_t;
+
+static void rtp_trace_walk_start(const rtp_trace_t *t, rtp_trace_walk_t *out) {
+    memset(out, 0, sizeof(*out));
+    out->t = t;
+    out->end = atomic_load(&t->n_recorded);
+    out->i = out->end - (unsigned)t->n_events;
+    if (out->end < (unsigned)t->n_events) {
+        out->i = 0;
+    }
+}
+
+/**
+ * Get the next span, i.e. an event and the time of the previous stage of its frame, and the
+ * arrival of its first packet. Returns false after the last one.
+ */
+static bool rtp_trace_walk_next(rtp_trace_walk_t *w, rtp_trace_event_t *e_out,
+                                int64_t *start_us_out, int64_t *first_us_out) {
+    while (w->i != w->end) {
+        const rtp_trace_event_t e = w->t->events[w->i & (w->t->n_events - 1)];
+        w->i++;
+
+        rtp_trace_walk_frame_t *f = NULL;
+        for (int k = 0; k < w->n_frames; k++) {
+            if (w->frames[k].ssrc == e.ssrc && w->frames[k].timestamp == e.timestamp) {
+                f = &w->frames[k];
+                break;
+            }
+        }
+        if (e.stage == RTP_TRACE_FIRST_PACKET) {
+            if (f == NULL) {
+                f = &w->frames[w->next_frame];
+                w->next_frame = (w->next_frame + 1) % RTP_TRACE_MAX_FRAMES;
+                if (w->n_frames < RTP_TRACE_MAX_FRAMES) {
+                    w->n_frames++;
+                }
+            }
+            f->ssrc = e.ssrc;
+            f->timestamp = e.timestamp;
+            f->first_us = e.t_us;
+            f->last_us = e.t_us;
+            continue;
+        }
+        if (f == NULL || e.stage >= RTP_TRACE_N_STAGES) {
+            // Started before the oldest event, or half written.
+            continue;
+        }
+        *e_out = e;
+        *start_us_out = f->last_us;
+        *first_us_out = f->first_us;
+        f->last_us = e.t_us;
+        return true;
+    }
+    return false;
+}
+
+static int compare_int32(const void *a, const void *b) {
+    const int32_t x = *(const int32_t *)a, y = *(const int32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void rtp_trace_percentiles(int32_t *values, const int n, rtp_trace_latency_t *out) {
+    memset(out, 0, sizeof(*out));
+    if (n == 0) {
+        return;
+    }
+    qsort(values, n, sizeof(values[0]), compare_int32);
+    out->n = n;
+    out->p50_us = values[(n - 1) * 50 / 100];
+    out->p99_us = values[(n - 1) * 99 / 100];
+    out->max_us = values[n - 1];
+}
+
+void rtp_trace_summarize(const rtp_trace_t *t, int32_t *scratch, const int n_scratch,
+                         rtp_trace_summary_t *out) {
+    assert(t != NULL);
+    assert(scratch != NULL);
+    assert(n_scratch >= t->n_events);
+    assert(out != NULL);
+    memset(out, 0, sizeof(*out));
+
+    // A walk per stage, and one for the total.
+    rtp_trace_walk_t w;
+    rtp_trace_event_t e;
+    int64_t start_us, first_us;
+    for (int stage = RTP_TRACE_FIRST_PACKET + 1; stage <= RTP_TRACE_N_STAGES; stage++) {
+        int n = 0;
+        rtp_trace_walk_start(t, &w);
+        while (rtp_trace_walk_next(&w, &e, &start_us, &first_us) && n < n_scratch) {
+            if (stage < RTP_TRACE_N_STAGES && e.stage == stage) {
+                scratch[n++] = e.t_us - start_us;
+            } else if (stage == RTP_TRACE_N_STAGES && e.stage == RTP_TRACE_DECODE_END) {
+                scratch[n++] = e.t_us - first_us;
+            }
+        }
+        rtp_trace_percentiles(scratch, n,
+                              stage < RTP_TRACE_N_STAGES ? &out->stages[stage] : &out->total);
+    }
+}
+
+void rtp_trace_export_chrome_json(const rtp_trace_t *t, rtp_trace_write_cb write, void *userdata) {
+    assert(t != NULL);
+    assert(write != NULL);
+    char line[256];
+    int sz = snprintf(line, sizeof(line), "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    write(line, sz, userdata);
+
+    rtp_trace_walk_t w;
+    rtp_trace_event_t e;
+    int64_t start_us, first_us;
+    rtp_trace_walk_start(t, &w);
+    const char *sep = "";
+    while (rtp_trace_walk_next(&w, &e, &start_us, &first_us)) {
+        char stripe[32] = "";
+        if (e.stage == RTP_TRACE_DRAW_START || e.stage == RTP_TRACE_DRAW_END) {
+            snprintf(stripe, sizeof(stripe), ",\"stripe\":%d", e.arg);
+        }
+        sz = snprintf(line, sizeof(line),
+                      "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%" PRId64 ",\"dur\":%" PRId64
+                      ",\"pid\":%" PRIu32 ",\"tid\":%d,\"args\":{\"timestamp\":%" PRIu32 "%s}}\n",
+                      sep, STAGE_NAMES[e.stage], start_us, e.t_us - start_us, e.ssrc, e.stage,
+                      e.timestamp, stripe);
+        assert(sz > 0 && sz < (int)sizeof(line));
+        write(line, sz, userdata);
+        sep = ",";
+    }
+
+    sz = snprintf(line, sizeof(line), "]}\n");
+    write(line, sz, userdata);
+}
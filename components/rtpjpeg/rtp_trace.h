@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fakesp.h"
+#include "rtp_jpeg.h"
+
+// Frames in flight at once the trace is matched up by, for rtp_trace_summarize() and the export.
+#define RTP_TRACE_MAX_FRAMES 32
+
+/**
+ * Stages of a frame on its way from the network to the display, in order.
+ * The stripes of a frame are drawn one after the other, so there are several draw stages each.
+ */
+typedef enum rtp_trace_stage_t {
+    RTP_TRACE_FIRST_PACKET,   // Arrival of the first packet.
+    RTP_TRACE_LAST_PACKET,    // Arrival of the marker packet, or the last one if it was lost.
+    RTP_TRACE_FRAME_CB,       // Handed out by the RTP/JPEG session.
+    RTP_TRACE_QUEUED,         // Handed over to the consumer, i.e. the decoder.
+    RTP_TRACE_DECODE_START,   // Taken up by the consumer.
+    RTP_TRACE_DRAW_START,     // A stripe was decoded and starts to be drawn, arg is its index.
+    RTP_TRACE_DRAW_END,       // A stripe was drawn, arg is its index.
+    RTP_TRACE_DECODE_END,     // Done with the frame.
+    RTP_TRACE_N_STAGES,
+} rtp_trace_stage_t;
+
+// An event of the trace, see rtp_trace_record().
+typedef struct rtp_trace_event_t {
+    int64_t t_us;
+    uint32_t ssrc;       // With the timestamp, tells the frame.
+    uint32_t timestamp;  // RTP timestamp of the frame.
+    uint16_t arg;
+    uint8_t stage;
+} rtp_trace_event_t;
+
+// Latency percentiles of a stage, see rtp_trace_summarize().
+typedef struct rtp_trace_latency_t {
+    int n;
+    int32_t p50_us;
+    int32_t p99_us;
+    int32_t max_us;
+} rtp_trace_latency_t;
+
+typedef struct rtp_trace_summary_t {
+    // Time frames spent in the span up to each stage, from the previous stage of the same frame,
+    // e.g. for RTP_TRACE_DECODE_START the time waiting in the queue. Nothing for the first stage.
+    rtp_trace_latency_t stages[RTP_TRACE_N_STAGES];
+    // From the first packet to RTP_TRACE_DECODE_END.
+    rtp_trace_latency_t total;
+} rtp_trace_summary_t;
+
+/**
+ * Traces the stages of frames into a fixed-size ring of events, overwriting the oldest ones.
+ * Recording is wait-free and thread-safe, so the tasks or threads of a pipeline can share a trace.
+ * Reading the trace while it is recorded to is safe, but may see a few events half written,
+ * which are matched up wrongly or not at all.
+ * Use init_rtp_trace() to initialize an instance before usage.
+ * All struct members are private to the implementation.
+ */
+typedef struct rtp_trace_t {
+    rtp_trace_event_t *events;
+    int n_events;
+    atomic_uint n_recorded;  // Wraps around, which works out as n_events is a power of two.
+} rtp_trace_t;
+
+/**
+ * Initialize a trace with storage for the last n_events events, which must outlive the trace.
+ * Returns ESP_ERR_INVALID_ARG unless n_events is a power of two.
+ */
+esp_err_t init_rtp_trace(rtp_trace_event_t *events, const int n_events, rtp_trace_t *out);
+
+// Record that a frame reached a stage at t_us, from any monotonic clock the trace shares.
+void rtp_trace_record(rtp_trace_t *t, const uint32_t ssrc, const uint32_t timestamp,
+                      const rtp_trace_stage_t stage, const int arg, const int64_t t_us);
+
+// Record the arrival of its first and last packet and RTP_TRACE_FRAME_CB for a frame handed out.
+void rtp_trace_frame(rtp_trace_t *t, const rtp_jpeg_frame_t *frame, const int64_t now_us);
+
+// Name of the span up to a stage, as in the export.
+const char *rtp_trace_stage_name(const rtp_trace_stage_t stage);
+
+/**
+ * Get the latency percentiles of each stage over the frames in the trace.
+ * scratch must have room for as many values as there are events.
+ */
+void rtp_trace_summarize(const rtp_trace_t *t, int32_t *scratch, const int n_scratch,
+                         rtp_trace_summary_t *out);
+
+// Receives the export piece by piece, each a full line.
+typedef void (*rtp_trace_write_cb)(const char *buf, ptrdiff_t sz, void *userdata);
+
+/**
+ * Export the trace in the Chrome trace event format, for https://ui.perfetto.dev or
+ * chrome://tracing: each stage of a frame is a span from its previous stage, on a track per stage
+ * in a process per SSRC.
+ */
+void rtp_trace_export_chrome_json(const rtp_trace_t *t, rtp_trace_write_cb write, void *userdata);
@@ -8,7 +8,9 @@
 
 // Hacky hack - we use lvgl's vendored tjpgd, instead of vendoring it ourself.
 #include "../managed_components/lvgl__lvgl/src/libs/tjpgd/tjpgd.h"
+#include "fakesp.h"
 #include "lcd.h"
+#include "trace.h"
 
 // This is the decoding block size of tjpgd.
 #define BLOCK_SZ_PX 16
@@ -53,6 +55,7 @@ static uint16_t rgb565(px888_t px) {
 
 // http://elm-chan.org/fsw/tjpgd/en/output.html
 static int jdec_out_func(JDEC *jd, void *bitmap, JRECT *rect) {
+    FAKESP_TRACE_SCOPE(jdec_out_func);
     ESP_LOGD(TAG, "Image block %hux%hu scl=%hhu t%hu l%hu b%hu r%hu", jd->width, jd->height,
              jd->scale, rect->top, rect->left, rect->bottom, rect->right);
 
@@ -82,8 +85,13 @@ static int jdec_out_func(JDEC *jd, void *bitmap, JRECT *rect) {
                   y_end = rect->bottom;
         ESP_LOGD(TAG, "lcd_draw_start() jpeg x1=%d y1=%d x2=%d y2=%d", x_start, y_start, x_end,
                  y_end);
+        const int stripe = rect->top / BLOCK_SZ_PX;
+        trace_decode(RTP_TRACE_DRAW_START, stripe);
+        FAKESP_TRACE_BEGIN(lcd_draw_start);
         lcd_draw_start(u->lcd, x_start, y_start, x_end, y_end, u->px_buf);
+        FAKESP_TRACE_END(lcd_draw_start);
         lcd_draw_wait_finished(u->lcd);
+        trace_decode(RTP_TRACE_DRAW_END, stripe);
 
         // Without this hacky sleep statement, there unfortunately is tearing visible on the left
         // side of the screen. But only if LVGL is initialized. De-initializing in when unused
@@ -137,8 +145,10 @@ esp_err_t jpeg_decoder_decode_to_lcd(jpeg_decoder_t *d, const uint8_t *data,
     d->data_max_sz = data_max_sz;
     d->read_offset = 0;
 
-    memset(d->px_buf, 0, d->px_buf_sz);
-    memset(d->work, 0, TJPGD_WORK_SZ);
+    // Every stripe of px_buf is filled by the blocks before it is drawn, and tjpgd initializes
+    // what it uses of the work area, so neither is cleared.
+    FAKESP_POISON_FILL(d->px_buf, d->px_buf_sz);
+    FAKESP_POISON_FILL(d->work, TJPGD_WORK_SZ);
 
     JRESULT res = jd_prepare(d->jdec, jdec_in_func, d->work, TJPGD_WORK_SZ, (void *)d);
     if (res != JDR_OK) {
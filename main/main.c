@@ -15,12 +15,15 @@
 #include <string.h>
 
 #include "dns.h"
+#include "fakesp.h"
 #include "jpeg.h"
 #include "lcd.h"
 #include "lvgl_display.h"
+#include "rtp_log.h"
 #include "rtp_udp.h"
 #include "sdkconfig.h"
 #include "smpte_bars.h"
+#include "trace.h"
 #include "wifi.h"
 
 static const char *TAG = "main";
@@ -83,6 +86,12 @@ void app_main(void) {
     ESP_LOGI(TAG, "Initialize mDNS");
     init_mdns_svr();
 
+    init_trace();
+#if CONFIG_RTP_LOG_DEFERRED_N_RECORDS > 0
+    static rtp_log_record_t log_records[CONFIG_RTP_LOG_DEFERRED_N_RECORDS];
+    ESP_ERROR_CHECK(init_rtp_log(log_records, CONFIG_RTP_LOG_DEFERRED_N_RECORDS));
+#endif
+
     print_free_heap_stack();
     ESP_LOGI(TAG, "Initializing JPEG receive buffer");
     QueueHandle_t rtp_out = xQueueCreate(1, CONFIG_RTP_JPEG_MAX_DATA_SIZE_BYTES);
@@ -120,6 +129,8 @@ void app_main(void) {
             if (reset_screen) {
                 lv_obj_invalidate(scr);
                 reset_screen = false;
+                trace_dump();
+                fakesp_tracepoints_print();
             }
             uint32_t time_till_next_ms = lv_timer_handler();
             vTaskDelay(pdMS_TO_TICKS(time_till_next_ms));
@@ -128,6 +139,7 @@ void app_main(void) {
         // Wait some ticks for a frame, continue if none.
         if (!xQueueReceive(rtp_out, &decode_in_buf, pdMS_TO_TICKS(10))) {
             ESP_LOGD(TAG, "Received nothing");
+            rtp_log_flush();
             continue;
         }
 
@@ -135,11 +147,14 @@ void app_main(void) {
         ESP_LOGD(TAG, "Received frame, decode");
         last_frame_recv_us = esp_timer_get_time();
         reset_screen = true;
+        trace_decode(RTP_TRACE_DECODE_START, 0);
         const esp_err_t err =
             jpeg_decoder_decode_to_lcd(&jpeg_dec, decode_in_buf, sizeof(decode_in_buf));
+        trace_decode(RTP_TRACE_DECODE_END, 0);
         if (err == ESP_OK) {
             const int64_t t1 = esp_timer_get_time();
             ESP_LOGI(TAG, "Decoded frame dt=%lldus", t1 - last_frame_recv_us);
+            rtp_udp_report_decode_us(t1 - last_frame_recv_us);
         } else {
             ESP_LOGW(TAG, "Decoding frame failed: %s (%d)", esp_err_to_name(err), err);
         }
@@ -1,5 +1,6 @@
 #include "rtp_udp.h"
 
+#include <stdatomic.h>
 #include <string.h>
 #include <sys/param.h>
 
@@ -11,7 +12,9 @@
 #include <esp_event.h>
 #include <esp_log.h>
 #include <esp_netif.h>
+#include <esp_random.h>
 #include <esp_system.h>
+#include <esp_timer.h>
 #include <esp_wifi.h>
 #include <freertos/task.h>
 #include <lwip/err.h>
@@ -20,22 +23,32 @@
 #include <lwip/sys.h>
 #include <nvs_flash.h>
 
+#include "rtcp.h"
 #include "rtp.h"
+#include "rtp_fec.h"
 #include "rtp_jpeg.h"
+#include "trace.h"
 
 static const char *TAG = "rtp_udp";
 
 _Static_assert(CONFIG_RTP_JITBUF_CAP_PACKET_SIZE_BYTES == CONFIG_SMALLTV_UDP_PAYLOAD_BYTES,
                "Jitterbuffer packet size should be equal to UDP MTU!");
 
+// Decode times reported by rtp_udp_report_decode_us() since the last RTCP report.
+static atomic_uint_least32_t decode_us_sum = 0;
+static atomic_uint_least32_t decode_count = 0;
+
 typedef struct rtp_udp_t {
     QueueHandle_t out;
 
     int sock;
+    int rtcp_sock;  // Bound to CONFIG_SMALLTV_RTP_PORT + 1.
     struct sockaddr_storage source_addr;
 
-    char rx_buf[CONFIG_SMALLTV_UDP_PAYLOAD_BYTES];
+    // FEC packets are slightly larger than the media packets they protect.
+    char rx_buf[CONFIG_SMALLTV_UDP_PAYLOAD_BYTES + RTP_FEC_MAX_OVERHEAD];
     ptrdiff_t rx_sz;
+    int64_t rx_us;  // Arrival time of the packet in rx_buf, from esp_timer_get_time().
     struct iovec iov;
     struct msghdr msg;
 } rtp_udp_t;
@@ -59,10 +72,14 @@ static esp_err_t sock_bind_prepare(rtp_udp_t *u) {
     const int enable = 1;
     lwip_setsockopt(u->sock, IPPROTO_IP, IP_PKTINFO, &enable, sizeof(enable));
 
-    // Set timeout.
+    // Set timeout. We wake up at least every jitterbuffer wait budget, so packets get handed out
+    // after waiting for it even if nothing else arrives.
+    const int64_t timeout_us = CONFIG_RTP_JITBUF_MAX_WAIT_US > 0
+                                   ? CONFIG_RTP_JITBUF_MAX_WAIT_US
+                                   : CONFIG_SMALLTV_UDP_RECV_TIMEOUT_S * 1000000LL;
     struct timeval timeout = {0};
-    timeout.tv_sec = CONFIG_SMALLTV_UDP_RECV_TIMEOUT_S;
-    timeout.tv_usec = 0;
+    timeout.tv_sec = timeout_us / 1000000;
+    timeout.tv_usec = timeout_us % 1000000;
     setsockopt(u->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
 
     const int err = bind(u->sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
@@ -72,6 +89,20 @@ static esp_err_t sock_bind_prepare(rtp_udp_t *u) {
     }
     ESP_LOGI(TAG, "Socket bound, port %d", CONFIG_SMALLTV_RTP_PORT);
 
+    // RTCP socket, only used without blocking.
+    assert(u->rtcp_sock == -1);
+    u->rtcp_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (u->rtcp_sock < 0) {
+        ESP_LOGE(TAG, "socket() failed: errno %d", errno);
+        return ESP_FAIL;
+    }
+    dest_addr.sin_port = htons(CONFIG_SMALLTV_RTP_PORT + 1);
+    const int err2 = bind(u->rtcp_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
+    if (err2 < 0) {
+        ESP_LOGE(TAG, "bind() failed: errno %d", errno);
+        return ESP_FAIL;
+    }
+
     // Prepare for receiving.
     u->iov.iov_base = u->rx_buf;
     u->iov.iov_len = sizeof(u->rx_buf);
@@ -94,6 +125,10 @@ static void sock_shutdown(rtp_udp_t *u) {
     shutdown(u->sock, 0);
     close(u->sock);
     u->sock = -1;
+    if (u->rtcp_sock != -1) {
+        close(u->rtcp_sock);
+        u->rtcp_sock = -1;
+    }
 }
 
 static esp_err_t sock_receive(rtp_udp_t *u) {
@@ -102,11 +137,15 @@ static esp_err_t sock_receive(rtp_udp_t *u) {
     ESP_LOGD(TAG, "Waiting for data");
     assert(u->sock >= 0);
     const ptrdiff_t sz = recvmsg(u->sock, &u->msg, 0);
+    if (sz < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return ESP_ERR_TIMEOUT;
+    }
     if (sz < 0) {
         ESP_LOGE(TAG, "recvmsg() failed: errno %d", errno);
         return ESP_FAIL;
     }
     u->rx_sz = sz;
+    u->rx_us = esp_timer_get_time();
 
     // Get sender IP as string.
     char addr_str[16];
@@ -117,18 +156,101 @@ static esp_err_t sock_receive(rtp_udp_t *u) {
     return ESP_OK;
 }
 
+void rtp_udp_report_decode_us(int64_t decode_us) {
+    atomic_fetch_add(&decode_us_sum, (uint32_t)decode_us);
+    atomic_fetch_add(&decode_count, 1);
+}
+
+/**
+ * Handle SRs from the source, send NACKs for missing packets and a RR + APP feedback when due.
+ * By convention, the source receives RTCP on its RTP port + 1.
+ */
+static void rtcp_service(rtp_udp_t *u, rtcp_session_t *rtcp, rtp_jitbuf_t *jitbuf,
+                         const rtp_jpeg_session_t *sess, const int64_t now_us) {
+    uint8_t buf[256];
+    ptrdiff_t sz;
+    while ((sz = recv(u->rtcp_sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        if (rtcp_session_feed(rtcp, buf, sz, now_us) != ESP_OK) {
+            ESP_LOGD(TAG, "Failed to parse RTCP packet");
+        }
+    }
+
+    assert(u->source_addr.ss_family == PF_INET);
+    struct sockaddr_in dest_addr = *(struct sockaddr_in *)&u->source_addr;
+    dest_addr.sin_port = htons(ntohs(dest_addr.sin_port) + 1);
+
+    uint16_t nacks[CONFIG_RTP_JITBUF_CAP_N_PACKETS];
+    const int n_nacks =
+        rtp_jitbuf_get_nacks(jitbuf, now_us, nacks, CONFIG_RTP_JITBUF_CAP_N_PACKETS);
+    if (n_nacks > 0) {
+        sz = rtcp_session_make_nack(rtcp, jitbuf->ssrc, nacks, n_nacks, buf, sizeof(buf));
+        assert(sz > 0);
+        if (sendto(u->rtcp_sock, buf, sz, 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) <
+            0) {
+            ESP_LOGW(TAG, "sendto() failed: errno %d", errno);
+        }
+        ESP_LOGD(TAG, "Sent NACK for %d packets from seq=%" PRIu16, n_nacks, nacks[0]);
+    }
+
+    if (!rtcp_session_report_due(rtcp, now_us)) {
+        return;
+    }
+    rtp_jitbuf_reception_t rx;
+    rtp_jitbuf_get_reception(jitbuf, &rx);
+    rtp_jpeg_session_stats_t stats;
+    rtp_jpeg_session_stats(sess, &stats);
+    const uint32_t n = atomic_exchange(&decode_count, 0);
+    const uint32_t sum = atomic_exchange(&decode_us_sum, 0);
+    const rtcp_app_feedback_t app = {
+        .frames_completed = stats.frames_completed,
+        .frames_dropped = stats.frames_dropped,
+        .frames_oversize = stats.frames_oversize,
+        .frames_rescued = stats.frames_rescued,
+        .decode_us_avg = n > 0 ? sum / n : 0,
+    };
+    sz = rtcp_session_make_report(rtcp, &rx, &app, now_us, buf, sizeof(buf));
+    assert(sz > 0);
+    if (sendto(u->rtcp_sock, buf, sz, 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) < 0) {
+        ESP_LOGW(TAG, "sendto() failed: errno %d", errno);
+        return;
+    }
+    ESP_LOGI(TAG,
+             "RTCP report sent: dropped=%" PRIu32 " oversize=%" PRIu32 " rescued=%" PRIu32
+             " decode=%" PRIu32 "us fec_recovered=%" PRIu32 "/%" PRIu32 " damaged=%" PRIu32,
+             app.frames_dropped, app.frames_oversize, app.frames_rescued, app.decode_us_avg,
+             rx.fec_recovered, rx.fec_received, stats.frames_damaged);
+    rtp_jitbuf_stats_t js;
+    rtp_jitbuf_stats(jitbuf, &js);
+    ESP_LOGI(TAG,
+             "Jitbuf fed=%" PRIu32 " duplicates=%" PRIu32 " late=%" PRIu32 " evicted=%" PRIu32
+             " gap_releases=%" PRIu32 " max_reorder=%d copied=%" PRIu64,
+             js.fed, js.duplicates, js.late, js.evicted, js.gap_releases, js.max_reorder_depth,
+             js.bytes_copied);
+    ESP_LOGI(TAG,
+             "Session completed=%" PRIu32 " missing=%" PRIu32 " header=%" PRIu32
+             " unsupported=%" PRIu32 " copied=%" PRIu64,
+             stats.frames_completed, stats.dropped_missing, stats.dropped_header,
+             stats.dropped_unsupported, stats.bytes_copied);
+}
+
 static void jpeg_frame_cb(const rtp_jpeg_frame_t *frame, void *userdata) {
     assert(frame != NULL);
     rtp_udp_t *u = (rtp_udp_t *)userdata;
     assert(u != NULL);
 
+    trace_frame(frame);
     const int success = xQueueOverwrite(u->out, frame->jpeg_data);
+    trace_queued(frame);
     ESP_LOGD(TAG, "Frame %dx%d ts=%" PRIu32 " posted to queue success=%d", frame->width,
              frame->height, frame->timestamp, success);
 }
 
+// Slab memory for the single jitterbuffer, enough for it to never run out of blocks.
+#define SLAB_MEM_SIZE_BYTES (RTP_JITBUF_MAX_BLOCKS * RTP_JITBUF_BLOCK_SIZE_BYTES)
+
 ptrdiff_t rtp_udp_recv_task_approx_stack_sz() {
-    return sizeof(rtp_udp_t) + sizeof(rtp_jpeg_session_t) + sizeof(rtp_jitbuf_t) + 3 * 1024;
+    return sizeof(rtp_udp_t) + sizeof(rtp_jpeg_session_t) + sizeof(rtp_jitbuf_t) +
+           SLAB_MEM_SIZE_BYTES + sizeof(rtcp_session_t) + 3 * 1024;
 }
 
 void rtp_udp_recv_task(void *pvParameters) {
@@ -136,6 +258,7 @@ void rtp_udp_recv_task(void *pvParameters) {
 
     rtp_udp_t u = {0};
     u.sock = -1;
+    u.rtcp_sock = -1;
     assert(pvParameters != NULL);
     u.out = (QueueHandle_t)pvParameters;
 
@@ -146,52 +269,66 @@ void rtp_udp_recv_task(void *pvParameters) {
         }
 
         ESP_LOGD(TAG, "Starting receive loop");
+        u.rx_us = esp_timer_get_time();
 
         bool sess_initialized = false;
         rtp_jpeg_session_t sess = {0};
+        uint8_t slab_mem[SLAB_MEM_SIZE_BYTES];
+        rtp_slab_t slab;
+        ESP_ERROR_CHECK(
+            init_rtp_slab(slab_mem, sizeof(slab_mem), RTP_JITBUF_BLOCK_SIZE_BYTES, &slab));
         rtp_jitbuf_t jitbuf = {0};
+        rtcp_session_t rtcp = {0};
 
         while (1) {
             const esp_err_t err2 = sock_receive(&u);
-            if (err2 != ESP_OK) {
+            const int64_t now_us = esp_timer_get_time();
+            if (err2 == ESP_ERR_TIMEOUT) {
+                if (now_us - u.rx_us > CONFIG_SMALLTV_UDP_RECV_TIMEOUT_S * 1000000LL) {
+                    ESP_LOGW(TAG, "Nothing received for %ds", CONFIG_SMALLTV_UDP_RECV_TIMEOUT_S);
+                    break;
+                }
+            } else if (err2 != ESP_OK) {
                 ESP_LOGW(TAG, "sock_receive() failed: %d", err2);
                 break;
-            }
+            } else {
+                if (!sess_initialized) {
+                    // Parse RTP header.
+                    uint16_t sequence_number = 0;
+                    uint32_t ssrc = 0;
+                    if (partial_parse_rtp_packet((uint8_t *)u.rx_buf, u.rx_sz, &sequence_number,
+                                                 &ssrc) != ESP_OK) {
+                        ESP_LOGD(TAG, "Failed to parse RTP header");
+                        continue;
+                    }
+
+                    // Try to initialize session.
+                    ESP_LOGI(TAG, "Starting session with ssrc=%" PRIu32, ssrc);
+                    init_rtp_jitbuf(ssrc, &slab, &jitbuf);
+                    init_rtp_jpeg_session(ssrc, jpeg_frame_cb, &u, &sess);
+                    init_rtcp_session(esp_random(), CONFIG_SMALLTV_MDNS_HOSTNAME, &rtcp);
+                    sess_initialized = true;
+                }
 
-            if (!sess_initialized) {
-                // Parse RTP header.
-                uint16_t sequence_number = 0;
-                uint32_t ssrc = 0;
-                if (partial_parse_rtp_packet((uint8_t *)u.rx_buf, u.rx_sz, &sequence_number,
-                                             &ssrc) != ESP_OK) {
-                    ESP_LOGD(TAG, "Failed to parse RTP header");
+                if (rtp_jitbuf_feed(&jitbuf, (uint8_t *)u.rx_buf, u.rx_sz, u.rx_us) != ESP_OK) {
+                    ESP_LOGD(TAG, "Failed to feed RTP packet to jitbuf");
                     continue;
                 }
-
-                // Try to initialize session.
-                ESP_LOGI(TAG, "Starting session with ssrc=%" PRIu32, ssrc);
-                init_rtp_jitbuf(ssrc, &jitbuf);
-                init_rtp_jpeg_session(ssrc, jpeg_frame_cb, &u, &sess);
-                sess_initialized = true;
             }
 
-            if (rtp_jitbuf_feed(&jitbuf, (uint8_t *)u.rx_buf, u.rx_sz) != ESP_OK) {
-                ESP_LOGD(TAG, "Failed to feed RTP packet to jitbuf");
+            if (!sess_initialized) {
                 continue;
             }
 
-            // Feed from jitbuf to jpeg session.
-            ptrdiff_t retr_sz = 0;
-            while ((retr_sz = rtp_jitbuf_retrieve(&jitbuf, (uint8_t *)u.rx_buf, sizeof(u.rx_buf))) >
-                   0) {
-                rtp_packet_t packet;
-                if (parse_rtp_packet((uint8_t *)u.rx_buf, retr_sz, &packet) != ESP_OK) {
-                    ESP_LOGD(TAG, "Failed to parse RTP header");
-                    continue;
-                }
+            // Request missing packets before giving up on them below.
+            rtcp_service(&u, &rtcp, &jitbuf, &sess, now_us);
 
+            // Feed from jitbuf to jpeg session, borrowing packets without copying them.
+            rtp_packet_view_t packet;
+            while (rtp_jitbuf_peek_next(&jitbuf, now_us, &packet) > 0) {
                 ESP_LOGD(TAG, "Feed to JPEG session");
                 esp_err_t err3 = rtp_jpeg_session_feed(&sess, &packet);
+                rtp_jitbuf_release(&jitbuf);
                 if (err3 != ESP_OK) {
                     ESP_LOGI(TAG, "Failed to feed RTP packet to jpeg_session %d", err3);
                     continue;
@@ -14,6 +14,10 @@
 
 ptrdiff_t rtp_udp_recv_task_approx_stack_sz();
 
+// Report the time it took to decode and display a frame, to be sent back to the source via RTCP.
+// Can be called from any task.
+void rtp_udp_report_decode_us(int64_t decode_us);
+
 // Task to receive UDP/RTP packets and depayload them into JPEG frames.
 // Expects a QueueHandle_t<uint8_t[CONFIG_RTP_JPEG_MAX_DATA_SIZE_BYTES]> as pvParameters argument.
 void rtp_udp_recv_task(void *pvParameters);
@@ -0,0 +1,148 @@
+#include "trace.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-compare"
+#include <freertos/FreeRTOS.h>
+#pragma GCC diagnostic pop
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <inttypes.h>
+#include <lwip/sockets.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+
+#if CONFIG_SMALLTV_TRACE_N_EVENTS > 0
+
+_Static_assert((CONFIG_SMALLTV_TRACE_N_EVENTS & (CONFIG_SMALLTV_TRACE_N_EVENTS - 1)) == 0,
+               "Events traced must be a power of two");
+
+static const char *TAG = "trace";
+
+static rtp_trace_event_t events[CONFIG_SMALLTV_TRACE_N_EVENTS];
+static rtp_trace_t trace;
+
+// The frame posted to the queue last, and the one taken off by the decoder.
+static portMUX_TYPE queued_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t queued_ssrc, queued_timestamp;
+static uint32_t decoding_ssrc, decoding_timestamp;
+
+// Events recorded at the last dump.
+static unsigned dumped = 0;
+
+// Datagrams of the dump, filled up with whole lines.
+typedef struct trace_dump_t {
+    int sock;  // -1 to dump to the console.
+    struct sockaddr_in dest_addr;
+    char buf[CONFIG_SMALLTV_UDP_PAYLOAD_BYTES];
+    ptrdiff_t sz;
+} trace_dump_t;
+static trace_dump_t dump;
+
+static void trace_dump_flush(trace_dump_t *d) {
+    if (d->sz > 0 && sendto(d->sock, d->buf, d->sz, 0, (struct sockaddr *)&d->dest_addr,
+                            sizeof(d->dest_addr)) < 0) {
+        ESP_LOGW(TAG, "sendto() failed: errno %d", errno);
+    }
+    d->sz = 0;
+}
+
+static void trace_dump_write(const char *buf, ptrdiff_t sz, void *userdata) {
+    trace_dump_t *d = userdata;
+    if (d->sock < 0) {
+        fwrite(buf, 1, sz, stdout);
+        return;
+    }
+    if (d->sz + sz > (ptrdiff_t)sizeof(d->buf)) {
+        trace_dump_flush(d);
+    }
+    memcpy(&d->buf[d->sz], buf, sz);
+    d->sz += sz;
+}
+
+#endif
+
+void init_trace() {
+#if CONFIG_SMALLTV_TRACE_N_EVENTS > 0
+    ESP_ERROR_CHECK(init_rtp_trace(events, CONFIG_SMALLTV_TRACE_N_EVENTS, &trace));
+#endif
+}
+
+void trace_frame(__attribute__((unused)) const rtp_jpeg_frame_t *frame) {
+#if CONFIG_SMALLTV_TRACE_N_EVENTS > 0
+    rtp_trace_frame(&trace, frame, esp_timer_get_time());
+#endif
+}
+
+void trace_queued(__attribute__((unused)) const rtp_jpeg_frame_t *frame) {
+#if CONFIG_SMALLTV_TRACE_N_EVENTS > 0
+    rtp_trace_record(&trace, frame->ssrc, frame->timestamp, RTP_TRACE_QUEUED, 0,
+                     esp_timer_get_time());
+    taskENTER_CRITICAL(&queued_lock);
+    queued_ssrc = frame->ssrc;
+    queued_timestamp = frame->timestamp;
+    taskEXIT_CRITICAL(&queued_lock);
+#endif
+}
+
+void trace_decode(__attribute__((unused)) const rtp_trace_stage_t stage,
+                  __attribute__((unused)) const int arg) {
+#if CONFIG_SMALLTV_TRACE_N_EVENTS > 0
+    if (stage == RTP_TRACE_DECODE_START) {
+        taskENTER_CRITICAL(&queued_lock);
+        decoding_ssrc = queued_ssrc;
+        decoding_timestamp = queued_timestamp;
+        taskEXIT_CRITICAL(&queued_lock);
+    }
+    rtp_trace_record(&trace, decoding_ssrc, decoding_timestamp, stage, arg, esp_timer_get_time());
+#endif
+}
+
+void trace_dump() {
+#if CONFIG_SMALLTV_TRACE_N_EVENTS > 0
+    const unsigned n_recorded = atomic_load(&trace.n_recorded);
+    if (n_recorded == dumped) {
+        return;
+    }
+    dumped = n_recorded;
+
+    static int32_t scratch[CONFIG_SMALLTV_TRACE_N_EVENTS];
+    rtp_trace_summary_t summary;
+    rtp_trace_summarize(&trace, scratch, CONFIG_SMALLTV_TRACE_N_EVENTS, &summary);
+    for (int i = RTP_TRACE_FIRST_PACKET + 1; i < RTP_TRACE_N_STAGES; i++) {
+        const rtp_trace_latency_t *l = &summary.stages[i];
+        ESP_LOGI(TAG, "%-13s n=%d p50=%" PRId32 "us p99=%" PRId32 "us max=%" PRId32 "us",
+                 rtp_trace_stage_name(i), l->n, l->p50_us, l->p99_us, l->max_us);
+    }
+    ESP_LOGI(TAG, "%-13s n=%d p50=%" PRId32 "us p99=%" PRId32 "us max=%" PRId32 "us", "total",
+             summary.total.n, summary.total.p50_us, summary.total.p99_us, summary.total.max_us);
+
+    dump.sock = -1;
+    dump.sz = 0;
+#if CONFIG_SMALLTV_TRACE_UDP_PORT > 0
+    dump.sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    const int enable = 1;
+    if (dump.sock < 0 ||
+        setsockopt(dump.sock, SOL_SOCKET, SO_BROADCAST, &enable, sizeof(enable)) < 0) {
+        ESP_LOGE(TAG, "Failed to create broadcast socket: errno %d", errno);
+        if (dump.sock >= 0) {
+            close(dump.sock);
+        }
+        return;
+    }
+    memset(&dump.dest_addr, 0, sizeof(dump.dest_addr));
+    dump.dest_addr.sin_family = AF_INET;
+    dump.dest_addr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+    dump.dest_addr.sin_port = htons(CONFIG_SMALLTV_TRACE_UDP_PORT);
+    ESP_LOGI(TAG, "Dumping trace to UDP port %d", CONFIG_SMALLTV_TRACE_UDP_PORT);
+#else
+    ESP_LOGI(TAG, "Dumping trace");
+#endif
+    rtp_trace_export_chrome_json(&trace, trace_dump_write, &dump);
+    if (dump.sock >= 0) {
+        trace_dump_flush(&dump);
+        close(dump.sock);
+    }
+#endif
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "rtp_jpeg.h"
+#include "rtp_trace.h"
+
+/**
+ * Trace of the stages of frames from the network to the display, see rtp_trace.h.
+ * Needs CONFIG_SMALLTV_TRACE_N_EVENTS > 0, does nothing otherwise.
+ * The stages up to the queue are traced from the receive task, the rest from the decoding task.
+ * The decoding task tells the frame it takes off the queue by the one posted last. With the queue
+ * holding a single frame which is overwritten, this is wrong only if the next frame is posted just
+ * in between, which at worst mixes up the stages of two consecutive frames.
+ */
+void init_trace();
+
+// A frame was handed out by the RTP/JPEG session.
+void trace_frame(const rtp_jpeg_frame_t *frame);
+
+// The frame was posted to the queue of the decoder.
+void trace_queued(const rtp_jpeg_frame_t *frame);
+
+// The decoder reached a stage with the frame taken off the queue, arg is as in rtp_trace_record().
+void trace_decode(const rtp_trace_stage_t stage, const int arg);
+
+// Log the latency of the stages and dump the trace, if anything was traced since the last dump.
+void trace_dump();